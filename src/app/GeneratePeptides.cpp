@@ -403,37 +403,13 @@ bool GeneratePeptides::makeDecoy(
   const set<string>& targetSeqs,  ///< targets to check against
   const set<string>& decoySeqs,  ///< decoys to check against
   bool shuffle, ///< shuffle (if false, reverse)
-  string& decoyOut  ///< string to store decoy
+  string& decoyOut,  ///< string to store decoy
+  SeededRandom* random ///< generator to shuffle with, or NULL for myrandom
 ) {
-  const string keepTerminal = Params::GetString("keep-terminal-aminos");
   string decoyPre, decoyPost;
-  if (keepTerminal == "N") {
-    if (seq.length() <= 2) {
-      decoyOut = seq;
-      return false;
-    }
-    decoyPre = seq[0];
-    decoyOut = seq.substr(1);
-  } else if (keepTerminal == "C") {
-    if (seq.length() <= 2) {
-      decoyOut = seq;
-      return false;
-    }
-    decoyPost = seq[seq.length() - 1];
-    decoyOut = seq.substr(0, seq.length() - 1);
-  } else if (keepTerminal == "NC") {
-    if (seq.length() <= 3) {
-      decoyOut = seq;
-      return false;
-    }
-    decoyPre = seq[0];
-    decoyPost = seq[seq.length() - 1];
-    decoyOut = seq.substr(1, seq.length() - 2);
-  } else {
+  if (!splitTerminals(seq, decoyPre, decoyOut, decoyPost)) {
     decoyOut = seq;
-    if (seq.length() <= 1) {
-      return false;
-    }
+    return false;
   }
 
   if (!shuffle) {
@@ -452,7 +428,7 @@ bool GeneratePeptides::makeDecoy(
   }
 
   // Shuffle
-  if (shufflePeptide(decoyOut)) {
+  if (shufflePeptide(decoyOut, 6, random)) {
     // Re-add n/c
     string decoyCheck = decoyPre + decoyOut + decoyPost;
     // Check in sets
@@ -467,13 +443,75 @@ bool GeneratePeptides::makeDecoy(
   return false;
 }
 
+/**
+ * Splits the sequence into the terminal amino acids that keep-terminal-aminos
+ * keeps in place and the middle that is shuffled or reversed.
+ * Returns false if the middle is too short to make a decoy from.
+ */
+bool GeneratePeptides::splitTerminals(
+  const string& seq,  ///< sequence to split
+  string& pre,  ///< kept n-terminal amino acid, if any
+  string& middle,  ///< amino acids to shuffle or reverse
+  string& post  ///< kept c-terminal amino acid, if any
+) {
+  const string keepTerminal = Params::GetString("keep-terminal-aminos");
+  pre.clear();
+  post.clear();
+  if (keepTerminal == "N") {
+    if (seq.length() <= 2) {
+      return false;
+    }
+    pre = seq[0];
+    middle = seq.substr(1);
+  } else if (keepTerminal == "C") {
+    if (seq.length() <= 2) {
+      return false;
+    }
+    post = seq[seq.length() - 1];
+    middle = seq.substr(0, seq.length() - 1);
+  } else if (keepTerminal == "NC") {
+    if (seq.length() <= 3) {
+      return false;
+    }
+    pre = seq[0];
+    post = seq[seq.length() - 1];
+    middle = seq.substr(1, seq.length() - 2);
+  } else {
+    middle = seq;
+    if (seq.length() <= 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Makes the reversed decoy of the sequence, as makeDecoy() tries first,
+ * without checking it against any targets or decoys.
+ * Returns false on failure, and decoyOut will be the same as seq.
+ */
+bool GeneratePeptides::reverseDecoy(
+  const string& seq,  ///< sequence to make decoy from
+  string& decoyOut  ///< string to store decoy
+) {
+  string decoyPre, decoyPost;
+  if (!splitTerminals(seq, decoyPre, decoyOut, decoyPost) ||
+      !reversePeptide(decoyOut)) {
+    decoyOut = seq;
+    return false;
+  }
+  decoyOut = decoyPre + decoyOut + decoyPost;
+  return true;
+}
+
 /**
  * Shuffles the peptide randomly.
  * Returns false if no different sequence was generated
  */
 bool GeneratePeptides::shufflePeptide(
   string& seq, ///< Peptide sequence to shuffle
-  unsigned int maxShuffleAttempts ///< Maximum number of shuffle attempts
+  unsigned int maxShuffleAttempts, ///< Maximum number of shuffle attempts
+  SeededRandom* random ///< generator to shuffle with, or NULL for myrandom
 ) {
   switch (seq.length()) {
   case 0:
@@ -488,7 +526,11 @@ bool GeneratePeptides::shufflePeptide(
   default:
     string originalSeq(seq);
     for (int i = 0; i < maxShuffleAttempts; i++) {
-      random_shuffle(seq.begin(), seq.end(), myrandom_limit);
+      if (random == NULL) {
+        random_shuffle(seq.begin(), seq.end(), myrandom_limit);
+      } else {
+        random_shuffle(seq.begin(), seq.end(), *random);
+      }
       if (seq != originalSeq) {
         return true;
       }
@@ -497,6 +539,27 @@ bool GeneratePeptides::shufflePeptide(
   }
 }
 
+GeneratePeptides::SeededRandom::SeededRandom(
+  unsigned long long seed,
+  const string& sequence
+) {
+  // FNV-1a hash of the sequence, so that the seed is the same on all platforms
+  unsigned long long hash = 14695981039346656037ULL;
+  for (string::const_iterator i = sequence.begin(); i != sequence.end(); ++i) {
+    hash = (hash ^ (unsigned char)*i) * 1099511628211ULL;
+  }
+  state_ = seed ^ hash;
+}
+
+int GeneratePeptides::SeededRandom::operator()(int max) {
+  // splitmix64
+  unsigned long long z = (state_ += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return (int)(z % (unsigned long long)max);
+}
+
 /**
  * Reverses the peptide sequence.
  * Returns false if no different sequence was generated
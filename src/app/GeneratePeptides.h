@@ -11,6 +11,18 @@ class GeneratePeptides : public CruxApplication {
  protected:
   static MASS_TYPE_T massType_;
 
+  /**
+   * Splits the sequence into the terminal amino acids that keep-terminal-aminos
+   * keeps in place and the middle that is shuffled or reversed.
+   * Returns false if the middle is too short to make a decoy from.
+   */
+  static bool splitTerminals(
+    const std::string& seq, ///< sequence to split
+    std::string& pre, ///< kept n-terminal amino acid, if any
+    std::string& middle, ///< amino acids to shuffle or reverse
+    std::string& post ///< kept c-terminal amino acid, if any
+  );
+
  public:
 
   class OrderedPeptide {
@@ -41,6 +53,22 @@ class GeneratePeptides : public CruxApplication {
     unsigned int position_;
   };
 
+  /**
+   * A random number generator for shuffling one peptide, seeded from a base
+   * seed and the peptide sequence, so that the shuffle of a sequence does not
+   * depend on what was shuffled before it.
+   */
+  class SeededRandom {
+   public:
+    SeededRandom(unsigned long long seed, const std::string& sequence);
+    /**
+     * Returns an integer in the range [0, max)
+     */
+    int operator()(int max);
+   private:
+    unsigned long long state_;
+  };
+
   /**
    * Constructor
    */
@@ -101,6 +129,17 @@ class GeneratePeptides : public CruxApplication {
     const std::set<std::string>& targetSeqs,  ///< targets to check against
     const std::set<std::string>& decoySeqs,  ///< decoys to check against
     bool shuffle, ///< shuffle (if false, reverse)
+    std::string& decoyOut, ///< string to store decoy
+    SeededRandom* random = NULL ///< generator to shuffle with, or NULL for myrandom
+  );
+
+  /**
+   * Makes the reversed decoy of the sequence, without checking it against any
+   * targets or decoys.
+   * Returns false on failure, and decoyOut will be the same as seq.
+   */
+  static bool reverseDecoy(
+    const std::string& seq, ///< sequence to make decoy from
     std::string& decoyOut ///< string to store decoy
   );
 
@@ -110,7 +149,8 @@ class GeneratePeptides : public CruxApplication {
    */
   static bool shufflePeptide(
     std::string& seq,  ///< Peptide sequence to shuffle
-    unsigned int maxShuffleAttempts = 6 ///< Maximum number of shuffle attempts
+    unsigned int maxShuffleAttempts = 6, ///< Maximum number of shuffle attempts
+    SeededRandom* random = NULL ///< generator to shuffle with, or NULL for myrandom
   );
 
   /**
@@ -18,6 +18,9 @@ int ReadSpectrumRecordsApplication::main(int argc, char** argv) {
   HeadedRecordReader reader(records_file, &header);
   if (!reader.OK()) {
     carp(CARP_FATAL, "Error reading spectrum records file");
+  } else if (header.spectra_header().version() > SPECTRUM_RECORDS_VERSION) {
+    carp(CARP_FATAL, "Spectrum records file is in a later format than this "
+                     "version of Crux reads");
   }
 
   show(reader);
@@ -34,10 +37,12 @@ void ReadSpectrumRecordsApplication::show(
 ) {
   int count = 0;
   pb::Spectrum pb_spectrum;
+  PeakStore peaks;
   cout << setprecision(10);
   while (!reader.Done()) {
     reader.Read(&pb_spectrum);
-    Spectrum spectrum(pb_spectrum);
+    peaks.Clear();
+    Spectrum spectrum(pb_spectrum, &peaks);
 
     cout << "Spectrum Number: " << spectrum.SpectrumNumber();
     if (spectrum.PrecursorMZ() > 0)
@@ -50,6 +55,12 @@ void ReadSpectrumRecordsApplication::show(
         cout << ", " << spectrum.ChargeState(i);
       cout << endl;
     }
+    if (pb_spectrum.charge_precursor_m_z_size() > 0) {
+      cout << "Precursor m/z by charge: " << pb_spectrum.charge_precursor_m_z(0);
+      for (int i = 1; i < pb_spectrum.charge_precursor_m_z_size(); ++i)
+        cout << ", " << pb_spectrum.charge_precursor_m_z(i);
+      cout << endl;
+    }
 
     for (int i = 0; i < spectrum.Size(); ++i)
       cout << spectrum.M_Z(i) << " " << spectrum.Intensity(i) << endl;
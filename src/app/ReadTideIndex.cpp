@@ -5,6 +5,7 @@
 #include "parameter.h"
 #include "app/tide/records_to_vector-inl.h"
 #include "app/tide/peptide.h"
+#include "app/tide/protein_arena.h"
 #include "util/Params.h"
 #include <vector>
 
@@ -26,12 +27,12 @@ int ReadTideIndex::main(int argc, char** argv) {
 
   // Read proteins index file
   carp(CARP_INFO, "Reading proteins...");
-  ProteinVec proteins;
+  ProteinArena protein_arena;
   pb::Header protein_header;
-  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins,
-      proteins_file, &protein_header)) {
+  if (!protein_arena.Read(proteins_file, &protein_header)) {
     carp(CARP_FATAL, "Error reading index (%s)", proteins_file.c_str());
   }
+  const ProteinViewVec& proteins = protein_arena.Proteins();
   carp(CARP_DEBUG, "Read %d proteins", proteins.size());
 
   // Read auxlocs index file
@@ -79,7 +80,7 @@ int ReadTideIndex::main(int argc, char** argv) {
     if (peptide.HasAuxLocationsIndex()) {
       const pb::AuxLocation* aux_loc = locations[peptide.AuxLocationsIndex()];
       for (int i = 0; i < aux_loc->location_size(); i++) {
-        const pb::Protein* protein = proteins[aux_loc->location(i).protein_id()];
+        const ProteinView* protein = proteins[aux_loc->location(i).protein_id()];
         if (protein->has_name()) {
           *output_stream << ';' << protein->name();
         }
@@ -38,28 +38,29 @@ int SubtractIndexApplication::main(int argc, char** argv) {
 
   bool overwrite = Params::GetBool("overwrite");
   bool has_decoys = false;
+  string operation = Params::GetString("index-operation");
+  TideIndexApplication::IndexOperation op =
+    operation == "union" ? TideIndexApplication::UNION_INDEXES :
+    operation == "intersect" ? TideIndexApplication::INTERSECT_INDEXES :
+    TideIndexApplication::SUBTRACT_INDEXES;
+  int num_threads = Params::GetInt("num-threads");
+  if (num_threads < 1) {
+    num_threads = max(1, (int)boost::thread::hardware_concurrency());
+  }
 
   //open tide index 1
   const string index1 = Params::GetString("tide index 1");  
   bool write_peptides = FileUtils::Exists(index1 + "/tide-index.peptides.target.txt");
   string peptides_file1 = index1 + "/pepix";
-  string proteins_file1 = index1 + "/protix";
-  string auxlocs_file1 = index1 + "/auxlocs";
 
   carp(CARP_INFO, "Reading index %s", index1.c_str());
-  ProteinVec proteins1;
-  pb::Header protein_header1;
-  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins1,
-    proteins_file1, &protein_header1)) {
-    carp(CARP_FATAL, "Error reading index (%s)", proteins_file1.c_str());
-  }
-  carp(CARP_DEBUG, "Read %d proteins", proteins1.size());
-  
   pb::Header peptides_header1;
-  HeadedRecordReader peptide_reader1(peptides_file1, &peptides_header1);
-  if (peptides_header1.file_type() != pb::Header::PEPTIDES ||
-    !peptides_header1.has_peptides_header()) {
-    carp(CARP_FATAL, "Error reading index (%s)", peptides_file1.c_str());
+  {
+    HeadedRecordReader peptide_reader1(peptides_file1, &peptides_header1);
+    if (peptides_header1.file_type() != pb::Header::PEPTIDES ||
+      !peptides_header1.has_peptides_header()) {
+      carp(CARP_FATAL, "Error reading index (%s)", peptides_file1.c_str());
+    }
   }
   const pb::Header::PeptidesHeader& pepHeader1 = peptides_header1.peptides_header();
   DECOY_TYPE_T headerDecoyType = (DECOY_TYPE_T)pepHeader1.decoys();
@@ -73,20 +74,14 @@ int SubtractIndexApplication::main(int argc, char** argv) {
     &peptides_header1.peptides_header().nterm_mods(),
     &peptides_header1.peptides_header().cterm_mods(), 0.0, 0.0);
 
-  //open tide index 2
-  const string index2 = Params::GetString("tide index 2");
-  string peptides_file2 = index2 + "/pepix";
-  string proteins_file2 = index2 + "/protix";
-  carp(CARP_INFO, "Reading index %s", index2.c_str());
-  pb::Header peptides_header2;
-  HeadedRecordReader peptide_reader2(peptides_file2, &peptides_header2);
-  ProteinVec proteins2;
-  pb::Header protein_header2;
-  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins2,
-    proteins_file2, &protein_header2)) {
-    carp(CARP_FATAL, "Error reading index (%s)", proteins_file2.c_str());
+  //tide index 2, possibly a list
+  vector<string> indexes2 = StringUtils::Split(Params::GetString("tide index 2"), ',');
+  for (vector<string>::const_iterator i = indexes2.begin(); i != indexes2.end(); ++i) {
+    carp(CARP_INFO, "Reading index %s", i->c_str());
+    if (!FileUtils::Exists(*i + "/pepix")) {
+      carp(CARP_FATAL, "Error reading index (%s)", i->c_str());
+    }
   }
-  carp(CARP_DEBUG, "Read %d proteins", proteins2.size());
 
   //output files;
   const string index_out = Params::GetString("output index");
@@ -119,80 +114,20 @@ int SubtractIndexApplication::main(int argc, char** argv) {
         "tide-index.peptides.decoy.txt").c_str(), NULL, overwrite);
     }
   }
-  //copy aux and protein files;
-  FileUtils::Copy(auxlocs_file1, out_aux);
-  FileUtils::Copy(proteins_file1, out_proteins);
-
-  pb::Header new_header;
-  CHECK(peptides_header1.file_type() == pb::Header::PEPTIDES);
-  CHECK(peptides_header1.has_peptides_header());
-  new_header.set_file_type(pb::Header::PEPTIDES);
-  pb::Header_PeptidesHeader* subheader = new_header.mutable_peptides_header();
-  subheader->CopyFrom(peptides_header1.peptides_header());
-  subheader->set_has_peaks(true);
-  pb::Header_Source* source = new_header.add_source();
-  source->mutable_header()->CopyFrom(peptides_header1);
-  HeadedRecordWriter writer(out_peptides, new_header);
-  CHECK(peptide_reader1.OK());
-  CHECK(peptide_reader2.OK());
-  CHECK(writer.OK());
-
-  pb::Peptide pb_peptide1, pb_peptide2;
-  double pep_mass1, pre_pep_mass1, pep_mass2, pre_pep_mass2;
-  string pep_str1, pep_str2;
-    
-  vector<pb::Peptide> peptide_container;
-  pep_mass2 = pre_pep_mass2 = 0.0;
-  pre_pep_mass1 = 0.0;
-  bool found;
-
-  while (!peptide_reader1.Done()) {
-    peptide_reader1.Read(&pb_peptide1);
-    pep_mass1 = pb_peptide1.mass();
-    found = false;
 
-    if (pre_pep_mass1 < pep_mass1) {
-      peptide_container.clear();
-      pre_pep_mass1 = pep_mass1;
-    }
+  // All indexes are merged in one pass
+  bool flat = FileUtils::Exists(index1 + "/pepix.flat");
+  bool packed = FileUtils::Exists(index1 + "/pepix.packed");
+  TideIndexApplication::combineIndexes(index1, indexes2, index_out, op,
+    num_threads, flat, packed, out_target_list, out_decoy_list);
 
-    while (pep_mass2 < pep_mass1) {
-      if (!peptide_reader2.Done()) {
-        peptide_reader2.Read(&pb_peptide2);
-        pep_mass2 = pb_peptide2.mass();
-      } else { 
-        break; 
-      }
-    }
-    while (pep_mass2 == pep_mass1) {
-      peptide_container.push_back(pb_peptide2);
-      if (!peptide_reader2.Done()) {
-        peptide_reader2.Read(&pb_peptide2);
-        pep_mass2 = pb_peptide2.mass();
-      } else {
-        break;
-      }
-    }
-    pep_str1 = getModifiedPeptideSeq(&pb_peptide1, &proteins1);
-    for (vector<pb::Peptide>::iterator it = peptide_container.begin(); it != peptide_container.end(); ++it) {
-      pep_str2 = getModifiedPeptideSeq(&(*it), &proteins2);
-      if (pep_str1 == pep_str2) {
-        found = true;
-        break;
-      }
-    }
-    if (!found) {
-      CHECK(writer.Write(&pb_peptide1));
-      carp(CARP_DEBUG, "%s\t%lf\n", pep_str1.c_str(), pep_mass1);
-
-      if (write_peptides) {
-        if (!pb_peptide1.is_decoy()) {
-          *out_target_list << pep_str1 << '\t' << pb_peptide1.mass() << endl;
-        } else {
-          *out_decoy_list << pep_str1 << '\t' << pb_peptide1.mass() << endl;
-        }
-      }
-    }
+  if (out_target_list) {
+    out_target_list->close();
+    delete out_target_list;
+  }
+  if (out_decoy_list) {
+    out_decoy_list->close();
+    delete out_decoy_list;
   }
 
   return 0;
@@ -211,10 +146,14 @@ string SubtractIndexApplication::getName() const {
 string SubtractIndexApplication::getDescription() const {
   return "[[html:<p>This command takes two peptide indices, created by the tide-index "
     "command, and subtracts the second index from the first. The result is an output "
-    "index that contains peptides that appear in the first index but not the second.</p>]]"
+    "index that contains peptides that appear in the first index but not the second. "
+    "With <code>index-operation</code>, the indices can instead be intersected or "
+    "combined. The second index may be a comma-separated list of indices.</p>]]"
     "[[nohtml:This command takes two peptide indices, created by the tide-index command, "
     "and subtracts the second index from the first. The result is an output index "
-    "that contains peptides that appear in the first index but not the second.]]";
+    "that contains peptides that appear in the first index but not the second. With "
+    "index-operation, the indices can instead be intersected or combined. The second "
+    "index may be a comma-separated list of indices.]]";
 }
 
 /**
@@ -239,7 +178,9 @@ vector<string> SubtractIndexApplication::getOptions() const {
     "parameter-file",
     "overwrite",
     "peptide-list",
-    "output-dir"
+    "output-dir",
+    "index-operation",
+    "num-threads"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
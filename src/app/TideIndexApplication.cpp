@@ -1,5 +1,7 @@
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <boost/functional/hash.hpp>
 #include "io/carp.h"
 #include "util/CarpStreamBuf.h"
 #include "util/AminoAcidUtil.h"
@@ -9,16 +11,34 @@
 #include "GeneratePeptides.h"
 #include "TideIndexApplication.h"
 #include "TideMatchSet.h"
+#include "app/tide/flat_peptides.h"
+#include "app/tide/index_stamp.h"
+#include "app/tide/packed_peptides.h"
+#include "app/tide/peak_index.h"
+#include "app/tide/mass_index.h"
 #include "app/tide/modifications.h"
 #include "app/tide/records_to_vector-inl.h"
 
 #ifdef _MSC_VER
 #include <io.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <sys/resource.h>
 #endif
 
 extern void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
                                 const string& input_filename,
-                                const string& output_filename);
+                                const string& output_filename,
+                                const string& mass_index_filename,
+                                const string& mass_histogram_filename,
+                                const string& flat_filename,
+                                const string& packed_filename,
+                                const string& peaks_filename);
+extern bool WritePeakIndex(const vector<const pb::Protein*>& proteins,
+                           const string& peptides_filename,
+                           const string& peaks_filename,
+                           double bin_width, double bin_offset);
 extern void AddMods(HeadedRecordReader* reader,
                     string out_file,
                     string tmpDir,                    
@@ -26,6 +46,8 @@ extern void AddMods(HeadedRecordReader* reader,
                     const vector<const pb::Protein*>& proteins, VariableModTable& var_mod_table);
 DECLARE_int32(max_mods);
 DECLARE_int32(min_mods);
+DECLARE_int32(mods_buffer_mb);
+DECLARE_int32(mods_threads);
 
 TideIndexApplication::TideIndexApplication() {
 }
@@ -43,6 +65,17 @@ int TideIndexApplication::main(
   const string& fasta,
   const string& index,
   string cmd_line
+) {
+  if (Params::GetBool("append")) {
+    return appendToIndex(fasta, index, cmd_line);
+  }
+  return createIndex(fasta, index, cmd_line);
+}
+
+int TideIndexApplication::createIndex(
+  const string& fasta,
+  const string& index,
+  string cmd_line
 ) {
   carp(CARP_INFO, "Running tide-index...");
 
@@ -63,6 +96,13 @@ int TideIndexApplication::main(
   bool monoisotopic_precursor = Params::GetString("isotopic-mass") != "average";
   FLAGS_max_mods = Params::GetInt("max-mods");
   FLAGS_min_mods = Params::GetInt("min-mods");
+  FLAGS_mods_threads = Params::GetInt("num-threads");
+  if (FLAGS_mods_threads < 1) {
+    FLAGS_mods_threads = max(1, (int)boost::thread::hardware_concurrency());
+  }
+  if (Params::GetInt("max-index-memory") > 0) {
+    FLAGS_mods_buffer_mb = Params::GetInt("max-index-memory");
+  }
   bool allowDups = Params::GetBool("allow-dups");
   if (FLAGS_min_mods > FLAGS_max_mods) {
     carp(CARP_FATAL, "The value for 'min-mods' cannot be greater than the value "
@@ -108,9 +148,13 @@ int TideIndexApplication::main(
 
   var_mod_table.SerializeUniqueDeltas();
 
+  // Binning matters only for the peaks stored by peak-index
+  bool peakIndex = Params::GetBool("peak-index");
   if (!MassConstants::Init(var_mod_table.ParsedModTable(), 
     var_mod_table.ParsedNtpepModTable(), 
-    var_mod_table.ParsedCtpepModTable(), 0, 0)) {
+    var_mod_table.ParsedCtpepModTable(),
+    peakIndex ? Params::GetDouble("mz-bin-width") : 0,
+    peakIndex ? Params::GetDouble("mz-bin-offset") : 0)) {
     carp(CARP_FATAL, "Error in MassConstants::Init");
   }
 
@@ -127,6 +171,11 @@ int TideIndexApplication::main(
   string out_proteins = FileUtils::Join(index, "protix");
   string out_peptides = FileUtils::Join(index, "pepix");
   string out_aux = FileUtils::Join(index, "auxlocs");
+  string out_mass_index = FileUtils::Join(index, "massidx");
+  string out_mass_histogram = FileUtils::Join(index, "masshist");
+  string out_flat = FileUtils::Join(index, "pepix.flat");
+  string out_packed = FileUtils::Join(index, "pepix.packed");
+  string out_peaks = FileUtils::Join(index, "pepix.peaks");
   string modless_peptides = out_peptides + ".nomods.tmp";
   string peakless_peptides = out_peptides + ".nopeaks.tmp";
   ofstream* out_target_list = NULL;
@@ -153,6 +202,11 @@ int TideIndexApplication::main(
       FileUtils::Remove(out_proteins);
       FileUtils::Remove(out_peptides);
       FileUtils::Remove(out_aux);
+      FileUtils::Remove(out_mass_index);
+      FileUtils::Remove(out_mass_histogram);
+      FileUtils::Remove(out_flat);
+      FileUtils::Remove(out_packed);
+      FileUtils::Remove(out_peaks);
       FileUtils::Remove(modless_peptides);
       FileUtils::Remove(peakless_peptides);
     } else {
@@ -167,9 +221,14 @@ int TideIndexApplication::main(
   pb::Header proteinPbHeader;
   vector<TideIndexPeptide> peptideHeap;
   vector<string*> proteinSequences;
+  PeptideRuns peptideRuns;
+  peptideRuns.tempDir = Params::GetString("temp-dir");
+  peptideRuns.maxPeptides =
+    ((size_t)Params::GetInt("max-index-memory") << 20) / sizeof(TideIndexPeptide);
   fastaToPb(cmd_line, enzyme_t, digestion, missed_cleavages, min_mass, max_mass,
             min_length, max_length, allowDups, mass_type, decoy_type, fasta, out_proteins,
-            proteinPbHeader, peptideHeap, proteinSequences, out_decoy_fasta);
+            proteinPbHeader, peptideHeap, proteinSequences, peptideRuns,
+            out_decoy_fasta);
 
   pb::Header header_with_mods;
 
@@ -207,7 +266,8 @@ int TideIndexApplication::main(
   string basic_peptides = need_mods ? modless_peptides : peakless_peptides;
   carp(CARP_DETAILED_DEBUG, "basic_peptides=%s", basic_peptides.c_str());
 
-  writePeptidesAndAuxLocs(peptideHeap, basic_peptides, out_aux, header_no_mods);
+  writePeptidesAndAuxLocs(peptideHeap, peptideRuns, proteinSequences,
+                          basic_peptides, out_aux, header_no_mods);
   // Do some clean up
   for (vector<string*>::iterator i = proteinSequences.begin();
        i != proteinSequences.end();
@@ -293,7 +353,11 @@ int TideIndexApplication::main(
   }
 
   carp(CARP_INFO, "Precomputing theoretical spectra...");
-  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides);
+  AddTheoreticalPeaks(proteins, peakless_peptides, out_peptides, out_mass_index,
+                      out_mass_histogram,
+                      Params::GetBool("flat-index") ? out_flat : "",
+                      Params::GetBool("packed-index") ? out_packed : "",
+                      peakIndex ? out_peaks : "");
 
   // Clean up
   for (vector<const pb::Protein*>::iterator i = proteins.begin();
@@ -312,9 +376,730 @@ int TideIndexApplication::main(
   FileUtils::Remove(modless_peptides);
   FileUtils::Remove(peakless_peptides);
 
+  double peakMemory = peakMemoryMB();
+  if (peakMemory >= 0) {
+    carp(CARP_INFO, "Peak memory usage: %.1f MB", peakMemory);
+  }
+
   return 0;
 }
 
+int TideIndexApplication::appendToIndex(
+  const string& fasta,
+  const string& index,
+  const string& cmd_line
+) {
+  if (!FileUtils::Exists(FileUtils::Join(index, "protix")) ||
+      !FileUtils::Exists(FileUtils::Join(index, "pepix")) ||
+      !FileUtils::Exists(FileUtils::Join(index, "auxlocs"))) {
+    carp(CARP_FATAL, "Cannot append to %s, which is not a tide index",
+         index.c_str());
+  }
+  // The peak index is recomputed for the merged peptides, which are numbered
+  // anew; keep the binning of an existing one unless peak-index=T
+  string peaksFile = FileUtils::Join(index, "pepix.peaks");
+  double binWidth = Params::GetDouble("mz-bin-width");
+  double binOffset = Params::GetDouble("mz-bin-offset");
+  bool peakIndex = Params::GetBool("peak-index") ||
+    (FileUtils::Exists(peaksFile) &&
+     PeakIndexReader::ReadBins(peaksFile, &binWidth, &binOffset));
+
+  // Index the new proteins on their own, then merge that index into the
+  // existing one
+  string deltaIndex = FileUtils::Join(index, "append.tmp");
+  FileUtils::Remove(deltaIndex);
+  int result = createIndex(fasta, deltaIndex, cmd_line);
+  if (result != 0) {
+    return result;
+  }
+  carp(CARP_INFO, "Adding the new proteins and peptides to %s...", index.c_str());
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = max(1, (int)boost::thread::hardware_concurrency());
+  }
+  // The peptide lists, if any, are of the whole index; they replace those
+  // written for the new proteins alone
+  ofstream* targetList = NULL;
+  ofstream* decoyList = NULL;
+  if (Params::GetBool("peptide-list")) {
+    targetList = create_stream_in_path(make_file_path(
+      "tide-index.peptides.target.txt").c_str(), NULL, true);
+    if (get_tide_decoy_type_parameter("decoy-format") != NO_DECOYS) {
+      decoyList = create_stream_in_path(make_file_path(
+        "tide-index.peptides.decoy.txt").c_str(), NULL, true);
+    }
+  }
+  string flatFile = FileUtils::Join(index, "pepix.flat");
+  string packedFile = FileUtils::Join(index, "pepix.packed");
+  combineIndexes(index, vector<string>(1, deltaIndex), index, UNION_INDEXES,
+                 numThreads,
+                 FileUtils::Exists(flatFile) || Params::GetBool("flat-index"),
+                 FileUtils::Exists(packedFile) || Params::GetBool("packed-index"),
+                 targetList, decoyList);
+  FileUtils::Remove(deltaIndex);
+  if (targetList) {
+    targetList->close();
+    delete targetList;
+  }
+  if (decoyList) {
+    decoyList->close();
+    delete decoyList;
+  }
+
+  if (peakIndex) {
+    carp(CARP_INFO, "Precomputing theoretical spectra...");
+    ProteinVec proteins;
+    if (!ReadRecordsToVector<pb::Protein>(&proteins,
+           FileUtils::Join(index, "protix"))) {
+      carp(CARP_FATAL, "Error reading proteins file");
+    }
+    if (!WritePeakIndex(proteins, FileUtils::Join(index, "pepix"), peaksFile,
+                        binWidth, binOffset)) {
+      carp(CARP_WARNING, "Could not write peak index %s", peaksFile.c_str());
+    }
+    for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
+      delete *i;
+    }
+  }
+  return 0;
+}
+
+namespace {
+
+bool ReadPeptide(HeadedRecordReader* reader, pb::Peptide* peptide) {
+  if (reader->Done()) {
+    return false;
+  }
+  if (!reader->Read(peptide)) {
+    carp(CARP_FATAL, "Error reading peptides");
+  }
+  return true;
+}
+
+// Decodes the modifications of the peptides of one index.
+struct ModDecoder {
+  ModCoder coder;
+  vector<double> deltas;
+  explicit ModDecoder(const pb::ModTable& modTable) {
+    coder.Init(modTable.unique_deltas_size());
+    deltas.assign(modTable.unique_deltas().begin(), modTable.unique_deltas().end());
+  }
+};
+
+// The aux locations of one index, read as they are needed. Only the offset of
+// each record is held; tide-index writes the records in the order in which
+// the peptides first refer to them, so most reads need no seek.
+class AuxLocFile {
+ public:
+  AuxLocFile(const string& filename, pb::Header* header)
+    : reader_(filename, header), next_(-1) {
+    string bytes;
+    while (true) {
+      google::protobuf::int64 offset = reader_.Reader()->Offset();
+      if (reader_.Done()) {
+        break;
+      }
+      offsets_.push_back(offset);
+      reader_.ReadBytes(&bytes);
+    }
+    if (!reader_.OK()) {
+      carp(CARP_FATAL, "Error reading auxlocs file %s", filename.c_str());
+    }
+  }
+
+  int Size() const { return offsets_.size(); }
+
+  bool Read(int index, pb::AuxLocation* auxLoc) {
+    if (index < 0 || index >= (int)offsets_.size()) {
+      return false;
+    } else if (index != next_ && !reader_.Reader()->Seek(offsets_[index])) {
+      return false;
+    }
+    next_ = index + 1;
+    return !reader_.Done() && reader_.Read(auxLoc);
+  }
+
+ private:
+  HeadedRecordReader reader_;
+  vector<google::protobuf::int64> offsets_;
+  int next_;  // the record the reader is at, if known
+};
+
+// One of the indexes being combined.
+struct CombineInput {
+  string index;
+  ProteinArena proteins;
+  int proteinOffset;  // of its proteins in the output
+  pb::Header proteinsHeader;
+  pb::Header peptidesHeader;
+  pb::Header auxLocsHeader;
+  HeadedRecordReader* peptides;
+  AuxLocFile* auxLocs;
+  ModDecoder* decoder;
+  vector<int> auxLocMap;  // per aux location, its index in the output or -1
+  // For a union, the unmodified targets that an earlier index also has
+  set<string> sharedTargets;
+  pb::Peptide next;
+  bool more;
+};
+
+// The peptides of all indexes that have one mass, as a range of the block,
+// ordered by index.
+struct MassBucket {
+  size_t begin, end;
+};
+
+// A block of mass buckets whose peptides are compared in parallel.
+struct CombineBlock {
+  const vector<CombineInput*>* inputs;
+  bool sameMods;  // whether all indexes encode mods the same way
+  vector<pb::Peptide> peptides;
+  vector<int> inputOf;  // per peptide, the index it is from
+  vector<MassBucket> buckets;
+  // Per peptide, the peptide of an earlier index that it matches, or -1
+  vector<int> matches;
+  // For a union, the decoys that are the same modified sequence as a target
+  // of another index; these are left out. (Not vector<bool>, whose elements
+  // cannot be written from several threads.)
+  bool dropDecoys;
+  vector<char> dropped;
+};
+
+// Whether peptides x and y of the block are the same modified sequence. The
+// masses are assumed to be equal.
+bool SameSequence(const CombineBlock& block, size_t x, size_t y) {
+  const pb::Peptide& xPeptide = block.peptides[x];
+  const pb::Peptide& yPeptide = block.peptides[y];
+  if (xPeptide.length() != yPeptide.length() ||
+      xPeptide.modifications_size() != yPeptide.modifications_size()) {
+    return false;
+  }
+  const CombineInput* xInput = (*block.inputs)[block.inputOf[x]];
+  const CombineInput* yInput = (*block.inputs)[block.inputOf[y]];
+  for (int i = 0; i < xPeptide.modifications_size(); i++) {
+    if (block.sameMods) {
+      if (xPeptide.modifications(i) != yPeptide.modifications(i)) {
+        return false;
+      }
+    } else {
+      int xIndex, yIndex, xDelta, yDelta;
+      xInput->decoder->coder.DecodeMod(xPeptide.modifications(i), &xIndex, &xDelta);
+      yInput->decoder->coder.DecodeMod(yPeptide.modifications(i), &yIndex, &yDelta);
+      if (xIndex != yIndex ||
+          fabs(xInput->decoder->deltas[xDelta] -
+               yInput->decoder->deltas[yDelta]) > 1e-6) {
+        return false;
+      }
+    }
+  }
+  const ProteinView* xProtein =
+    xInput->proteins.Proteins()[xPeptide.first_location().protein_id()];
+  const ProteinView* yProtein =
+    yInput->proteins.Proteins()[yPeptide.first_location().protein_id()];
+  return memcmp(xProtein->residues() + xPeptide.first_location().pos(),
+                yProtein->residues() + yPeptide.first_location().pos(),
+                xPeptide.length()) == 0;
+}
+
+// Matches the peptides of every step-th bucket, starting at first. Each index
+// holds a sequence only once, as a target or as a decoy, so a peptide is the
+// same sequence as at most one peptide of each other index. Peptides match if
+// both are targets or both are decoys, and a peptide is matched to the first
+// index that has it; otherwise the decoy may be dropped.
+void MatchBuckets(CombineBlock* block, size_t first, size_t step) {
+  for (size_t b = first; b < block->buckets.size(); b += step) {
+    const MassBucket& bucket = block->buckets[b];
+    for (size_t j = bucket.begin; j < bucket.end; j++) {
+      for (size_t i = bucket.begin;
+           block->inputOf[i] < block->inputOf[j];
+           i++) {
+        if (!SameSequence(*block, i, j)) {
+          continue;
+        }
+        bool iDecoy = block->peptides[i].is_decoy();
+        if (iDecoy == block->peptides[j].is_decoy()) {
+          if (block->matches[j] < 0) {
+            block->matches[j] = i;
+          }
+        } else if (block->dropDecoys) {
+          block->dropped[iDecoy ? i : j] = true;
+        }
+      }
+    }
+  }
+}
+
+// The index whose next peptide is the lightest, or -1 if all are done.
+int LightestInput(const vector<CombineInput*>& inputs) {
+  int lightest = -1;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (inputs[i]->more &&
+        (lightest < 0 || inputs[i]->next.mass() < inputs[lightest]->next.mass())) {
+      lightest = i;
+    }
+  }
+  return lightest;
+}
+
+// The unmodified residues of a peptide.
+string Residues(const ProteinViewVec& proteins, const pb::Peptide& peptide) {
+  return string(proteins[peptide.first_location().protein_id()]->residues() +
+                peptide.first_location().pos(), peptide.length());
+}
+
+// The target that a shuffled or reversed decoy was made from. tide-index
+// stores it in the decoy's protein, after the decoy and its flanking residue;
+// empty if the protein does not hold one, as with protein-reverse decoys.
+string DecoySource(const ProteinViewVec& proteins, const pb::Peptide& decoy) {
+  const ProteinView* protein = proteins[decoy.first_location().protein_id()];
+  int begin = decoy.first_location().pos() + decoy.length() + 1;
+  if (begin + decoy.length() != protein->length()) {
+    return "";
+  }
+  return string(protein->residues() + begin, decoy.length());
+}
+
+// Reads the next unmodified target of the index.
+bool ReadUnmodifiedTarget(HeadedRecordReader* reader, pb::Peptide* peptide) {
+  while (ReadPeptide(reader, peptide)) {
+    if (!peptide->is_decoy() && peptide->modifications_size() == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Finds the unmodified targets of each index that an earlier index also has.
+// The earlier index already has decoys made from these, so for a union the
+// decoys that the later one made from them are left out, keeping one decoy
+// per target.
+void FindSharedTargets(const vector<CombineInput*>& inputs) {
+  vector<HeadedRecordReader*> readers;
+  vector<pb::Peptide> next(inputs.size());
+  vector<bool> more(inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    readers.push_back(new HeadedRecordReader(
+      FileUtils::Join(inputs[i]->index, "pepix"), NULL));
+    more[i] = ReadUnmodifiedTarget(readers[i], &next[i]);
+  }
+  set<string> bucket;
+  while (true) {
+    int lightest = -1;
+    for (size_t i = 0; i < inputs.size(); i++) {
+      if (more[i] && (lightest < 0 || next[i].mass() < next[lightest].mass())) {
+        lightest = i;
+      }
+    }
+    if (lightest < 0) {
+      break;
+    }
+    double mass = next[lightest].mass();
+    bucket.clear();
+    for (size_t i = 0; i < inputs.size(); i++) {
+      while (more[i] && next[i].mass() == mass) {
+        string residues = Residues(inputs[i]->proteins.Proteins(), next[i]);
+        if (!bucket.insert(residues).second) {
+          inputs[i]->sharedTargets.insert(residues);
+        }
+        more[i] = ReadUnmodifiedTarget(readers[i], &next[i]);
+      }
+    }
+  }
+  for (size_t i = 0; i < readers.size(); i++) {
+    if (!readers[i]->OK()) {
+      carp(CARP_FATAL, "Error reading peptides file");
+    }
+    delete readers[i];
+  }
+}
+
+// Replaces the proteins header that header, or any header it was made from,
+// holds with proteinsHeader, which was written to proteinsFile.
+void SetProteinsHeader(pb::Header* header, const pb::Header& proteinsHeader,
+                       const string& proteinsFile) {
+  for (int i = 0; i < header->source_size(); i++) {
+    pb::Header_Source* source = header->mutable_source(i);
+    if (!source->has_header()) {
+      continue;
+    } else if (source->header().file_type() == pb::Header::RAW_PROTEINS) {
+      source->mutable_header()->CopyFrom(proteinsHeader);
+      source->set_filename(proteinsFile);
+    } else {
+      SetProteinsHeader(source->mutable_header(), proteinsHeader, proteinsFile);
+    }
+  }
+}
+
+void AddLocation(int proteinId, int pos, pb::AuxLocation* auxLoc) {
+  pb::Location* location = auxLoc->add_location();
+  location->set_protein_id(proteinId);
+  location->set_pos(pos);
+}
+
+// Adds the locations of aux location auxLocIdx of input to outAuxLoc, with
+// the protein ids as in the output.
+void AddLocations(CombineInput* input, int auxLocIdx, pb::AuxLocation* outAuxLoc) {
+  pb::AuxLocation auxLoc;
+  if (!input->auxLocs->Read(auxLocIdx, &auxLoc)) {
+    carp(CARP_FATAL, "Error reading auxlocs of %s", input->index.c_str());
+  }
+  for (int i = 0; i < auxLoc.location_size(); i++) {
+    AddLocation(auxLoc.location(i).protein_id() + input->proteinOffset,
+                auxLoc.location(i).pos(), outAuxLoc);
+  }
+}
+
+}
+
+// Whether two indexes were built with the same settings, whichever builds
+// they are.
+static bool SameSettings(pb::Header_PeptidesHeader header1,
+                         pb::Header_PeptidesHeader header2) {
+  header1.clear_build_id();
+  header2.clear_build_id();
+  return header1.SerializeAsString() == header2.SerializeAsString();
+}
+
+void TideIndexApplication::combineIndexes(
+  const string& index1,
+  const vector<string>& indexes2,
+  const string& outIndex,
+  IndexOperation op,
+  int numThreads,
+  bool flat,
+  bool packed,
+  ofstream* targetList,
+  ofstream* decoyList
+) {
+  string outProteinsFile = FileUtils::Join(outIndex, "protix");
+  string outPeptidesFile = FileUtils::Join(outIndex, "pepix");
+  string outAuxLocsFile = FileUtils::Join(outIndex, "auxlocs");
+  string massIndexFile = FileUtils::Join(outIndex, "massidx");
+  string massHistogramFile = FileUtils::Join(outIndex, "masshist");
+  string flatFile = FileUtils::Join(outIndex, "pepix.flat");
+  string packedFile = FileUtils::Join(outIndex, "pepix.packed");
+  string peaksFile = FileUtils::Join(outIndex, "pepix.peaks");
+
+  // Peptides of a union refer to the proteins of all indexes, numbered in
+  // the order of the indexes
+  vector<CombineInput*> inputs;
+  int numProteins = 0;
+  for (size_t i = 0; i <= indexes2.size(); i++) {
+    CombineInput* input = new CombineInput;
+    input->index = i == 0 ? index1 : indexes2[i - 1];
+    if (!input->proteins.Read(FileUtils::Join(input->index, "protix"),
+                              &input->proteinsHeader)) {
+      carp(CARP_FATAL, "Error reading proteins file of %s", input->index.c_str());
+    }
+    input->proteinOffset = numProteins;
+    numProteins += input->proteins.Proteins().size();
+    input->peptides = new HeadedRecordReader(
+      FileUtils::Join(input->index, "pepix"), &input->peptidesHeader);
+    if (!input->peptides->OK() ||
+        input->peptidesHeader.file_type() != pb::Header::PEPTIDES) {
+      carp(CARP_FATAL, "Error reading peptides file of %s", input->index.c_str());
+    }
+    input->auxLocs = new AuxLocFile(FileUtils::Join(input->index, "auxlocs"),
+                                    &input->auxLocsHeader);
+    input->auxLocMap.assign(input->auxLocs->Size(), -1);
+    input->decoder = new ModDecoder(input->peptidesHeader.peptides_header().mods());
+    inputs.push_back(input);
+  }
+
+  // The output is a new build of pepix
+  pb::Header peptidesHeader = inputs[0]->peptidesHeader;
+  peptidesHeader.mutable_peptides_header()->set_build_id(NewBuildId());
+  pb::Header proteinsHeader = inputs[0]->proteinsHeader;
+  pb::Header auxLocsHeader = inputs[0]->auxLocsHeader;
+  CombineBlock block;
+  block.inputs = &inputs;
+  block.dropDecoys = op == UNION_INDEXES;
+  block.sameMods = true;
+  for (size_t i = 1; i < inputs.size(); i++) {
+    const pb::Header& header = inputs[i]->peptidesHeader;
+    if (op == UNION_INDEXES) {
+      if (!SameSettings(peptidesHeader.peptides_header(), header.peptides_header())) {
+        carp(CARP_FATAL, "The settings (enzyme, masses, lengths, modifications "
+                         "or decoys) of %s differ from those of %s",
+             inputs[i]->index.c_str(), index1.c_str());
+      }
+      for (int j = 0; j < inputs[i]->proteinsHeader.source_size(); j++) {
+        proteinsHeader.add_source()->CopyFrom(inputs[i]->proteinsHeader.source(j));
+      }
+    }
+    if (peptidesHeader.peptides_header().mods().SerializeAsString() !=
+        header.peptides_header().mods().SerializeAsString()) {
+      block.sameMods = false;
+    }
+  }
+
+  {
+    HeadedRecordWriter proteinWriter(outProteinsFile + ".tmp", proteinsHeader);
+    pb::Protein protein;
+    for (size_t i = 0; i < (op == UNION_INDEXES ? inputs.size() : 1); i++) {
+      HeadedRecordReader reader(FileUtils::Join(inputs[i]->index, "protix"));
+      while (!reader.Done()) {
+        if (!reader.Read(&protein)) {
+          break;
+        }
+        protein.set_id(protein.id() + inputs[i]->proteinOffset);
+        proteinWriter.Write(&protein);
+      }
+      if (!reader.OK()) {
+        carp(CARP_FATAL, "Error reading proteins file of %s",
+             inputs[i]->index.c_str());
+      }
+    }
+    if (!proteinWriter.OK()) {
+      carp(CARP_FATAL, "Error writing proteins file");
+    }
+  }
+  // pepix and auxlocs carry the header of the proteins they refer to
+  SetProteinsHeader(&peptidesHeader, proteinsHeader, AbsPath(outProteinsFile));
+  SetProteinsHeader(&auxLocsHeader, proteinsHeader, AbsPath(outProteinsFile));
+
+  if (op == UNION_INDEXES && inputs.size() > 1) {
+    FindSharedTargets(inputs);
+  }
+
+  FileUtils::Remove(massIndexFile);
+  FileUtils::Remove(massHistogramFile);
+  FileUtils::Remove(flatFile);
+  FileUtils::Remove(packedFile);
+  // Peak indexes are not carried over; the peptide ids change
+  FileUtils::Remove(peaksFile);
+  HeadedRecordWriter* peptideWriter =
+    new HeadedRecordWriter(outPeptidesFile + ".tmp", peptidesHeader);
+  HeadedRecordWriter* auxLocWriter =
+    new HeadedRecordWriter(outAuxLocsFile + ".tmp", auxLocsHeader);
+  MassIndexBuilder massIndex;
+  MassHistogram massHistogram;
+  FlatPeptideWriter* flatWriter = flat ? new FlatPeptideWriter(flatFile) : NULL;
+  PackedPeptideWriter* packedWriter =
+    packed ? new PackedPeptideWriter(packedFile) : NULL;
+  if (!peptideWriter->OK() || !auxLocWriter->OK() ||
+      (flatWriter && !flatWriter->OK()) ||
+      (packedWriter && !packedWriter->OK())) {
+    carp(CARP_FATAL, "Error creating index files in %s", outIndex.c_str());
+  }
+
+  // The aux locations are written in the order in which the peptides first
+  // refer to them. Those of peptides in several indexes are keyed by the
+  // first locations of the peptides; the modified forms of a peptide share
+  // them.
+  map<vector<pair<int, int> >, int> sharedAuxLocMap;
+  int numAuxLocs = 0;
+  int count = 0, shared = 0, dropped = 0, droppedShared = 0;
+  pb::AuxLocation auxLoc;
+  vector<pair<int, int> > key;
+  // Per peptide of the block, the first and the next peptide that match it
+  vector<int> firstMatch, nextMatch;
+
+  const size_t blockSize = 1 << 16;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    inputs[i]->more = ReadPeptide(inputs[i]->peptides, &inputs[i]->next);
+  }
+  while (true) {
+    // Read a block of whole mass buckets, and match them in parallel
+    block.peptides.clear();
+    block.inputOf.clear();
+    block.buckets.clear();
+    while (block.peptides.size() < blockSize) {
+      int lightest = LightestInput(inputs);
+      if (lightest < 0) {
+        break;
+      }
+      double mass = inputs[lightest]->next.mass();
+      MassBucket bucket;
+      bucket.begin = block.peptides.size();
+      for (size_t i = 0; i < inputs.size(); i++) {
+        CombineInput* input = inputs[i];
+        while (input->more && input->next.mass() == mass) {
+          if (input->next.is_decoy() && !input->sharedTargets.empty() &&
+              input->sharedTargets.find(DecoySource(input->proteins.Proteins(),
+                                                    input->next)) !=
+                input->sharedTargets.end()) {
+            ++droppedShared;
+          } else {
+            block.peptides.push_back(input->next);
+            block.inputOf.push_back(i);
+          }
+          input->more = ReadPeptide(input->peptides, &input->next);
+        }
+      }
+      bucket.end = block.peptides.size();
+      // Only the peptides of the first index are kept unless for a union
+      if (op != UNION_INDEXES &&
+          (bucket.begin == bucket.end || block.inputOf[bucket.begin] != 0)) {
+        block.peptides.resize(bucket.begin);
+        block.inputOf.resize(bucket.begin);
+        continue;
+      }
+      block.buckets.push_back(bucket);
+    }
+    if (block.buckets.empty()) {
+      break;
+    }
+    block.matches.assign(block.peptides.size(), -1);
+    block.dropped.assign(block.peptides.size(), false);
+    boost::thread_group threads;
+    for (int t = 1; t < numThreads; t++) {
+      threads.create_thread(boost::bind(&MatchBuckets, &block, t, numThreads));
+    }
+    MatchBuckets(&block, 0, numThreads);
+    threads.join_all();
+
+    firstMatch.assign(block.peptides.size(), -1);
+    nextMatch.assign(block.peptides.size(), -1);
+    for (int j = (int)block.peptides.size() - 1; j >= 0; j--) {
+      int i = block.matches[j];
+      if (i >= 0) {
+        nextMatch[j] = firstMatch[i];
+        firstMatch[i] = j;
+      }
+    }
+
+    // Write the buckets in order; in each, the peptides of the first index
+    // come first
+    for (size_t b = 0; b < block.buckets.size(); b++) {
+      const MassBucket& bucket = block.buckets[b];
+      for (size_t i = bucket.begin; i < bucket.end; i++) {
+        CombineInput* input = inputs[block.inputOf[i]];
+        if (block.matches[i] >= 0 ||
+            (op != UNION_INDEXES && block.inputOf[i] != 0)) {
+          continue;  // written with the peptide that it matches, if at all
+        }
+        // The number of other indexes that have the peptide
+        size_t numMatches = 0;
+        for (int j = firstMatch[i]; j >= 0; j = nextMatch[j]) {
+          ++numMatches;
+        }
+        if (numMatches > 0) {
+          ++shared;
+        }
+        if ((op == SUBTRACT_INDEXES && numMatches > 0) ||
+            (op == INTERSECT_INDEXES && numMatches < inputs.size() - 1)) {
+          continue;
+        } else if (block.dropped[i]) {
+          ++dropped;
+          continue;
+        }
+        pb::Peptide& peptide = block.peptides[i];
+        ofstream* list = peptide.is_decoy() ? decoyList : targetList;
+        if (list) {
+          *list << getModifiedPeptideSeq(&peptide, &input->proteins.Proteins())
+                << '\t' << peptide.mass() << endl;
+        }
+        pb::Location* location = peptide.mutable_first_location();
+        location->set_protein_id(location->protein_id() + input->proteinOffset);
+        int auxLocIdx = peptide.has_aux_locations_index() ?
+          peptide.aux_locations_index() : -1;
+        if (op == UNION_INDEXES && numMatches > 0) {
+          // Add the locations of the other indexes
+          key.clear();
+          key.push_back(make_pair(location->protein_id(), location->pos()));
+          for (int j = firstMatch[i]; j >= 0; j = nextMatch[j]) {
+            const pb::Location& other = block.peptides[j].first_location();
+            key.push_back(make_pair(
+              other.protein_id() + inputs[block.inputOf[j]]->proteinOffset,
+              other.pos()));
+          }
+          map<vector<pair<int, int> >, int>::const_iterator
+            lookup = sharedAuxLocMap.find(key);
+          if (lookup != sharedAuxLocMap.end()) {
+            auxLocIdx = lookup->second;
+          } else {
+            auxLoc.Clear();
+            if (auxLocIdx >= 0) {
+              AddLocations(input, auxLocIdx, &auxLoc);
+            }
+            int k = 1;
+            for (int j = firstMatch[i]; j >= 0; j = nextMatch[j], k++) {
+              AddLocation(key[k].first, key[k].second, &auxLoc);
+              if (block.peptides[j].has_aux_locations_index()) {
+                AddLocations(inputs[block.inputOf[j]],
+                             block.peptides[j].aux_locations_index(), &auxLoc);
+              }
+            }
+            auxLocWriter->Write(&auxLoc);
+            auxLocIdx = sharedAuxLocMap[key] = numAuxLocs++;
+          }
+        } else if (auxLocIdx >= 0) {
+          if (auxLocIdx >= (int)input->auxLocMap.size()) {
+            carp(CARP_FATAL, "Error reading auxlocs of %s", input->index.c_str());
+          } else if (input->auxLocMap[auxLocIdx] < 0) {
+            auxLoc.Clear();
+            AddLocations(input, auxLocIdx, &auxLoc);
+            auxLocWriter->Write(&auxLoc);
+            input->auxLocMap[auxLocIdx] = numAuxLocs++;
+          }
+          auxLocIdx = input->auxLocMap[auxLocIdx];
+        }
+        if (auxLocIdx >= 0) {
+          peptide.set_aux_locations_index(auxLocIdx);
+        }
+        peptide.set_id(count++);
+        massIndex.Add(peptide.mass(), peptideWriter->Writer()->Offset());
+        massHistogram.Add(peptide.mass(), peptide.is_decoy());
+        peptideWriter->Write(&peptide);
+        if (flatWriter) {
+          flatWriter->Write(peptide);
+        }
+        if (packedWriter) {
+          packedWriter->Write(peptide);
+        }
+      }
+    }
+  }
+  if (!peptideWriter->OK() || !auxLocWriter->OK()) {
+    carp(CARP_FATAL, "Error writing peptides to %s", outIndex.c_str());
+  }
+  for (vector<CombineInput*>::iterator i = inputs.begin(); i != inputs.end(); ++i) {
+    if (!(*i)->peptides->OK()) {
+      carp(CARP_FATAL, "Error reading peptides file of %s", (*i)->index.c_str());
+    }
+    delete (*i)->peptides;
+    delete (*i)->auxLocs;
+    delete (*i)->decoder;
+    delete *i;
+  }
+  delete auxLocWriter;
+  delete peptideWriter; // close the peptides before indexing them
+  carp(CARP_INFO, "Wrote %d peptides; %d were found in more than one index",
+       count, shared);
+  if (dropped > 0) {
+    carp(CARP_INFO, "Left out %d decoys that are targets in another index",
+         dropped);
+  }
+  if (droppedShared > 0) {
+    carp(CARP_INFO, "Left out %d decoys made from targets that an earlier "
+         "index already has decoys for", droppedShared);
+  }
+
+  FileUtils::Rename(outProteinsFile + ".tmp", outProteinsFile);
+  FileUtils::Rename(outAuxLocsFile + ".tmp", outAuxLocsFile);
+  FileUtils::Rename(outPeptidesFile + ".tmp", outPeptidesFile);
+  if (!massIndex.Write(massIndexFile, outPeptidesFile)) {
+    carp(CARP_WARNING, "Could not write mass index %s", massIndexFile.c_str());
+  }
+  if (!massHistogram.Write(massHistogramFile, outPeptidesFile)) {
+    carp(CARP_WARNING, "Could not write mass histogram %s",
+         massHistogramFile.c_str());
+  }
+  if (flatWriter) {
+    if (!flatWriter->Close(outPeptidesFile)) {
+      carp(CARP_WARNING, "Could not write flat index %s", flatFile.c_str());
+    }
+    delete flatWriter;
+  }
+  if (packedWriter) {
+    if (!packedWriter->Close(outPeptidesFile)) {
+      carp(CARP_WARNING, "Could not write packed index %s", packedFile.c_str());
+    }
+    delete packedWriter;
+  }
+}
+
 string TideIndexApplication::getName() const {
   return "tide-index";
 }
@@ -372,12 +1157,21 @@ vector<string> TideIndexApplication::getOptions() const {
     "output-dir",
     "overwrite",
     "peptide-list",
+    "flat-index",
+    "packed-index",
+    "peak-index",
+    "append",
     "parameter-file",
     "seed",
     "clip-nterm-methionine",
     "verbosity",
     "allow-dups",
-    "temp-dir"
+    "parallel-decoys",
+    "num-threads",
+    "temp-dir",
+    "max-index-memory",
+    "mz-bin-width",
+    "mz-bin-offset"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
 }
@@ -422,6 +1216,7 @@ void TideIndexApplication::fastaToPb(
   pb::Header& outProteinPbHeader,
   vector<TideIndexPeptide>& outPeptideHeap,
   vector<string*>& outProteinSequences,
+  PeptideRuns& outPeptideRuns,
   ofstream* decoyFasta
 ) {
   typedef GeneratePeptides::CleavedPeptide PeptideInfo;
@@ -438,6 +1233,9 @@ void TideIndexApplication::fastaToPb(
 
   outPeptideHeap.clear();
   outProteinSequences.clear();
+  if (outPeptideRuns.maxPeptides > 0) {
+    outPeptideHeap.reserve(outPeptideRuns.maxPeptides);
+  }
 
   HeadedRecordWriter proteinWriter(proteinPbFile, outProteinPbHeader);
   ifstream fastaStream(fasta.c_str(), ifstream::in);
@@ -445,57 +1243,97 @@ void TideIndexApplication::fastaToPb(
   string proteinName;
   string* proteinSequence = new string;
   int curProtein = -1;
-  vector< pair< ProteinInfo, vector<PeptideInfo> > > cleavedPeptideInfo;
+  // The target proteins, by id. Their peptides are not kept; the passes
+  // after the first digest the proteins again.
+  vector<ProteinInfo> targetProteins;
   set<string> setTargets, setDecoys;
   map<const string*, TargetInfo> targetInfo;
+  // When peptides are spilled to disk, the distinct targets are found while
+  // the runs are merged, rather than kept in setTargets during digestion.
+  bool collectTargetsAfter = outPeptideRuns.maxPeptides > 0;
+
+  int numThreads = Params::GetInt("num-threads");
+  if (numThreads < 1) {
+    numThreads = max(1, (int)boost::thread::hardware_concurrency());
+  }
+  carp(CARP_DEBUG, "Digesting proteins with %d threads", numThreads);
+  // Proteins are digested a chunk at a time, in parallel, and the results are
+  // then taken in FASTA order, so the index does not depend on numThreads.
+  const size_t chunkSize = 4096;
+  DigestJob job;
+  job.sequences = &outProteinSequences;
+  job.reverse = false;
+  job.enzyme = enzyme;
+  job.digestion = digestion;
+  job.missedCleavages = missedCleavages;
+  job.minLength = minLength;
+  job.maxLength = maxLength;
+  job.massType = massType;
+  vector<DigestedProtein> digested;
+  job.out = &digested;
+  vector<string> proteinNames;
 
   // Iterate over all proteins in FASTA file
   unsigned int targetsGenerated = 0, decoysGenerated = 0;
-  while (GeneratePeptides::getNextProtein(fastaStream, &proteinName, proteinSequence)) {
-    outProteinSequences.push_back(proteinSequence);
-    cleavedPeptideInfo.push_back(make_pair(
-      ProteinInfo(proteinName, proteinSequence), vector<PeptideInfo>()));
-    const ProteinInfo& proteinInfo = cleavedPeptideInfo.back().first;
-    vector<PeptideInfo>& cleavedPeptides = cleavedPeptideInfo.back().second;
-    // Write pb::Protein
-    getPbProtein(++curProtein, proteinName, *proteinSequence, pbProtein);
-    proteinWriter.Write(&pbProtein);
-    cleavedPeptides = GeneratePeptides::cleaveProtein(
-      *proteinSequence, enzyme, digestion, missedCleavages, minLength, maxLength);
-    // Iterate over all generated peptides for this protein
-    for (vector<PeptideInfo>::iterator i = cleavedPeptides.begin();
-         i != cleavedPeptides.end(); ) {
-      FLOAT_T pepMass = calcPepMassTide(i->Sequence(), massType);
-      if (pepMass < 0.0) {
-        // Sequence contained some invalid character
-        carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", i->Sequence().c_str());
-        ++invalidPepCnt;
-        i = cleavedPeptides.erase(i);
-        continue;
-      } else if (pepMass < minMass || pepMass > maxMass) {
-        // Skip to next peptide if not in mass range
-        ++i;
-        continue;
-      }
-      // Add target to heap
-      TideIndexPeptide pepTarget(
-        pepMass, i->Length(), proteinSequence, curProtein, i->Position(), false);
-      outPeptideHeap.push_back(pepTarget);
-      push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
-      if (!allowDups && decoyType != NO_DECOYS) {
-        const string* setTarget = &*(setTargets.insert(i->Sequence()).first);
-        targetInfo.insert(make_pair(setTarget, TargetInfo(proteinInfo, i->Position(), pepMass)));
+  bool moreProteins = true;
+  while (moreProteins) {
+    proteinNames.clear();
+    job.begin = outProteinSequences.size();
+    while (proteinNames.size() < chunkSize &&
+           (moreProteins = GeneratePeptides::getNextProtein(
+              fastaStream, &proteinName, proteinSequence))) {
+      proteinNames.push_back(proteinName);
+      outProteinSequences.push_back(proteinSequence);
+      proteinSequence = new string;
+    }
+    job.end = outProteinSequences.size();
+    digestProteins(job, numThreads);
+
+    for (size_t k = 0; k < proteinNames.size(); ++k) {
+      string* chunkSequence = outProteinSequences[job.begin + k];
+      targetProteins.push_back(ProteinInfo(proteinNames[k], chunkSequence));
+      // Write pb::Protein
+      getPbProtein(++curProtein, proteinNames[k], *chunkSequence, pbProtein);
+      proteinWriter.Write(&pbProtein);
+      const vector<PeptideInfo>& cleavedPeptides = digested[k].peptides;
+      const vector<FLOAT_T>& masses = digested[k].masses;
+      // Iterate over all generated peptides for this protein
+      for (size_t j = 0; j < cleavedPeptides.size(); ++j) {
+        const PeptideInfo& peptide = cleavedPeptides[j];
+        FLOAT_T pepMass = masses[j];
+        if (pepMass < 0.0) {
+          // Sequence contained some invalid character
+          carp(CARP_DEBUG, "Ignoring invalid sequence <%s>", peptide.Sequence().c_str());
+          ++invalidPepCnt;
+          continue;
+        } else if (pepMass < minMass || pepMass > maxMass) {
+          // Skip to next peptide if not in mass range
+          continue;
+        }
+        // Add target to heap
+        TideIndexPeptide pepTarget(
+          pepMass, peptide.Length(), chunkSequence, curProtein, peptide.Position(), false);
+        outPeptideHeap.push_back(pepTarget);
+        push_heap(outPeptideHeap.begin(), outPeptideHeap.end(), greater<TideIndexPeptide>());
+        if (!allowDups && decoyType != NO_DECOYS && !collectTargetsAfter) {
+          const string* setTarget = &*(setTargets.insert(peptide.Sequence()).first);
+          targetInfo.insert(make_pair(setTarget,
+            TargetInfo(curProtein, peptide.Position(), pepMass)));
+        }
+        ++targetsGenerated;
       }
-      ++targetsGenerated;
-      ++i;
+      spillPeptides(outPeptideHeap, outPeptideRuns);
     }
-    proteinSequence = new string;
   }
   delete proteinSequence;
   if (targetsGenerated == 0) {
     carp(CARP_FATAL, "No target sequences generated.  Is \'%s\' a FASTA file?",
          fasta.c_str());
   }
+  if (collectTargetsAfter && !allowDups && decoyType != NO_DECOYS) {
+    collectTargets(outPeptideHeap, outPeptideRuns, outProteinSequences,
+                   setTargets, targetInfo);
+  }
 
   // Generate decoys
   map<const string, const string*> targetToDecoy;
@@ -503,49 +1341,88 @@ void TideIndexApplication::fastaToPb(
     if (decoyFasta) {
       carp(CARP_INFO, "Writing reverse-protein fasta and decoys...");
     }
-    for (vector< pair< ProteinInfo, vector<PeptideInfo> > >::const_iterator i =
-         cleavedPeptideInfo.begin(); i != cleavedPeptideInfo.end(); ++i) {
-      string decoyProtein = *(i->first.sequence);
-      reverse(decoyProtein.begin(), decoyProtein.end());
-      if (decoyFasta) {
-        (*decoyFasta) << ">"<< decoyPrefix << i->first.name << endl
-                      << decoyProtein << endl;
-      }
-      vector<PeptideInfo> cleavedReverse = GeneratePeptides::cleaveProtein(
-        decoyProtein, enzyme, digestion, missedCleavages, minLength, maxLength);
-      // Iterate over all generated peptides for this protein
-      for (vector<PeptideInfo>::iterator j = cleavedReverse.begin();
-           j != cleavedReverse.end();
-           ++j) {
-        FLOAT_T pepMass = calcPepMassTide(j->Sequence(), massType);
-        if (pepMass < 0.0) {
-          // Sequence contained some invalid character
-          carp(CARP_DEBUG, "Ignoring invalid sequence in decoy fasta <%s>",
-               j->Sequence().c_str());
-          ++invalidPepCnt;
-          continue;
-        } else if (pepMass < minMass || pepMass > maxMass) {
-          // Skip to next peptide if not in mass range
-          continue;
-        } else if (!allowDups && setTargets.find(j->Sequence()) != setTargets.end()) {
-          // Sequence already exists as a target
-          continue;
+    // Digest the reversed target proteins, which are the first
+    // targetProteins.size() sequences, a chunk at a time
+    job.reverse = true;
+    for (job.begin = 0; job.begin < targetProteins.size(); job.begin = job.end) {
+      job.end = min(job.begin + chunkSize, targetProteins.size());
+      digestProteins(job, numThreads);
+      for (size_t k = job.begin; k < job.end; ++k) {
+        const ProteinInfo& targetProtein = targetProteins[k];
+        string decoyProtein = *(targetProtein.sequence);
+        reverse(decoyProtein.begin(), decoyProtein.end());
+        if (decoyFasta) {
+          (*decoyFasta) << ">"<< decoyPrefix << targetProtein.name << endl
+                        << decoyProtein << endl;
         }
-        string* decoySequence = new string(j->Sequence());
-        outProteinSequences.push_back(decoySequence);
-
-        // Write pb::Protein
-        getDecoyPbProtein(++curProtein, ProteinInfo(i->first.name, &decoyProtein),
-                          *decoySequence, j->Position(), pbProtein);
-        proteinWriter.Write(&pbProtein);
-        // Add decoy to heap
-        TideIndexPeptide pepDecoy(pepMass, j->Length(), decoySequence,
-          curProtein, (j->Position() > 0) ? 1 : 0, true);
-        outPeptideHeap.push_back(pepDecoy);
-        push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
-          greater<TideIndexPeptide>());
-        ++decoysGenerated;
+        const vector<PeptideInfo>& cleavedReverse = digested[k - job.begin].peptides;
+        const vector<FLOAT_T>& masses = digested[k - job.begin].masses;
+        // Iterate over all generated peptides for this protein
+        for (size_t j = 0; j < cleavedReverse.size(); ++j) {
+          const PeptideInfo& peptide = cleavedReverse[j];
+          FLOAT_T pepMass = masses[j];
+          if (pepMass < 0.0) {
+            // Sequence contained some invalid character
+            carp(CARP_DEBUG, "Ignoring invalid sequence in decoy fasta <%s>",
+                 peptide.Sequence().c_str());
+            ++invalidPepCnt;
+            continue;
+          } else if (pepMass < minMass || pepMass > maxMass) {
+            // Skip to next peptide if not in mass range
+            continue;
+          } else if (!allowDups && setTargets.find(peptide.Sequence()) != setTargets.end()) {
+            // Sequence already exists as a target
+            continue;
+          }
+          string* decoySequence = new string(peptide.Sequence());
+          outProteinSequences.push_back(decoySequence);
+
+          // Write pb::Protein
+          getDecoyPbProtein(++curProtein, ProteinInfo(targetProtein.name, &decoyProtein),
+                            *decoySequence, peptide.Position(), pbProtein);
+          proteinWriter.Write(&pbProtein);
+          // Add decoy to heap
+          TideIndexPeptide pepDecoy(pepMass, peptide.Length(), decoySequence,
+            curProtein, (peptide.Position() > 0) ? 1 : 0, true);
+          outPeptideHeap.push_back(pepDecoy);
+          push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
+            greater<TideIndexPeptide>());
+          ++decoysGenerated;
+        }
+        spillPeptides(outPeptideHeap, outPeptideRuns);
+      }
+    }
+  } else if (!allowDups && Params::GetBool("parallel-decoys")) {
+    vector<const string*> targets;
+    targets.reserve(setTargets.size());
+    for (set<string>::const_iterator i = setTargets.begin();
+         i != setTargets.end();
+         ++i) {
+      targets.push_back(&*i);
+    }
+    vector<string> decoys;
+    vector<bool> made;
+    makeDecoysParallel(targets, setTargets, decoyType == PEPTIDE_SHUFFLE_DECOYS,
+                       numThreads, decoys, made);
+    // Add the decoys in target order, as the serial loop below does
+    for (size_t i = 0; i < targets.size(); ++i) {
+      if (!made[i]) {
+        carp(CARP_DETAILED_INFO, "Failed to generate decoy for sequence %s",
+             targets[i]->c_str());
+        ++failedDecoyCnt;
+        continue;
       }
+      const TargetInfo& info = targetInfo.find(targets[i])->second;
+      string* decoySequence = new string;
+      decoySequence->swap(decoys[i]);
+      if (decoyFasta) {
+        targetToDecoy[*targets[i]] = decoySequence;
+      }
+      addDecoy(decoySequence, decoysGenerated, curProtein, targetProteins[info.protein],
+               info.start, pbProtein, info.mass, outPeptideHeap,
+               outProteinSequences);
+      proteinWriter.Write(&pbProtein);
+      spillPeptides(outPeptideHeap, outPeptideRuns);
     }
   } else if (!allowDups) {
     for (set<string>::const_iterator i = setTargets.begin();
@@ -554,35 +1431,45 @@ void TideIndexApplication::fastaToPb(
       const string* setTarget = &*i;
       const map<const string*, TargetInfo>::iterator targetLookup =
         targetInfo.find(setTarget);
-      const ProteinInfo& proteinInfo = (targetLookup->second.proteinInfo);
+      const ProteinInfo& proteinInfo = targetProteins[targetLookup->second.protein];
       const int startLoc = targetLookup->second.start;
       FLOAT_T pepMass = targetLookup->second.mass;
       if(generateDecoy(*setTarget, targetToDecoy, &setTargets, &setDecoys, decoyType, allowDups, failedDecoyCnt,
                     decoysGenerated, curProtein, proteinInfo, startLoc, pbProtein,
                     pepMass, outPeptideHeap, outProteinSequences)) {
         proteinWriter.Write(&pbProtein);
+        spillPeptides(outPeptideHeap, outPeptideRuns);
       } else {
         continue;
       }
     }
   
   } else { // allow dups
-    for (vector<pair<ProteinInfo, vector<PeptideInfo> > >::const_iterator i = cleavedPeptideInfo.begin();
-         i != cleavedPeptideInfo.end();
-         ++i) {
-      for (vector<PeptideInfo>::const_iterator j = i->second.begin();
-           j != i->second.end();
-           ++j) {
-        const string setTarget = j->Sequence();
-        const ProteinInfo& proteinInfo = i->first;
-        const int startLoc = j->Position();
-        FLOAT_T pepMass = calcPepMassTide(j->Sequence(), massType);
-        if(generateDecoy(setTarget, targetToDecoy, NULL, NULL, decoyType, allowDups, failedDecoyCnt,
-                      decoysGenerated, curProtein, proteinInfo, startLoc, pbProtein,
-                      pepMass, outPeptideHeap, outProteinSequences)) {
-          proteinWriter.Write(&pbProtein);
-        } else {
-          continue;
+    // Digest the target proteins again, a chunk at a time
+    job.reverse = false;
+    for (job.begin = 0; job.begin < targetProteins.size(); job.begin = job.end) {
+      job.end = min(job.begin + chunkSize, targetProteins.size());
+      digestProteins(job, numThreads);
+      for (size_t k = job.begin; k < job.end; ++k) {
+        const vector<PeptideInfo>& cleavedPeptides = digested[k - job.begin].peptides;
+        const vector<FLOAT_T>& masses = digested[k - job.begin].masses;
+        for (size_t j = 0; j < cleavedPeptides.size(); ++j) {
+          if (masses[j] < 0.0) {
+            // Sequence contained some invalid character, counted above
+            continue;
+          }
+          const string setTarget = cleavedPeptides[j].Sequence();
+          const ProteinInfo& proteinInfo = targetProteins[k];
+          const int startLoc = cleavedPeptides[j].Position();
+          FLOAT_T pepMass = masses[j];
+          if(generateDecoy(setTarget, targetToDecoy, NULL, NULL, decoyType, allowDups, failedDecoyCnt,
+                        decoysGenerated, curProtein, proteinInfo, startLoc, pbProtein,
+                        pepMass, outPeptideHeap, outProteinSequences)) {
+            proteinWriter.Write(&pbProtein);
+            spillPeptides(outPeptideHeap, outPeptideRuns);
+          } else {
+            continue;
+          }
         }
       }
     }
@@ -600,30 +1487,459 @@ void TideIndexApplication::fastaToPb(
   // Write to decoy fasta if necessary (if protein-reverse, we already wrote it)
   if (decoyFasta && decoyType != PROTEIN_REVERSE_DECOYS) {
     carp(CARP_INFO, "Writing decoy fasta...");
-    // Iterate over all (protein, peptides from that protein)
-    for (vector< pair< ProteinInfo, vector<PeptideInfo> > >::const_iterator i =
-         cleavedPeptideInfo.begin(); i != cleavedPeptideInfo.end(); ++i) {
-      string decoyProtein = *(i->first.sequence);
-      // Iterate over all peptides from the protein
-      for (vector<PeptideInfo>::const_iterator j = i->second.begin();
-           j != i->second.end();
-           ++j) {
-        // In the protein sequence, replace the target peptide with its decoy
-        const string setTarget = j->Sequence();
-        const map<const string, const string*>::const_iterator decoyCheck = targetToDecoy.find(setTarget);
-        if (decoyCheck != targetToDecoy.end()) {
-          decoyProtein.replace(j->Position(), j->Length(), *(decoyCheck->second));
+    // Digest the target proteins again, a chunk at a time
+    job.reverse = false;
+    for (job.begin = 0; job.begin < targetProteins.size(); job.begin = job.end) {
+      job.end = min(job.begin + chunkSize, targetProteins.size());
+      digestProteins(job, numThreads);
+      for (size_t k = job.begin; k < job.end; ++k) {
+        string decoyProtein = *(targetProteins[k].sequence);
+        const vector<PeptideInfo>& cleavedPeptides = digested[k - job.begin].peptides;
+        const vector<FLOAT_T>& masses = digested[k - job.begin].masses;
+        // Iterate over all peptides from the protein
+        for (size_t j = 0; j < cleavedPeptides.size(); ++j) {
+          if (masses[j] < 0.0) {
+            continue;
+          }
+          // In the protein sequence, replace the target peptide with its decoy
+          const PeptideInfo& peptide = cleavedPeptides[j];
+          const map<const string, const string*>::const_iterator decoyCheck =
+            targetToDecoy.find(peptide.Sequence());
+          if (decoyCheck != targetToDecoy.end()) {
+            decoyProtein.replace(peptide.Position(), peptide.Length(), *(decoyCheck->second));
+          }
         }
+        // Write out the final protein
+        (*decoyFasta) << ">" << decoyPrefix << targetProteins[k].name << endl
+                      << decoyProtein << endl;
       }
-      // Write out the final protein
-      (*decoyFasta) << ">" << decoyPrefix << i->first.name << endl
-                    << decoyProtein << endl;
     }
   }
 }
 
+void TideIndexApplication::digestProteins(
+  const DigestJob& job,
+  int numThreads
+) {
+  job.out->clear();
+  job.out->resize(job.end - job.begin);
+  boost::thread_group threads;
+  for (int t = 1; t < numThreads; t++) {
+    threads.create_thread(boost::bind(&TideIndexApplication::digestProteinsThread,
+                                      &job, t, numThreads));
+  }
+  digestProteinsThread(&job, 0, numThreads);
+  threads.join_all();
+}
+
+void TideIndexApplication::makeDecoysParallel(
+  const vector<const string*>& targets,
+  const set<string>& setTargets,
+  bool shuffle,
+  int numThreads,
+  vector<string>& decoys,
+  vector<bool>& made
+) {
+  // The number of shards is fixed, so that which decoys collide within a
+  // shard does not depend on numThreads.
+  const size_t numShards = 64;
+  vector<int> shards(targets.size(), -1);
+  vector<char> collided(targets.size(), 0);
+  vector< vector<size_t> > shardTargets(numShards);
+  vector< set<const string*, StringPtrLess> > shardDecoys(numShards);
+  decoys.clear();
+  decoys.resize(targets.size());
+
+  DecoyJob job;
+  job.targets = &targets;
+  job.setTargets = &setTargets;
+  job.shuffle = shuffle;
+  // Drawn from the generator seeded with the seed parameter. Reversing draws
+  // nothing, so that the shuffles below draw what they would serially.
+  job.seed = shuffle ? (unsigned long long)myrandom() : 0;
+  job.decoys = &decoys;
+  job.shards = &shards;
+  job.collided = &collided;
+  job.shardTargets = &shardTargets;
+  job.shardDecoys = &shardDecoys;
+
+  carp(CARP_DEBUG, "Generating decoys with %d threads", numThreads);
+  boost::thread_group threads;
+  for (int t = 1; t < numThreads; t++) {
+    threads.create_thread(boost::bind(&TideIndexApplication::makeDecoysThread,
+                                      &job, t, numThreads));
+  }
+  makeDecoysThread(&job, 0, numThreads);
+  threads.join_all();
+
+  if (!shuffle) {
+    // A reversed decoy that failed, or that equals a target or the decoy of an
+    // earlier target, is made again by makeDecoy() in target order, which
+    // shuffles it with myrandom, so the decoys are the same as those made
+    // with parallel-decoys=F.
+    set<string> setDecoys;
+    made.assign(targets.size(), false);
+    for (size_t i = 0; i < targets.size(); ++i) {
+      made[i] = shards[i] >= 0 &&
+        setDecoys.find(decoys[i]) == setDecoys.end();
+      if (!made[i]) {
+        made[i] = GeneratePeptides::makeDecoy(*targets[i], setTargets,
+                                              setDecoys, false, decoys[i]);
+      }
+      if (made[i]) {
+        setDecoys.insert(decoys[i]);
+      }
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (shards[i] >= 0) {
+      shardTargets[shards[i]].push_back(i);
+    }
+  }
+  for (int t = 1; t < numThreads; t++) {
+    threads.create_thread(boost::bind(&TideIndexApplication::dedupDecoysThread,
+                                      &job, t, numThreads));
+  }
+  dedupDecoysThread(&job, 0, numThreads);
+  threads.join_all();
+
+  // A decoy that collided with that of an earlier target gets one more
+  // shuffle, as a reversed decoy that collides does in makeDecoy(), checked
+  // against all decoys made so far. These are rare, so they are done serially,
+  // in target order.
+  const set<string> noDecoys;
+  string decoy;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (!collided[i]) {
+      continue;
+    }
+    GeneratePeptides::SeededRandom random(job.seed + 1, *targets[i]);
+    if (GeneratePeptides::makeDecoy(*targets[i], setTargets, noDecoys, true,
+                                    decoy, &random)) {
+      int shard = boost::hash<string>()(decoy) % numShards;
+      if (shardDecoys[shard].find(&decoy) == shardDecoys[shard].end()) {
+        decoys[i] = decoy;
+        shardDecoys[shard].insert(&decoys[i]);
+        collided[i] = 0;
+      }
+    }
+    if (collided[i]) {
+      shards[i] = -1;
+    }
+  }
+
+  made.assign(targets.size(), false);
+  for (size_t i = 0; i < targets.size(); ++i) {
+    made[i] = shards[i] >= 0;
+  }
+}
+
+void TideIndexApplication::makeDecoysThread(
+  const DecoyJob* job,
+  size_t first,
+  size_t step
+) {
+  const set<string> noDecoys;  // decoys are de-duplicated afterwards
+  size_t numShards = job->shardDecoys->size();
+  for (size_t i = first; i < job->targets->size(); i += step) {
+    const string& target = *(*job->targets)[i];
+    string& decoy = (*job->decoys)[i];
+    bool made;
+    if (job->shuffle) {
+      GeneratePeptides::SeededRandom random(job->seed, target);
+      made = GeneratePeptides::makeDecoy(target, *job->setTargets, noDecoys,
+                                         true, decoy, &random);
+    } else {
+      made = GeneratePeptides::reverseDecoy(target, decoy) &&
+        job->setTargets->find(decoy) == job->setTargets->end();
+    }
+    if (made) {
+      (*job->shards)[i] = boost::hash<string>()(decoy) % numShards;
+    }
+  }
+}
+
+void TideIndexApplication::dedupDecoysThread(
+  const DecoyJob* job,
+  size_t first,
+  size_t step
+) {
+  for (size_t shard = first; shard < job->shardDecoys->size(); shard += step) {
+    set<const string*, StringPtrLess>& decoys = (*job->shardDecoys)[shard];
+    const vector<size_t>& targets = (*job->shardTargets)[shard];
+    for (vector<size_t>::const_iterator i = targets.begin();
+         i != targets.end();
+         ++i) {
+      if (!decoys.insert(&(*job->decoys)[*i]).second) {
+        (*job->collided)[*i] = 1;
+      }
+    }
+  }
+}
+
+void TideIndexApplication::digestProteinsThread(
+  const DigestJob* job,
+  size_t first,
+  size_t step
+) {
+  string reversed;
+  for (size_t i = job->begin + first; i < job->end; i += step) {
+    const string* sequence = (*job->sequences)[i];
+    if (job->reverse) {
+      reversed.assign(sequence->rbegin(), sequence->rend());
+      sequence = &reversed;
+    }
+    DigestedProtein& digested = (*job->out)[i - job->begin];
+    digested.peptides = GeneratePeptides::cleaveProtein(*sequence, job->enzyme,
+      job->digestion, job->missedCleavages, job->minLength, job->maxLength);
+    digested.masses.reserve(digested.peptides.size());
+    for (vector<GeneratePeptides::CleavedPeptide>::const_iterator j =
+         digested.peptides.begin(); j != digested.peptides.end(); ++j) {
+      digested.masses.push_back(calcPepMassTide(j->Sequence(), job->massType));
+    }
+  }
+}
+
+namespace {
+
+// A peptide as it is stored in a run. Its residues are found again from the
+// protein sequence when the run is read back.
+struct SpilledPeptide {
+  double mass;
+  int length;
+  int proteinId;
+  int proteinPos;
+  int decoy;
+};
+
+// Number of records read or written at a time
+const size_t kRunBufferSize = 4096;
+
+// Runs are numbered across the whole process, and named after it, so that
+// concurrent tide-index processes sharing temp-dir do not collide.
+string GetRunName(const string& tmpDir) {
+  static int run = 0;
+  char buf[64];
+  sprintf(buf, "tide_index_peptides_partial_%d_%d", (int)getpid(), run++);
+  if (!tmpDir.empty()) {
+    return FileUtils::Join(tmpDir, buf);
+  }
+#ifdef _MSC_VER
+  char buf2[261];
+  GetTempPath(261, buf2);
+  return FileUtils::Join(string(buf2), buf);
+#else
+  return FileUtils::Join(string("/tmp/"), buf);
+#endif
+}
+
+}
+
+void TideIndexApplication::spillPeptides(
+  vector<TideIndexPeptide>& peptideHeap,
+  PeptideRuns& runs
+) {
+  if (runs.maxPeptides == 0 || peptideHeap.size() < runs.maxPeptides) {
+    return;
+  }
+  string runFile = GetRunName(runs.tempDir);
+  FILE* out = fopen(runFile.c_str(), "wb");
+  if (out == NULL) {
+    carp(CARP_FATAL, "Error creating temporary file %s", runFile.c_str());
+  }
+  runs.files.push_back(runFile);
+  carp(CARP_DEBUG, "Writing %d peptides to %s", peptideHeap.size(), runFile.c_str());
+
+  // The sorted heap is in descending order, so the run is written from the back
+  sort_heap(peptideHeap.begin(), peptideHeap.end(), greater<TideIndexPeptide>());
+  vector<SpilledPeptide> buffer;
+  buffer.reserve(kRunBufferSize);
+  for (vector<TideIndexPeptide>::const_reverse_iterator i = peptideHeap.rbegin();
+       i != peptideHeap.rend();
+       ++i) {
+    SpilledPeptide record = { i->getMass(), i->getLength(), i->getProteinId(),
+                              i->getProteinPos(), i->isDecoy() ? 1 : 0 };
+    buffer.push_back(record);
+    if (buffer.size() == kRunBufferSize || i + 1 == peptideHeap.rend()) {
+      if (fwrite(&buffer[0], sizeof(SpilledPeptide), buffer.size(), out) !=
+          buffer.size()) {
+        carp(CARP_FATAL, "Error writing temporary file %s", runFile.c_str());
+      }
+      buffer.clear();
+    }
+  }
+  if (fclose(out) != 0) {
+    carp(CARP_FATAL, "Error writing temporary file %s", runFile.c_str());
+  }
+  peptideHeap.clear();
+}
+
+class TideIndexApplication::PeptideMerger {
+ public:
+  PeptideMerger(vector<TideIndexPeptide>& peptideHeap,
+                const PeptideRuns& runs,
+                const vector<string*>& proteinSequences)
+    : memory_(peptideHeap), proteinSequences_(proteinSequences) {
+    // The heap is the last source; sorted, it is read from the back
+    sort_heap(memory_.begin(), memory_.end(), greater<TideIndexPeptide>());
+    runs_.resize(runs.files.size());
+    for (size_t i = 0; i < runs_.size(); i++) {
+      runs_[i].name = runs.files[i];
+      runs_[i].file = fopen(runs_[i].name.c_str(), "rb");
+      runs_[i].pos = 0;
+      if (runs_[i].file == NULL) {
+        carp(CARP_FATAL, "Error opening temporary file %s", runs_[i].name.c_str());
+      }
+    }
+    for (size_t i = 0; i <= runs_.size(); i++) {
+      advance(i);
+    }
+  }
+
+  // Closes and deletes the runs
+  ~PeptideMerger() {
+    for (vector<Run>::iterator i = runs_.begin(); i != runs_.end(); ++i) {
+      fclose(i->file);
+      FileUtils::Remove(i->name);
+    }
+  }
+
+  bool Empty() const { return heads_.empty(); }
+
+  const TideIndexPeptide& Top() const { return heads_.front().peptide; }
+
+  void Pop() {
+    size_t source = heads_.front().source;
+    pop_heap(heads_.begin(), heads_.end(), HeadGreater());
+    heads_.pop_back();
+    advance(source);
+  }
+
+ private:
+  struct Head {
+    TideIndexPeptide peptide;
+    size_t source;
+  };
+
+  // Equal peptides are taken from earlier runs first
+  struct HeadGreater {
+    bool operator()(const Head& x, const Head& y) const {
+      if (x.peptide > y.peptide) {
+        return true;
+      } else if (y.peptide > x.peptide) {
+        return false;
+      }
+      return x.source > y.source;
+    }
+  };
+
+  struct Run {
+    string name;
+    FILE* file;
+    vector<SpilledPeptide> buffer;
+    size_t pos;
+  };
+
+  // Adds the next peptide of the source to the heads, if it has one
+  void advance(size_t source) {
+    Head head;
+    head.source = source;
+    if (source == runs_.size()) {
+      if (memory_.empty()) {
+        return;
+      }
+      head.peptide = memory_.back();
+      memory_.pop_back();
+    } else {
+      Run& run = runs_[source];
+      if (run.pos == run.buffer.size()) {
+        run.buffer.resize(kRunBufferSize);
+        run.buffer.resize(fread(&run.buffer[0], sizeof(SpilledPeptide),
+                                kRunBufferSize, run.file));
+        run.pos = 0;
+        if (ferror(run.file)) {
+          carp(CARP_FATAL, "Error reading temporary file %s", run.name.c_str());
+        } else if (run.buffer.empty()) {
+          return;
+        }
+      }
+      const SpilledPeptide& record = run.buffer[run.pos++];
+      head.peptide = TideIndexPeptide(record.mass, record.length,
+        proteinSequences_[record.proteinId], record.proteinId, record.proteinPos,
+        record.decoy != 0);
+    }
+    heads_.push_back(head);
+    push_heap(heads_.begin(), heads_.end(), HeadGreater());
+  }
+
+  vector<TideIndexPeptide>& memory_;
+  const vector<string*>& proteinSequences_;
+  vector<Run> runs_;
+  vector<Head> heads_;
+};
+
+void TideIndexApplication::collectTargets(
+  vector<TideIndexPeptide>& peptideHeap,
+  PeptideRuns& runs,
+  const vector<string*>& proteinSequences,
+  set<string>& setTargets,
+  map<const string*, TargetInfo>& targetInfo
+) {
+  string runFile = GetRunName(runs.tempDir);
+  FILE* out = fopen(runFile.c_str(), "wb");
+  if (out == NULL) {
+    carp(CARP_FATAL, "Error creating temporary file %s", runFile.c_str());
+  }
+  carp(CARP_DEBUG, "Merging %d runs of targets into %s", runs.files.size() + 1,
+       runFile.c_str());
+
+  vector<SpilledPeptide> buffer;
+  buffer.reserve(kRunBufferSize);
+  {
+    PeptideMerger merger(peptideHeap, runs, proteinSequences);
+    while (!merger.Empty()) {
+      // Copies of a target are adjacent in the merge. The first location is
+      // the one with the lowest protein id and position, as it would be if
+      // the target had been recorded when its protein was digested.
+      TideIndexPeptide group(merger.Top());
+      TideIndexPeptide first(group);
+      while (!merger.Empty() && merger.Top() == group) {
+        const TideIndexPeptide& peptide = merger.Top();
+        if (peptide.getProteinId() < first.getProteinId() ||
+            (peptide.getProteinId() == first.getProteinId() &&
+             peptide.getProteinPos() < first.getProteinPos())) {
+          first = peptide;
+        }
+        SpilledPeptide record = { peptide.getMass(), peptide.getLength(),
+                                  peptide.getProteinId(), peptide.getProteinPos(), 0 };
+        buffer.push_back(record);
+        merger.Pop();
+        if (buffer.size() == kRunBufferSize || merger.Empty()) {
+          if (fwrite(&buffer[0], sizeof(SpilledPeptide), buffer.size(), out) !=
+              buffer.size()) {
+            carp(CARP_FATAL, "Error writing temporary file %s", runFile.c_str());
+          }
+          buffer.clear();
+        }
+      }
+      const string* setTarget = &*(setTargets.insert(first.getSequence()).first);
+      targetInfo.insert(make_pair(setTarget, TargetInfo(
+        first.getProteinId(), first.getProteinPos(), first.getMass())));
+    }
+  }
+  if (fclose(out) != 0) {
+    carp(CARP_FATAL, "Error writing temporary file %s", runFile.c_str());
+  }
+  // The merger deleted the old runs
+  runs.files.assign(1, runFile);
+}
+
 void TideIndexApplication::writePeptidesAndAuxLocs(
   vector<TideIndexPeptide>& peptideHeap,
+  PeptideRuns& peptideRuns,
+  const vector<string*>& proteinSequences,
   const string& peptidePbFile,
   const string& auxLocsPbFile,
   pb::Header& pbHeader
@@ -686,18 +2002,21 @@ void TideIndexApplication::writePeptidesAndAuxLocs(
   pb::AuxLocation pbAuxLoc;
   int auxLocIdx = -1;
   carp(CARP_DEBUG, "%d peptides in heap", peptideHeap.size());
+  if (!peptideRuns.files.empty()) {
+    carp(CARP_INFO, "Merging %d sorted runs of peptides",
+         peptideRuns.files.size() + 1);
+  }
   int count = 0;
-  sort_heap(peptideHeap.begin(), peptideHeap.end(),
-            greater<TideIndexPeptide>());
-  while (!peptideHeap.empty()) {
-    TideIndexPeptide curPeptide(peptideHeap.back());
-    peptideHeap.pop_back();
+  PeptideMerger merger(peptideHeap, peptideRuns, proteinSequences);
+  while (!merger.Empty()) {
+    TideIndexPeptide curPeptide(merger.Top());
+    merger.Pop();
     // For duplicate peptides we only record the location
-    while (!peptideHeap.empty() && peptideHeap.back() == curPeptide) {
+    while (!merger.Empty() && merger.Top() == curPeptide) {
       pb::Location* location = pbAuxLoc.add_location();
-      location->set_protein_id(peptideHeap.back().getProteinId());
-      location->set_pos(peptideHeap.back().getProteinPos());
-      peptideHeap.pop_back();
+      location->set_protein_id(merger.Top().getProteinId());
+      location->set_pos(merger.Top().getProteinPos());
+      merger.Pop();
     }
     getPbPeptide(count, curPeptide, pbPeptide);
     // Not all peptides have aux locations associated with them. Check to see
@@ -717,6 +2036,7 @@ void TideIndexApplication::writePeptidesAndAuxLocs(
       carp(CARP_INFO, "Wrote %d peptides", count);
     }
   }
+  peptideRuns.files.clear();
 }
 
 FLOAT_T TideIndexApplication::calcPepMassTide(
@@ -839,15 +2159,11 @@ void TideIndexApplication::processParams() {
 }
 
 
-string getModifiedPeptideSeq(const pb::Peptide* peptide,
-  const ProteinVec* proteins) {
+// Inserts the modifications of peptide into its unmodified sequence pep_str.
+static string addModsToSeq(string pep_str, const pb::Peptide* peptide) {
   int mod_index;
   double mod_delta;
   stringstream mod_stream;
-  const pb::Location& location = peptide->first_location();
-  const pb::Protein* protein = proteins->at(location.protein_id());
-  // Get peptide sequence without mods
-  string pep_str = protein->residues().substr(location.pos(), peptide->length());
 
   // Store all mod indices/deltas
   map<int, double> mod_map;
@@ -870,6 +2186,23 @@ string getModifiedPeptideSeq(const pb::Peptide* peptide,
   return pep_str;
 }
 
+string getModifiedPeptideSeq(const pb::Peptide* peptide,
+  const ProteinVec* proteins) {
+  const pb::Location& location = peptide->first_location();
+  const pb::Protein* protein = proteins->at(location.protein_id());
+  // Get peptide sequence without mods
+  return addModsToSeq(
+    protein->residues().substr(location.pos(), peptide->length()), peptide);
+}
+
+string getModifiedPeptideSeq(const pb::Peptide* peptide,
+  const ProteinViewVec* proteins) {
+  const pb::Location& location = peptide->first_location();
+  const ProteinView* protein = proteins->at(location.protein_id());
+  return addModsToSeq(
+    string(protein->residues() + location.pos(), peptide->length()), peptide);
+}
+
 bool TideIndexApplication::generateDecoy(
   const string& setTarget,
   std::map<const string, const string*>& targetToDecoy,
@@ -915,6 +2248,22 @@ bool TideIndexApplication::generateDecoy(
     }
   }
 
+  addDecoy(decoySequence, decoysGenerated, curProtein, proteinInfo, startLoc,
+           pbProtein, pepMass, outPeptideHeap, outProteinSequences);
+  return true;
+}
+
+void TideIndexApplication::addDecoy(
+  string* decoySequence,
+  unsigned int& decoysGenerated,
+  int& curProtein,
+  const ProteinInfo& proteinInfo,
+  const int startLoc,
+  pb::Protein& pbProtein,
+  FLOAT_T pepMass,
+  vector<TideIndexPeptide>& outPeptideHeap,
+  vector<string*>& outProteinSequences
+) {
   outProteinSequences.push_back(decoySequence);
 
   // Write pb::Protein
@@ -922,12 +2271,27 @@ bool TideIndexApplication::generateDecoy(
                     startLoc, pbProtein);
   // Add decoy to heap
   TideIndexPeptide pepDecoy(
-              pepMass, setTarget.length(), decoySequence, curProtein, (startLoc > 0) ? 1 : 0, true);
+              pepMass, decoySequence->length(), decoySequence, curProtein, (startLoc > 0) ? 1 : 0, true);
   outPeptideHeap.push_back(pepDecoy);
   push_heap(outPeptideHeap.begin(), outPeptideHeap.end(),
     greater<TideIndexPeptide>());
   ++decoysGenerated;
-  return true;
+}
+
+double TideIndexApplication::peakMemoryMB() {
+#ifdef _MSC_VER
+  return -1;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return -1;
+  }
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024.0 * 1024.0);  // bytes
+#else
+  return usage.ru_maxrss / 1024.0;  // kilobytes
+#endif
+#endif
 }
 
 
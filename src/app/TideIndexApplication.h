@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <gflags/gflags.h>
 #include "header.pb.h"
+#include "GeneratePeptides.h"
 #include "tide/records.h"
 #include "tide/peptide.h"
 #include "tide/theoretical_peak_set.h"
@@ -21,6 +22,7 @@
 using namespace std;
 
 std::string getModifiedPeptideSeq(const pb::Peptide* peptide, const ProteinVec* proteins);
+std::string getModifiedPeptideSeq(const pb::Peptide* peptide, const ProteinViewVec* proteins);
 
 class TideIndexApplication : public CruxApplication {
 
@@ -77,6 +79,34 @@ class TideIndexApplication : public CruxApplication {
 
   virtual COMMAND_T getCommand() const;
 
+  enum IndexOperation {
+    UNION_INDEXES,     // peptides in any index
+    SUBTRACT_INDEXES,  // peptides in the first index but in none of the others
+    INTERSECT_INDEXES  // peptides in the first index and in all of the others
+  };
+
+  /**
+   * Writes to outIndex the peptides of index1 and indexes2 selected by op,
+   * merging all of them by mass in one pass. Peptides are the same if they
+   * have the same sequence and modifications, and both are targets or both
+   * decoys; numThreads threads compare them. A peptide in several indexes
+   * keeps its entry in the first of them, and in a union gets the locations
+   * from the others as auxiliary locations. outIndex may be index1. If
+   * targetList is given, the sequences of the peptides written are listed
+   * there and in decoyList.
+   */
+  static void combineIndexes(
+    const std::string& index1,
+    const std::vector<std::string>& indexes2,
+    const std::string& outIndex,
+    IndexOperation op,
+    int numThreads,
+    bool flat,
+    bool packed,
+    std::ofstream* targetList,
+    std::ofstream* decoyList
+  );
+
  protected:
 
   class TideIndexPeptide {
@@ -144,13 +174,141 @@ class TideIndexApplication : public CruxApplication {
   };
 
   struct TargetInfo {
-    ProteinInfo proteinInfo;
+    int protein;  // index of the target protein, which is also its id
     int start;
     FLOAT_T mass;
-    TargetInfo(const ProteinInfo& protein, int startLoc, FLOAT_T pepMass)
-      : proteinInfo(protein), start(startLoc), mass(pepMass) {}
+    TargetInfo(int proteinId, int startLoc, FLOAT_T pepMass)
+      : protein(proteinId), start(startLoc), mass(pepMass) {}
+  };
+
+  /**
+   * The peptides cleaved from one protein, and their masses (negative for
+   * sequences containing unrecognized characters).
+   */
+  struct DigestedProtein {
+    std::vector<GeneratePeptides::CleavedPeptide> peptides;
+    std::vector<FLOAT_T> masses;
+  };
+
+  struct DigestJob {
+    const std::vector<string*>* sequences;
+    size_t begin;
+    size_t end;
+    bool reverse;  // digest the reversed sequences
+    ENZYME_T enzyme;
+    DIGEST_T digestion;
+    int missedCleavages;
+    int minLength;
+    int maxLength;
+    MASS_TYPE_T massType;
+    std::vector<DigestedProtein>* out;  // one per sequence in [begin, end)
+  };
+
+  /**
+   * Cleaves the proteins of job and computes the peptide masses, using
+   * numThreads threads.
+   */
+  static void digestProteins(
+    const DigestJob& job,
+    int numThreads
+  );
+
+  static void digestProteinsThread(
+    const DigestJob* job,
+    size_t first,
+    size_t step
+  );
+
+  struct StringPtrLess {
+    bool operator()(const string* lhs, const string* rhs) const {
+      return *lhs < *rhs;
+    }
   };
 
+  /**
+   * Decoys made with parallel-decoys=T. Every target gets a candidate decoy,
+   * shuffled with a generator seeded from seed and its own sequence, and the
+   * candidates are then de-duplicated a shard at a time, each shard in target
+   * order, so the decoys do not depend on the number of threads. Reversed
+   * decoys are not shuffled in the threads; the few that collide are made
+   * again in target order, as they would be with parallel-decoys=F.
+   */
+  struct DecoyJob {
+    const std::vector<const string*>* targets;  // in sorted order
+    const set<string>* setTargets;
+    bool shuffle;
+    unsigned long long seed;
+    std::vector<string>* decoys;  // one per target
+    std::vector<int>* shards;  // shard of each decoy, or -1 if none was made
+    std::vector<char>* collided;  // decoy equals that of an earlier target
+    std::vector< std::vector<size_t> >* shardTargets;  // in target order
+    std::vector< set<const string*, StringPtrLess> >* shardDecoys;
+  };
+
+  /**
+   * Makes a decoy for each of targets using numThreads threads. On return,
+   * decoys[i] holds the decoy of targets[i] if made[i] is true.
+   */
+  static void makeDecoysParallel(
+    const std::vector<const string*>& targets,
+    const set<string>& setTargets,
+    bool shuffle,
+    int numThreads,
+    std::vector<string>& decoys,
+    std::vector<bool>& made
+  );
+
+  static void makeDecoysThread(
+    const DecoyJob* job,
+    size_t first,
+    size_t step
+  );
+
+  static void dedupDecoysThread(
+    const DecoyJob* job,
+    size_t first,
+    size_t step
+  );
+
+  /**
+   * Sorted runs of peptides that were written to temp-dir because the
+   * peptide heap grew past max-index-memory.
+   */
+  struct PeptideRuns {
+    std::string tempDir;
+    size_t maxPeptides;  // heap size that triggers a spill; 0 for no limit
+    std::vector<std::string> files;
+  };
+
+  /**
+   * Merges the runs and the in-memory heap into one stream of peptides in
+   * ascending order.
+   */
+  class PeptideMerger;
+
+  /**
+   * If the heap has reached runs.maxPeptides, writes it to a new run and
+   * empties it.
+   */
+  static void spillPeptides(
+    std::vector<TideIndexPeptide>& peptideHeap,
+    PeptideRuns& runs
+  );
+
+  /**
+   * Merges the target peptides in the runs and the heap into a single run,
+   * and records each distinct target, at its first location, in setTargets
+   * and targetInfo. With max-index-memory, this replaces building them
+   * while the proteins are digested.
+   */
+  static void collectTargets(
+    std::vector<TideIndexPeptide>& peptideHeap,
+    PeptideRuns& runs,
+    const std::vector<string*>& proteinSequences,
+    set<string>& setTargets,
+    map<const string*, TargetInfo>& targetInfo
+  );
+
   static void fastaToPb(
     const std::string& commandLine,
     const ENZYME_T enzyme,
@@ -168,11 +326,14 @@ class TideIndexApplication : public CruxApplication {
     pb::Header& outProteinPbHeader,
     std::vector<TideIndexPeptide>& outPeptideHeap,
     std::vector<string*>& outProteinSequences,
+    PeptideRuns& outPeptideRuns,
     std::ofstream* decoyFasta
   );
 
   static void writePeptidesAndAuxLocs(
     std::vector<TideIndexPeptide>& peptideHeap, // will be destroyed.
+    PeptideRuns& peptideRuns, // will be deleted.
+    const std::vector<string*>& proteinSequences,
     const std::string& peptidePbFile,
     const std::string& auxLocsPbFile,
     pb::Header& pbHeader
@@ -232,6 +393,47 @@ class TideIndexApplication : public CruxApplication {
     vector<string*>& outProteinSequences
   );
 
+  /**
+   * Writes the decoy protein for decoySequence to pbProtein and adds the decoy
+   * to the heap. Takes ownership of decoySequence.
+   */
+  static void addDecoy(
+    string* decoySequence,
+    unsigned int& decoysGenerated,
+    int& curProtein,
+    const ProteinInfo& proteinInfo,
+    const int startLoc,
+    pb::Protein& pbProtein,
+    FLOAT_T pepMass,
+    vector<TideIndexPeptide>& outPeptideHeap,
+    vector<string*>& outProteinSequences
+  );
+
+  /**
+   * Returns the peak resident set size of the process in MB, or a negative
+   * number if it is not known.
+   */
+  static double peakMemoryMB();
+
+  /**
+   * Creates a new index of the proteins in fasta.
+   */
+  int createIndex(
+    const string& fasta,
+    const string& index,
+    string cmd_line
+  );
+
+  /**
+   * Indexes the proteins in fasta on their own, with the current settings,
+   * and merges them into the existing index.
+   */
+  int appendToIndex(
+    const string& fasta,
+    const string& index,
+    const string& cmd_line
+  );
+
   virtual void processParams();
 };
 
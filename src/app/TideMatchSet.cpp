@@ -1,6 +1,6 @@
 /*
  * There are two versions of the report function, which writes matches to output
- * files. The first version, which takes ofstreams as arguments, is used when
+ * files. The first version, which takes PsmWriters as arguments, is used when
  * only tab-delimited output is required. It does not perform any object
  * conversions. The second version takes an OutputFiles object as an argument
  * and is used when any non-tab-delimited output is required. It must convert
@@ -36,11 +36,11 @@ TideMatchSet::~TideMatchSet() {
  * This is for writing tab-delimited only
  */
 void TideMatchSet::report(
-  ofstream* target_file,  ///< target file to write to
-  ofstream* decoy_file, ///< decoy file to write to
+  PsmWriter* target_file,  ///< target file to write to
+  PsmWriter* decoy_file, ///< decoy file to write to
   int top_matches,
   const ActivePeptideQueue* peptides, ///< peptide queue
-  const ProteinVec& proteins, ///< proteins corresponding with peptides
+  const ProteinViewVec& proteins, ///< proteins corresponding with peptides
   const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
   bool compute_sp ///< whether to compute sp or not
 ) {
@@ -140,7 +140,7 @@ void TideMatchSet::report(
     }
   }  
   // target peptide or concat search
-  ofstream* file =
+  PsmWriter* file =
     (Params::GetBool("concat") || !peptide_->IsDecoy()) ? target_file : decoy_file;
   writeToFile(file, peptides, proteins, locations, compute_sp);
 }
@@ -149,9 +149,9 @@ void TideMatchSet::report(
  * Helper function for tab delimited report function for peptide centric search
  */
 void TideMatchSet::writeToFile(
-  ofstream* file,
+  PsmWriter* file,
   const ActivePeptideQueue* peptides,
-  const ProteinVec& proteins,
+  const ProteinViewVec& proteins,
   const vector<const pb::AuxLocation*>& locations,
   bool compute_sp ///< whether to compute sp or not
 ) {
@@ -161,7 +161,7 @@ void TideMatchSet::writeToFile(
   int cur = 0;
 
   const Peptide* peptide = peptides->GetPeptide(0);
-  const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
+  const ProteinView* protein = proteins[peptide->FirstLocProteinId()];
   int pos = peptide->FirstLocPos();
   string proteinNames = getProteinName(*protein,
       (!protein->has_target_pos()) ? pos : protein->target_pos());
@@ -184,59 +184,61 @@ void TideMatchSet::writeToFile(
   }
 
   Crux::Peptide cruxPep = getCruxPeptide(peptide);
+  bool concat = Params::GetBool("concat");
+  PsmBuffer* out = file->Buffer();
   for (vector<Peptide::spectrum_matches>::const_iterator 
         i = peptide_->spectrum_matches_array.begin(); 
         i != peptide_->spectrum_matches_array.end(); 
         ++i) {
     Spectrum* spectrum = i->spectrum_;
     
-    *file << spectrum->SpectrumNumber() << '\t'
-          << i->charge_ << '\t'
-          << spectrum->PrecursorMZ() << '\t'
-          << (spectrum->PrecursorMZ() - MASS_PROTON) * i->charge_ << '\t'
-          << cruxPep.calcModifiedMass() << '\t'
-          << i->d_cn_ << '\t';
+    out->BeginRow(spectrum->SpectrumNumber(), i->charge_, cur + 1);
+    *out << spectrum->SpectrumNumber() << '\t'
+         << i->charge_ << '\t'
+         << spectrum->PrecursorMZ() << '\t'
+         << (spectrum->PrecursorMZ() - MASS_PROTON) * i->charge_ << '\t'
+         << cruxPep.calcModifiedMass() << '\t'
+         << i->d_cn_ << '\t';
     SpScorer::SpScoreData spData;
     if (compute_sp) {
-      *file << i->spData_.sp_score << '\t'
-          << i->spData_.sp_rank << '\t';
+      *out << i->spData_.sp_score << '\t'
+           << i->spData_.sp_rank << '\t';
     }
-    *file << i->score1_ << '\t';
+    *out << i->score1_ << '\t';
     if (exact_pval_search_) {
-      *file << i->score2_<< '\t';
+      *out << i->score2_<< '\t';
     }
     
     if (elution_window_ ) {
-      *file << i->elution_score_ << '\t';
+      *out << i->elution_score_ << '\t';
     }
 
-    *file << ++cur << '\t';
+    *out << ++cur << '\t';
     if (compute_sp) {
-      *file << i->spData_.matched_ions << '\t'
-            << i->spData_.total_ions << '\t';
+      *out << i->spData_.matched_ions << '\t'
+           << i->spData_.total_ions << '\t';
     }
-    *file << i->score3_ << '\t';
+    *out << i->score3_ << '\t';
 
-    if (Params::GetBool("concat")) {
-      *file << peptides->ActiveTargets() + peptides->ActiveDecoys() << '\t';
+    if (concat) {
+      *out << peptides->ActiveTargets() + peptides->ActiveDecoys() << '\t';
     } else {
-      *file << (!peptide->IsDecoy() ? peptides->ActiveTargets() : peptides->ActiveDecoys()) << '\t';
+      *out << (!peptide->IsDecoy() ? peptides->ActiveTargets() : peptides->ActiveDecoys()) << '\t';
     }
-    *file << cruxPep.getModifiedSequenceWithMasses() << '\t'
-          << cruxPep.getModsString() << '\t'
-          << CleavageType << '\t'
-          << proteinNames << '\t'
-          << flankingAAs;
+    *out << cruxPep.getModifiedSequenceWithMasses() << '\t'
+         << cruxPep.getModsString() << '\t'
+         << CleavageType << '\t'
+         << proteinNames << '\t'
+         << flankingAAs;
     if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
       // write target sequence
-      const string& residues = protein->residues();
-      *file << '\t'
-            << residues.substr(residues.length() - peptide->Len());
-    } else if (Params::GetBool("concat") && !TideSearchApplication::proteinLevelDecoys()) {
-      *file << '\t'
-            << cruxPep.getUnshuffledSequence();
+      *out << '\t'
+           << protein->residues() + protein->length() - peptide->Len();
+    } else if (concat && !TideSearchApplication::proteinLevelDecoys()) {
+      *out << '\t'
+           << cruxPep.getUnshuffledSequence();
     }
-    *file << endl;
+    out->EndRow();
   }
 }
 
@@ -245,18 +247,17 @@ void TideMatchSet::writeToFile(
  * This is for writing tab-delimited only
  */
 void TideMatchSet::report(
-  ofstream* target_file,  ///< target file to write to
-  ofstream* decoy_file, ///< decoy file to write to
+  PsmWriter* target_file,  ///< target file to write to
+  PsmWriter* decoy_file, ///< decoy file to write to
   int top_n,  ///< number of matches to report
   const string& spectrum_filename, ///< name of spectrum file
   const Spectrum* spectrum, ///< spectrum for matches
   int charge, ///< charge for matches
   const ActivePeptideQueue* peptides, ///< peptide queue
-  const ProteinVec& proteins,  ///< proteins corresponding with peptides
+  const ProteinViewVec& proteins,  ///< proteins corresponding with peptides
   const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
   bool compute_sp, ///< whether to compute sp or not
-  bool highScoreBest, //< indicates semantics of score magnitude
-  boost::mutex * rwlock
+  bool highScoreBest //< indicates semantics of score magnitude
 ) {
   if (matches_->size() == 0) {
     return;
@@ -280,28 +281,27 @@ void TideMatchSet::report(
     computeSpData(decoys, &sp_map, &sp_scorer, peptides);
   }
   writeToFile(target_file, top_n, targets, spectrum_filename, spectrum, charge,
-              peptides, proteins, locations, delta_cn_map, delta_lcn_map, compute_sp ? &sp_map : NULL, rwlock);
+              peptides, proteins, locations, delta_cn_map, delta_lcn_map, compute_sp ? &sp_map : NULL);
   writeToFile(decoy_file, top_n, decoys, spectrum_filename, spectrum, charge,
-              peptides, proteins, locations, delta_cn_map, delta_lcn_map, compute_sp ? &sp_map : NULL, rwlock);
+              peptides, proteins, locations, delta_cn_map, delta_lcn_map, compute_sp ? &sp_map : NULL);
 }
 
 /**
  * Helper function for tab delimited report function
  */
 void TideMatchSet::writeToFile(
-  ofstream* file,
+  PsmWriter* file,
   int top_n,
   const vector<Arr::iterator>& vec,
   const string& spectrum_filename,
   const Spectrum* spectrum,
   int charge,
   const ActivePeptideQueue* peptides,
-  const ProteinVec& proteins,
+  const ProteinViewVec& proteins,
   const vector<const pb::AuxLocation*>& locations,
   const map<Arr::iterator, FLOAT_T>& delta_cn_map,
   const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
-  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
-  boost::mutex * rwlock
+  const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
 ) {
   if (!file) {
     return;
@@ -309,6 +309,9 @@ void TideMatchSet::writeToFile(
 
   int massPrecision = Params::GetInt("mass-precision");
   int precision = Params::GetInt("precision");
+  bool fileColumn = Params::GetBool("file-column");
+  bool concat = Params::GetBool("concat");
+  PsmBuffer* out = file->Buffer();
 
   int cur = 0;
   int concatDistinctMatches = peptides->ActiveTargets() + peptides->ActiveDecoys();
@@ -318,7 +321,7 @@ void TideMatchSet::writeToFile(
 
   for (vector<Arr::iterator>::const_iterator i = vec.begin(); i != cutoff; ++i) {
     const Peptide* peptide = peptides->GetPeptide((*i)->second);
-    const pb::Protein* protein = proteins[peptide->FirstLocProteinId()];
+    const ProteinView* protein = proteins[peptide->FirstLocProteinId()];
     int pos = peptide->FirstLocPos();
     string proteinNames = getProteinName(*protein,
       (!protein->has_target_pos()) ? pos : protein->target_pos());
@@ -343,53 +346,51 @@ void TideMatchSet::writeToFile(
     Crux::Peptide cruxPep = getCruxPeptide(peptide);
     const SpScorer::SpScoreData* sp_data = sp_map ? &(sp_map->at(*i).first) : NULL;
 
-    rwlock->lock();
-    if (Params::GetBool("file-column")) {
-      *file << spectrum_filename << '\t';
+    out->BeginRow(spectrum->SpectrumNumber(), charge, cur + 1);
+    if (fileColumn) {
+      *out << spectrum_filename << '\t';
     }
-    *file << spectrum->SpectrumNumber() << '\t'
-          << charge << '\t'
-          << StringUtils::ToString(spectrum->PrecursorMZ(), massPrecision) << '\t'
-          << StringUtils::ToString((spectrum->PrecursorMZ() - MASS_PROTON) * charge, massPrecision) << '\t'
-          << StringUtils::ToString(cruxPep.calcModifiedMass(), massPrecision) << '\t'
-          << delta_cn_map.at(*i) << '\t'
-          << delta_lcn_map.at(*i) << '\t';
+    *out << spectrum->SpectrumNumber() << '\t'
+         << charge << '\t'
+         << PsmBuffer::Fixed(spectrum->PrecursorMZ(), massPrecision) << '\t'
+         << PsmBuffer::Fixed((spectrum->PrecursorMZ() - MASS_PROTON) * charge, massPrecision) << '\t'
+         << PsmBuffer::Fixed(cruxPep.calcModifiedMass(), massPrecision) << '\t'
+         << delta_cn_map.at(*i) << '\t'
+         << delta_lcn_map.at(*i) << '\t';
     if (sp_map) {
-      *file << StringUtils::ToString(sp_data->sp_score, precision) << '\t'
-            << sp_map->at(*i).second << '\t';
+      *out << PsmBuffer::Fixed(sp_data->sp_score, precision) << '\t'
+           << sp_map->at(*i).second << '\t';
     }
-    *file << StringUtils::ToString((*i)->first.first, precision) << '\t';
+    *out << PsmBuffer::Fixed((*i)->first.first, precision) << '\t';
     if (exact_pval_search_) {
-      *file << (*i)->first.second << '\t';
+      *out << (*i)->first.second << '\t';
     }
-    *file << ++cur << '\t';
+    *out << ++cur << '\t';
     if (sp_map) {
-      *file << sp_data->matched_ions << '\t'
-            << sp_data->total_ions << '\t';
+      *out << sp_data->matched_ions << '\t'
+           << sp_data->total_ions << '\t';
     }
 
-    if (Params::GetBool("concat")) {
-      *file << concatDistinctMatches << '\t';
+    if (concat) {
+      *out << concatDistinctMatches << '\t';
     } else {
-      *file << (!peptide->IsDecoy() ? peptides->ActiveTargets() : peptides->ActiveDecoys()) << '\t';
+      *out << (!peptide->IsDecoy() ? peptides->ActiveTargets() : peptides->ActiveDecoys()) << '\t';
     }
 
-    *file << cruxPep.getModifiedSequenceWithMasses() << '\t'
-          << cruxPep.getModsString() << '\t'
-          << CleavageType << '\t'
-          << proteinNames << '\t'
-          << flankingAAs;
+    *out << cruxPep.getModifiedSequenceWithMasses() << '\t'
+         << cruxPep.getModsString() << '\t'
+         << CleavageType << '\t'
+         << proteinNames << '\t'
+         << flankingAAs;
     if (peptide->IsDecoy() && !TideSearchApplication::proteinLevelDecoys()) {
       // write target sequence
-      const string& residues = protein->residues();
-      *file << '\t'
-            << residues.substr(residues.length() - peptide->Len());
-    } else if (Params::GetBool("concat") && !TideSearchApplication::proteinLevelDecoys()) {
-      *file << '\t'
-            << cruxPep.getUnshuffledSequence();
+      *out << '\t'
+           << protein->residues() + protein->length() - peptide->Len();
+    } else if (concat && !TideSearchApplication::proteinLevelDecoys()) {
+      *out << '\t'
+           << cruxPep.getUnshuffledSequence();
     }
-    *file << endl;
-    rwlock->unlock();
+    out->EndRow();
   }
 }
 
@@ -492,7 +493,7 @@ vector<Crux::Modification> TideMatchSet::getMods(const Peptide* peptide) {
 
 void TideMatchSet::gatherTargetsAndDecoys(
   const ActivePeptideQueue* peptides,
-  const ProteinVec& proteins,
+  const ProteinViewVec& proteins,
   vector<Arr::iterator>& targetsOut,
   vector<Arr::iterator>& decoysOut,
   int top_n,
@@ -503,7 +504,7 @@ void TideMatchSet::gatherTargetsAndDecoys(
     for (Arr::iterator i = matches_->end(); i != matches_->begin(); ) {
       pop_heap(matches_->begin(), i--, highScoreBest ? lessScore : moreScore);
       const Peptide& peptide = *(peptides->GetPeptide(i->second));
-      const pb::Protein& protein = *(proteins[peptide.FirstLocProteinId()]);
+      const ProteinView& protein = *(proteins[peptide.FirstLocProteinId()]);
       vector<Arr::iterator>* vec_ptr = !peptide.IsDecoy() ? &targetsOut : &decoysOut;
       if (vec_ptr->size() < top_n + 1) {
         vec_ptr->push_back(i);
@@ -548,7 +549,7 @@ pb::Peptide* TideMatchSet::getPbPeptide(const Peptide& peptide) {
 /**
  * Gets the protein name with the index appended.
  */
-string TideMatchSet::getProteinName(const pb::Protein& protein, int pos) {
+string TideMatchSet::getProteinName(const ProteinView& protein, int pos) {
   stringstream proteinNameStream;
   proteinNameStream << protein.name() << '(' << pos + 1 << ')';
   return proteinNameStream.str();
@@ -559,17 +560,17 @@ string TideMatchSet::getProteinName(const pb::Protein& protein, int pos) {
  */
 void TideMatchSet::getFlankingAAs(
   const Peptide* peptide, ///< Tide peptide to get flanking AAs for
-  const pb::Protein* protein, ///< Tide protein for the peptide
+  const ProteinView* protein, ///< Tide protein for the peptide
   int pos,  ///< location of peptide within protein
   string* out_n,  ///< out parameter for n flank
   string* out_c ///< out parameter for c flank
 ) {
   int idx_n = pos - 1;
   int idx_c = pos + peptide->Len();
-  const string& seq = protein->residues();
+  const char* seq = protein->residues();
 
-  *out_n = (idx_n >= 0) ? seq.substr(idx_n, 1) : "-";
-  *out_c = (idx_c < seq.length()) ? seq.substr(idx_c, 1) : "-";
+  *out_n = (idx_n >= 0) ? string(1, seq[idx_n]) : "-";
+  *out_c = (idx_c < protein->length()) ? string(1, seq[idx_c]) : "-";
 }
 
 void TideMatchSet::computeDeltaCns(
@@ -8,6 +8,7 @@
 #include "tide/active_peptide_queue.h"  // no include guard
 #include "tide/fixed_cap_array.h"
 #include "tide/peptide.h"
+#include "tide/psm_writer.h"
 #include "tide/sp_scorer.h"
 #include "tide/spectrum_collection.h"
 
@@ -49,11 +50,11 @@ class TideMatchSet {
    * Write peptide centric matches to output files
    */
   void report(
-    ofstream* target_file,  ///< target file to write to
-    ofstream* decoy_file, ///< decoy file to write to
+    PsmWriter* target_file,  ///< target file to write to
+    PsmWriter* decoy_file, ///< decoy file to write to
     int top_matches,
     const ActivePeptideQueue* peptides, ///< peptide queue
-    const ProteinVec& proteins, ///< proteins corresponding with peptides
+    const ProteinViewVec& proteins, ///< proteins corresponding with peptides
     const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
     bool compute_sp ///< whether to compute sp or not
   );
@@ -62,18 +63,17 @@ class TideMatchSet {
    * Write spectrum centric to output files
    */
   void report(
-    ofstream* target_file,  ///< target file to write to
-    ofstream* decoy_file, ///< decoy file to write to
+    PsmWriter* target_file,  ///< target file to write to
+    PsmWriter* decoy_file, ///< decoy file to write to
     int top_n,  ///< number of matches to report
     const string& spectrum_filename, ///< name of spectrum file
     const Spectrum* spectrum, ///< spectrum for matches
     int charge, ///< charge for matches
     const ActivePeptideQueue* peptides, ///< peptide queue
-    const ProteinVec& proteins, ///< proteins corresponding with peptides
+    const ProteinViewVec& proteins, ///< proteins corresponding with peptides
     const vector<const pb::AuxLocation*>& locations,  ///< auxiliary locations
     bool compute_sp, ///< whether to compute sp or not
-    bool highScoreBest, //< indicates semantics of score magnitude
-    boost::mutex * rwlock
+    bool highScoreBest //< indicates semantics of score magnitude
   );
 
   static void writeHeaders(
@@ -108,9 +108,9 @@ class TideMatchSet {
    * Helper function for tab delimited report function for peptide centric
    */
   void writeToFile(
-    ofstream* file,
+    PsmWriter* file,
     const ActivePeptideQueue* peptides,
-    const ProteinVec& proteins,
+    const ProteinViewVec& proteins,
     const vector<const pb::AuxLocation*>& locations,
     bool compute_sp ///< whether to compute sp or not
   );
@@ -119,19 +119,18 @@ class TideMatchSet {
    * Helper function for tab delimited report function
    */
   void writeToFile(
-    ofstream* file,
+    PsmWriter* file,
     int top_n,
     const vector<Arr::iterator>& vec,
     const string& spectrum_filename,
     const Spectrum* spectrum,
     int charge,
     const ActivePeptideQueue* peptides,
-    const ProteinVec& proteins,
+    const ProteinViewVec& proteins,
     const vector<const pb::AuxLocation*>& locations,
     const map<Arr::iterator, FLOAT_T>& delta_cn_map,
     const map<Arr::iterator, FLOAT_T>& delta_lcn_map,
-    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map,
-    boost::mutex * rwlock
+    const map<Arr::iterator, pair<const SpScorer::SpScoreData, int> >* sp_map
   );
 
   Crux::Peptide getCruxPeptide(const Peptide* peptide);
@@ -139,7 +138,7 @@ class TideMatchSet {
 
   void gatherTargetsAndDecoys(
     const ActivePeptideQueue* peptides,
-    const ProteinVec& proteins,
+    const ProteinViewVec& proteins,
     vector<Arr::iterator>& targetsOut,
     vector<Arr::iterator>& decoysOut,
     int top_n,
@@ -157,7 +156,7 @@ class TideMatchSet {
    * Gets the protein name with the index appended.
    */
   static string getProteinName(
-    const pb::Protein& protein,
+    const ProteinView& protein,
     int pos
   );
 
@@ -166,7 +165,7 @@ class TideMatchSet {
    */
   static void getFlankingAAs(
     const Peptide* peptide, ///< Tide peptide to get flanking AAs for
-    const pb::Protein* protein, ///< Tide protein for the peptide
+    const ProteinView* protein, ///< Tide protein for the peptide
     int pos,  ///< location of peptide within protein
     string* out_n,  ///< out parameter for n flank
     string* out_c ///< out parameter for c flank
@@ -1,6 +1,13 @@
 #include <cstdio>
 #include "app/tide/abspath.h"
 #include "app/tide/records_to_vector-inl.h"
+#include "app/tide/shared_peptide_stream.h"
+#include "app/tide/mass_index.h"
+#include "app/tide/flat_peptides.h"
+#include "app/tide/packed_peptides.h"
+#include "app/tide/peak_index.h"
+#include "app/tide/protein_arena.h"
+#include "app/tide/peak_scorer.h"
 
 #include "io/carp.h"
 #include "parameter.h"
@@ -33,7 +40,8 @@ const double TideSearchApplication::XCORR_SCALING = 100000000.0;
 const double TideSearchApplication::RESCALE_FACTOR = 20.0;
 
 TideSearchApplication::TideSearchApplication():
-  exact_pval_search_(false), remove_index_(""), spectrum_flag_(NULL) {
+  spectrum_flag_(NULL), use_shared_stream_(false), remove_index_(""),
+  exact_pval_search_(false) {
 }
 
 TideSearchApplication::~TideSearchApplication() {
@@ -70,10 +78,27 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   }
   carp(CARP_INFO, "Number of Threads: %d", NUM_THREADS); // prints the number of threads
 
+  // The scoring backend decides how ActivePeptideQueues prepare peptides, so
+  // it has to be set before any are created
+  PeakScorer::Backend scoring_backend;
+  if (!PeakScorer::ParseBackend(Params::GetString("scoring-backend"), &scoring_backend)) {
+    carp(CARP_FATAL, "Invalid scoring-backend value %s",
+         Params::GetString("scoring-backend").c_str());
+  }
+  PeakScorer::SetBackend(scoring_backend);
+  if (PeakScorer::UsePeakLists()) {
+    carp(CARP_INFO, "Scoring with %s instructions", PeakScorer::InstructionSet());
+  }
+
   const string index = input_index;
   string peptides_file = FileUtils::Join(index, "pepix");
   string proteins_file = FileUtils::Join(index, "protix");
   string auxlocs_file = FileUtils::Join(index, "auxlocs");
+  string mass_index_file = FileUtils::Join(index, "massidx");
+  string mass_histogram_file = FileUtils::Join(index, "masshist");
+  string flat_peptides_file = FileUtils::Join(index, "pepix.flat");
+  string packed_peptides_file = FileUtils::Join(index, "pepix.packed");
+  string peaks_file = FileUtils::Join(index, "pepix.peaks");
 
   double window = Params::GetDouble("precursor-window");
   WINDOW_TYPE_T window_type = string_to_window_type(Params::GetString("precursor-window-type"));
@@ -121,6 +146,15 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   exact_pval_search_ = Params::GetBool("exact-p-value");
   bin_width_  = Params::GetDouble("mz-bin-width");
   bin_offset_ = Params::GetDouble("mz-bin-offset");
+
+  // Settings consulted for every spectrum, looked up once here
+  search_config_.bin_width = bin_width_;
+  search_config_.bin_offset = bin_offset_;
+  search_config_.use_neutral_loss_peaks = Params::GetBool("use-neutral-loss-peaks");
+  search_config_.use_flanking_peaks = Params::GetBool("use-flanking-peaks");
+  search_config_.skip_preprocessing = Params::GetBool("skip-preprocessing");
+  search_config_.remove_precursor_peak = Params::GetBool("remove-precursor-peak");
+  search_config_.remove_precursor_tolerance = Params::GetDouble("remove-precursor-tolerance");
   // for now don't allow XCorr p-value searches with variable bin width
   if (exact_pval_search_ && !Params::IsDefault("mz-bin-width")) {
     carp(CARP_FATAL, "Tide-search with XCorr p-values and variable bin width "
@@ -172,12 +206,12 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   
   carp(CARP_INFO, "Reading index %s", index.c_str());
   // Read proteins index file
-  ProteinVec proteins;
+  ProteinArena protein_arena;
   pb::Header protein_header;
-  if (!ReadRecordsToVector<pb::Protein, const pb::Protein>(&proteins,
-      proteins_file, &protein_header)) {
+  if (!protein_arena.Read(proteins_file, &protein_header)) {
     carp(CARP_FATAL, "Error reading index (%s)", proteins_file.c_str());
   }
+  const ProteinViewVec& proteins = protein_arena.Proteins();
   carp(CARP_DEBUG, "Read %d proteins", proteins.size());
 
   //open a copy of peptide buffer for Amino Acid Frequency (AAF) calculation.
@@ -213,12 +247,30 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   }
   carp(CARP_DEBUG, "Read %d auxlocs", locations.size());
 
+  // With a shared peptide stream, one reader decodes the index and compiles
+  // the theoretical peaks for all threads; otherwise each thread has its own.
+  use_shared_stream_ = Params::GetBool("shared-peptide-stream") &&
+    NUM_THREADS > 1 && !exact_pval_search_;
+  int num_readers = use_shared_stream_ ? 1 : NUM_THREADS;
+
   // Read peptides index file
   pb::Header peptides_header;
 
+  // The mass index, if present, lets each reader skip directly to the
+  // peptides it needs
+  MassIndex mass_index;
+  if (ReadMassIndex(mass_index_file, peptides_file, &mass_index)) {
+    carp(CARP_DEBUG, "Read %d mass index entries", mass_index.size());
+  }
+  if (mass_histogram_.Read(mass_histogram_file, peptides_file)) {
+    carp(CARP_DEBUG, "Index holds %lld targets and %lld decoys",
+         mass_histogram_.Targets(), mass_histogram_.Decoys());
+  }
+
   vector<HeadedRecordReader*> peptide_reader;
-  for (int i = 0; i < NUM_THREADS; i++) {
+  for (int i = 0; i < num_readers; i++) {
     peptide_reader.push_back(new HeadedRecordReader(peptides_file, &peptides_header));
+    peptide_reader[i]->Reader()->SetMassIndex(&mass_index);
   }
 
   if ((peptides_header.file_type() != pb::Header::PEPTIDES) ||
@@ -242,6 +294,64 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
   TideMatchSet::initModMap(pepHeader.nterm_mods(), PEPTIDE_N);
   TideMatchSet::initModMap(pepHeader.cterm_mods(), PEPTIDE_C);
 
+  // With max-spectrum-memory, spectra are searched out of core: only their
+  // precursors are held, and the peaks are read back from spectrumrecords.
+  // Peptide-centric search holds on to its spectra until the end.
+  bool out_of_core = Params::GetInt("max-spectrum-memory") > 0;
+  if (out_of_core && Params::GetBool("peptide-centric-search")) {
+    carp(CARP_INFO, "max-spectrum-memory is not supported with "
+         "peptide-centric-search; spectra will be held in memory");
+    out_of_core = false;
+  }
+
+  // Check that all spectrum files can be read before any output is written.
+  // Only the header of a spectrumrecords file is read here. Other files are
+  // parsed once: the first input straight into memory, to be searched
+  // first, and any others into temporary spectrumrecords files, so that
+  // only one file's spectra are held at a time.
+  vector<InputFile> input_sr;
+  SpectrumCollection* parsed_spectra = NULL;
+  for (vector<string>::const_iterator f = input_files.begin(); f != input_files.end(); f++) {
+    pb::Header spectrum_header;
+    string spectrumrecords = *f;
+    bool keep = true;
+    HeadedRecordReader header_reader(spectrumrecords, &spectrum_header);
+    if (!header_reader.OK() ||
+        spectrum_header.file_type() != pb::Header::SPECTRA) {
+      spectrumrecords = Params::GetString("store-spectra");
+      if (!spectrumrecords.empty() && input_files.size() > 1) {
+        carp(CARP_FATAL, "Cannot use store-spectra option with multiple input "
+                         "spectrum files");
+      } else if (spectrumrecords.empty() && f == input_files.begin() &&
+                 !out_of_core) {
+        carp(CARP_INFO, "Reading spectra file %s", f->c_str());
+        carp(CARP_INFO, "Elapsed time starting parse: %.3g s", wall_clock() / 1e6);
+        parsed_spectra = new SpectrumCollection;
+        if (!SpectrumRecordWriter::read(*f, parsed_spectra)) {
+          carp(CARP_FATAL, "Error reading spectra file %s", f->c_str());
+        }
+      } else {
+        keep = !spectrumrecords.empty();
+        if (!keep) {
+          spectrumrecords = make_file_path(FileUtils::BaseName(*f) + ".spectrumrecords.tmp");
+        }
+        carp(CARP_INFO, "Converting %s to spectrumrecords format", f->c_str());
+        carp(CARP_INFO, "Elapsed time starting conversion: %.3g s", wall_clock() / 1e6);
+        carp(CARP_DEBUG, "New spectrumrecords filename: %s", spectrumrecords.c_str());
+        if (!SpectrumRecordWriter::convert(*f, spectrumrecords)) {
+          if (!keep) {
+            remove(spectrumrecords.c_str());
+          }
+          carp(CARP_FATAL, "Error converting %s to spectrumrecords format", f->c_str());
+        }
+      }
+    } else if (spectrum_header.spectra_header().version() > SPECTRUM_RECORDS_VERSION) {
+      carp(CARP_FATAL, "Spectrum file %s is in a later spectrumrecords format "
+                       "than this version of Crux reads", f->c_str());
+    }
+    input_sr.push_back(InputFile(*f, spectrumrecords, keep));
+  }
+
   ofstream* target_file = NULL;
   ofstream* decoy_file = NULL;
 
@@ -268,40 +378,10 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     TideMatchSet::writeHeaders(target_file, false, compute_sp);
     TideMatchSet::writeHeaders(decoy_file, true, compute_sp);
   }
-
-  // Try to read all spectrum files as spectrumrecords, convert those that fail
-  vector<InputFile> input_sr;
-  for (vector<string>::const_iterator f = input_files.begin(); f != input_files.end(); f++) {
-    SpectrumCollection spectra;
-    pb::Header spectrum_header;
-    string spectrumrecords = *f;
-    bool keepSpectrumrecords = true;
-    if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
-      // Failed, try converting to spectrumrecords file
-      carp(CARP_INFO, "Converting %s to spectrumrecords format", f->c_str());
-      carp(CARP_INFO, "Elapsed time starting conversion: %.3g s", wall_clock() / 1e6);
-      spectrumrecords = Params::GetString("store-spectra");
-      keepSpectrumrecords = !spectrumrecords.empty();
-      if (!keepSpectrumrecords) {
-        spectrumrecords = make_file_path(FileUtils::BaseName(*f) + ".spectrumrecords.tmp");
-      } else if (input_files.size() > 1) {
-        carp(CARP_FATAL, "Cannot use store-spectra option with multiple input "
-                         "spectrum files");
-      }
-      carp(CARP_DEBUG, "New spectrumrecords filename: %s", spectrumrecords.c_str());
-      if (!SpectrumRecordWriter::convert(*f, spectrumrecords)) {
-        carp(CARP_FATAL, "Error converting %s to spectrumrecords format", f->c_str());
-      }
-      carp(CARP_DEBUG, "Reading converted spectra file %s", spectrumrecords.c_str());
-      // Re-read converted file as spectrumrecords file
-      if (!spectra.ReadSpectrumRecords(spectrumrecords, &spectrum_header)) {
-        carp(CARP_DEBUG, "Deleting %s", spectrumrecords.c_str());
-        remove(spectrumrecords.c_str());
-        carp(CARP_FATAL, "Error reading spectra file %s", spectrumrecords.c_str());
-      }
-    }
-    input_sr.push_back(InputFile(*f, spectrumrecords, keepSpectrumrecords));
-  }
+  // Matches are formatted by each search thread and written in blocks
+  bool sorted_output = Params::GetBool("sorted-output");
+  PsmWriter* target_writer = target_file ? new PsmWriter(target_file, sorted_output) : NULL;
+  PsmWriter* decoy_writer = decoy_file ? new PsmWriter(decoy_file, sorted_output) : NULL;
 
   // Loop through spectrum files
   for (vector<InputFile>::const_iterator f = input_sr.begin();
@@ -309,38 +389,106 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
        f++) {
 
     if (!peptide_reader[0]) {
-      for (int i = 0; i < NUM_THREADS; i++) {
+      for (int i = 0; i < num_readers; i++) {
         peptide_reader[i] = new HeadedRecordReader(peptides_file, &peptides_header);
+        peptide_reader[i]->Reader()->SetMassIndex(&mass_index);
       }
     }
 
+    // Theoretical peaks stored by tide-index for this pepix and binning, if
+    // any, stand in for computing them; one reader per source of peptides
+    vector<PeakIndexReader*> peak_index;
+    for (int i = 0; i < num_readers; i++) {
+      PeakIndexReader* peaks = new PeakIndexReader(peaks_file, peptides_file,
+                                                   bin_width_, bin_offset_);
+      if (peaks->OK()) {
+        peak_index.push_back(peaks);
+      } else {
+        delete peaks;
+        break;
+      }
+    }
+    if (!peak_index.empty()) {
+      carp(CARP_DEBUG, "Reading theoretical peaks from %s", peaks_file.c_str());
+    }
+
+    SharedPeptideStream* shared_stream = NULL;
+    if (use_shared_stream_) {
+      carp(CARP_DEBUG, "Sharing one peptide stream among %d threads", NUM_THREADS);
+      shared_stream = new SharedPeptideStream(peptide_reader[0]->Reader(), proteins, NUM_THREADS);
+      if (!peak_index.empty()) {
+        shared_stream->SetPeakIndex(peak_index[0]);
+      }
+    }
     vector<ActivePeptideQueue*> active_peptide_queue;
+    vector<FlatPeptideSource*> flat_reader;
+    string flat_reader_file;
     for (int i = 0; i < NUM_THREADS; i++) {
-      active_peptide_queue.push_back(new ActivePeptideQueue(peptide_reader[i]->Reader(), proteins));
+      if (shared_stream) {
+        active_peptide_queue.push_back(new ActivePeptideQueue(shared_stream, i, proteins));
+      } else {
+        active_peptide_queue.push_back(new ActivePeptideQueue(peptide_reader[i]->Reader(), proteins));
+        // Prefer the packed index, then the flat index, if tide-index wrote
+        // one for this pepix
+        PackedPeptideReader* packed =
+          new PackedPeptideReader(packed_peptides_file, peptides_file);
+        if (packed->OK()) {
+          active_peptide_queue[i]->SetFlatReader(packed);
+          flat_reader.push_back(packed);
+          flat_reader_file = packed_peptides_file;
+        } else {
+          delete packed;
+          FlatPeptideReader* flat = new FlatPeptideReader(flat_peptides_file, peptides_file);
+          if (flat->OK()) {
+            active_peptide_queue[i]->SetFlatReader(flat);
+            flat_reader.push_back(flat);
+            flat_reader_file = flat_peptides_file;
+          } else {
+            delete flat;
+          }
+        }
+        if (i < (int)peak_index.size()) {
+          active_peptide_queue[i]->SetPeakIndex(peak_index[i]);
+        }
+      }
       active_peptide_queue[i]->SetBinSize(bin_width_, bin_offset_);
     }
+    if (!flat_reader.empty()) {
+      carp(CARP_DEBUG, "Reading peptides from %s", flat_reader_file.c_str());
+    }
 
     string spectra_file = f->SpectrumRecords;
-    carp(CARP_INFO, "Reading spectra file %s", spectra_file.c_str());
-    // Try to read file as spectrumrecords file
-    SpectrumCollection spectra;
+    SpectrumCollection* spectra = NULL;
     pb::Header spectrum_header;
-    if (!spectra.ReadSpectrumRecords(spectra_file, &spectrum_header)) {
-      // This should never happen since we would have failed earlier
-      carp(CARP_FATAL, "Error reading spectra file %s", spectra_file.c_str());
+    if (spectra_file.empty()) {
+      // Parsed straight into memory above
+      spectra = parsed_spectra;
+      parsed_spectra = NULL;
+    } else if (out_of_core) {
+      spectra = new SpectrumCollection;
+      carp(CARP_INFO, "Indexing spectra file %s", spectra_file.c_str());
+      if (!spectra->IndexSpectrumRecords(spectra_file, &spectrum_header, NUM_THREADS)) {
+        carp(CARP_FATAL, "Error reading spectra file %s", spectra_file.c_str());
+      }
+    } else {
+      spectra = new SpectrumCollection;
+      carp(CARP_INFO, "Reading spectra file %s", spectra_file.c_str());
+      if (!spectra->ReadSpectrumRecords(spectra_file, &spectrum_header, NUM_THREADS)) {
+        carp(CARP_FATAL, "Error reading spectra file %s", spectra_file.c_str());
+      }
     }
 
     carp(CARP_INFO, "Sorting spectra");
     if (window_type != WINDOW_MZ) {
-      spectra.Sort();
+      spectra->Sort();
     } else {
-      spectra.Sort<ScSortByMz>(ScSortByMz(window));
+      spectra->Sort<ScSortByMz>(ScSortByMz(window));
     }
 
-    double highest_mz = spectra.FindHighestMZ();
-    unsigned int spectrum_num = spectra.SpecCharges()->size();
+    double highest_mz = spectra->FindHighestMZ();
+    unsigned int spectrum_num = spectra->SpecCharges()->size();
     if (spectrum_num > 0 && exact_pval_search_) {
-      highest_mz = spectra.SpecCharges()->at(spectrum_num - 1).neutral_mass;
+      highest_mz = spectra->SpecCharges()->at(spectrum_num - 1).neutral_mass;
     }
     carp(CARP_DEBUG, "Max m/z %f", highest_mz);
     MaxBin::SetGlobalMax(highest_mz);
@@ -349,13 +497,19 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
     if (spectrum_flag_ == NULL) {
       resetMods();
     }
-    search(f->OriginalName, spectra.SpecCharges(), active_peptide_queue, proteins,
+    search(f->OriginalName, spectra, active_peptide_queue, proteins,
            locations, window, window_type, Params::GetDouble("spectrum-min-mz"),
            Params::GetDouble("spectrum-max-mz"), min_scan, max_scan,
            Params::GetInt("min-peaks"), charge_to_search,
-           Params::GetInt("top-match"), spectra.FindHighestMZ(),
-           target_file, decoy_file, compute_sp,
+           Params::GetInt("top-match"), spectra->FindHighestMZ(),
+           target_writer, decoy_writer, compute_sp,
            nAA, aaFreqN, aaFreqI, aaFreqC, aaMass, negative_isotope_errors);
+    if (target_writer) {
+      target_writer->Flush();
+    }
+    if (decoy_writer) {
+      decoy_writer->Flush();
+    }
 
     PSMConvertApplication converter;
     
@@ -405,27 +559,40 @@ int TideSearchApplication::main(const vector<string>& input_files, const string
         converter.convertFile("tsv", "sqt", concat_file_name, "tide-search.", Params::GetString("protein-database"), true);
       }
     }
-    
-    // Delete temporary spectrumrecords file
-    if (!f->Keep) {
-      carp(CARP_DEBUG, "Deleting %s", spectra_file.c_str());
-      remove(spectra_file.c_str());
-    }
 
     // Clean up
     for (int i = 0; i < NUM_THREADS; i++) {
       delete active_peptide_queue[i];
+    }
+    delete shared_stream;
+    for (vector<FlatPeptideSource*>::iterator i = flat_reader.begin();
+         i != flat_reader.end();
+         ++i) {
+      delete *i;
+    }
+    for (vector<PeakIndexReader*>::iterator i = peak_index.begin();
+         i != peak_index.end();
+         ++i) {
+      delete *i;
+    }
+    for (int i = 0; i < num_readers; i++) {
       delete peptide_reader[i];
       peptide_reader[i] = NULL;
     }
 
+    delete spectra;
+    // Delete temporary spectrumrecords file
+    if (!f->Keep) {
+      carp(CARP_DEBUG, "Deleting %s", spectra_file.c_str());
+      remove(spectra_file.c_str());
+    }
+
   } // End of spectrum file loop
 
   delete negative_isotope_errors;
   
-  for (ProteinVec::iterator i = proteins.begin(); i != proteins.end(); ++i) {
-    delete *i;
-  }
+  delete target_writer;
+  delete decoy_writer;
   if (target_file) {
     delete target_file;
     if (decoy_file) {
@@ -446,7 +613,7 @@ void TideSearchApplication::search(void* threadarg) {
   const string& spectrum_filename = my_data->spectrum_filename;
   const vector<SpectrumCollection::SpecCharge>* spec_charges = my_data->spec_charges;
   ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
-  ProteinVec& proteins = my_data->proteins;
+  const ProteinViewVec& proteins = my_data->proteins;
   vector<const pb::AuxLocation*>& locations = my_data->locations;
   double precursor_window = my_data->precursor_window;
   WINDOW_TYPE_T window_type = my_data->window_type;
@@ -458,11 +625,10 @@ void TideSearchApplication::search(void* threadarg) {
   int search_charge = my_data->search_charge;
   int top_matches = my_data->top_matches;
   double highest_mz = my_data->highest_mz;
-  ofstream* target_file = my_data -> target_file;
-  ofstream* decoy_file = my_data->decoy_file;
+  PsmWriter* target_file = my_data -> target_file;
+  PsmWriter* decoy_file = my_data->decoy_file;
   bool compute_sp = my_data->compute_sp;
   int64_t thread_num = my_data->thread_num;
-  int64_t num_threads = my_data->num_threads;
   int nAA = my_data->nAA;
   double* aaFreqN = my_data->aaFreqN;
   double* aaFreqI = my_data->aaFreqI;
@@ -476,35 +642,65 @@ void TideSearchApplication::search(void* threadarg) {
   bool exact_pval_search = my_data->exact_pval_search;
   map<pair<string, unsigned int>, bool>* spectrum_flag = my_data->spectrum_flag;
 
-  int* sc_index = my_data->sc_index;
+  boost::atomic<int>* sc_index = my_data->sc_index;
   int* total_candidate_peptides = my_data->total_candidate_peptides;
+  SpecChargeScheduler* scheduler = my_data->scheduler;
+  SpectrumReader* spectrum_reader = my_data->spectrum_reader;
 
   // params
   bool peptide_centric = Params::GetBool("peptide-centric-search");
-  bool use_neutral_loss_peaks = Params::GetBool("use-neutral-loss-peaks");
-  bool use_flanking_peaks = Params::GetBool("use-flanking-peaks");
   int max_charge = Params::GetInt("max-precursor-charge");
 
   // This is the main search loop.
-  ObservedPeakSet observed(bin_width, bin_offset,
-                           use_neutral_loss_peaks,
-                           use_flanking_peaks);    
+  ObservedPeakSet observed(search_config_);
 
   // cycle through spectrum-charge pairs, sorted by neutral mass
   FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
   int print_interval = Params::GetInt("print-search-progress");
 
-  for (vector<SpectrumCollection::SpecCharge>::const_iterator sc = spec_charges->begin()+thread_num;
-       sc < spec_charges->begin() + (spec_charges->size());
-       sc = sc + num_threads) {
-    
-    locks_array[3]->lock();
-    ++(*sc_index);
-    if (print_interval > 0 && *sc_index % print_interval == 0) {
+  // With spectrum batching, neighbouring spectra whose windows overlap are
+  // collected and scored together (see scoreSpectrumBatch()). Each member of
+  // a batch needs its own preprocessed spectrum.
+  int batch_size = (peptide_centric || exact_pval_search) ?
+    1 : Params::GetInt("spectrum-batch-size");
+  vector<batched_spectrum> batch(max(batch_size, 1));
+  int batch_count = 0;
+  double batch_max_range = 0.0;
+  vector<ObservedPeakSet*> batch_observed;
+  for (int i = 0; i < batch_size && batch_size > 1; i++) {
+    batch_observed.push_back(new ObservedPeakSet(search_config_));
+  }
+
+  // Buffers reused for every spectrum-charge pair this thread searches
+  search_workspace workspace;
+
+  // The scheduler hands this thread contiguous blocks of spec_charges, in
+  // increasing mass order.
+  int block_next = 0;
+  int block_end = 0;
+  for (;;) {
+    if (block_next == block_end) {
+      // Batches stay within a block; the next block may be far away in mass
+      if (batch_count > 0) {
+        scoreSpectrumBatch(my_data, &batch, batch_count, batch_observed, &workspace);
+        batch_count = 0;
+      }
+      if (!scheduler->Next(thread_num, &block_next, &block_end)) {
+        break;
+      }
+    }
+    vector<SpectrumCollection::SpecCharge>::const_iterator sc =
+      spec_charges->begin() + block_next++;
+    if (spectrum_reader != NULL && batch_count == 0) {
+      // No spectrum loaded earlier is still in use
+      spectrum_reader->Release();
+    }
+
+    int searched = ++(*sc_index);
+    if (print_interval > 0 && searched % print_interval == 0) {
       carp(CARP_INFO, "%d spectrum-charge combinations searched, %.0f%% complete",
-           *sc_index, *sc_index / sc_total * 100);
+           searched, searched / sc_total * 100);
     }
-    locks_array[3]->unlock();
 
     Spectrum* spectrum = sc->spectrum;
     double precursor_mz = spectrum->PrecursorMZ();
@@ -528,14 +724,31 @@ void TideSearchApplication::search(void* threadarg) {
         (search_charge != 0 && charge != search_charge) || charge > max_charge) {
       continue;
     }
+    if (spectrum_reader != NULL) {
+      spectrum = spectrum_reader->Load(*sc);
+    }
 
     // The active peptide queue holds the candidate peptides for spectrum.
     // Calculate and set the window, depending on the window type.
-    vector<double>* min_mass = new vector<double>();
-    vector<double>* max_mass = new vector<double>();
-    vector<bool>* candidatePeptideStatus = new vector<bool>();
+    workspace.Clear();
+    vector<double>* min_mass = &workspace.min_mass;
+    vector<double>* max_mass = &workspace.max_mass;
+    vector<bool>* candidatePeptideStatus = &workspace.candidatePeptideStatus;
     double min_range, max_range;
     computeWindow(*sc, window_type, precursor_window, max_charge, negative_isotope_errors, min_mass, max_mass, &min_range, &max_range);
+    if (batch_size > 1) {
+      // Add to the batch, scoring the batch first if it is full or if this
+      // spectrum's window does not overlap it.
+      if (batch_count > 0 &&
+          (batch_count == batch_size || min_range > batch_max_range)) {
+        scoreSpectrumBatch(my_data, &batch, batch_count, batch_observed, &workspace);
+        batch_count = 0;
+      }
+      batch_max_range = batch_count == 0 ? max_range : max(batch_max_range, max_range);
+      batch[batch_count++].Set(spectrum, charge, *min_mass, *max_mass,
+                               min_range, max_range);
+      continue;
+    }
     if (!exact_pval_search) {  //execute original tide-search program
 
       // Normalize the observed spectrum and compute the cache of
@@ -551,14 +764,16 @@ void TideSearchApplication::search(void* threadarg) {
       locks_array[2]->unlock();
 
       int candidatePeptideStatusSize = candidatePeptideStatus->size();
-      TideMatchSet::Arr2 match_arr2(candidatePeptideStatusSize); // Scored peptides will go here.
+      // Scored peptides will go here.
+      TideMatchSet::Arr2& match_arr2 = *workspace.MatchArr2(candidatePeptideStatusSize);
 
       // Programs for taking the dot-product with the observed spectrum are laid
       // out in memory managed by the active_peptide_queue, one program for each
       // candidate peptide. The programs will store the results directly into
       // match_arr. We now pass control to those programs.
       collectScoresCompiled(active_peptide_queue, spectrum, observed, &match_arr2,
-                            candidatePeptideStatusSize, charge);
+                            candidatePeptideStatusSize, charge,
+                            &workspace.scoreCheck);
 
       // matches will arrange the results in a heap by score, return the top
       // few, and recover the association between counter and peptide. We output
@@ -573,7 +788,7 @@ void TideSearchApplication::search(void* threadarg) {
             }
           }
       } else {  //spectrum centric match report.
-        TideMatchSet::Arr match_arr(nCandPeptide);
+        TideMatchSet::Arr& match_arr = *workspace.MatchArr(nCandPeptide);
         for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
              it != match_arr2.end();
              ++it) {
@@ -591,7 +806,7 @@ void TideSearchApplication::search(void* threadarg) {
 
         matches.report(target_file, decoy_file, top_matches, spectrum_filename,
                          spectrum, charge, active_peptide_queue, proteins,
-                         locations, compute_sp, true, locks_array[0]);
+                         locations, compute_sp, true);
       }  //end peptide_centric == true
     } else {  // execute exact-pval-search
 
@@ -605,7 +820,8 @@ void TideSearchApplication::search(void* threadarg) {
       (*total_candidate_peptides) += nCandPeptide;
       locks_array[2]->unlock();
 
-      TideMatchSet::Arr match_arr(nCandPeptide); // scored peptides will go here.
+      // scored peptides will go here.
+      TideMatchSet::Arr& match_arr = *workspace.MatchArr(nCandPeptide);
   
       // iterators needed at multiple places in following code
       deque<Peptide*>::const_iterator iter_ = active_peptide_queue->iter_;
@@ -625,9 +841,10 @@ void TideSearchApplication::search(void* threadarg) {
       int pe;
       int ma;
       int pepMaInt;
-      int* pepMassInt = new int[nCandPeptide];
-      vector<int> pepMassIntUnique;
-      pepMassIntUnique.reserve(nCandPeptide);
+      vector<int>& pepMassInt = workspace.pepMassInt;
+      pepMassInt.resize(nCandPeptide);
+      vector<int>& pepMassIntUnique = workspace.pepMassIntUnique;
+      pepMassIntUnique.clear();
       
       peidx = 0;
       pe = 0;
@@ -649,28 +866,29 @@ void TideSearchApplication::search(void* threadarg) {
       pepMassIntUnique.erase(last, pepMassIntUnique.end());
       int nPepMassIntUniq = (int)pepMassIntUnique.size();
 
-      int** evidenceObs = new int*[nPepMassIntUniq];
-      int* scoreOffsetObs = new int[nPepMassIntUniq];
-      double** pValueScoreObs = new double*[nPepMassIntUniq];
-      int* intensArrayTheor = new int[maxPrecurMass]; // initialized later in loop
+      // One set of score count vectors for each unique integer peptide mass,
+      // in buffers that are reused from one spectrum to the next.
+      vector<search_workspace::score_count>& scoreCounts = workspace.scoreCounts;
+      if ((int)scoreCounts.size() < nPepMassIntUniq) {
+        scoreCounts.resize(nPepMassIntUniq);
+      }
       for (pe = 0; pe < nPepMassIntUniq; pe++) { // TODO should probably instead use iterator over pepMassIntUnique
-        evidenceObs[pe] = new int[maxPrecurMass];
-        for (ma = 0; ma < maxPrecurMass; ma++) {
-          evidenceObs[pe][ma] = 0;
-        }
-        scoreOffsetObs[pe] = 0;
         pepMaInt = pepMassIntUnique[pe]; // TODO should be accessed with an iterator
         // preprocess to create one integerized evidence vector for each cluster of masses among selected peptides
         double pepMassMonoMean = (pepMaInt - 0.5 + bin_offset) * bin_width;
+        search_workspace::score_count& counts = scoreCounts[pe];
+        vector<int>& evidenceObs = counts.evidence;
+        evidenceObs.resize(maxPrecurMass);
         observed.CreateEvidenceVector(*spectrum, bin_width, bin_offset, charge,
-                                      pepMassMonoMean, maxPrecurMass, evidenceObs[pe]);
+                                      pepMassMonoMean, maxPrecurMass, &evidenceObs[0]);
         // NOTE: will have to go back to separate dynamic programming for
         //       target and decoy if they have different probNI and probC
-        int maxEvidence = *std::max_element(evidenceObs[pe], evidenceObs[pe] + maxPrecurMass);
-        int minEvidence = *std::min_element(evidenceObs[pe], evidenceObs[pe] + maxPrecurMass);
+        int maxEvidence = *std::max_element(evidenceObs.begin(), evidenceObs.end());
+        int minEvidence = *std::min_element(evidenceObs.begin(), evidenceObs.end());
         // estimate maxScore and minScore
         int maxNResidue = (int)floor((double)pepMaInt / (double)minDeltaMass);
-        vector<int> sortEvidenceObs (evidenceObs[pe], evidenceObs[pe] + maxPrecurMass);
+        vector<int>& sortEvidenceObs = workspace.sortEvidenceObs;
+        sortEvidenceObs.assign(evidenceObs.begin(), evidenceObs.end());
         std::sort(sortEvidenceObs.begin(), sortEvidenceObs.end(), greater<int>());
         int maxScore = 0;
         int minScore = 0;
@@ -683,27 +901,25 @@ void TideSearchApplication::search(void* threadarg) {
         int bottomRowBuffer = maxEvidence + 1;
         int topRowBuffer = -minEvidence;
         int nRowDynProg = bottomRowBuffer - minScore + 1 + maxScore + topRowBuffer;
-        pValueScoreObs[pe] = new double[nRowDynProg];
+        counts.pValues.resize(nRowDynProg);
 
-        scoreOffsetObs[pe] = calcScoreCount(maxPrecurMass, evidenceObs[pe], pepMaInt,
-                                            maxEvidence, minEvidence, maxScore, minScore, 
-                                            nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
-                                            pValueScoreObs[pe]);
+        counts.offset = calcScoreCount(maxPrecurMass, &counts.evidence[0], pepMaInt,
+                                       maxEvidence, minEvidence, maxScore, minScore,
+                                       nAA, aaFreqN, aaFreqI, aaFreqC, aaMass,
+                                       &counts.pValues[0], &workspace.dynProgArray);
       }
 
       // ***** calculate p-values for peptide-spectrum matches ***********************************
+      vector<int>& intensArrayTheor = workspace.intensArrayTheor; // initialized later in loop
+      intensArrayTheor.resize(maxPrecurMass);
       iter_ = active_peptide_queue -> iter_;
       iter1_ = active_peptide_queue -> iter1_;
       pe = 0;
       for (peidx = 0; peidx < candidatePeptideStatusSize; peidx++) { // TODO should probably use iterator instead
         if ((*candidatePeptideStatus)[peidx]) {
-          int pepMassIntIdx = 0;
-          for (ma = 0; ma < nPepMassIntUniq; ma++) { // TODO should probably use iterator instead
-            if (pepMassIntUnique[ma] == pepMassInt[pe]) { // TODO pepMassIntUnique should be accessed with an iterator
-              pepMassIntIdx = ma;
-              break;
-            }
-          }
+          const search_workspace::score_count& counts = scoreCounts[
+            std::lower_bound(pepMassIntUnique.begin(), pepMassIntUnique.end(),
+                             pepMassInt[pe]) - pepMassIntUnique.begin()];
           // score XCorr for target peptide with integerized evidenceObs array
           for (ma = 0; ma < maxPrecurMass; ma++) {
             intensArrayTheor[ma] = 0;
@@ -716,10 +932,10 @@ void TideSearchApplication::search(void* threadarg) {
 
           int scoreRefactInt = 0;
           for (ma = 0; ma < maxPrecurMass; ma++) {
-            scoreRefactInt += evidenceObs[pepMassIntIdx][ma] * intensArrayTheor[ma];
+            scoreRefactInt += counts.evidence[ma] * intensArrayTheor[ma];
           }
-          int scoreCountIdx = scoreRefactInt + scoreOffsetObs[pepMassIntIdx];
-          double pValue = pValueScoreObs[pepMassIntIdx][scoreCountIdx];
+          int scoreCountIdx = scoreRefactInt + counts.offset;
+          double pValue = counts.pValues[scoreCountIdx];
           if (peptide_centric) {
               (*iter_)->AddHit(spectrum, pValue, (double)scoreRefactInt, candidatePeptideStatusSize - peidx, charge);
           } else {
@@ -736,16 +952,6 @@ void TideSearchApplication::search(void* threadarg) {
         ++iter_; // TODO need to add test to make sure haven't gone past available peptides
         ++iter1_; // TODO need to add test to make sure haven't gone past available b ion queues
       }
-      // clean up
-      delete [] pepMassInt;
-      delete [] scoreOffsetObs;
-      for (pe = 0; pe < nPepMassIntUniq; pe++) {
-        delete [] evidenceObs[pe];
-        delete [] pValueScoreObs[pe];
-      }
-      delete [] evidenceObs;
-      delete [] pValueScoreObs;
-      delete [] intensArrayTheor;
       if (!peptide_centric) {
         // matches will arrange the results in a heap by score, return the top
         // few, and recover the association between counter and peptide. We output
@@ -755,21 +961,162 @@ void TideSearchApplication::search(void* threadarg) {
 
         matches.report(target_file, decoy_file, top_matches, spectrum_filename,
                        spectrum, charge, active_peptide_queue, proteins,
-                       locations, compute_sp, false, locks_array[0]);
+                       locations, compute_sp, false);
         
       } // end peptide_centric == true
     } // end exact-pval-search
-    delete min_mass;
-    delete max_mass;
-    delete candidatePeptideStatus;
+  }
+  for (vector<ObservedPeakSet*>::iterator i = batch_observed.begin();
+       i != batch_observed.end();
+       ++i) {
+    delete *i;
+  }
+  // Let other threads sharing the peptide stream proceed without us.
+  active_peptide_queue->DetachStream();
+}
+
+void TideSearchApplication::scoreSpectrumBatch(
+  thread_data* my_data,
+  vector<batched_spectrum>* batch,
+  int num_spectra,
+  const vector<ObservedPeakSet*>& observed,
+  search_workspace* workspace
+) {
+  ActivePeptideQueue* active_peptide_queue = my_data->active_peptide_queue;
+
+  // Bring in the peptides for the whole batch at once.
+  vector<double>& min_mass = workspace->batch_min_mass;
+  vector<double>& max_mass = workspace->batch_max_mass;
+  min_mass.assign(1, (*batch)[0].min_mass.front());
+  max_mass.assign(1, (*batch)[0].max_mass.back());
+  double min_range = (*batch)[0].min_range;
+  double max_range = (*batch)[0].max_range;
+  for (int k = 1; k < num_spectra; k++) {
+    min_mass[0] = min(min_mass[0], (*batch)[k].min_mass.front());
+    max_mass[0] = max(max_mass[0], (*batch)[k].max_mass.back());
+    min_range = min(min_range, (*batch)[k].min_range);
+    max_range = max(max_range, (*batch)[k].max_range);
+  }
+  vector<bool>& batch_status = workspace->batch_status;
+  batch_status.clear();
+  if (active_peptide_queue->SetActiveRange(&min_mass, &max_mass, min_range,
+                                           max_range, &batch_status) == 0) {
+    return;
+  }
+  deque<Peptide*>::const_iterator batch_begin = active_peptide_queue->iter_;
+  int batch_peptides = batch_status.size();
+
+  // Find each spectrum's own window within the batch window, and preprocess
+  // the spectra that have candidates.
+  vector<deque<Peptide*>::const_iterator>& begins = workspace->begins;
+  vector<deque<Peptide*>::const_iterator>& ends = workspace->ends;
+  vector< vector<bool> >& candidatePeptideStatus =
+    workspace->batchCandidatePeptideStatus;
+  vector<int>& num_candidates = workspace->num_candidates;
+  vector<int>& offsets = workspace->offsets;
+  vector<int>& sizes = workspace->sizes;
+  vector<int>& charges = workspace->charges;
+  vector<const int*>& caches = workspace->caches;
+  vector< pair<int, int>* >& results = workspace->results;
+  begins.resize(num_spectra);
+  ends.resize(num_spectra);
+  candidatePeptideStatus.resize(num_spectra);
+  num_candidates.resize(num_spectra);
+  offsets.resize(num_spectra);
+  sizes.resize(num_spectra);
+  charges.resize(num_spectra);
+  caches.resize(num_spectra);
+  results.resize(num_spectra);
+  int total_candidates = 0;
+  for (int k = 0; k < num_spectra; k++) {
+    batched_spectrum& b = (*batch)[k];
+    candidatePeptideStatus[k].clear();
+    num_candidates[k] = active_peptide_queue->SetActiveWindow(
+      &b.min_mass, &b.max_mass, &candidatePeptideStatus[k]);
+    begins[k] = active_peptide_queue->iter_;
+    ends[k] = active_peptide_queue->end_;
+    offsets[k] = begins[k] - batch_begin;
+    sizes[k] = num_candidates[k] > 0 ? candidatePeptideStatus[k].size() : 0;
+    charges[k] = b.charge;
+    results[k] = workspace->BatchMatchArr2(k, sizes[k])->data();
+    caches[k] = NULL;
+    if (num_candidates[k] > 0) {
+      observed[k]->PreprocessSpectrum(*b.spectrum, b.charge);
+      caches[k] = observed[k]->GetCache();
+      total_candidates += num_candidates[k];
+    }
+  }
+  my_data->locks_array[2]->lock();
+  (*my_data->total_candidate_peptides) += total_candidates;
+  my_data->locks_array[2]->unlock();
+
+  // Score every spectrum in the batch against each peptide in turn, while
+  // its peaks are at hand. Compiled programs can only run against one
+  // spectrum at a time.
+  if (PeakScorer::UsePeakLists()) {
+    PeakScorer::ScoreBatch(batch_begin, batch_peptides, num_spectra,
+                           &offsets[0], &sizes[0], &charges[0], &caches[0],
+                           &results[0]);
+  }
+
+  for (int k = 0; k < num_spectra; k++) {
+    if (num_candidates[k] == 0) {
+      continue;
+    }
+    const batched_spectrum& b = (*batch)[k];
+    TideMatchSet::Arr2& match_arr2 = *workspace->BatchMatchArr2(k);
+    active_peptide_queue->iter_ = begins[k];
+    active_peptide_queue->end_ = ends[k];
+    if (!PeakScorer::UsePeakLists()) {
+      collectScoresCompiled(active_peptide_queue, b.spectrum, *observed[k],
+                            &match_arr2, sizes[k], b.charge,
+                            &workspace->scoreCheck);
+    } else {
+      match_arr2.set_size(sizes[k]);
+      if (PeakScorer::UseCompiledPrograms()) {
+        // Cross-check the batch scores against the compiled programs
+        TideMatchSet::Arr2& compiled = *workspace->MatchArr2(sizes[k]);
+        collectScoresCompiled(active_peptide_queue, b.spectrum, *observed[k],
+                              &compiled, sizes[k], b.charge,
+                              &workspace->scoreCheck);
+        for (int i = 0; i < sizes[k]; i++) {
+          if (compiled[i] != match_arr2[i]) {
+            carp(CARP_FATAL, "Batch scoring disagrees with compiled scoring "
+                 "for scan %d, charge %d", b.spectrum->SpectrumNumber(), b.charge);
+          }
+        }
+      }
+    }
+
+    // The same spectrum-centric report as in search()
+    TideMatchSet::Arr& match_arr = *workspace->MatchArr(num_candidates[k]);
+    for (TideMatchSet::Arr2::iterator it = match_arr2.begin();
+         it != match_arr2.end();
+         ++it) {
+      int peptide_idx = sizes[k] - (it->second);
+      if (candidatePeptideStatus[k][peptide_idx]) {
+        TideMatchSet::Pair pair;
+        pair.first.first = (double)(it->first / XCORR_SCALING);
+        pair.first.second = 0.0;
+        pair.second = it->second;
+        match_arr.push_back(pair);
+      }
+    }
+    TideMatchSet matches(&match_arr, my_data->highest_mz);
+    matches.exact_pval_search_ = false;
+
+    matches.report(my_data->target_file, my_data->decoy_file,
+                   my_data->top_matches, my_data->spectrum_filename,
+                   b.spectrum, b.charge, active_peptide_queue, my_data->proteins,
+                   my_data->locations, my_data->compute_sp, true);
   }
 }
 
 void TideSearchApplication::search(
   const string& spectrum_filename,
-  const vector<SpectrumCollection::SpecCharge>* spec_charges,
+  const SpectrumCollection* spectra,
   vector<ActivePeptideQueue*> active_peptide_queue,
-  ProteinVec& proteins,
+  const ProteinViewVec& proteins,
   vector<const pb::AuxLocation*>& locations,
   double precursor_window,
   WINDOW_TYPE_T window_type,
@@ -781,8 +1128,8 @@ void TideSearchApplication::search(
   int search_charge,
   int top_matches,
   double highest_mz,
-  ofstream* target_file,
-  ofstream* decoy_file,
+  PsmWriter* target_file,
+  PsmWriter* decoy_file,
   bool compute_sp,
   int nAA, 
   double* aaFreqN,
@@ -791,12 +1138,11 @@ void TideSearchApplication::search(
   int* aaMass,
   vector<int>* negative_isotope_errors
 ) {
-  // Create an array of 4 locks.
-  // Lock #0: Results file output
+  // Create an array of 3 locks.
+  // Lock #0: Unused; results are written through PsmWriter
   // Lock #1: Only used by cascade-search on spectrum_flag (map)
   // Lock #2: Updating # of candidate peptides
-  // Lock #3: Updating sc_index and reporting progress
-  int num_locks = 4;
+  int num_locks = 3;
   vector<boost::mutex *> locks_array;
 
   for (int i = 0; i < num_locks; i++) {
@@ -806,8 +1152,10 @@ void TideSearchApplication::search(
   int elution_window = Params::GetInt("elution-window-size");
   bool peptide_centric = Params::GetBool("peptide-centric-search");
 
+  const vector<SpectrumCollection::SpecCharge>* spec_charges = spectra->SpecCharges();
+
   // initialize fields required for output
-  int* sc_index = new int(-1);
+  boost::atomic<int>* sc_index = new boost::atomic<int>(-1);
   int* total_candidate_peptides = new int(0);
   FLOAT_T sc_total = (FLOAT_T)spec_charges->size();
 
@@ -836,6 +1184,54 @@ void TideSearchApplication::search(
     active_peptide_queue[i]->SetOutputs(NULL, &locations, top_matches, compute_sp, target_file, decoy_file, highest_mz);
   }
 
+  // Split the spectrum-charge pairs into contiguous mass blocks. Each thread
+  // gets its own part of the mass range, so that its peptide window only
+  // covers that part. Threads sharing one peptide stream instead take small
+  // blocks in turn from a single partition, so that together they only cover
+  // a few blocks at a time and the stream can free what lies behind them.
+  // With a mass histogram, the blocks are cut by the expected number of
+  // candidates, which is what the search time of a spectrum depends on. Every
+  // spectrum also costs something to read and preprocess.
+  const int blocks_per_thread = use_shared_stream_ ? 64 : 16;
+  vector<double> expected_candidates(spec_charges->size(), 1.0);
+  if (!mass_histogram_.Empty()) {
+    int max_charge = Params::GetInt("max-precursor-charge");
+    vector<double> min_mass, max_mass;
+    double min_range, max_range, total_candidates = 0;
+    for (size_t j = 0; j < spec_charges->size(); ++j) {
+      const SpectrumCollection::SpecCharge& sc = (*spec_charges)[j];
+      min_mass.clear();
+      max_mass.clear();
+      computeWindow(sc, window_type, precursor_window, max_charge,
+                    negative_isotope_errors, &min_mass, &max_mass,
+                    &min_range, &max_range);
+      double candidates = 0;
+      for (size_t i = 0; i < min_mass.size(); ++i) {
+        candidates += mass_histogram_.Count(min_mass[i], max_mass[i]);
+      }
+      total_candidates += candidates;
+      expected_candidates[j] += candidates;
+    }
+    if (!spec_charges->empty()) {
+      carp(CARP_INFO, "Expecting about %.0f candidates per spectrum-charge "
+           "combination", total_candidates / spec_charges->size());
+    }
+  }
+  int num_partitions = use_shared_stream_ ? 1 : NUM_THREADS;
+  int blocks_per_partition = blocks_per_thread * NUM_THREADS / num_partitions;
+  SpecChargeScheduler scheduler(expected_candidates, NUM_THREADS,
+                                num_partitions, blocks_per_partition);
+
+  // Out of core, each thread reads back the peaks of the spectra it searches,
+  // holding at most its share of max-spectrum-memory.
+  vector<SpectrumReader*> spectrum_readers(NUM_THREADS, (SpectrumReader*)NULL);
+  if (spectra->OutOfCore()) {
+    size_t cache_bytes = ((size_t)Params::GetInt("max-spectrum-memory") << 20) / NUM_THREADS;
+    for (int i = 0; i < NUM_THREADS; i++) {
+      spectrum_readers[i] = new SpectrumReader(*spectra, cache_bytes);
+    }
+  }
+
   // Creating structs to hold information required for each thread to search through
   // a spec charge
 
@@ -846,7 +1242,8 @@ void TideSearchApplication::search(
       spectrum_max_mz, min_scan, max_scan, min_peaks, search_charge, top_matches,
       highest_mz, target_file, decoy_file, compute_sp,
       i, NUM_THREADS, nAA, aaFreqN, aaFreqI, aaFreqC, aaMass, locks_array, 
-      bin_width_, bin_offset_, exact_pval_search_, spectrum_flag_, sc_index, total_candidate_peptides, negative_isotope_errors));
+      bin_width_, bin_offset_, exact_pval_search_, spectrum_flag_, sc_index, total_candidate_peptides, negative_isotope_errors,
+      &scheduler, spectrum_readers[i]));
   }
 
   boost::thread_group threadgroup;
@@ -871,6 +1268,9 @@ void TideSearchApplication::search(
   }
   delete sc_index;
   delete total_candidate_peptides;
+  for (int i = 0; i < NUM_THREADS; i++) {
+    delete spectrum_readers[i];
+  }
 
 }
 
@@ -880,15 +1280,22 @@ void TideSearchApplication::collectScoresCompiled(
   const ObservedPeakSet& observed,
   TideMatchSet::Arr2* match_arr,
   int queue_size,
-  int charge
+  int charge,
+  vector< pair<int, int> >* check ///< reused buffer for scoring-backend=check
 ) {
   if (!active_peptide_queue->HasNext()) {
     return;
   }
+  const int* cache = observed.GetCache();
+  if (!PeakScorer::UseCompiledPrograms()) {
+    PeakScorer::Score(active_peptide_queue->iter_, queue_size, charge, cache,
+                      match_arr->data());
+    match_arr->set_size(queue_size);
+    return;
+  }
   // prog gets the address of the dot-product program for the first peptide
   // in the active queue.
   const void* prog = active_peptide_queue->NextPeptide()->Prog(charge);
-  const int* cache = observed.GetCache();
   // results will get (score, counter) pairs, where score is the dot product
   // of the observed peak set with a candidate peptide. The candidate
   // peptide is given by counter, which refers to the index within the
@@ -984,6 +1391,25 @@ void TideSearchApplication::collectScoresCompiled(
   // match_arr is filled by the compiled programs, not by calls to
   // push_back(). We have to set the final size explicitly.
   match_arr->set_size(queue_size);
+
+  if (PeakScorer::UsePeakLists()) {
+    // Cross-check the vector scores against the compiled programs
+    if (check->size() < (size_t)queue_size) {
+      check->resize(queue_size);
+    }
+    pair<int, int>* vector_results = &(*check)[0];
+    PeakScorer::Score(active_peptide_queue->iter_, queue_size, charge, cache,
+                      vector_results);
+    for (int i = 0; i < queue_size; ++i) {
+      if (vector_results[i] != results[i]) {
+        carp(CARP_FATAL, "Scoring backends disagree for scan %d, charge %d: "
+             "compiled (%d, %d), %s (%d, %d)", spectrum->SpectrumNumber(),
+             charge, results[i].first, results[i].second,
+             PeakScorer::InstructionSet(), vector_results[i].first,
+             vector_results[i].second);
+      }
+    }
+  }
 }
 
 void TideSearchApplication::computeWindow(
@@ -1070,7 +1496,7 @@ string TideSearchApplication::getDescription() const {
     "<li>If a FASTA file was provided, convert it to an index using "
     "<code>tide-index</code>.</li>"
     "<li>Convert the given "
-    "fragmentation spectra to a binary format.</li><li>Search the spectra "
+    "fragmentation spectra to a binary format in memory.</li><li>Search the spectra "
     "against the database and store the results in binary format.</li><li>"
     "Convert the results to one or more requested output formats.</li></ol><p>"
     "By default, the intermediate binary files are stored in the output "
@@ -1103,6 +1529,7 @@ vector<string> TideSearchApplication::getOptions() const {
     "top-match",
     "store-spectra",
     "store-index",
+    "max-spectrum-memory",
     "concat",
     "compute-sp",
     "remove-precursor-peak",
@@ -1117,6 +1544,7 @@ vector<string> TideSearchApplication::getOptions() const {
     "pin-output",
     "fileroot",
     "file-column",
+    "sorted-output",
     "output-dir",
     "overwrite",
     "parameter-file",
@@ -1129,6 +1557,9 @@ vector<string> TideSearchApplication::getOptions() const {
     "peptide-centric-search",
     "elution-window-size",
     "num-threads",
+    "shared-peptide-stream",
+    "scoring-backend",
+    "spectrum-batch-size",
     "verbosity"
   };
   return vector<string>(arr, arr + sizeof(arr) / sizeof(string));
@@ -1178,7 +1609,8 @@ int TideSearchApplication::calcScoreCount(
   double* aaFreqI,
   double* aaFreqC,
   int* aaMass,
-  double* pValueScoreObs
+  double* pValueScoreObs,
+  vector<double>* dynProgArray
 ) {
   const int nDeltaMass = nAA;
   int minDeltaMass = aaMass[0];
@@ -1190,8 +1622,6 @@ int TideSearchApplication::calcScoreCount(
   int ma;
   int evidence;
   int de;
-  int evidenceRow;
-  double sumScore;
 
   int bottomRowBuffer = maxEvidence + 1;
   int topRowBuffer = -minEvidence;
@@ -1210,91 +1640,75 @@ int TideSearchApplication::calcScoreCount(
   int initCountRow = bottomRowBuffer - minScore;
   int initCountCol = maxDeltaMass + colStart;
 
-  double** dynProgArray = new double*[nRow];
-  for (row = 0; row < nRow; row++) {
-    dynProgArray[row] = new double[nCol];
-    for (col = 0; col < nCol; col++) {
-      dynProgArray[row][col] = 0.0;
-    }
-  }
-  double* scoreCountBinAdjust = 0;
-  scoreCountBinAdjust = new double[nRow];
-  for (row = 0; row < nRow; row++) {
-    scoreCountBinAdjust[row] = 0.0;
-  }
-
-  dynProgArray[initCountRow][initCountCol] = 1.0; // initial count of peptides with mass = 1
-  vector<int> deltaMassCol(nDeltaMass);
+  // The matrix is one contiguous buffer that the caller keeps between calls.
+  // It is stored a column (mass) at a time, so that each step of the
+  // recurrence below runs over consecutive rows (scores) in memory.
+  // Counts are accumulated in the same order as a row-by-row evaluation, so
+  // the results do not depend on the layout.
+  dynProgArray->assign((size_t)nRow * nCol, 0.0);
+  double* dynProg = &(*dynProgArray)[0];
+  double* colArray;
+  const double* prevColArray;
+
+  double* initCount = dynProg + (size_t)initCountCol * nRow + initCountRow;
+  *initCount = 1.0; // initial count of peptides with mass = 1
   // populate matrix with scores for first (i.e. N-terminal) amino acid in sequence
   for (de = 0; de < nDeltaMass; de++) {
     ma = aaMass[de];
     row = initCountRow + evidenceObs[ma + colStart];
     col = initCountCol + ma;
     if (col <= maxDeltaMass + colLast) {
-      dynProgArray[row][col] += dynProgArray[initCountRow][initCountCol] * aaFreqN[de];
+      dynProg[(size_t)col * nRow + row] += *initCount * aaFreqN[de];
     }
   }
   // set to zero now that score counts for first amino acid are in matrix
-  dynProgArray[initCountRow][initCountCol] = 0.0;
+  *initCount = 0.0;
   // populate matrix with score counts for non-terminal amino acids in sequence 
   for (ma = colFirst; ma < colLast; ma++) {
     col = maxDeltaMass + ma;
     evidence = evidenceObs[ma];
+    colArray = dynProg + (size_t)col * nRow;
     for (de = 0; de < nDeltaMass; de++) {
-      deltaMassCol[de] = col - aaMass[de];
-    }
-    for (row = rowFirst; row <= rowLast; row++) {
-      evidenceRow = row - evidence;
-      sumScore = dynProgArray[row][col];
-      for (de = 0; de < nDeltaMass; de++) {
-        sumScore += dynProgArray[evidenceRow][deltaMassCol[de]] * aaFreqI[de];
+      // prevColArray[row] is the count 'evidence' rows below row in column
+      // col - aaMass[de]
+      prevColArray = dynProg + (size_t)(col - aaMass[de]) * nRow - evidence;
+      double aaFreq = aaFreqI[de];
+      for (row = rowFirst; row <= rowLast; row++) {
+        colArray[row] += prevColArray[row] * aaFreq;
       }
-      dynProgArray[row][col] = sumScore;
     }
   }
   // populate matrix with score counts for last (i.e. C-terminal) amino acid in sequence
+  // (no evidence is added for last amino acid in sequence)
   ma = colLast;
   col = maxDeltaMass + ma;
-  evidence = 0; // no evidence should be added for last amino acid in sequence
-  for (de = 0; de < nDeltaMass; de++) {
-    deltaMassCol[de] = col - aaMass[de];
-  }
+  colArray = dynProg + (size_t)col * nRow;
   for (row = rowFirst; row <= rowLast; row++) {
-    evidenceRow = row - evidence;
-    sumScore = 0.0;
-    for (de = 0; de < nDeltaMass; de++) {
-      sumScore += dynProgArray[evidenceRow][deltaMassCol[de]] * aaFreqC[de];  // C-terminal residue
+    colArray[row] = 0.0;
+  }
+  for (de = 0; de < nDeltaMass; de++) {
+    prevColArray = dynProg + (size_t)(col - aaMass[de]) * nRow;
+    double aaFreq = aaFreqC[de];  // C-terminal residue
+    for (row = rowFirst; row <= rowLast; row++) {
+      colArray[row] += prevColArray[row] * aaFreq;
     }
-    dynProgArray[row][col] = sumScore;
   }
 
-  int colScoreCount = maxDeltaMass + colLast;
+  // colArray now holds the counts from the last column of the matrix
   double totalCount = 0.0;
   for (row = 0; row < nRow; row++) {
-    // at this point pValueScoreObs just holds counts from last column of dynamic programming array
-    pValueScoreObs[row] = dynProgArray[row][colScoreCount];
-    totalCount += pValueScoreObs[row];
-    scoreCountBinAdjust[row] = pValueScoreObs[row] / 2.0;
-  }
-  // convert from counts to cumulative sum of counts
-  for (row = nRow - 2; row >= 0; row--) {
-    pValueScoreObs[row] += pValueScoreObs[row + 1];
+    totalCount += colArray[row];
   }
   double logTotalCount = log(totalCount);
-  for (row = 0; row < nRow; row++) {
-    // adjust counts to reflect center of bin, not edge
-    pValueScoreObs[row] -= scoreCountBinAdjust[row];
+  double cumCount = 0.0;
+  for (row = nRow - 1; row >= 0; row--) {
+    // cumulative sum of counts, adjusted to reflect center of bin, not edge
+    cumCount += colArray[row];
+    pValueScoreObs[row] = cumCount - colArray[row] / 2.0;
     // normalize distribution; use exp( log ) to avoid potential underflow
     pValueScoreObs[row] = exp(log(pValueScoreObs[row]) - logTotalCount);
   }
 
-  // clean up
-  for (row = 0; row < nRow; row++) {
-    delete [] dynProgArray[row];
-  }
-  delete [] dynProgArray;
-  delete [] scoreCountBinAdjust;
-  
   return scoreOffsetObs;
 }
 
@@ -11,7 +11,11 @@
 #include "peptides.pb.h"
 #include "spectrum.pb.h"
 #include "tide/theoretical_peak_set.h"
+#include "tide/mass_index.h"
 #include "tide/max_mz.h"
+#include "tide/spec_charge_scheduler.h"
+#include "tide/search_config.h"
+#include <boost/atomic.hpp>
 
 using namespace std; 
 
@@ -54,9 +58,9 @@ class TideSearchApplication : public CruxApplication {
     */
   void search(
     const string& spectrum_filename,
-    const vector<SpectrumCollection::SpecCharge>* spec_charges,
+    const SpectrumCollection* spectra,
     vector<ActivePeptideQueue*> active_peptide_queue,
-    ProteinVec& proteins,
+    const ProteinViewVec& proteins,
     vector<const pb::AuxLocation*>& locations,
     double precursor_window,
     WINDOW_TYPE_T window_type,
@@ -68,8 +72,8 @@ class TideSearchApplication : public CruxApplication {
     int search_charge,
     int top_matches,
     double highest_mz,
-    ofstream* target_file,
-    ofstream* decoy_file,
+    PsmWriter* target_file,
+    PsmWriter* decoy_file,
     bool compute_sp,
     int nAA, 
     double* aaFreqN,
@@ -85,7 +89,8 @@ class TideSearchApplication : public CruxApplication {
     const ObservedPeakSet& observed,
     TideMatchSet::Arr2* match_arr,
     int queue_size,
-    int charge
+    int charge,
+    vector< pair<int, int> >* check
   );
 
   void computeWindow(
@@ -111,13 +116,17 @@ class TideSearchApplication : public CruxApplication {
   };
   double bin_width_;
   double bin_offset_;
+  bool use_shared_stream_;
+  SearchConfig search_config_;
+  // Empty if the index has no mass histogram
+  MassHistogram mass_histogram_;
 
   std::string remove_index_;
 
   struct InputFile {
     std::string OriginalName;
-    std::string SpectrumRecords;
-    bool Keep;
+    std::string SpectrumRecords;  // empty if OriginalName was parsed directly
+    bool Keep;  // false if SpectrumRecords is temporary
     InputFile(const std::string& name,
               const std::string& spectrumrecords,
               bool keep):
@@ -196,7 +205,7 @@ class TideSearchApplication : public CruxApplication {
     string spectrum_filename;
     const vector<SpectrumCollection::SpecCharge>* spec_charges;
     ActivePeptideQueue* active_peptide_queue;
-    ProteinVec proteins;
+    ProteinViewVec proteins;
     vector<const pb::AuxLocation*> locations;
     double precursor_window;
     WINDOW_TYPE_T window_type;
@@ -208,8 +217,8 @@ class TideSearchApplication : public CruxApplication {
     int search_charge;
     int top_matches;
     double highest_mz;
-    ofstream* target_file;
-    ofstream* decoy_file;
+    PsmWriter* target_file;
+    PsmWriter* decoy_file;
     bool compute_sp;
     int64_t thread_num;
     int64_t num_threads;
@@ -223,20 +232,23 @@ class TideSearchApplication : public CruxApplication {
     double bin_offset;
     bool exact_pval_search;
     map<pair<string, unsigned int>, bool>* spectrum_flag;
-    int* sc_index;
+    boost::atomic<int>* sc_index;
     int* total_candidate_peptides;
     vector<int>* negative_isotope_errors;
+    SpecChargeScheduler* scheduler;
+    SpectrumReader* spectrum_reader;  // NULL unless spectra are out of core
 
     thread_data (const string& spectrum_filename_, const vector<SpectrumCollection::SpecCharge>* spec_charges_,
-            ActivePeptideQueue* active_peptide_queue_, ProteinVec proteins_,
+            ActivePeptideQueue* active_peptide_queue_, ProteinViewVec proteins_,
             vector<const pb::AuxLocation*> locations_, double precursor_window_,
             WINDOW_TYPE_T window_type_, double spectrum_min_mz_, double spectrum_max_mz_,
             int min_scan_, int max_scan_, int min_peaks_, int search_charge_, int top_matches_,
-            double highest_mz_, ofstream* target_file_,
-            ofstream* decoy_file_, bool compute_sp_, int64_t thread_num_, int64_t num_threads_, int nAA_,
+            double highest_mz_, PsmWriter* target_file_,
+            PsmWriter* decoy_file_, bool compute_sp_, int64_t thread_num_, int64_t num_threads_, int nAA_,
             double* aaFreqN_, double* aaFreqI_, double* aaFreqC_, int* aaMass_, vector<boost::mutex*> locks_array_,  
             double bin_width_, double bin_offset_, bool exact_pval_search_, map<pair<string, unsigned int>, bool>* spectrum_flag_,
-            int* sc_index_, int* total_candidate_peptides_, vector<int>* negative_isotope_errors_) :
+            boost::atomic<int>* sc_index_, int* total_candidate_peptides_, vector<int>* negative_isotope_errors_,
+            SpecChargeScheduler* scheduler_, SpectrumReader* spectrum_reader_) :
             spectrum_filename(spectrum_filename_), spec_charges(spec_charges_), active_peptide_queue(active_peptide_queue_),
             proteins(proteins_), locations(locations_), precursor_window(precursor_window_), window_type(window_type_),
             spectrum_min_mz(spectrum_min_mz_), spectrum_max_mz(spectrum_max_mz_), min_scan(min_scan_), max_scan(max_scan_),
@@ -244,9 +256,164 @@ class TideSearchApplication : public CruxApplication {
             target_file(target_file_), decoy_file(decoy_file_), compute_sp(compute_sp_),
             thread_num(thread_num_), num_threads(num_threads_), nAA(nAA_), aaFreqN(aaFreqN_), aaFreqI(aaFreqI_), aaFreqC(aaFreqC_), 
             aaMass(aaMass_), locks_array(locks_array_), bin_width(bin_width_), bin_offset(bin_offset_), exact_pval_search(exact_pval_search_), 
-            spectrum_flag(spectrum_flag_), sc_index(sc_index_), total_candidate_peptides(total_candidate_peptides_), negative_isotope_errors(negative_isotope_errors_) {}
+            spectrum_flag(spectrum_flag_), sc_index(sc_index_), total_candidate_peptides(total_candidate_peptides_), negative_isotope_errors(negative_isotope_errors_),
+            scheduler(scheduler_), spectrum_reader(spectrum_reader_) {}
   };
 
+  /**
+   * Buffers that a search thread reuses for every spectrum-charge pair,
+   * rather than allocating them anew each time. The match arrays grow to the
+   * largest candidate window seen and are kept at that size.
+   */
+  class search_workspace {
+   public:
+    vector<double> min_mass;
+    vector<double> max_mass;
+    vector<bool> candidatePeptideStatus;
+    vector<int> pepMassInt;
+    vector<int> pepMassIntUnique;
+
+    /**
+     * The exact p-value score counts for one integer peptide mass, and the
+     * evidence vector they were computed from.
+     */
+    struct score_count {
+      vector<int> evidence;
+      int offset;
+      vector<double> pValues;
+    };
+    vector<score_count> scoreCounts;
+    vector<int> sortEvidenceObs;
+    vector<int> intensArrayTheor;
+    vector<double> dynProgArray;
+
+    /**
+     * For collectScoresCompiled() with scoring-backend=check: the vector
+     * scores that the compiled ones are checked against.
+     */
+    vector< pair<int, int> > scoreCheck;
+
+    /**
+     * For scoreSpectrumBatch(): the window of the whole batch, and then one
+     * entry for each spectrum of the batch.
+     */
+    vector<double> batch_min_mass;
+    vector<double> batch_max_mass;
+    vector<bool> batch_status;
+    vector<deque<Peptide*>::const_iterator> begins;
+    vector<deque<Peptide*>::const_iterator> ends;
+    vector< vector<bool> > batchCandidatePeptideStatus;
+    vector<int> num_candidates;
+    vector<int> offsets;
+    vector<int> sizes;
+    vector<int> charges;
+    vector<const int*> caches;
+    vector< pair<int, int>* > results;
+
+    search_workspace() :
+      match_arr2_(NULL), match_arr_(NULL), match_arr2_capacity_(0), match_arr_capacity_(0) {}
+    ~search_workspace() {
+      delete match_arr2_;
+      delete match_arr_;
+      for (size_t k = 0; k < batch_match_arr2_.size(); k++) {
+        delete batch_match_arr2_[k];
+      }
+    }
+
+    /**
+     * Empties the window buffers for the next spectrum-charge pair.
+     */
+    void Clear() {
+      min_mass.clear();
+      max_mass.clear();
+      candidatePeptideStatus.clear();
+    }
+
+    /**
+     * Return an empty array with room for size matches. The array stays
+     * valid until the next call.
+     */
+    TideMatchSet::Arr2* MatchArr2(int size) {
+      return Reserve(&match_arr2_, &match_arr2_capacity_, size);
+    }
+    TideMatchSet::Arr* MatchArr(int size) {
+      return Reserve(&match_arr_, &match_arr_capacity_, size);
+    }
+
+    /**
+     * As MatchArr2(), for spectrum k of a batch. The arrays of all members of
+     * the batch are valid at once.
+     */
+    TideMatchSet::Arr2* BatchMatchArr2(int k, int size) {
+      if (k >= (int)batch_match_arr2_.size()) {
+        batch_match_arr2_.resize(k + 1, NULL);
+        batch_match_arr2_capacity_.resize(k + 1, 0);
+      }
+      return Reserve(&batch_match_arr2_[k], &batch_match_arr2_capacity_[k], size);
+    }
+    TideMatchSet::Arr2* BatchMatchArr2(int k) { return batch_match_arr2_[k]; }
+
+   private:
+    template<class A> static A* Reserve(A** arr, int* capacity, int size) {
+      if (*arr == NULL || size > *capacity) {
+        delete *arr;
+        *capacity = max(size, 2 * *capacity);
+        *arr = new A(*capacity);
+      }
+      (*arr)->clear();
+      return *arr;
+    }
+
+    TideMatchSet::Arr2* match_arr2_;
+    TideMatchSet::Arr* match_arr_;
+    int match_arr2_capacity_;
+    int match_arr_capacity_;
+    vector<TideMatchSet::Arr2*> batch_match_arr2_;
+    vector<int> batch_match_arr2_capacity_;
+
+    search_workspace(const search_workspace&);
+    search_workspace& operator=(const search_workspace&);
+  };
+
+  /**
+   * A spectrum-charge pair waiting to be scored together with its
+   * neighbours in mass, and its candidate window.
+   */
+  struct batched_spectrum {
+    Spectrum* spectrum;
+    int charge;
+    vector<double> min_mass;
+    vector<double> max_mass;
+    double min_range;
+    double max_range;
+
+    /**
+     * Entries are overwritten in place from one batch to the next, so the
+     * window vectors keep their storage.
+     */
+    void Set(Spectrum* spectrum_, int charge_, const vector<double>& min_mass_,
+             const vector<double>& max_mass_, double min_range_, double max_range_) {
+      spectrum = spectrum_;
+      charge = charge_;
+      min_mass.assign(min_mass_.begin(), min_mass_.end());
+      max_mass.assign(max_mass_.begin(), max_mass_.end());
+      min_range = min_range_;
+      max_range = max_range_;
+    }
+  };
+
+  /**
+   * Scores and reports the first num_spectra spectrum-charge pairs of batch
+   * against a single peptide window covering all of them.
+   */
+  void scoreSpectrumBatch(
+    thread_data* my_data,
+    vector<batched_spectrum>* batch,
+    int num_spectra,
+    const vector<ObservedPeakSet*>& observed,
+    search_workspace* workspace
+  );
+
   int calcScoreCount(
     int numelEvidenceObs,
     int* evidenceObs,
@@ -260,7 +427,8 @@ class TideSearchApplication : public CruxApplication {
     double* aaFreqI,
     double* aaFreqC,
     int* aaMass,
-    double* pValueScoreObs
+    double* pValueScoreObs,
+    vector<double>* dynProgArray
   );
   
   void setSpectrumFlag(map<pair<string, unsigned int>, bool>* spectrum_flag);
@@ -6,51 +6,136 @@
 #include "peptides.pb.h"
 #include "peptide.h"
 #include "active_peptide_queue.h"
+#include "shared_peptide_stream.h"
+#include "flat_peptides.h"
+#include "peak_index.h"
 #include "records_to_vector-inl.h"
 #include "theoretical_peak_set.h"
 #include "compiler.h"
+#include "peak_scorer.h"
 #include "app/TideMatchSet.h"
 #define CHECK(x) GOOGLE_CHECK((x))
 
 DEFINE_int32(fifo_page_size, 1, "Page size for FIFO allocator, in megs");
 
 ActivePeptideQueue::ActivePeptideQueue(RecordReader* reader,
-                                       const vector<const pb::Protein*>&
+                                       const ProteinViewVec&
                                        proteins)
-  : reader_(reader),
+  : reader_(reader), flat_reader_(NULL), peak_index_(NULL),
+    shared_stream_(NULL), consumer_(0), stream_next_(0),
     proteins_(proteins),
     theoretical_peak_set_(2000),   // probably overkill, but no harm
     theoretical_b_peak_set_(200),  // probably overkill, but no harm
     active_targets_(0), active_decoys_(0),
-    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20),
-    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20),
-    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20) {
+    fifo_alloc_peptides_(new FifoAllocator(FLAGS_fifo_page_size << 20, false)),
+    fifo_alloc_prog1_(new FifoAllocator(FLAGS_fifo_page_size << 20,
+                                        PeakScorer::UseCompiledPrograms())),
+    fifo_alloc_prog2_(new FifoAllocator(FLAGS_fifo_page_size << 20,
+                                        PeakScorer::UseCompiledPrograms())) {
   CHECK(reader_->OK());
-  compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
-  compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+  if (PeakScorer::UseCompiledPrograms()) {
+    compiler_prog1_ = new TheoreticalPeakCompiler(fifo_alloc_prog1_);
+    compiler_prog2_ = new TheoreticalPeakCompiler(fifo_alloc_prog2_);
+  } else {
+    compiler_prog1_ = compiler_prog2_ = NULL;
+  }
+  peptide_centric_ = false;
+  elution_window_ = 0;
+}
+
+ActivePeptideQueue::ActivePeptideQueue(SharedPeptideStream* shared_stream,
+                                       int consumer,
+                                       const ProteinViewVec&
+                                       proteins)
+  : reader_(NULL), flat_reader_(NULL), peak_index_(NULL),
+    shared_stream_(shared_stream), consumer_(consumer), stream_next_(0),
+    proteins_(proteins),
+    theoretical_peak_set_(2000),
+    theoretical_b_peak_set_(200),
+    active_targets_(0), active_decoys_(0),
+    fifo_alloc_peptides_(NULL), fifo_alloc_prog1_(NULL),
+    fifo_alloc_prog2_(NULL), compiler_prog1_(NULL), compiler_prog2_(NULL) {
+  // Peptides and their programs live in the shared stream's allocators, so
+  // the queue has none of its own.
   peptide_centric_ = false;
   elution_window_ = 0;
 }
 
+void ActivePeptideQueue::DetachStream() {
+  if (shared_stream_ != NULL) {
+    shared_stream_->Detach(consumer_);
+  }
+}
+
 ActivePeptideQueue::~ActivePeptideQueue() {
   deque<Peptide*>::iterator i = queue_.begin();
   // for (; i != queue_.end(); ++i)
   //   delete (*i)->PB();
-  fifo_alloc_peptides_.ReleaseAll();
-  fifo_alloc_prog1_.ReleaseAll();
-  fifo_alloc_prog2_.ReleaseAll();
-
   delete compiler_prog1_;
   delete compiler_prog2_;
+  delete fifo_alloc_peptides_;
+  delete fifo_alloc_prog1_;
+  delete fifo_alloc_prog2_;
 }
 
 // Compute the theoretical peaks of the peptide in the "back" of the queue
 // (i.e. the one most recently read from disk -- the heaviest).
 void ActivePeptideQueue::ComputeTheoreticalPeaksBack() {
-  theoretical_peak_set_.Clear();
   Peptide* peptide = queue_.back();
-  peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_, current_pb_peptide_,
-                                   compiler_prog1_, compiler_prog2_);
+  // Peak lists for PeakScorer go with the peptide, in fifo_alloc_peptides_.
+  FifoAllocator* fifo_alloc_peaks = PeakScorer::UsePeakLists() ?
+    fifo_alloc_peptides_ : NULL;
+  const int32_t* peaks;
+  int num_peaks1, num_peaks2;
+  if (peak_index_ != NULL &&
+      peak_index_->Find(peptide->Id(), &peaks, &num_peaks1, &num_peaks2)) {
+    theoretical_peak_set_.LoadPeaks(peaks, num_peaks1, num_peaks2);
+    peptide->CompileTheoreticalPeaks(&theoretical_peak_set_,
+                                     compiler_prog1_, compiler_prog2_,
+                                     fifo_alloc_peaks);
+    return;
+  }
+  theoretical_peak_set_.Clear();
+  peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_,
+                                   compiler_prog1_, compiler_prog2_,
+                                   fifo_alloc_peaks);
+}
+
+// Skip ahead toward the first peptide of at least the given mass, if the
+// index allows it.
+void ActivePeptideQueue::SeekToMass(double mass) {
+  if (flat_reader_ != NULL) {
+    flat_reader_->SeekToMass(mass);
+  } else {
+    reader_->SeekToMass(mass);
+  }
+}
+
+// Read the next peptide no lighter than min_range, allocated by
+// fifo_alloc_peptides_. Returns NULL at the end of the index.
+Peptide* ActivePeptideQueue::ReadPeptide(double min_range) {
+  if (flat_reader_ != NULL) {
+    while (!flat_reader_->Done()) {
+      const FlatPeptide* flat = flat_reader_->Next();
+      if (flat->mass < min_range) {
+        continue; // skip peptides that fall below min_range
+      }
+      return new(fifo_alloc_peptides_)
+        Peptide(*flat, flat_reader_->Mods(flat), proteins_,
+                fifo_alloc_peptides_);
+    }
+    return NULL;
+  }
+  while (!reader_->Done()) {
+    reader_->Read(&current_pb_peptide_);
+    if (current_pb_peptide_.mass() < min_range) {
+      // we would delete current_pb_peptide_;
+      continue; // skip peptides that fall below min_range
+    }
+    return new(fifo_alloc_peptides_)
+      Peptide(current_pb_peptide_, proteins_, fifo_alloc_peptides_);
+  }
+  return NULL;
 }
 
 bool ActivePeptideQueue::isWithinIsotope(vector<double>* min_mass, vector<double>* max_mass, double mass, int* isotope_idx) {
@@ -84,51 +169,67 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     queue_.pop_front();
 //    delete peptide;
   }
-  if (queue_.empty()) {
-    //cerr << "Releasing All\n";
-    fifo_alloc_peptides_.ReleaseAll();
-    fifo_alloc_prog1_.ReleaseAll();
-    fifo_alloc_prog2_.ReleaseAll();
-    //cerr << "Prog1: ";
-    //fifo_alloc_prog1_.Show();
-    //cerr << "Prog2: ";
-    //fifo_alloc_prog2_.Show();
-  } else {
-    Peptide* peptide = queue_.front();
-    // Free all peptides up to, but not including peptide.
-    fifo_alloc_peptides_.Release(peptide); 
-    peptide->ReleaseFifo(&fifo_alloc_prog1_, &fifo_alloc_prog2_);
-  }
-  
-  // Enqueue all peptides that are not yet queued but are lighter than
-  // max_range. For each new enqueued peptide compute the corresponding
-  // theoretical peaks. Data associated with each peptide is allocated by
-  // fifo_alloc_peptides_.
+
   bool done = false;
-  if (queue_.empty() || queue_.back()->Mass() <= max_range) {
-    if (!queue_.empty()) {
-      ComputeTheoreticalPeaksBack();
+  if (shared_stream_ != NULL) {
+    // The shared stream owns the peptides and their programs, and frees them
+    // once no queue needs them. The queue is always a contiguous run of the
+    // stream, ending just before stream_next_.
+    if (queue_.empty() || queue_.back()->Mass() <= max_range) {
+      stream_next_ = shared_stream_->Fetch(consumer_,
+                                           stream_next_ - queue_.size(),
+                                           stream_next_, min_range, max_range,
+                                           &queue_);
+      done = queue_.empty() || queue_.back()->Mass() <= max_range;
     }
-    while (!(done = reader_->Done())) {
-      // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
-      if (current_pb_peptide_.mass() < min_range) {
-        // we would delete current_pb_peptide_;
-        continue; // skip peptides that fall below min_range
+  } else {
+    if (queue_.empty()) {
+      //cerr << "Releasing All\n";
+      fifo_alloc_peptides_->ReleaseAll();
+      fifo_alloc_prog1_->ReleaseAll();
+      fifo_alloc_prog2_->ReleaseAll();
+      //cerr << "Prog1: ";
+      //fifo_alloc_prog1_->Show();
+      //cerr << "Prog2: ";
+      //fifo_alloc_prog2_->Show();
+    } else {
+      Peptide* peptide = queue_.front();
+      // Free all peptides up to, but not including peptide.
+      fifo_alloc_peptides_->Release(peptide); 
+      peptide->ReleaseFifo(fifo_alloc_prog1_, fifo_alloc_prog2_);
+    }
+
+    // Enqueue all peptides that are not yet queued but are lighter than
+    // max_range. For each new enqueued peptide compute the corresponding
+    // theoretical peaks. Data associated with each peptide is allocated by
+    // fifo_alloc_peptides_.
+    if (queue_.empty() || queue_.back()->Mass() <= max_range) {
+      if (!queue_.empty()) {
+        ComputeTheoreticalPeaksBack();
+      } else {
+        // Nothing in memory is needed; jump ahead if the index allows it.
+        SeekToMass(min_range);
       }
-      Peptide* peptide = new(&fifo_alloc_peptides_)
-        Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
-      queue_.push_back(peptide);
-      if (peptide->Mass() > max_range) {
-        break;
+      // read all peptides lighter than max_range
+      Peptide* peptide;
+      while ((peptide = ReadPeptide(min_range)) != NULL) {
+        queue_.push_back(peptide);
+        if (peptide->Mass() > max_range) {
+          break;
+        }
+        ComputeTheoreticalPeaksBack();
       }
-      ComputeTheoreticalPeaksBack();
+      done = (peptide == NULL);
     }
   }
   // by now, if not EOF, then the last (and only the last) enqueued
   // peptide is too heavy
   assert(!queue_.empty() || done);
-  
+
+  return SetActiveWindow(min_mass, max_mass, candidatePeptideStatus);
+}
+
+int ActivePeptideQueue::SetActiveWindow(vector<double>* min_mass, vector<double>* max_mass, vector<bool>* candidatePeptideStatus) {
   // Set up iterator for use with HasNext(),
   // GetPeptide(), and NextPeptide(). Return the number of enqueued peptides.
  if (queue_.empty()) {
@@ -140,12 +241,12 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     ++iter_;
   }
   
-  int* isotope_idx = new int(0);
+  int isotope_idx = 0;
   end_ = iter_;
   int active = 0;
   active_targets_ = active_decoys_ = 0;
   while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
+    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), &isotope_idx)) {
       ++active;
       candidatePeptideStatus->push_back(true);
       if (!(*end_)->IsDecoy()) {
@@ -158,7 +259,6 @@ int ActivePeptideQueue::SetActiveRange(vector<double>* min_mass, vector<double>*
     }
     ++end_;
   }
-  delete isotope_idx;
   if (active == 0) {
     return 0;
   }
@@ -192,34 +292,32 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
 //    delete peptide;
   }
   if (queue_.empty()) {
-    fifo_alloc_peptides_.ReleaseAll();
+    fifo_alloc_peptides_->ReleaseAll();
   } else {
     Peptide* peptide = queue_.front();
     // Free all peptides up to, but not including peptide.
-    fifo_alloc_peptides_.Release(peptide); 
+    fifo_alloc_peptides_->Release(peptide); 
   }
   
   // Enqueue all peptides that are not yet queued but are lighter than
   // max_range. For each new enqueued peptide compute the corresponding
   // theoretical peaks. Data associated with each peptide is allocated by
   // fifo_alloc_peptides_.
-  bool done;
+  bool done = false;
   if (queue_.empty() || queue_.back()->Mass() <= max_range) {
-    while (!(done = reader_->Done())) {
-      // read all peptides lighter than max_range
-      reader_->Read(&current_pb_peptide_);
-      if (current_pb_peptide_.mass() < min_range) {
-        // we would delete current_pb_peptide_;
-        continue; // skip peptides that fall below min_range
-      }
-      Peptide* peptide = new(&fifo_alloc_peptides_)
-        Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+    if (queue_.empty()) {
+      SeekToMass(min_range);
+    }
+    // read all peptides lighter than max_range
+    Peptide* peptide;
+    while ((peptide = ReadPeptide(min_range)) != NULL) {
       queue_.push_back(peptide);
       ComputeBTheoreticalPeaksBack();
       if (peptide->Mass() > max_range) {
         break;
       }
     }
+    done = (peptide == NULL);
   }
   // by now, if not EOF, then the last (and only the last) enqueued
   // peptide is too heavy
@@ -232,13 +330,13 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
     ++iter1_;
   }
 
-  int* isotope_idx = new int(0);
+  int isotope_idx = 0;
   end_ = iter_;
   end1_ = iter1_;
   int active = 0;
   active_targets_ = active_decoys_ = 0;
   while (end_ != queue_.end() && (*end_)->Mass() < max_mass->back() ){
-    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), isotope_idx)) {
+    if (isWithinIsotope(min_mass, max_mass, (*end_)->Mass(), &isotope_idx)) {
       ++active;
       candidatePeptideStatus->push_back(true);
       if (!(*end_)->IsDecoy()) {
@@ -252,7 +350,6 @@ int ActivePeptideQueue::SetActiveRangeBIons(vector<double>* min_mass, vector<dou
     ++end_;
     ++end1_;
   }
-  delete isotope_idx;
   if (active == 0) {
     return 0;
   }
@@ -282,7 +379,7 @@ int ActivePeptideQueue::CountAAFrequency(
 
     while (!(reader_->Done())) { // read all peptides in index
       reader_->Read(&current_pb_peptide_);
-      Peptide* peptide = new(&fifo_alloc_peptides_) Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+      Peptide* peptide = new(fifo_alloc_peptides_) Peptide(current_pb_peptide_, proteins_, fifo_alloc_peptides_);
 
       double* dAAResidueMass = peptide->getAAMasses(); //retrieves the amino acid masses, modifications included
 
@@ -296,7 +393,7 @@ int ActivePeptideQueue::CountAAFrequency(
       ++cntTerm;
 
       delete[] dAAResidueMass;
-      fifo_alloc_peptides_.ReleaseAll();
+      fifo_alloc_peptides_->ReleaseAll();
     }
 
   //calculate the unique masses
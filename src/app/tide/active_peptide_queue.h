@@ -27,11 +27,21 @@
 #define ACTIVE_PEPTIDE_QUEUE_H
 
 class TheoreticalPeakCompiler;
+class SharedPeptideStream;
+class FlatPeptideSource;
+class PeakIndexReader;
+class PsmWriter;
 
 class ActivePeptideQueue {
  public:
   ActivePeptideQueue(RecordReader* reader,
-            const vector<const pb::Protein*>& proteins);
+            const ProteinViewVec& proteins);
+
+  // Draw peptides from a SharedPeptideStream (see shared_peptide_stream.h)
+  // rather than reading and compiling them privately. consumer identifies
+  // this queue to the stream.
+  ActivePeptideQueue(SharedPeptideStream* shared_stream, int consumer,
+            const ProteinViewVec& proteins);
 
   ~ActivePeptideQueue();
 
@@ -40,6 +50,10 @@ class ActivePeptideQueue {
   // See above for usage and .cc for implementation details.
   int SetActiveRange(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
   int SetActiveRangeBIons(vector<double>* min_mass, vector<double>* max_mass, double min_range, double max_range, vector<bool>* candidatePeptideStatus);
+  // Narrow the iterators to a window within the peptides already queued by
+  // SetActiveRange(), as for a spectrum whose window lies inside the last
+  // range set. Returns the number of candidates, as SetActiveRange() does.
+  int SetActiveWindow(vector<double>* min_mass, vector<double>* max_mass, vector<bool>* candidatePeptideStatus);
 
   bool HasNext() const { return iter_ != end_; }
   Peptide* NextPeptide() { return *iter_; }
@@ -62,7 +76,7 @@ class ActivePeptideQueue {
 
   void ReportPeptideHits(Peptide* peptide);
   void SetOutputs(OutputFiles* output_files, const vector<const pb::AuxLocation*>* locations, int top_matches,
-                  bool compute_sp, ofstream* target_file, ofstream* decoy_file, double highest_mz) {
+                  bool compute_sp, PsmWriter* target_file, PsmWriter* decoy_file, double highest_mz) {
       locations_ = locations;
       output_files_ = output_files;
       top_matches_ = top_matches;
@@ -78,6 +92,23 @@ class ActivePeptideQueue {
   void setElutionWindow(int elution_window) {
     elution_window_ = elution_window;
   }
+
+  // Tell the shared stream, if any, that this queue is finished with it.
+  void DetachStream();
+
+  // Read peptides for SetActiveRange() and SetActiveRangeBIons() from a flat
+  // or packed index (see flat_peptides.h and packed_peptides.h) holding the
+  // same peptides as reader. The reader passed to the constructor is still
+  // used by CountAAFrequency().
+  void SetFlatReader(FlatPeptideSource* flat_reader) {
+    flat_reader_ = flat_reader;
+  }
+
+  // Take theoretical peaks from a peak index (see peak_index.h) for the
+  // peptides it covers, rather than computing them.
+  void SetPeakIndex(PeakIndexReader* peak_index) {
+    peak_index_ = peak_index;
+  }
   // iter_ points to the current peptide. Client access is by HasNext(),
   // GetPeptide(), and NextPeptide(). end_ points just beyond the last active
   // peptide.
@@ -89,8 +120,8 @@ class ActivePeptideQueue {
   OutputFiles* output_files_;
   int top_matches_;
   bool compute_sp_;
-  ofstream* target_file_;
-  ofstream* decoy_file_;
+  PsmWriter* target_file_;
+  PsmWriter* decoy_file_;
   double highest_mz_;
   Peptide* current_peptide_;
   bool exact_pval_search_;
@@ -104,12 +135,26 @@ class ActivePeptideQueue {
   // See .cc file.
   void ComputeTheoreticalPeaksBack();
   void ComputeBTheoreticalPeaksBack();
+  void SeekToMass(double mass);
+  Peptide* ReadPeptide(double min_range);
 
   RecordReader* reader_;
   pb::Peptide current_pb_peptide_;
 
+  // If set, peptides are read from here rather than from reader_.
+  FlatPeptideSource* flat_reader_;
+
+  // If set, theoretical peaks are read from here where possible.
+  PeakIndexReader* peak_index_;
+
+  // Set instead of reader_ when peptides come from a shared stream.
+  // stream_next_ is the ordinal of the next peptide to request from it.
+  SharedPeptideStream* shared_stream_;
+  int consumer_;
+  size_t stream_next_;
+
   // All amino acid sequences from which the peptides are drawn.
-  const vector<const pb::Protein*>& proteins_; 
+  const ProteinViewVec& proteins_; 
 
   // Workspace for computing theoretical peaks for a single peptide.
   // Gets reused for each new peptide.
@@ -134,9 +179,10 @@ class ActivePeptideQueue {
   // since they set the proper permissions. The set of theoretical peaks for 
   // "dotting" with charge 1 and charge 2 spectra, have different
   // FifoAllocators and TheoreticalPeakCompilers.
-  FifoAllocator fifo_alloc_peptides_;
-  FifoAllocator fifo_alloc_prog1_;
-  FifoAllocator fifo_alloc_prog2_;
+  // They are NULL when peptides come from a shared stream.
+  FifoAllocator* fifo_alloc_peptides_;
+  FifoAllocator* fifo_alloc_prog1_;
+  FifoAllocator* fifo_alloc_prog2_;
   TheoreticalPeakCompiler* compiler_prog1_;
   TheoreticalPeakCompiler* compiler_prog2_;
 
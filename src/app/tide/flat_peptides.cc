@@ -0,0 +1,156 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "flat_peptides.h"
+#include "index_stamp.h"
+#include "io/carp.h"
+
+static bool FileSize(const string& filename, uint64_t* size) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  *size = st.st_size;
+  return true;
+}
+
+FlatPeptideWriter::FlatPeptideWriter(const string& filename)
+  : filename_(filename), mods_filename_(filename + ".mods.tmp"),
+    out_(NULL), mods_out_(NULL) {
+  memset(&header_, 0, sizeof(header_));
+  memcpy(header_.magic, FLAT_INDEX_MAGIC, sizeof(header_.magic));
+  header_.record_size = sizeof(FlatPeptide);
+  out_ = fopen(filename_.c_str(), "wb");
+  mods_out_ = fopen(mods_filename_.c_str(), "wb");
+  if (out_ == NULL || mods_out_ == NULL ||
+      fwrite(&header_, sizeof(header_), 1, out_) != 1) {
+    carp(CARP_ERROR, "Could not create flat index %s", filename_.c_str());
+    if (out_ != NULL) {
+      fclose(out_);
+      out_ = NULL;
+    }
+  }
+}
+
+FlatPeptideWriter::~FlatPeptideWriter() {
+  if (out_ != NULL) {
+    fclose(out_);
+  }
+  if (mods_out_ != NULL) {
+    fclose(mods_out_);
+  }
+  remove(mods_filename_.c_str());
+}
+
+bool FlatPeptideWriter::Write(const pb::Peptide& peptide) {
+  if (out_ == NULL) {
+    return false;
+  }
+  FlatPeptide record;
+  memset(&record, 0, sizeof(record));
+  record.mass = peptide.mass();
+  record.id = peptide.id();
+  record.length = peptide.length();
+  record.protein_id = peptide.first_location().protein_id();
+  record.pos = peptide.first_location().pos();
+  record.aux_locations_index = peptide.has_aux_locations_index() ?
+    peptide.aux_locations_index() : -1;
+  record.is_decoy = peptide.is_decoy() ? 1 : 0;
+  record.first_mod = header_.num_mods;
+  record.num_mods = peptide.modifications_size();
+  for (int i = 0; i < record.num_mods; ++i) {
+    int32_t mod = peptide.modifications(i);
+    if (fwrite(&mod, sizeof(mod), 1, mods_out_) != 1) {
+      return false;
+    }
+  }
+  header_.num_mods += record.num_mods;
+  ++header_.num_peptides;
+  return fwrite(&record, sizeof(record), 1, out_) == 1;
+}
+
+bool FlatPeptideWriter::Close(const string& pepix_filename) {
+  if (out_ == NULL || !FileSize(pepix_filename, &header_.pepix_size) ||
+      !IndexStamp(pepix_filename, &header_.pepix_stamp)) {
+    return false;
+  }
+  // Append the staged mods after the peptide records.
+  fclose(mods_out_);
+  mods_out_ = fopen(mods_filename_.c_str(), "rb");
+  if (mods_out_ == NULL) {
+    return false;
+  }
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), mods_out_)) > 0) {
+    if (fwrite(buf, 1, n, out_) != n) {
+      return false;
+    }
+  }
+  // Now that the counts are known, rewrite the header.
+  bool ok = fseek(out_, 0, SEEK_SET) == 0 &&
+            fwrite(&header_, sizeof(header_), 1, out_) == 1;
+  ok = (fclose(out_) == 0) && ok;
+  out_ = NULL;
+  return ok;
+}
+
+FlatPeptideReader::FlatPeptideReader(const string& filename,
+                                     const string& pepix_filename)
+  : map_(MAP_FAILED), map_size_(0), peptides_(NULL), next_(NULL), end_(NULL),
+    mods_(NULL) {
+  uint64_t file_size, pepix_size, pepix_stamp;
+  if (!FileSize(filename, &file_size) || !FileSize(pepix_filename, &pepix_size) ||
+      !IndexStamp(pepix_filename, &pepix_stamp) ||
+      file_size < sizeof(FlatIndexHeader)) {
+    return;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  map_size_ = (size_t)file_size;
+  map_ = mmap(0, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map_ == MAP_FAILED) {
+    carp(CARP_DEBUG, "Could not map flat index %s", filename.c_str());
+    return;
+  }
+  const FlatIndexHeader* header = (const FlatIndexHeader*)map_;
+  if (memcmp(header->magic, FLAT_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->record_size != sizeof(FlatPeptide) ||
+      header->pepix_size != pepix_size ||
+      header->pepix_stamp != pepix_stamp ||
+      file_size != sizeof(FlatIndexHeader) +
+                   header->num_peptides * sizeof(FlatPeptide) +
+                   header->num_mods * sizeof(int32_t)) {
+    carp(CARP_DEBUG, "Ignoring flat index %s", filename.c_str());
+    return;
+  }
+  peptides_ = next_ = (const FlatPeptide*)(header + 1);
+  end_ = peptides_ + header->num_peptides;
+  mods_ = (const int32_t*)end_;
+}
+
+FlatPeptideReader::~FlatPeptideReader() {
+  if (map_ != MAP_FAILED) {
+    munmap(map_, map_size_);
+  }
+}
+
+static bool FlatPeptideLighter(const FlatPeptide& peptide, double mass) {
+  return peptide.mass < mass;
+}
+
+void FlatPeptideReader::SeekToMass(double mass) {
+  next_ = lower_bound(next_, end_, mass, FlatPeptideLighter);
+}
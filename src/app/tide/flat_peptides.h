@@ -0,0 +1,128 @@
+// A flat peptide index is an alternative, memory-mappable layout of the
+// peptides in pepix, written by tide-index when flat-index=T. Where pepix
+// holds varint-prefixed pb::Peptide records that must each be decoded through
+// a CodedInputStream, the flat index holds fixed-width FlatPeptide records
+// that are read in place from a read-only mapping of the file. Concurrent
+// searches against the same index on one machine share the mapped pages.
+//
+// Layout (native byte order):
+//
+//    FlatIndexHeader
+//    FlatPeptide[num_peptides]   sorted by mass, as in pepix
+//    int32_t[num_mods]           modifications, in the encoding of
+//                                pb::Peptide::modifications; peptide p owns
+//                                mods [p.first_mod, p.first_mod + p.num_mods)
+//
+// pepix remains the primary index: it carries the pb::Header, and other tools
+// read it. The flat header records the size and the IndexStamp() (see
+// index_stamp.h) of the pepix it was written with, and a flat index that does
+// not match is ignored. The pb::Peptide peak diff
+// fields are not carried over, since tide-index does not populate them.
+
+#ifndef FLAT_PEPTIDES_H
+#define FLAT_PEPTIDES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "peptides.pb.h"
+
+using namespace std;
+
+#define FLAT_INDEX_MAGIC "TIDEFLT2"
+
+struct FlatIndexHeader {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t reserved;
+  uint64_t num_peptides;
+  uint64_t num_mods;
+  uint64_t pepix_size;
+  uint64_t pepix_stamp;
+};
+
+struct FlatPeptide {
+  double mass;
+  int32_t id;
+  int32_t length;
+  int32_t protein_id;
+  int32_t pos;
+  int32_t aux_locations_index; // -1 if none
+  int32_t is_decoy;
+  uint64_t first_mod;
+  int32_t num_mods;
+  int32_t reserved;
+};
+
+class FlatPeptideWriter {
+ public:
+  // Mods are staged in a temporary file next to filename and appended when
+  // the writer is closed.
+  explicit FlatPeptideWriter(const string& filename);
+  ~FlatPeptideWriter();
+
+  bool OK() const { return out_ != NULL; }
+
+  bool Write(const pb::Peptide& peptide);
+
+  // Finish the file. pepix_filename must already be complete and closed.
+  bool Close(const string& pepix_filename);
+
+ private:
+  string filename_;
+  string mods_filename_;
+  FILE* out_;
+  FILE* mods_out_;
+  FlatIndexHeader header_;
+};
+
+// Where tide-search reads FlatPeptides from: a flat index, or a packed index
+// (see packed_peptides.h) decoded into FlatPeptides.
+class FlatPeptideSource {
+ public:
+  virtual ~FlatPeptideSource() {}
+
+  virtual bool Done() const = 0;
+
+  // Return the next peptide and advance past it. The peptide and its mods
+  // remain valid at least until the next call.
+  virtual const FlatPeptide* Next() = 0;
+
+  virtual const int32_t* Mods(const FlatPeptide* peptide) const = 0;
+
+  // Move ahead to the first peptide at least as heavy as mass. Never moves
+  // back.
+  virtual void SeekToMass(double mass) = 0;
+};
+
+class FlatPeptideReader : public FlatPeptideSource {
+ public:
+  // Map filename read-only. OK() is false if filename does not exist, is not
+  // a flat index, or was not written for pepix_filename.
+  FlatPeptideReader(const string& filename, const string& pepix_filename);
+  ~FlatPeptideReader();
+
+  bool OK() const { return peptides_ != NULL; }
+
+  bool Done() const { return next_ == end_; }
+
+  const FlatPeptide* Next() { return next_++; }
+
+  const int32_t* Mods(const FlatPeptide* peptide) const {
+    return mods_ + peptide->first_mod;
+  }
+
+  void SeekToMass(double mass);
+
+  uint64_t Size() const { return end_ - peptides_; }
+
+ private:
+  void* map_;
+  size_t map_size_;
+  const FlatPeptide* peptides_;
+  const FlatPeptide* next_;
+  const FlatPeptide* end_;
+  const int32_t* mods_;
+};
+
+#endif // FLAT_PEPTIDES_H
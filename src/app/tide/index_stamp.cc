@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <vector>
+#ifdef _MSC_VER
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "index_stamp.h"
+
+// 64-bit FNV-1a
+static const uint64_t kFnvOffset = 14695981039346656037ULL;
+static const uint64_t kFnvPrime = 1099511628211ULL;
+
+static uint64_t Hash(uint64_t hash, const void* data, size_t size) {
+  const unsigned char* p = (const unsigned char*)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ p[i]) * kFnvPrime;
+  }
+  return hash;
+}
+
+bool IndexStamp(const string& pepix_filename, uint64_t* stamp) {
+  struct stat st;
+  if (stat(pepix_filename.c_str(), &st) != 0) {
+    return false;
+  }
+  uint64_t size = st.st_size;
+  FILE* f = fopen(pepix_filename.c_str(), "rb");
+  if (f == NULL) {
+    return false;
+  }
+  uint64_t hash = Hash(kFnvOffset, &size, sizeof(size));
+  vector<char> buf(kIndexStampSpan);
+  // The head, then the tail; they overlap in a small file, which is harmless.
+  size_t head = size < kIndexStampSpan ? (size_t)size : kIndexStampSpan;
+  bool ok = fread(&buf[0], 1, head, f) == head;
+  hash = Hash(hash, &buf[0], head);
+  if (ok && size > kIndexStampSpan) {
+    ok = fseek(f, -(long)kIndexStampSpan, SEEK_END) == 0 &&
+         fread(&buf[0], 1, kIndexStampSpan, f) == kIndexStampSpan;
+    hash = Hash(hash, &buf[0], kIndexStampSpan);
+  }
+  fclose(f);
+  *stamp = hash;
+  return ok;
+}
+
+uint64_t NewBuildId() {
+  static uint64_t count = 0;
+  uint64_t values[4] = { (uint64_t)time(NULL), (uint64_t)clock(),
+                         (uint64_t)getpid(), ++count };
+  return Hash(kFnvOffset, values, sizeof(values));
+}
@@ -0,0 +1,29 @@
+// An index stamp identifies one build of a pepix, so that the files written
+// alongside it (the mass index and histogram, and the flat, packed and peak
+// indexes) can tell when pepix has been rebuilt since they were written.
+// Checking only the size of pepix is not enough: an index rebuilt with other
+// settings can happen to be the same size.
+//
+// The stamp hashes the size of pepix together with its first and last
+// kIndexStampSpan bytes. The first of these hold the header, and every pepix
+// gets a fresh build_id in its header when it is written, so a rebuilt pepix
+// gets a new stamp even if its peptides are unchanged. Copying an index
+// directory keeps the stamp.
+
+#ifndef INDEX_STAMP_H
+#define INDEX_STAMP_H
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+const size_t kIndexStampSpan = 1 << 16;
+
+// Compute the stamp of pepix_filename. Returns false if it cannot be read.
+bool IndexStamp(const string& pepix_filename, uint64_t* stamp);
+
+// Return a build_id for the header of a pepix that is about to be written.
+uint64_t NewBuildId();
+
+#endif // INDEX_STAMP_H
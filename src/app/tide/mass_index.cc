@@ -0,0 +1,206 @@
+#include <math.h>
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "mass_index.h"
+#include "index_stamp.h"
+#include "peptides.pb.h"
+
+DEFINE_double(mass_index_step, 0.5, "Mass index interval, in Da.");
+DEFINE_int32(mass_index_records, 4096, "Maximum number of records between "
+                                       "mass index entries.");
+DEFINE_double(mass_histogram_bin, 0.01, "Mass histogram interval, in Da.");
+
+static bool IndexedFileSize(const string& filename,
+                            google::protobuf::int64* size) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  *size = st.st_size;
+  return true;
+}
+
+MassIndexBuilder::MassIndexBuilder()
+  : mass_step_(FLAGS_mass_index_step), record_step_(FLAGS_mass_index_records),
+    last_bin_(-1), since_last_(0) {
+}
+
+void MassIndexBuilder::Add(double mass, google::protobuf::int64 offset) {
+  long long bin = (long long)floor(mass / mass_step_);
+  if (entries_.empty() || bin != last_bin_ || ++since_last_ >= record_step_) {
+    entries_.push_back(make_pair(mass, offset));
+    last_bin_ = bin;
+    since_last_ = 0;
+  }
+}
+
+bool MassIndexBuilder::Write(const string& filename,
+                             const string& indexed_filename) const {
+  google::protobuf::int64 file_size;
+  uint64_t stamp;
+  if (!IndexedFileSize(indexed_filename, &file_size) ||
+      !IndexStamp(indexed_filename, &stamp)) {
+    return false;
+  }
+  pb::Header header;
+  header.set_file_type(pb::Header::MASS_INDEX);
+  pb::Header_MassIndexHeader* subheader = header.mutable_mass_index_header();
+  subheader->set_mass_step(mass_step_);
+  subheader->set_record_step(record_step_);
+  subheader->set_file_size(file_size);
+  subheader->set_index_stamp(stamp);
+  HeadedRecordWriter writer(filename, header);
+  if (!writer.OK()) {
+    return false;
+  }
+  pb::MassOffset entry;
+  for (MassIndex::const_iterator i = entries_.begin(); i != entries_.end(); ++i) {
+    entry.set_mass(i->first);
+    entry.set_offset(i->second);
+    if (!writer.Write(&entry)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReadMassIndex(const string& filename, const string& indexed_filename,
+                   MassIndex* mass_index) {
+  google::protobuf::int64 file_size;
+  uint64_t stamp;
+  if (!IndexedFileSize(indexed_filename, &file_size) ||
+      !IndexStamp(indexed_filename, &stamp)) {
+    return false;
+  }
+  pb::Header header;
+  HeadedRecordReader reader(filename, &header);
+  if (!reader.OK() || header.file_type() != pb::Header::MASS_INDEX ||
+      header.mass_index_header().file_size() != file_size ||
+      !header.mass_index_header().has_index_stamp() ||
+      header.mass_index_header().index_stamp() != stamp) {
+    carp(CARP_DEBUG, "Ignoring mass index %s", filename.c_str());
+    return false;
+  }
+  mass_index->clear();
+  pb::MassOffset entry;
+  while (!reader.Done()) {
+    if (!reader.Read(&entry)) {
+      mass_index->clear();
+      return false;
+    }
+    mass_index->push_back(make_pair(entry.mass(), entry.offset()));
+  }
+  return reader.OK();
+}
+
+MassHistogram::MassHistogram()
+  : bin_width_(FLAGS_mass_histogram_bin), targets_(0), decoys_(0) {
+}
+
+long long MassHistogram::Bin(double mass) const {
+  return (long long)floor(mass / bin_width_);
+}
+
+void MassHistogram::Add(double mass, bool decoy) {
+  long long bin = Bin(mass);
+  if (bins_.empty() || bin != bins_.back()) {
+    bins_.push_back(bin);
+    bin_targets_.push_back(0);
+    bin_decoys_.push_back(0);
+    cumulative_.push_back(cumulative_.empty() ? 0 : cumulative_.back());
+  }
+  if (decoy) {
+    ++bin_decoys_.back();
+    ++decoys_;
+  } else {
+    ++bin_targets_.back();
+    ++targets_;
+  }
+  ++cumulative_.back();
+}
+
+bool MassHistogram::Write(const string& filename,
+                          const string& counted_filename) const {
+  google::protobuf::int64 file_size;
+  uint64_t stamp;
+  if (!IndexedFileSize(counted_filename, &file_size) ||
+      !IndexStamp(counted_filename, &stamp)) {
+    return false;
+  }
+  pb::Header header;
+  header.set_file_type(pb::Header::MASS_HISTOGRAM);
+  pb::Header_MassHistogramHeader* subheader =
+    header.mutable_mass_histogram_header();
+  subheader->set_bin_width(bin_width_);
+  subheader->set_file_size(file_size);
+  subheader->set_index_stamp(stamp);
+  HeadedRecordWriter writer(filename, header);
+  if (!writer.OK()) {
+    return false;
+  }
+  pb::MassBin entry;
+  for (size_t i = 0; i < bins_.size(); ++i) {
+    entry.set_bin(bins_[i]);
+    entry.set_targets(bin_targets_[i]);
+    entry.set_decoys(bin_decoys_[i]);
+    if (!writer.Write(&entry)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MassHistogram::Read(const string& filename,
+                         const string& counted_filename) {
+  *this = MassHistogram();
+  google::protobuf::int64 file_size;
+  uint64_t stamp;
+  if (!IndexedFileSize(counted_filename, &file_size) ||
+      !IndexStamp(counted_filename, &stamp)) {
+    return false;
+  }
+  pb::Header header;
+  HeadedRecordReader reader(filename, &header);
+  if (!reader.OK() || header.file_type() != pb::Header::MASS_HISTOGRAM ||
+      header.mass_histogram_header().file_size() != file_size ||
+      !header.mass_histogram_header().has_index_stamp() ||
+      header.mass_histogram_header().index_stamp() != stamp ||
+      !(header.mass_histogram_header().bin_width() > 0)) {
+    carp(CARP_DEBUG, "Ignoring mass histogram %s", filename.c_str());
+    return false;
+  }
+  bin_width_ = header.mass_histogram_header().bin_width();
+  pb::MassBin entry;
+  while (!reader.Done()) {
+    if (!reader.Read(&entry) ||
+        (!bins_.empty() && entry.bin() <= bins_.back())) {
+      *this = MassHistogram();
+      return false;
+    }
+    bins_.push_back(entry.bin());
+    bin_targets_.push_back(entry.targets());
+    bin_decoys_.push_back(entry.decoys());
+    targets_ += entry.targets();
+    decoys_ += entry.decoys();
+    cumulative_.push_back(targets_ + decoys_);
+  }
+  if (!reader.OK()) {
+    *this = MassHistogram();
+    return false;
+  }
+  return true;
+}
+
+long long MassHistogram::Count(double min_mass, double max_mass) const {
+  if (bins_.empty() || max_mass < min_mass) {
+    return 0;
+  }
+  size_t first = lower_bound(bins_.begin(), bins_.end(), Bin(min_mass)) -
+                 bins_.begin();
+  size_t last = upper_bound(bins_.begin(), bins_.end(), Bin(max_mass)) -
+                bins_.begin();
+  if (last <= first) {
+    return 0;
+  }
+  return cumulative_[last - 1] - (first > 0 ? cumulative_[first - 1] : 0);
+}
@@ -0,0 +1,92 @@
+// A mass index is a small file written alongside a file of peptide records
+// sorted by mass (pepix). It lists the byte offsets of selected records
+// together with their masses: one entry whenever the mass passes into a new
+// interval of FLAGS_mass_index_step Da, and at least one entry every
+// FLAGS_mass_index_records records. With it, RecordReader::SeekToMass() can
+// skip over the part of the index lighter than a given mass without decoding
+// it.
+//
+// The mass index is itself a file of HeadedRecords, with a header of type
+// MASS_INDEX followed by one pb::MassOffset per entry. The header records the
+// size and the IndexStamp() (see index_stamp.h) of the indexed file, so that
+// an index left over from an older pepix is ignored rather than followed to
+// the wrong place.
+
+#ifndef MASS_INDEX_H
+#define MASS_INDEX_H
+
+#include <string>
+#include <vector>
+#include "records.h"
+
+using namespace std;
+
+class MassIndexBuilder {
+ public:
+  MassIndexBuilder();
+
+  // Call before writing each record, with the mass of the record and the
+  // writer's current offset.
+  void Add(double mass, google::protobuf::int64 offset);
+
+  // Write the collected entries to filename. indexed_filename is the file of
+  // records that has been indexed; it must be complete and closed.
+  bool Write(const string& filename, const string& indexed_filename) const;
+
+ private:
+  MassIndex entries_;
+  double mass_step_;
+  int record_step_;
+  long long last_bin_;
+  int since_last_;
+};
+
+// Read a mass index for indexed_filename into mass_index. Returns false if
+// the mass index is missing, unreadable, or does not match indexed_filename.
+bool ReadMassIndex(const string& filename, const string& indexed_filename,
+                   MassIndex* mass_index);
+
+// A mass histogram is another small file written alongside pepix. It counts
+// the target and decoy peptides in each FLAGS_mass_histogram_bin Da interval
+// of mass, so that tide-search can tell how many candidates a precursor
+// window holds before reading any peptides. Like the mass index, it is a file
+// of HeadedRecords, with a header of type MASS_HISTOGRAM followed by one
+// pb::MassBin per non-empty interval, and it records the size and the
+// IndexStamp() of the counted file.
+class MassHistogram {
+ public:
+  MassHistogram();
+
+  // Call for each record, in order of mass.
+  void Add(double mass, bool decoy);
+
+  // Write the histogram to filename. counted_filename is the file of records
+  // that has been counted; it must be complete and closed.
+  bool Write(const string& filename, const string& counted_filename) const;
+
+  // Replace the histogram with the one in filename. Returns false, leaving
+  // the histogram empty, if it is missing, unreadable, or does not match
+  // counted_filename.
+  bool Read(const string& filename, const string& counted_filename);
+
+  bool Empty() const { return bins_.empty(); }
+  long long Targets() const { return targets_; }
+  long long Decoys() const { return decoys_; }
+
+  // The number of peptides in the intervals that overlap
+  // [min_mass, max_mass].
+  long long Count(double min_mass, double max_mass) const;
+
+ private:
+  long long Bin(double mass) const;
+
+  double bin_width_;
+  vector<long long> bins_;  // non-empty bins, in increasing order
+  vector<long long> bin_targets_;
+  vector<long long> bin_decoys_;
+  vector<long long> cumulative_;  // peptides in bins_[0] through bins_[i]
+  long long targets_;
+  long long decoys_;
+};
+
+#endif // MASS_INDEX_H
@@ -0,0 +1,282 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <algorithm>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "packed_peptides.h"
+#include "index_stamp.h"
+#include "io/carp.h"
+
+static bool FileSize(const string& filename, uint64_t* size) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  *size = st.st_size;
+  return true;
+}
+
+static uint64_t MassBits(double mass) {
+  uint64_t bits;
+  memcpy(&bits, &mass, sizeof(bits));
+  return bits;
+}
+
+static double BitsMass(uint64_t bits) {
+  double mass;
+  memcpy(&mass, &bits, sizeof(mass));
+  return mass;
+}
+
+static uint32_t ZigZag(int32_t n) {
+  return ((uint32_t)n << 1) ^ (uint32_t)(n >> 31);
+}
+
+static int32_t UnZigZag(uint32_t n) {
+  return (int32_t)(n >> 1) ^ -(int32_t)(n & 1);
+}
+
+static void PutVarint(string* out, uint64_t n) {
+  while (n >= 0x80) {
+    out->push_back((char)(n | 0x80));
+    n >>= 7;
+  }
+  out->push_back((char)n);
+}
+
+// Returns false if the varint runs past end.
+static inline bool GetVarint(const unsigned char** p, const unsigned char* end,
+                             uint64_t* n) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+    unsigned char byte = *(*p)++;
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *n = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+PackedPeptideWriter::PackedPeptideWriter(const string& filename,
+                                         uint32_t block_peptides)
+  : filename_(filename), out_(NULL), block_size_(0), prev_mass_bits_(0),
+    prev_protein_id_(0) {
+  memset(&header_, 0, sizeof(header_));
+  memcpy(header_.magic, PACKED_INDEX_MAGIC, sizeof(header_.magic));
+  header_.block_peptides = block_peptides;
+  out_ = fopen(filename_.c_str(), "wb");
+  if (out_ == NULL || fwrite(&header_, sizeof(header_), 1, out_) != 1) {
+    carp(CARP_ERROR, "Could not create packed index %s", filename_.c_str());
+    if (out_ != NULL) {
+      fclose(out_);
+      out_ = NULL;
+    }
+  }
+}
+
+PackedPeptideWriter::~PackedPeptideWriter() {
+  if (out_ != NULL) {
+    fclose(out_);
+  }
+}
+
+bool PackedPeptideWriter::Write(const pb::Peptide& peptide) {
+  if (out_ == NULL || peptide.id() != (int64_t)header_.num_peptides ||
+      !(peptide.mass() >= 0.0)) {
+    return false;
+  }
+  uint64_t mass_bits = MassBits(peptide.mass());
+  if (block_size_ == 0) {
+    PackedBlock block;
+    memset(&block, 0, sizeof(block));
+    block.first_mass = peptide.mass();
+    directory_.push_back(block);
+    prev_mass_bits_ = mass_bits;
+    prev_protein_id_ = 0;
+  } else if (mass_bits < prev_mass_bits_) {
+    return false; // not sorted by mass
+  }
+  PutVarint(&block_, mass_bits - prev_mass_bits_);
+  prev_mass_bits_ = mass_bits;
+  PutVarint(&block_, peptide.length());
+  int32_t protein_id = peptide.first_location().protein_id();
+  PutVarint(&block_, ZigZag(protein_id - prev_protein_id_));
+  prev_protein_id_ = protein_id;
+  PutVarint(&block_, peptide.first_location().pos());
+  uint64_t flags = (uint64_t)peptide.modifications_size() << 2 |
+                   (peptide.has_aux_locations_index() ? 2 : 0) |
+                   (peptide.is_decoy() ? 1 : 0);
+  PutVarint(&block_, flags);
+  if (peptide.has_aux_locations_index()) {
+    PutVarint(&block_, peptide.aux_locations_index());
+  }
+  int32_t prev_mod = 0;
+  for (int i = 0; i < peptide.modifications_size(); ++i) {
+    PutVarint(&block_, ZigZag(peptide.modifications(i) - prev_mod));
+    prev_mod = peptide.modifications(i);
+  }
+  ++header_.num_peptides;
+  if (++block_size_ == header_.block_peptides) {
+    return FlushBlock();
+  }
+  return true;
+}
+
+bool PackedPeptideWriter::FlushBlock() {
+  if (block_size_ == 0) {
+    return true;
+  }
+  PackedBlock& block = directory_.back();
+  block.offset = ftell(out_);
+  block.num_bytes = block_.size();
+  bool ok = fwrite(block_.data(), 1, block_.size(), out_) == block_.size();
+  block_.clear();
+  block_size_ = 0;
+  return ok;
+}
+
+bool PackedPeptideWriter::Close(const string& pepix_filename) {
+  if (out_ == NULL || !FlushBlock() ||
+      !FileSize(pepix_filename, &header_.pepix_size) ||
+      !IndexStamp(pepix_filename, &header_.pepix_stamp)) {
+    return false;
+  }
+  header_.num_blocks = directory_.size();
+  header_.directory_offset = ftell(out_);
+  bool ok = directory_.empty() ||
+            fwrite(&directory_[0], sizeof(PackedBlock), directory_.size(),
+                   out_) == directory_.size();
+  // Now that the counts are known, rewrite the header.
+  ok = ok && fseek(out_, 0, SEEK_SET) == 0 &&
+       fwrite(&header_, sizeof(header_), 1, out_) == 1;
+  ok = (fclose(out_) == 0) && ok;
+  out_ = NULL;
+  return ok;
+}
+
+PackedPeptideReader::PackedPeptideReader(const string& filename,
+                                         const string& pepix_filename)
+  : map_(MAP_FAILED), map_size_(0), data_(NULL), directory_(NULL),
+    num_blocks_(0), block_peptides_(0), num_peptides_(0), block_(0),
+    next_(0) {
+  uint64_t file_size, pepix_size, pepix_stamp;
+  if (!FileSize(filename, &file_size) || !FileSize(pepix_filename, &pepix_size) ||
+      !IndexStamp(pepix_filename, &pepix_stamp) ||
+      file_size < sizeof(PackedIndexHeader)) {
+    return;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  map_size_ = (size_t)file_size;
+  map_ = mmap(0, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map_ == MAP_FAILED) {
+    carp(CARP_DEBUG, "Could not map packed index %s", filename.c_str());
+    return;
+  }
+  const PackedIndexHeader* header = (const PackedIndexHeader*)map_;
+  if (memcmp(header->magic, PACKED_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->pepix_size != pepix_size || header->pepix_stamp != pepix_stamp ||
+      header->block_peptides == 0 ||
+      header->num_blocks != (header->num_peptides + header->block_peptides - 1) /
+                            header->block_peptides ||
+      header->directory_offset < sizeof(PackedIndexHeader) ||
+      file_size != header->directory_offset +
+                   header->num_blocks * sizeof(PackedBlock)) {
+    carp(CARP_DEBUG, "Ignoring packed index %s", filename.c_str());
+    return;
+  }
+  data_ = (const char*)map_;
+  directory_ = (const PackedBlock*)(data_ + header->directory_offset);
+  num_blocks_ = header->num_blocks;
+  block_peptides_ = header->block_peptides;
+  num_peptides_ = header->num_peptides;
+}
+
+PackedPeptideReader::~PackedPeptideReader() {
+  if (map_ != MAP_FAILED) {
+    munmap(map_, map_size_);
+  }
+}
+
+void PackedPeptideReader::DecodeBlock(uint32_t b) {
+  const PackedBlock& block = directory_[b];
+  uint64_t first_id = (uint64_t)b * block_peptides_;
+  size_t count = min((uint64_t)block_peptides_, num_peptides_ - first_id);
+  const unsigned char* p = (const unsigned char*)data_ + block.offset;
+  const unsigned char* end = p + block.num_bytes;
+  if (block.offset + block.num_bytes > map_size_) {
+    end = p;
+  }
+  peptides_.resize(count);
+  mods_.clear();
+  uint64_t mass_bits = MassBits(block.first_mass);
+  int32_t protein_id = 0;
+  bool ok = true;
+  for (size_t i = 0; i < count && ok; ++i) {
+    FlatPeptide& peptide = peptides_[i];
+    uint64_t delta, length, protein_delta, pos, flags, aux = 0;
+    ok = GetVarint(&p, end, &delta) && GetVarint(&p, end, &length) &&
+         GetVarint(&p, end, &protein_delta) && GetVarint(&p, end, &pos) &&
+         GetVarint(&p, end, &flags) &&
+         (!(flags & 2) || GetVarint(&p, end, &aux));
+    mass_bits += delta;
+    protein_id += UnZigZag((uint32_t)protein_delta);
+    peptide.mass = BitsMass(mass_bits);
+    peptide.id = first_id + i;
+    peptide.length = length;
+    peptide.protein_id = protein_id;
+    peptide.pos = pos;
+    peptide.aux_locations_index = (flags & 2) ? (int32_t)aux : -1;
+    peptide.is_decoy = flags & 1;
+    peptide.first_mod = mods_.size();
+    peptide.num_mods = flags >> 2;
+    peptide.reserved = 0;
+    int32_t mod = 0;
+    for (int j = 0; j < peptide.num_mods && ok; ++j) {
+      uint64_t mod_delta;
+      ok = GetVarint(&p, end, &mod_delta);
+      mod += UnZigZag((uint32_t)mod_delta);
+      mods_.push_back(mod);
+    }
+  }
+  if (!ok) {
+    carp(CARP_FATAL, "Packed index is corrupt in block %u", b);
+  }
+  block_ = b + 1;
+  next_ = 0;
+}
+
+static bool PackedBlockLighter(const PackedBlock& block, double mass) {
+  return block.first_mass < mass;
+}
+
+void PackedPeptideReader::SeekToMass(double mass) {
+  // The last block starting below mass holds the first peptide at least as
+  // heavy, unless that is the first peptide of the following block.
+  uint32_t b = lower_bound(directory_ + block_, directory_ + num_blocks_,
+                           mass, PackedBlockLighter) - directory_;
+  if (b > block_) {
+    DecodeBlock(b - 1);
+  }
+  while (!Done()) {
+    if (next_ == peptides_.size()) {
+      DecodeBlock(block_);
+    }
+    if (peptides_[next_].mass >= mass) {
+      return;
+    }
+    ++next_;
+  }
+}
@@ -0,0 +1,136 @@
+// A packed peptide index is a compact encoding of the peptides in pepix,
+// written by tide-index when packed-index=T. A pepix record spends a full
+// double on the mass, a varint on the id and a nested Location on every
+// peptide, and the flat index (see flat_peptides.h) spends 48 bytes on each.
+// The packed index instead groups the peptides into blocks and, within a
+// block, stores each field as a varint relative to what precedes it:
+//
+//  - masses are sorted and non-negative, so the bit patterns of successive
+//    masses only grow; each mass is stored as the difference of its bits from
+//    those of the previous mass, which is exact and usually small (zero for
+//    peptides of equal mass).
+//  - ids are implicit: as in pepix, a peptide's id is its position.
+//  - protein ids are stored as the zigzag difference from the previous one.
+//  - mods are stored as zigzag differences from the previous mod of the same
+//    peptide.
+//
+// Blocks decode with shifts and adds only, a block at a time, into
+// FlatPeptides, so tide-search reads the packed index exactly as it would a
+// flat one. A directory of the first mass of each block lets SeekToMass()
+// skip blocks without decoding them.
+//
+// Layout (native byte order):
+//
+//    PackedIndexHeader
+//    blocks                      block_peptides peptides each, except the last
+//    PackedBlock[num_blocks]     at directory_offset
+//
+// As with the flat index, pepix remains the primary index, the header records
+// the size and the IndexStamp() of the pepix it was written with, and a packed
+// index that does not match is ignored.
+
+#ifndef PACKED_PEPTIDES_H
+#define PACKED_PEPTIDES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "flat_peptides.h"
+
+using namespace std;
+
+#define PACKED_INDEX_MAGIC "TIDEPAK2"
+
+struct PackedIndexHeader {
+  char magic[8];
+  uint32_t block_peptides;
+  uint32_t num_blocks;
+  uint64_t num_peptides;
+  uint64_t directory_offset;
+  uint64_t pepix_size;
+  uint64_t pepix_stamp;
+};
+
+struct PackedBlock {
+  double first_mass;
+  uint64_t offset;
+  uint32_t num_bytes;
+  uint32_t reserved;
+};
+
+class PackedPeptideWriter {
+ public:
+  explicit PackedPeptideWriter(const string& filename,
+                               uint32_t block_peptides = 1024);
+  ~PackedPeptideWriter();
+
+  bool OK() const { return out_ != NULL; }
+
+  // Peptides must be written in pepix order, and their ids must be their
+  // positions in pepix.
+  bool Write(const pb::Peptide& peptide);
+
+  // Finish the file. pepix_filename must already be complete and closed.
+  bool Close(const string& pepix_filename);
+
+ private:
+  bool FlushBlock();
+
+  string filename_;
+  FILE* out_;
+  PackedIndexHeader header_;
+  vector<PackedBlock> directory_;
+  string block_;           // encoded peptides of the current block
+  uint32_t block_size_;    // number of peptides in block_
+  uint64_t prev_mass_bits_;
+  int32_t prev_protein_id_;
+};
+
+class PackedPeptideReader : public FlatPeptideSource {
+ public:
+  // Map filename read-only. OK() is false if filename does not exist, is not
+  // a packed index, or was not written for pepix_filename.
+  PackedPeptideReader(const string& filename, const string& pepix_filename);
+  ~PackedPeptideReader();
+
+  bool OK() const { return directory_ != NULL; }
+
+  bool Done() const {
+    return next_ == peptides_.size() && block_ == num_blocks_;
+  }
+
+  const FlatPeptide* Next() {
+    if (next_ == peptides_.size()) {
+      DecodeBlock(block_);
+    }
+    return &peptides_[next_++];
+  }
+
+  const int32_t* Mods(const FlatPeptide* peptide) const {
+    return mods_.empty() ? NULL : &mods_[peptide->first_mod];
+  }
+
+  void SeekToMass(double mass);
+
+  uint64_t Size() const { return num_peptides_; }
+
+ private:
+  // Replace the decoded peptides with those of block b, and move to its first.
+  void DecodeBlock(uint32_t b);
+
+  void* map_;
+  size_t map_size_;
+  const char* data_;
+  const PackedBlock* directory_;
+  uint32_t num_blocks_;
+  uint32_t block_peptides_;
+  uint64_t num_peptides_;
+
+  uint32_t block_;  // next block to decode
+  vector<FlatPeptide> peptides_;  // of block_ - 1
+  vector<int32_t> mods_;
+  size_t next_;
+};
+
+#endif // PACKED_PEPTIDES_H
@@ -0,0 +1,199 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <io.h>
+#include "mman.h"
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "peak_index.h"
+#include "index_stamp.h"
+#include "mass_constants.h"
+#include "max_mz.h"
+#include "io/carp.h"
+
+static bool FileSize(const string& filename, uint64_t* size) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  *size = st.st_size;
+  return true;
+}
+
+PeakIndexWriter::PeakIndexWriter(const string& filename, double bin_width,
+                                 double bin_offset)
+  : filename_(filename), peaks_filename_(filename + ".codes.tmp"),
+    out_(NULL), peaks_out_(NULL) {
+  memset(&header_, 0, sizeof(header_));
+  memcpy(header_.magic, PEAK_INDEX_MAGIC, sizeof(header_.magic));
+  header_.record_size = sizeof(PeakList);
+  header_.bin_width = bin_width;
+  header_.bin_offset = bin_offset;
+  out_ = fopen(filename_.c_str(), "wb");
+  peaks_out_ = fopen(peaks_filename_.c_str(), "wb");
+  if (out_ == NULL || peaks_out_ == NULL ||
+      fwrite(&header_, sizeof(header_), 1, out_) != 1) {
+    carp(CARP_ERROR, "Could not create peak index %s", filename_.c_str());
+    if (out_ != NULL) {
+      fclose(out_);
+      out_ = NULL;
+    }
+  }
+}
+
+PeakIndexWriter::~PeakIndexWriter() {
+  if (out_ != NULL) {
+    fclose(out_);
+  }
+  if (peaks_out_ != NULL) {
+    fclose(peaks_out_);
+  }
+  remove(peaks_filename_.c_str());
+}
+
+bool PeakIndexWriter::Write(const pb::Peptide& peptide,
+                            const TheoreticalPeakArr* peaks) {
+  if (out_ == NULL || peptide.id() != (int)header_.num_peptides) {
+    return false;
+  }
+  PeakList record;
+  memset(&record, 0, sizeof(record));
+  record.first_peak = header_.num_peaks;
+  record.num_peaks1 = peaks[0].size();
+  record.num_peaks2 = peaks[1].size();
+  for (int charge = 0; charge < 2; ++charge) {
+    for (int i = 0; i < peaks[charge].size(); ++i) {
+      int32_t code = peaks[charge][i].Code();
+      if (fwrite(&code, sizeof(code), 1, peaks_out_) != 1) {
+        return false;
+      }
+    }
+  }
+  header_.num_peaks += record.num_peaks1 + record.num_peaks2;
+  ++header_.num_peptides;
+  return fwrite(&record, sizeof(record), 1, out_) == 1;
+}
+
+bool PeakIndexWriter::Close(const string& pepix_filename) {
+  if (out_ == NULL || !FileSize(pepix_filename, &header_.pepix_size) ||
+      !IndexStamp(pepix_filename, &header_.pepix_stamp)) {
+    return false;
+  }
+  // Append the staged peak codes after the peak lists.
+  fclose(peaks_out_);
+  peaks_out_ = fopen(peaks_filename_.c_str(), "rb");
+  if (peaks_out_ == NULL) {
+    return false;
+  }
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), peaks_out_)) > 0) {
+    if (fwrite(buf, 1, n, out_) != n) {
+      return false;
+    }
+  }
+  // Now that the counts are known, rewrite the header.
+  bool ok = fseek(out_, 0, SEEK_SET) == 0 &&
+            fwrite(&header_, sizeof(header_), 1, out_) == 1;
+  ok = (fclose(out_) == 0) && ok;
+  out_ = NULL;
+  return ok;
+}
+
+PeakIndexReader::PeakIndexReader(const string& filename,
+                                 const string& pepix_filename,
+                                 double bin_width, double bin_offset)
+  : map_(MAP_FAILED), map_size_(0), lists_(NULL), peaks_(NULL),
+    num_peptides_(0), cache_bin_end_(-1), covers_(false) {
+  uint64_t file_size, pepix_size, pepix_stamp;
+  if (!FileSize(filename, &file_size) || !FileSize(pepix_filename, &pepix_size) ||
+      !IndexStamp(pepix_filename, &pepix_stamp) ||
+      file_size < sizeof(PeakIndexHeader)) {
+    return;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  map_size_ = (size_t)file_size;
+  map_ = mmap(0, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map_ == MAP_FAILED) {
+    carp(CARP_DEBUG, "Could not map peak index %s", filename.c_str());
+    return;
+  }
+  const PeakIndexHeader* header = (const PeakIndexHeader*)map_;
+  if (memcmp(header->magic, PEAK_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->record_size != sizeof(PeakList) ||
+      header->pepix_size != pepix_size ||
+      header->pepix_stamp != pepix_stamp ||
+      file_size != sizeof(PeakIndexHeader) +
+                   header->num_peptides * sizeof(PeakList) +
+                   header->num_peaks * sizeof(int32_t)) {
+    carp(CARP_DEBUG, "Ignoring peak index %s", filename.c_str());
+    return;
+  }
+  if (header->bin_width != bin_width || header->bin_offset != bin_offset) {
+    carp(CARP_DEBUG, "Ignoring peak index %s, which was written for "
+         "mz-bin-width=%g and mz-bin-offset=%g", filename.c_str(),
+         header->bin_width, header->bin_offset);
+    return;
+  }
+  lists_ = (const PeakList*)(header + 1);
+  num_peptides_ = header->num_peptides;
+  peaks_ = (const int32_t*)(lists_ + num_peptides_);
+}
+
+PeakIndexReader::~PeakIndexReader() {
+  if (map_ != MAP_FAILED) {
+    munmap(map_, map_size_);
+  }
+}
+
+bool PeakIndexReader::ReadBins(const string& filename, double* bin_width,
+                               double* bin_offset) {
+  FILE* in = fopen(filename.c_str(), "rb");
+  if (in == NULL) {
+    return false;
+  }
+  PeakIndexHeader header;
+  bool ok = fread(&header, sizeof(header), 1, in) == 1 &&
+            memcmp(header.magic, PEAK_INDEX_MAGIC, sizeof(header.magic)) == 0;
+  fclose(in);
+  if (ok) {
+    *bin_width = header.bin_width;
+    *bin_offset = header.bin_offset;
+  }
+  return ok;
+}
+
+bool PeakIndexReader::Find(int id, const int32_t** peaks, int* num_peaks1,
+                           int* num_peaks2) {
+  if (id < 0 || (uint64_t)id >= num_peptides_ || !Covers()) {
+    return false;
+  }
+  const PeakList& list = lists_[id];
+  *peaks = peaks_ + list.first_peak;
+  *num_peaks1 = list.num_peaks1;
+  *num_peaks2 = list.num_peaks2;
+  return true;
+}
+
+bool PeakIndexReader::Covers() {
+  int end = MaxBin::Global().CacheBinEnd();
+  if (end != cache_bin_end_) {
+    cache_bin_end_ = end;
+    // The lightest ion skipped for charge 1 is heavier than end, and the
+    // lightest for charge 2 is heavier than end*2 + 2; see Peptide::AddIons().
+    covers_ = MaxBin::Global().MaxBinEnd() <= 0 ||
+      (MassConstants::mass2bin(end + MassConstants::B + MassConstants::proton,
+                               1) >= (unsigned int)end &&
+       MassConstants::mass2bin(end*2 + 2 + MassConstants::B +
+                               MassConstants::proton, 2) >= (unsigned int)end);
+  }
+  return covers_;
+}
@@ -0,0 +1,122 @@
+// A peak index is an optional file written alongside pepix by tide-index when
+// peak-index=T. It holds the binned theoretical B and Y ion peaks of every
+// peptide in pepix, as ActivePeptideQueue would otherwise compute them at
+// search time, for the mz-bin-width and mz-bin-offset given to tide-index.
+// tide-search reads the peaks from here and only compiles them into its dot
+// product programs, provided that it is searching with the same bin width and
+// offset; otherwise, it ignores the file and computes the peaks as usual.
+//
+// Layout (native byte order):
+//
+//    PeakIndexHeader
+//    PeakList[num_peptides]      in pepix order; the peptide with id i owns
+//                                PeakList i
+//    int32_t[num_peaks]          peak codes (see TheoreticalPeakPair::Code());
+//                                peptide p owns the num_peaks1 charge 1 peaks
+//                                from p.first_peak, followed by its
+//                                num_peaks2 charge 2 peaks
+//
+// The peaks are stored for the full m/z range. At search time they are cut
+// off at MaxBin::Global().CacheBinEnd() when compiled, as computed peaks are.
+// As with the flat index (see flat_peptides.h), the header records the size and
+// the IndexStamp() of the pepix it was written with, and a peak index that
+// does not match is ignored.
+
+#ifndef PEAK_INDEX_H
+#define PEAK_INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "peptides.pb.h"
+#include "theoretical_peak_pair.h"
+
+using namespace std;
+
+#define PEAK_INDEX_MAGIC "TIDEPKS2"
+
+struct PeakIndexHeader {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t reserved;
+  double bin_width;
+  double bin_offset;
+  uint64_t num_peptides;
+  uint64_t num_peaks;
+  uint64_t pepix_size;
+  uint64_t pepix_stamp;
+};
+
+struct PeakList {
+  uint64_t first_peak;
+  int32_t num_peaks1;
+  int32_t num_peaks2;
+};
+
+class PeakIndexWriter {
+ public:
+  // Peak codes are staged in a temporary file next to filename and appended
+  // when the writer is closed.
+  PeakIndexWriter(const string& filename, double bin_width, double bin_offset);
+  ~PeakIndexWriter();
+
+  bool OK() const { return out_ != NULL; }
+
+  // Peptides must be written in pepix order, and their ids must be their
+  // positions in pepix. peaks holds the charge 1 and charge 2 peaks, as
+  // returned by TheoreticalPeakSetBYSparse::GetPeaks().
+  bool Write(const pb::Peptide& peptide, const TheoreticalPeakArr* peaks);
+
+  // Finish the file. pepix_filename must already be complete and closed.
+  bool Close(const string& pepix_filename);
+
+ private:
+  string filename_;
+  string peaks_filename_;
+  FILE* out_;
+  FILE* peaks_out_;
+  PeakIndexHeader header_;
+};
+
+class PeakIndexReader {
+ public:
+  // Map filename read-only. OK() is false if filename does not exist, is not
+  // a peak index, was not written for pepix_filename, or was written for a
+  // different bin width or offset.
+  PeakIndexReader(const string& filename, const string& pepix_filename,
+                  double bin_width, double bin_offset);
+  ~PeakIndexReader();
+
+  bool OK() const { return lists_ != NULL; }
+
+  // Get the bin width and offset that the peak index filename was written
+  // for. Returns false if filename does not exist or is not a peak index.
+  static bool ReadBins(const string& filename, double* bin_width,
+                       double* bin_offset);
+
+  // Point *peaks at the stored peaks of the peptide with the given id.
+  // Returns false if the peptide is not in the index, or if the stored peaks
+  // cannot stand in for computed ones under the current
+  // MaxBin::Global(); see Covers().
+  bool Find(int id, const int32_t** peaks, int* num_peaks1,
+            int* num_peaks2);
+
+ private:
+  // Peptide::ComputeTheoreticalPeaks() stops adding ions once their mass
+  // passes MaxBin::Global().CacheBinEnd(). The stored peaks have no such cut,
+  // so they give the same programs only if every ion so skipped would have
+  // fallen beyond the end of the cache anyway. That holds for all usual bin
+  // widths, but not for very wide bins.
+  bool Covers();
+
+  void* map_;
+  size_t map_size_;
+  const PeakList* lists_;
+  const int32_t* peaks_;
+  uint64_t num_peptides_;
+  // Covers() for the MaxBin::Global().CacheBinEnd() last checked
+  int cache_bin_end_;
+  bool covers_;
+};
+
+#endif // PEAK_INDEX_H
@@ -0,0 +1,129 @@
+#include "peak_scorer.h"
+#include "peptide.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PEAK_SCORER_X86 1
+#include <immintrin.h>
+#endif
+
+PeakScorer::Backend PeakScorer::backend_ = PeakScorer::JIT;
+
+bool PeakScorer::ParseBackend(const string& name, Backend* backend) {
+  if (name == "jit") {
+    *backend = JIT;
+  } else if (name == "simd") {
+    *backend = SIMD;
+  } else if (name == "check") {
+    *backend = CHECK;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Sums are unsigned so that they wrap exactly as the compiled 32-bit adds do.
+typedef unsigned int (*DotFunction)(const int* cache, const int* peaks,
+                                    int num_peaks);
+
+static unsigned int DotScalar(const int* cache, const int* peaks,
+                              int num_peaks) {
+  unsigned int sum = 0;
+  for (int i = 0; i < num_peaks; ++i) {
+    sum += (unsigned int)cache[peaks[i]];
+  }
+  return sum;
+}
+
+#ifdef PEAK_SCORER_X86
+__attribute__((target("avx2")))
+static unsigned int DotAVX2(const int* cache, const int* peaks,
+                            int num_peaks) {
+  __m256i sum = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= num_peaks; i += 8) {
+    __m256i index = _mm256_loadu_si256((const __m256i*)(peaks + i));
+    sum = _mm256_add_epi32(sum, _mm256_i32gather_epi32(cache, index, 4));
+  }
+  __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                               _mm256_extracti128_si256(sum, 1));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+  half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+  unsigned int total = (unsigned int)_mm_cvtsi128_si32(half);
+  for (; i < num_peaks; ++i) {
+    total += (unsigned int)cache[peaks[i]];
+  }
+  return total;
+}
+
+__attribute__((target("avx512f")))
+static unsigned int DotAVX512(const int* cache, const int* peaks,
+                              int num_peaks) {
+  __m512i sum = _mm512_setzero_si512();
+  int i = 0;
+  for (; i + 16 <= num_peaks; i += 16) {
+    __m512i index = _mm512_loadu_si512((const void*)(peaks + i));
+    sum = _mm512_add_epi32(sum, _mm512_i32gather_epi32(index, cache, 4));
+  }
+  if (i < num_peaks) {
+    // Masked-off lanes neither load an index nor gather.
+    __mmask16 mask = (__mmask16)((1u << (num_peaks - i)) - 1);
+    __m512i index = _mm512_maskz_loadu_epi32(mask, peaks + i);
+    sum = _mm512_add_epi32(sum, _mm512_mask_i32gather_epi32(
+      _mm512_setzero_si512(), mask, index, cache, 4));
+  }
+  return (unsigned int)_mm512_reduce_add_epi32(sum);
+}
+#endif
+
+static DotFunction ChooseDot(const char** name) {
+#ifdef PEAK_SCORER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    *name = "avx512";
+    return DotAVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return DotAVX2;
+  }
+#endif
+  *name = "scalar";
+  return DotScalar;
+}
+
+static const char* dot_name = NULL;
+static DotFunction dot = ChooseDot(&dot_name);
+
+const char* PeakScorer::InstructionSet() {
+  return dot_name;
+}
+
+void PeakScorer::Score(deque<Peptide*>::const_iterator begin,
+                       int num_peptides, int charge, const int* cache,
+                       pair<int, int>* results) {
+  for (int i = 0; i < num_peptides; ++i, ++begin) {
+    int num_peaks;
+    const int* peaks = (*begin)->Peaks(charge, &num_peaks);
+    results[i].first = (int)dot(cache, peaks, num_peaks);
+    results[i].second = num_peptides - i;
+  }
+}
+
+void PeakScorer::ScoreBatch(deque<Peptide*>::const_iterator begin,
+                            int num_peptides, int num_spectra,
+                            const int* offsets, const int* sizes,
+                            const int* charges, const int* const* caches,
+                            pair<int, int>* const* results) {
+  for (int p = 0; p < num_peptides; ++p, ++begin) {
+    for (int k = 0; k < num_spectra; ++k) {
+      int i = p - offsets[k];
+      if (i < 0 || i >= sizes[k]) {
+        continue;
+      }
+      int num_peaks;
+      const int* peaks = (*begin)->Peaks(charges[k], &num_peaks);
+      results[k][i].first = (int)dot(caches[k], peaks, num_peaks);
+      results[k][i].second = sizes[k] - i;
+    }
+  }
+}
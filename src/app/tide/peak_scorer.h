@@ -0,0 +1,68 @@
+// PeakScorer takes the dot products of candidate peptides with an observed
+// spectrum without generated code. It is an alternative to the compiled
+// programs described in compiler.h.
+//
+// Each Peptide may keep, besides or instead of its compiled programs, the
+// list of cache indices its programs would add together (see
+// Peptide::Peaks()). PeakScorer sums the corresponding cache entries with
+// SIMD gathers, choosing the widest instruction set the CPU supports at run
+// time, and writes (score, counter) pairs in the same layout as the compiled
+// programs. Scores are 32-bit integer sums, so they match the compiled
+// programs bit for bit.
+//
+// The backend is process-wide and must be set before any ActivePeptideQueue
+// is created, since it decides whether the queue compiles programs, keeps
+// peak lists, or both:
+//
+//    JIT     compiled programs only (the default)
+//    SIMD    peak lists only; no executable memory is mapped
+//    CHECK   both, with every vector score checked against the compiled one
+
+#ifndef PEAK_SCORER_H
+#define PEAK_SCORER_H
+
+#include <deque>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+class Peptide;
+
+class PeakScorer {
+ public:
+  enum Backend { JIT, SIMD, CHECK };
+
+  static void SetBackend(Backend backend) { backend_ = backend; }
+  static Backend GetBackend() { return backend_; }
+
+  // Returns false if name is not one of "jit", "simd", or "check".
+  static bool ParseBackend(const string& name, Backend* backend);
+
+  static bool UseCompiledPrograms() { return backend_ != SIMD; }
+  static bool UsePeakLists() { return backend_ != JIT; }
+
+  // Name of the instruction set used by Score(), e.g. "avx2".
+  static const char* InstructionSet();
+
+  // Score the num_peptides peptides starting at begin against cache, for the
+  // given charge. results[i] gets (score, num_peptides - i), as written by
+  // the compiled programs.
+  static void Score(deque<Peptide*>::const_iterator begin, int num_peptides,
+                    int charge, const int* cache, pair<int, int>* results);
+
+  // Score several spectra against one run of num_peptides peptides starting
+  // at begin, visiting each peptide's peaks once for all of them. Spectrum k
+  // takes peptides [offsets[k], offsets[k] + sizes[k]) of the run, and
+  // results[k] is filled as Score() would fill it for those peptides.
+  static void ScoreBatch(deque<Peptide*>::const_iterator begin,
+                         int num_peptides, int num_spectra,
+                         const int* offsets, const int* sizes,
+                         const int* charges, const int* const* caches,
+                         pair<int, int>* const* results);
+
+ private:
+  static Backend backend_;
+};
+
+#endif // PEAK_SCORER_H
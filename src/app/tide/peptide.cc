@@ -176,7 +176,6 @@ void DisAsm(const void* prog) {
 #endif
 
 void Peptide::Compile(const TheoreticalPeakArr* peaks,
-                      const pb::Peptide& pb_peptide,
                       TheoreticalPeakCompiler* compiler_prog1,
                       TheoreticalPeakCompiler* compiler_prog2) {
   int pos_size = peaks[0].size();
@@ -204,6 +203,27 @@ void Peptide::Compile(const TheoreticalPeakArr* peaks,
 //	exit(1);  
 }
 
+void Peptide::KeepPeaks(const TheoreticalPeakArr* peaks,
+                        FifoAllocator* fifo_alloc_peaks) {
+  // Keep the same peaks, in the same order, as Compile(); see
+  // TheoreticalPeakCompiler::AddPositive().
+  int end = MaxBin::Global().CacheBinEnd() * NUM_PEAK_TYPES;
+  peaks_ = (int*) fifo_alloc_peaks->New(
+    sizeof(peaks_[0]) * (peaks[0].size() + peaks[1].size()));
+  int n = 0;
+  for (int charge = 0; charge < 2; ++charge) {
+    for (int i = 0; i < peaks[charge].size(); ++i) {
+      if (peaks[charge][i].Code() < end) {
+        peaks_[n++] = peaks[charge][i].Code();
+      }
+    }
+    if (charge == 0) {
+      num_peaks1_ = n;
+    }
+  }
+  num_peaks2_ = n;
+}
+
 void Peptide::ComputeTheoreticalPeaks(TheoreticalPeakSet* workspace) const {
   AddIons<TheoreticalPeakSet>(workspace);   // Generic workspace
 #ifdef DEBUG
@@ -222,18 +242,38 @@ void Peptide::ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
                                       const pb::Peptide& pb_peptide,
                                       TheoreticalPeakCompiler* compiler_prog1,
                                       TheoreticalPeakCompiler* compiler_prog2) {
+  // The stored peak diffs in pb_peptide are not used; see Compile().
+  ComputeTheoreticalPeaks(workspace, compiler_prog1, compiler_prog2);
+}
+
+void Peptide::ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
+                                      TheoreticalPeakCompiler* compiler_prog1,
+                                      TheoreticalPeakCompiler* compiler_prog2,
+                                      FifoAllocator* fifo_alloc_peaks) {
   // Search-time fast workspace
   AddIons<ST_TheoreticalPeakSet>(workspace);
+  CompileTheoreticalPeaks(workspace, compiler_prog1, compiler_prog2,
+                          fifo_alloc_peaks);
+}
 
+void Peptide::CompileTheoreticalPeaks(const ST_TheoreticalPeakSet* workspace,
+                                      TheoreticalPeakCompiler* compiler_prog1,
+                                      TheoreticalPeakCompiler* compiler_prog2,
+                                      FifoAllocator* fifo_alloc_peaks) {
 #if 0
   TheoreticalPeakArr peaks[2];
   peaks[0].Init(2000);
   peaks[1].Init(2000);
   workspace->GetPeaks(&peaks[0], NULL, &peaks[1], NULL, NULL);
-  Compile(peaks, pb_peptide, compiler_prog1, compiler_prog2);
+  Compile(peaks, compiler_prog1, compiler_prog2);
 #endif
 
-  Compile(workspace->GetPeaks(), pb_peptide, compiler_prog1, compiler_prog2);
+  if (compiler_prog1 != NULL) {
+    Compile(workspace->GetPeaks(), compiler_prog1, compiler_prog2);
+  }
+  if (fifo_alloc_peaks != NULL) {
+    KeepPeaks(workspace->GetPeaks(), fifo_alloc_peaks);
+  }
 #ifdef DEBUG
   if (Id() == FLAGS_debug_peptide_id) {
     cout << "Prog1:" << endl;
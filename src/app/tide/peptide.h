@@ -29,6 +29,8 @@
 #include "peptides.pb.h"
 #include "theoretical_peak_pair.h"
 #include "fifo_alloc.h"
+#include "flat_peptides.h"
+#include "protein_arena.h"
 #include "mod_coder.h"
 #include "sp_scorer.h"
 
@@ -57,6 +59,15 @@ typedef TheoreticalPeakSetBYSparse ST_TheoreticalPeakSet; // ST="search time"
 
 class TheoreticalPeakCompiler;
 
+// Amino acid sequence of a protein, as held at indexing time (pb::Protein) or
+// at search time (ProteinView; see protein_arena.h).
+inline const char* ProteinResidues(const pb::Protein* protein) {
+  return protein->residues().data();
+}
+inline const char* ProteinResidues(const ProteinView* protein) {
+  return protein->residues();
+}
+
 // BIG CAUTION: At search time, you CANNOT expect even the IMPLICIT destructor
 // to get called!! We actually RELY on the fact that when we use FIFO
 // allocation, the destructor won't get called. We expect the destructor to 
@@ -67,8 +78,10 @@ class Peptide {
  public:
   // The proteins parameter is presumed to live in memory all the while the
   // Peptide exists, so that residues_ can refer to the amino acid sequence.
+  // Protein may be pb::Protein or ProteinView.
+  template<class Protein>
   Peptide(const pb::Peptide& peptide,
-          const vector<const pb::Protein*>& proteins,
+          const vector<const Protein*>& proteins,
           FifoAllocator* fifo_alloc = NULL)
     : len_(peptide.length()), mass_(peptide.mass()), id_(peptide.id()),
     first_loc_protein_id_(peptide.first_location().protein_id()),
@@ -76,9 +89,9 @@ class Peptide {
     has_aux_locations_index_(peptide.has_aux_locations_index()),
     aux_locations_index_(peptide.aux_locations_index()),
     mods_(NULL), num_mods_(0), decoy_(peptide.is_decoy()),
-    prog1_(NULL), prog2_(NULL) {
+    prog1_(NULL), prog2_(NULL), peaks_(NULL), num_peaks1_(0), num_peaks2_(0) {
     // Set residues_ by pointing to the first occurrence in proteins.
-    residues_ = proteins[first_loc_protein_id_]->residues().data() 
+    residues_ = ProteinResidues(proteins[first_loc_protein_id_])
                     + first_loc_pos_;
     if (peptide.modifications_size() > 0) {
       num_mods_ = peptide.modifications_size();
@@ -91,6 +104,34 @@ class Peptide {
         mods_[i] = ModCoder::Mod(peptide.modifications(i));
     }
   }
+
+  // As above, but from a record of a flat index (see flat_peptides.h), with
+  // mods pointing at its modifications.
+  template<class Protein>
+  Peptide(const FlatPeptide& peptide, const int32_t* mods,
+          const vector<const Protein*>& proteins,
+          FifoAllocator* fifo_alloc = NULL)
+    : len_(peptide.length), mass_(peptide.mass), id_(peptide.id),
+    first_loc_protein_id_(peptide.protein_id),
+    first_loc_pos_(peptide.pos),
+    has_aux_locations_index_(peptide.aux_locations_index >= 0),
+    aux_locations_index_(has_aux_locations_index_ ?
+                         peptide.aux_locations_index : 0),
+    mods_(NULL), num_mods_(0), decoy_(peptide.is_decoy != 0),
+    prog1_(NULL), prog2_(NULL), peaks_(NULL), num_peaks1_(0), num_peaks2_(0) {
+    residues_ = ProteinResidues(proteins[first_loc_protein_id_])
+                    + first_loc_pos_;
+    if (peptide.num_mods > 0) {
+      num_mods_ = peptide.num_mods;
+      if (fifo_alloc) {
+        mods_ = (ModCoder::Mod*) fifo_alloc->New(sizeof(mods_[0]) * num_mods_);
+      } else {
+        mods_ = new ModCoder::Mod[num_mods_];
+      }
+      for (int i = 0; i < num_mods_; ++i)
+        mods_[i] = ModCoder::Mod(mods[i]);
+    }
+  }
   class spectrum_matches {
    public:
       spectrum_matches(Spectrum* spectrum, double score1, double score2,
@@ -175,6 +216,20 @@ class Peptide {
                                const pb::Peptide& pb_peptide,
                                TheoreticalPeakCompiler* compiler_prog1,
                                TheoreticalPeakCompiler* compiler_prog2);
+  // The same, for a Peptide constructed without a pb::Peptide. The compilers
+  // may be NULL, in which case no programs are generated. If fifo_alloc_peaks
+  // is given, the peak lists for PeakScorer (see peak_scorer.h) are kept
+  // there.
+  void ComputeTheoreticalPeaks(ST_TheoreticalPeakSet* workspace,
+                               TheoreticalPeakCompiler* compiler_prog1,
+                               TheoreticalPeakCompiler* compiler_prog2,
+                               FifoAllocator* fifo_alloc_peaks = NULL);
+  // As above, but with the peaks already in workspace, as loaded from a peak
+  // index (see peak_index.h) rather than computed.
+  void CompileTheoreticalPeaks(const ST_TheoreticalPeakSet* workspace,
+                               TheoreticalPeakCompiler* compiler_prog1,
+                               TheoreticalPeakCompiler* compiler_prog2,
+                               FifoAllocator* fifo_alloc_peaks = NULL);
   void ComputeBTheoreticalPeaks(TheoreticalPeakSetBIons* workspace) const;
 
   // Return the appropriate program depending on the precursor charge.
@@ -183,6 +238,12 @@ class Peptide {
     return max_charge <= 2 ? prog1_ : prog2_;
   }
 
+  // Return the cache indices summed by Prog(max_charge), if they were kept.
+  const int* Peaks(int max_charge, int* num_peaks) const {
+    *num_peaks = max_charge <= 2 ? num_peaks1_ : num_peaks2_;
+    return peaks_;
+  }
+
   void ReleaseFifo(FifoAllocator* fifo_alloc_prog1,
        FifoAllocator* fifo_alloc_prog2) {
     // TODO 258: this code should probably move to ActivePeptideQueue
@@ -218,9 +279,10 @@ class Peptide {
   template<class W> void AddBIonsOnly(W* workspace) const;
 
   void Compile(const TheoreticalPeakArr* peaks,
-               const pb::Peptide& pb_peptide,
                TheoreticalPeakCompiler* compiler_prog1,
                TheoreticalPeakCompiler* compiler_prog2);
+  void KeepPeaks(const TheoreticalPeakArr* peaks,
+                 FifoAllocator* fifo_alloc_peaks);
           
 
   void Show();
@@ -239,6 +301,13 @@ class Peptide {
 
   void* prog1_;
   void* prog2_;
+
+  // Cache indices of the charge 1 peaks, followed by those of the charge 2
+  // peaks. Charge 1 programs use the first num_peaks1_, charge 2 programs
+  // all num_peaks2_.
+  int* peaks_;
+  int num_peaks1_;
+  int num_peaks2_;
 };
 
 #endif // PEPTIDE_H
@@ -12,6 +12,9 @@
 #include <algorithm>
 #include <numeric>
 #include <gflags/gflags.h>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <google/protobuf/repeated_field.h>
 #include "abspath.h"
 #include "records.h"
 #include "records_to_vector-inl.h"
@@ -32,6 +35,12 @@ DEFINE_int32(max_mods, 255, "Maximum number of modifications that can be applied
                             "to a single peptide.");
 DEFINE_int32(min_mods, 0, "Minimum number of modifications that can be applied "
                           "to a single peptide.");
+DEFINE_int32(mods_buffer_mb, 1024, "Memory for holding modified peptides before "
+                                   "they are sorted and written to a temporary "
+                                   "file, in MBytes.");
+DEFINE_int32(mods_merge_fanout, 64, "Maximum number of temporary files of "
+                                    "modified peptides merged at once.");
+DEFINE_int32(mods_threads, 1, "Number of threads generating modified peptides.");
 
 static string GetTempName(string tmpDir, int filenum) {
   char buf[36];
@@ -48,30 +57,29 @@ static string GetTempName(string tmpDir, int filenum) {
 #endif
 }
 
+typedef google::protobuf::RepeatedPtrField<pb::Peptide> PeptidePool;
+
+// Generates the modified forms of peptides. Each thread has its own
+// ModsOutputter, which appends to its own pool of peptides.
 class ModsOutputter {
  public:
   unsigned long modpeptidecnt_;
-  ModsOutputter(string tmpDir,
-                const vector<const pb::Protein*>& proteins,
-		VariableModTable* var_mod_table,
-		HeadedRecordWriter* final_writer)
-    : proteins_(proteins),
+  ModsOutputter(const vector<const pb::Protein*>& proteins,
+		VariableModTable* var_mod_table)
+    : modpeptidecnt_(0),
+      proteins_(proteins),
       mod_table_(var_mod_table),
       max_counts_(*mod_table_->MaxCounts()),
       counts_mapper_vec_(max_counts_.size(), 0),
-      final_writer_(final_writer),
-      count_(0) {
-    InitCountsMapper(tmpDir);
-  }
-
-  ~ModsOutputter() {
-    for (int i = 0; i < writers_.size(); ++i)
-      delete writers_[i];
-    Merge();
+      out_(NULL) {
+    InitCountsMapper();
   }
 
-  void Output(pb::Peptide* peptide) {
+  // Appends the modified forms of peptide to out. Their ids are left for the
+  // caller to set.
+  void Output(pb::Peptide* peptide, PeptidePool* out) {
     peptide_ = peptide;
+    out_ = out;
     const pb::Location& loc = peptide->first_location();
     residues_ = proteins_[loc.protein_id()]->residues().data() + loc.pos();
     vector<int> counts(max_counts_.size(), 0);
@@ -79,15 +87,11 @@ class ModsOutputter {
   }
 
  private:
-  string tmpDir_;
   void OutputMods(int pos, vector<int>& counts);
   void OutputNtermMods(int pos, vector<int>& counts);
   void OutputCtermMods(int pos, vector<int>& counts);
-  void Merge();
 
-  void InitCountsMapper(string tmpDir) {
-    tmpDir_ = tmpDir;
-    
+  void InitCountsMapper() {
     int prod = 1;
     for (int i = 0; i < max_counts_.size(); ++i) {
       counts_mapper_vec_[i] = prod;
@@ -97,23 +101,8 @@ class ModsOutputter {
         prod *= (max_counts_[i]+1);
     }
 
-    writers_.resize(prod);
-    if (prod > 100) {
-      carp(CARP_INFO, "Opening %d files for modifications.", prod);
-    }
-
-    for (int i = 0; i < prod; ++i) {
-      writers_[i] = new RecordWriter(GetTempName(tmpDir, i), FLAGS_buf_size << 10);
-      if (!writers_[i]->OK()) {
-        // delete temporary files
-        for (int j = 0; j < i; ++j)
-          unlink(GetTempName(tmpDir, j).c_str());
-        CHECK(writers_[i]->OK());
-      }
-    }
-
     const vector<double>& deltas = *mod_table_->OriginalDeltas();
-    delta_by_file_.resize(prod);
+    delta_by_counts_.resize(prod);
     for (int i = 0; i < prod; ++i) {
       double total_delta = 0;
       int x = i;
@@ -122,7 +111,7 @@ class ModsOutputter {
         x %= counts_mapper_vec_[j];
         total_delta += deltas[j] * digit;
       }
-      delta_by_file_[i] = total_delta;
+      delta_by_counts_[i] = total_delta;
     }
   }
 
@@ -137,29 +126,23 @@ class ModsOutputter {
     return dot;
   }
 
-  RecordWriter* Write(const vector<int>& counts) {
+  void Write(const vector<int>& counts) {
     ++modpeptidecnt_;
     int index = DotProd(counts);
-    double mass = peptide_->mass();
-    peptide_->set_mass(delta_by_file_[index] + mass);
-    if (!writers_[index]->Write(peptide_)) {
-      carp(CARP_FATAL, "I/O error writing modifications");
-    }
-    peptide_->set_mass(mass);
-    return writers_[index];
+    pb::Peptide* modified = out_->Add();
+    modified->CopyFrom(*peptide_);
+    modified->set_mass(delta_by_counts_[index] + peptide_->mass());
   }
 
   const vector<const pb::Protein*>& proteins_;
   VariableModTable* mod_table_;
   const vector<int>& max_counts_;
   vector<int> counts_mapper_vec_;
-  vector<RecordWriter*> writers_;
-  vector<double> delta_by_file_;
-  HeadedRecordWriter* final_writer_;
-  int count_;
+  vector<double> delta_by_counts_; // total mass delta, indexed by DotProd(counts)
 
   pb::Peptide* peptide_;
   const char* residues_;
+  PeptidePool* out_;
 };
 
 //terminal modifications count as a modification and hence 
@@ -268,7 +251,6 @@ void ModsOutputter::OutputCtermMods(int pos, vector<int>& counts) {
     return;
   } else if (total == FLAGS_max_mods) {
     if (total >= FLAGS_min_mods) {
-      peptide_->set_id(count_++);
       Write(counts);
     }
     return;
@@ -284,7 +266,6 @@ void ModsOutputter::OutputCtermMods(int pos, vector<int>& counts) {
       peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
       if (TotalMods(counts) >= FLAGS_min_mods) {
-        peptide_->set_id(count_++);
         Write(counts);
       }
 
@@ -301,7 +282,6 @@ void ModsOutputter::OutputCtermMods(int pos, vector<int>& counts) {
       peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
       if (TotalMods(counts) >= FLAGS_min_mods) {
-        peptide_->set_id(count_++);
         Write(counts);
       }
 
@@ -321,7 +301,6 @@ void ModsOutputter::OutputCtermMods(int pos, vector<int>& counts) {
         peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
         if (TotalMods(counts) >= FLAGS_min_mods) {
-          peptide_->set_id(count_++);
           Write(counts);
         }
 
@@ -341,7 +320,6 @@ void ModsOutputter::OutputCtermMods(int pos, vector<int>& counts) {
         peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
         if (TotalMods(counts) >= FLAGS_min_mods) {
-          peptide_->set_id(count_++);
           Write(counts);
         }
 
@@ -360,7 +338,6 @@ void ModsOutputter::OutputCtermMods(int pos, vector<int>& counts) {
         peptide_->add_modifications(mod_table_->EncodeMod(pos, delta_index));
 
         if (TotalMods(counts) >= FLAGS_min_mods) {
-          peptide_->set_id(count_++);
           Write(counts);
         }
         
@@ -370,7 +347,6 @@ void ModsOutputter::OutputCtermMods(int pos, vector<int>& counts) {
       }
     }
     if (TotalMods(counts) >= FLAGS_min_mods) {
-      peptide_->set_id(count_++);
       Write(counts);    
     }
   }
@@ -417,46 +393,157 @@ struct greater_pepreader
   }
 };
 
-void ModsOutputter::Merge() {
-  int num_files = writers_.size();
-  vector<PepReader*> readers(num_files);
-  for (int i = 0; i < num_files; ++i)
-    readers[i] = new PepReader(GetTempName(tmpDir_, i));
-
-  // initialize heap
-  PepReader** heap_end = &(readers[0]) + num_files;
-  for (PepReader** reader = &(readers[0]); reader < heap_end; ++reader)
-    if (!(*reader)->Advance())
-      swap(*reader--, *--heap_end);
-  make_heap(&(readers[0]), heap_end, greater_pepreader());
-  
-  // do heap merge
-  int id = 0;
+// Sorts peptides by mass; modified peptides of equal mass stay in the order in
+// which they were generated.
+struct less_peptide {
+  bool operator()(const pb::Peptide* x, const pb::Peptide* y) const {
+    if (x->mass() != y->mass())
+      return x->mass() < y->mass();
+    return x->id() < y->id();
+  }
+};
+
+// Holds modified peptides in memory until they outgrow FLAGS_mods_buffer_mb,
+// then writes them to a temporary file as a run sorted by mass and id. The
+// runs are merged FLAGS_mods_merge_fanout at a time, so the number of open
+// files stays bounded however many combinations of mods there are.
+class ModsSorter {
+ public:
+  ModsSorter(const string& tmpDir, RecordWriter* final_writer)
+    : tmpDir_(tmpDir), final_writer_(final_writer), next_run_(0), bytes_(0) {
+  }
+
+  // Takes note of peptides that were added to pools; spills the pools once
+  // they hold too much.
+  void Added(const vector<PeptidePool*>& pools, size_t bytes) {
+    bytes_ += bytes;
+    if (bytes_ >= ((size_t)FLAGS_mods_buffer_mb << 20)) {
+      Spill(pools);
+    }
+  }
+
+  // Writes every peptide, in order of mass, to the final writer, numbering
+  // them from 0.
+  void Finish(const vector<PeptidePool*>& pools) {
+    if (runs_.empty()) {
+      vector<pb::Peptide*> sorted;
+      Sort(pools, &sorted);
+      for (int i = 0; i < (int)sorted.size(); ++i) {
+        sorted[i]->set_id(i);
+        if (!final_writer_->Write(sorted[i])) {
+          carp(CARP_FATAL, "I/O error writing modifications");
+        }
+      }
+      return;
+    }
+    Spill(pools);
+    int fanout = max(FLAGS_mods_merge_fanout, 2);
+    while ((int)runs_.size() > fanout) {
+      // Merge the oldest runs into a new one
+      vector<int> group(runs_.begin(), runs_.begin() + fanout);
+      runs_.erase(runs_.begin(), runs_.begin() + fanout);
+      int run = next_run_++;
+      {
+        RecordWriter writer(GetTempName(tmpDir_, run), FLAGS_buf_size << 10);
+        CHECK(writer.OK());
+        Merge(group, &writer, false);
+      }
+      runs_.push_back(run);
+    }
+    Merge(runs_, final_writer_, true);
+    runs_.clear();
+  }
+
+ private:
+  void Sort(const vector<PeptidePool*>& pools, vector<pb::Peptide*>* sorted) {
+    for (size_t i = 0; i < pools.size(); ++i) {
+      PeptidePool* pool = pools[i];
+      for (int j = 0; j < pool->size(); ++j) {
+        sorted->push_back(pool->Mutable(j));
+      }
+    }
+    sort(sorted->begin(), sorted->end(), less_peptide());
+  }
+
+  void Spill(const vector<PeptidePool*>& pools) {
+    vector<pb::Peptide*> sorted;
+    Sort(pools, &sorted);
+    if (!sorted.empty()) {
+      int run = next_run_++;
+      RecordWriter writer(GetTempName(tmpDir_, run), FLAGS_buf_size << 10);
+      CHECK(writer.OK());
+      for (vector<pb::Peptide*>::const_iterator i = sorted.begin(); i != sorted.end(); ++i) {
+        if (!writer.Write(*i)) {
+          carp(CARP_FATAL, "I/O error writing modifications");
+        }
+      }
+      runs_.push_back(run);
+    }
+    // The pools keep their peptides for reuse
+    for (size_t i = 0; i < pools.size(); ++i) {
+      pools[i]->Clear();
+    }
+    bytes_ = 0;
+  }
+
+  // Merges the runs into writer by mass and id, and deletes them. When
+  // renumber is set, the peptides are numbered from 0 as they are written.
+  void Merge(const vector<int>& runs, RecordWriter* writer, bool renumber) {
+    int num_files = runs.size();
+    vector<PepReader*> readers(num_files);
+    for (int i = 0; i < num_files; ++i)
+      readers[i] = new PepReader(GetTempName(tmpDir_, runs[i]));
+
+    // initialize heap
+    PepReader** heap_end = &(readers[0]) + num_files;
+    for (PepReader** reader = &(readers[0]); reader < heap_end; ++reader)
+      if (!(*reader)->Advance())
+        swap(*reader--, *--heap_end);
+    make_heap(&(readers[0]), heap_end, greater_pepreader());
+
+    // do heap merge
+    int id = 0;
 #ifndef NDEBUG
-  double last_mass = 0.0;
+    double last_mass = 0.0;
 #endif
-  while (heap_end > &(readers[0])) {
-    pop_heap(&(readers[0]), heap_end, greater_pepreader());
-    pb::Peptide* current = (*(heap_end-1))->Current();
-    current->set_id(id++);
+    while (heap_end > &(readers[0])) {
+      pop_heap(&(readers[0]), heap_end, greater_pepreader());
+      pb::Peptide* current = (*(heap_end-1))->Current();
+      if (renumber)
+        current->set_id(id++);
 #ifndef NDEBUG
-    assert(current->mass() >= last_mass);
-    last_mass = current->mass();
+      assert(current->mass() >= last_mass);
+      last_mass = current->mass();
 #endif
-    final_writer_->Write(current);
-    CHECK(final_writer_->OK());
-    if ((*(heap_end-1))->Advance()) {
-      push_heap(&(readers[0]), heap_end, greater_pepreader());
-    } else {
-      --heap_end;
+      if (!writer->Write(current)) {
+        carp(CARP_FATAL, "I/O error writing modifications");
+      }
+      if ((*(heap_end-1))->Advance()) {
+        push_heap(&(readers[0]), heap_end, greater_pepreader());
+      } else {
+        --heap_end;
+      }
     }
-  }
 
-  // delete temporary files
-  for (int i = 0; i < num_files; ++i) {
-    delete readers[i];
-    unlink(GetTempName(tmpDir_, i).c_str());
+    // delete temporary files
+    for (int i = 0; i < num_files; ++i) {
+      delete readers[i];
+      unlink(GetTempName(tmpDir_, runs[i]).c_str());
+    }
   }
+
+  string tmpDir_;
+  RecordWriter* final_writer_;
+  vector<int> runs_;
+  int next_run_;
+  size_t bytes_;
+};
+
+// Generates the modified forms of peptides[begin, end).
+static void OutputRange(ModsOutputter* outputter, vector<pb::Peptide>* peptides,
+                        int begin, int end, PeptidePool* out) {
+  for (int i = begin; i < end; ++i)
+    outputter->Output(&(*peptides)[i], out);
 }
 
 void AddMods(HeadedRecordReader* reader, string out_file,
@@ -467,14 +554,62 @@ void AddMods(HeadedRecordReader* reader, string out_file,
   CHECK(reader->OK());
   HeadedRecordWriter writer(out_file, header, FLAGS_buf_size << 10);
   CHECK(writer.OK());
-  ModsOutputter outputter(tmpDir, proteins, &var_mod_table, &writer);
-  outputter.modpeptidecnt_ = 0; 
-  pb::Peptide peptide;
-  while (!reader->Done()) {
-    CHECK(reader->Read(&peptide));
-    outputter.Output(&peptide);
-  } 
-  carp(CARP_INFO, "Created %d peptides.", outputter.modpeptidecnt_);
+  ModsSorter sorter(tmpDir, writer.Writer());
+
+  // The unmodified peptides are read in batches. Each thread expands a
+  // contiguous slice of the batch, and the ids are then given out in batch
+  // order, so the output is the same for any number of threads.
+  int num_threads = max(FLAGS_mods_threads, 1);
+  const int kBatchSize = 1024 * num_threads;
+  vector<ModsOutputter*> outputters(num_threads);
+  vector<PeptidePool*> pools(num_threads);
+  for (int t = 0; t < num_threads; ++t) {
+    outputters[t] = new ModsOutputter(proteins, &var_mod_table);
+    pools[t] = new PeptidePool;
+  }
+  vector<pb::Peptide> batch(kBatchSize);
+  vector<int> pool_start(num_threads);
+  int id = 0;
+  bool done = reader->Done();
+  while (!done) {
+    int batch_size = 0;
+    while (!done && batch_size < kBatchSize) {
+      CHECK(reader->Read(&batch[batch_size++]));
+      done = reader->Done();
+    }
+    for (int t = 0; t < num_threads; ++t)
+      pool_start[t] = pools[t]->size();
+    boost::thread_group threads;
+    for (int t = 1; t < num_threads; ++t) {
+      threads.create_thread(boost::bind(&OutputRange, outputters[t], &batch,
+        batch_size * t / num_threads, batch_size * (t + 1) / num_threads,
+        pools[t]));
+    }
+    OutputRange(outputters[0], &batch, 0, batch_size / num_threads, pools[0]);
+    threads.join_all();
+
+    size_t bytes = 0;
+    for (int t = 0; t < num_threads; ++t) {
+      for (int i = pool_start[t]; i < pools[t]->size(); ++i) {
+        pb::Peptide* peptide = pools[t]->Mutable(i);
+        peptide->set_id(id++);
+        // The peptide itself, with its mods and locations, and its slot in
+        // the pool
+        bytes += (size_t)peptide->SpaceUsed() + sizeof(pb::Peptide*);
+      }
+    }
+    sorter.Added(pools, bytes);
+  }
+  sorter.Finish(pools);
+  CHECK(writer.OK());
+
+  unsigned long modpeptidecnt = 0;
+  for (int t = 0; t < num_threads; ++t) {
+    modpeptidecnt += outputters[t]->modpeptidecnt_;
+    delete outputters[t];
+    delete pools[t];
+  }
+  carp(CARP_INFO, "Created %d peptides.", modpeptidecnt);
   CHECK(reader->OK());
 }
 
@@ -484,15 +619,5 @@ void AddMods(HeadedRecordReader* reader, string out_file,
 	     const vector<const pb::Protein*>& proteins) {
   VariableModTable var_mod_table;
   var_mod_table.Init(header.peptides_header().mods());
-  CHECK(reader->OK());
-  HeadedRecordWriter writer(out_file, header, FLAGS_buf_size << 10);
-  CHECK(writer.OK());
-  ModsOutputter outputter(tmpDir, proteins, &var_mod_table, &writer);
-
-  pb::Peptide peptide;
-  while (!reader->Done()) {
-    CHECK(reader->Read(&peptide));
-    outputter.Output(&peptide);
-  }
-  CHECK(reader->OK());
+  AddMods(reader, out_file, tmpDir, header, proteins, var_mod_table);
 }
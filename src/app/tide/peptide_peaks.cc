@@ -25,6 +25,12 @@
 #include "peptide.h"
 #include "theoretical_peak_set.h"
 #include "abspath.h"
+#include "mass_index.h"
+#include "index_stamp.h"
+#include "flat_peptides.h"
+#include "packed_peptides.h"
+#include "peak_index.h"
+#include "mass_constants.h"
 
 using namespace std;
 
@@ -56,7 +62,12 @@ static void AddPeaksToPB(pb::Peptide* peptide, const TheoreticalPeakArr* peaks,
 
 void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
 			 const string& input_filename,
-			 const string& output_filename) {
+			 const string& output_filename,
+			 const string& mass_index_filename,
+			 const string& mass_histogram_filename,
+			 const string& flat_filename,
+			 const string& packed_filename,
+			 const string& peaks_filename) {
   pb::Header orig_header, new_header;
   HeadedRecordReader reader(input_filename, &orig_header);
   CHECK(orig_header.file_type() == pb::Header::PEPTIDES);
@@ -66,12 +77,35 @@ void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
   pb::Header_PeptidesHeader* subheader = new_header.mutable_peptides_header();
   subheader->CopyFrom(orig_header.peptides_header());
   subheader->set_has_peaks(true);
+  subheader->set_build_id(NewBuildId());
   pb::Header_Source* source = new_header.add_source();
   source->mutable_header()->CopyFrom(orig_header);
   source->set_filename(AbsPath(input_filename));
-  HeadedRecordWriter writer(output_filename, new_header);
+  HeadedRecordWriter* writer = new HeadedRecordWriter(output_filename, new_header);
   CHECK(reader.OK());
-  CHECK(writer.OK());
+  CHECK(writer->OK());
+  MassIndexBuilder mass_index;
+  MassHistogram mass_histogram;
+  FlatPeptideWriter* flat_writer = NULL;
+  if (!flat_filename.empty()) {
+    flat_writer = new FlatPeptideWriter(flat_filename);
+    CHECK(flat_writer->OK());
+  }
+  PackedPeptideWriter* packed_writer = NULL;
+  if (!packed_filename.empty()) {
+    packed_writer = new PackedPeptideWriter(packed_filename);
+    CHECK(packed_writer->OK());
+  }
+  // The peak index holds the peaks that search would compute, binned as
+  // MassConstants was initialized.
+  PeakIndexWriter* peak_writer = NULL;
+  ST_TheoreticalPeakSet peak_workspace(2000);
+  if (!peaks_filename.empty()) {
+    peak_writer = new PeakIndexWriter(peaks_filename,
+                                      MassConstants::bin_width_,
+                                      MassConstants::bin_offset_);
+    CHECK(peak_writer->OK());
+  }
 
   pb::Peptide pb_peptide;
 //  const int workspace_size = 2000; // More than sufficient for theor. peaks.
@@ -91,7 +125,90 @@ void AddTheoreticalPeaks(const vector<const pb::Protein*>& proteins,
     AddPeaksToPB(&pb_peptide, &peaks_charge_2, 2, false);
     AddPeaksToPB(&pb_peptide, &negs_charge_1, 1, true);
     AddPeaksToPB(&pb_peptide, &negs_charge_2, 2, true);
-*/    CHECK(writer.Write(&pb_peptide));
+*/
+    mass_index.Add(pb_peptide.mass(), writer->Writer()->Offset());
+    mass_histogram.Add(pb_peptide.mass(), pb_peptide.is_decoy());
+    CHECK(writer->Write(&pb_peptide));
+    if (flat_writer) {
+      CHECK(flat_writer->Write(pb_peptide));
+    }
+    if (packed_writer) {
+      CHECK(packed_writer->Write(pb_peptide));
+    }
+    if (peak_writer) {
+      Peptide peptide(pb_peptide, proteins);
+      peak_workspace.Clear();
+      peptide.ComputeTheoreticalPeaks(&peak_workspace, NULL, NULL);
+      if (!peak_writer->Write(pb_peptide, peak_workspace.GetPeaks())) {
+        carp(CARP_WARNING, "Could not write peak index %s",
+             peaks_filename.c_str());
+        delete peak_writer;
+        peak_writer = NULL;
+        remove(peaks_filename.c_str());
+      }
+    }
   }
   CHECK(reader.OK());
+  delete writer; // close output_filename before indexing it
+  if (!mass_index.Write(mass_index_filename, output_filename)) {
+    carp(CARP_WARNING, "Could not write mass index %s",
+         mass_index_filename.c_str());
+  }
+  if (!mass_histogram.Write(mass_histogram_filename, output_filename)) {
+    carp(CARP_WARNING, "Could not write mass histogram %s",
+         mass_histogram_filename.c_str());
+  }
+  if (flat_writer) {
+    CHECK(flat_writer->Close(output_filename));
+    delete flat_writer;
+  }
+  if (packed_writer) {
+    CHECK(packed_writer->Close(output_filename));
+    delete packed_writer;
+  }
+  if (peak_writer) {
+    if (!peak_writer->Close(output_filename)) {
+      carp(CARP_WARNING, "Could not write peak index %s",
+           peaks_filename.c_str());
+    }
+    delete peak_writer;
+  }
+}
+
+// Write the peak index for the peptides of an existing pepix, as
+// AddTheoreticalPeaks() would have. MassConstants is initialized from the
+// modifications in the header of peptides_filename, with the given binning.
+bool WritePeakIndex(const vector<const pb::Protein*>& proteins,
+                    const string& peptides_filename,
+                    const string& peaks_filename,
+                    double bin_width, double bin_offset) {
+  pb::Header header;
+  HeadedRecordReader reader(peptides_filename, &header);
+  if (!reader.OK() || header.file_type() != pb::Header::PEPTIDES ||
+      !MassConstants::Init(&header.peptides_header().mods(),
+                           &header.peptides_header().nterm_mods(),
+                           &header.peptides_header().cterm_mods(),
+                           bin_width, bin_offset)) {
+    return false;
+  }
+  PeakIndexWriter* peak_writer =
+    new PeakIndexWriter(peaks_filename, bin_width, bin_offset);
+  ST_TheoreticalPeakSet peak_workspace(2000);
+  pb::Peptide pb_peptide;
+  bool ok = peak_writer->OK();
+  while (ok && !reader.Done()) {
+    ok = reader.Read(&pb_peptide);
+    if (ok) {
+      Peptide peptide(pb_peptide, proteins);
+      peak_workspace.Clear();
+      peptide.ComputeTheoreticalPeaks(&peak_workspace, NULL, NULL);
+      ok = peak_writer->Write(pb_peptide, peak_workspace.GetPeaks());
+    }
+  }
+  ok = ok && reader.OK() && peak_writer->Close(peptides_filename);
+  delete peak_writer;
+  if (!ok) {
+    remove(peaks_filename.c_str());
+  }
+  return ok;
 }
@@ -0,0 +1,54 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include "protein_arena.h"
+#include "raw_proteins.pb.h"
+#include "records.h"
+
+bool ProteinArena::Read(const string& filename, pb::Header* header) {
+  text_.clear();
+  views_.clear();
+  proteins_.clear();
+
+  HeadedRecordReader reader(filename, header);
+  // The names and residues take up most of the file, so its size is a good
+  // bound on the text; reserving it avoids moving the text as it grows.
+  struct stat st;
+  if (stat(filename.c_str(), &st) == 0) {
+    text_.reserve(st.st_size);
+  }
+  // The views point into text_ only once it is complete; until then, keep
+  // the offsets of their names and residues.
+  vector<size_t> name_offsets, residue_offsets;
+  pb::Protein protein;
+  while (!reader.Done()) {
+    reader.Read(&protein);
+    ProteinView view;
+    view.id_ = protein.id();
+    view.length_ = protein.residues().length();
+    view.target_pos_ = protein.has_target_pos() ? protein.target_pos() : -1;
+    view.has_name_ = protein.has_name();
+    name_offsets.push_back(text_.size());
+    text_.insert(text_.end(), protein.name().begin(), protein.name().end());
+    text_.push_back('\0');
+    residue_offsets.push_back(text_.size());
+    text_.insert(text_.end(), protein.residues().begin(),
+                 protein.residues().end());
+    text_.push_back('\0');
+    views_.push_back(view);
+  }
+  if (!reader.OK()) { // Discard everything if we fail.
+    text_.clear();
+    views_.clear();
+    return false;
+  }
+
+  const char* base = text_.empty() ? NULL : &text_[0];
+  proteins_.reserve(views_.size());
+  for (size_t i = 0; i < views_.size(); ++i) {
+    views_[i].name_ = base + name_offsets[i];
+    views_[i].residues_ = base + residue_offsets[i];
+    proteins_.push_back(&views_[i]);
+  }
+  return true;
+}
@@ -0,0 +1,65 @@
+// A ProteinArena holds the proteins of a protix file for use at search time.
+// ReadRecordsToVector<pb::Protein>() would make a separate pb::Protein, with
+// its own name and residue strings, for every protein; for large databases
+// that is hundreds of thousands of small heap blocks. The arena instead copies
+// all names and residues into one contiguous block of text and describes each
+// protein by a fixed-size ProteinView pointing into it. Views are addressed by
+// protein id, just as the vector of pb::Proteins was, and their residues stay
+// put for as long as the arena exists, so Peptides may refer into them.
+
+#ifndef PROTEIN_ARENA_H
+#define PROTEIN_ARENA_H
+
+#include <string>
+#include <vector>
+#include "header.pb.h"
+
+using namespace std;
+
+class ProteinView {
+ public:
+  int id() const { return id_; }
+
+  // Both are NUL-terminated.
+  const char* name() const { return name_; }
+  const char* residues() const { return residues_; }
+  int length() const { return length_; }
+
+  bool has_name() const { return has_name_; }
+  bool has_target_pos() const { return target_pos_ >= 0; }
+  int target_pos() const { return target_pos_; }
+
+ private:
+  friend class ProteinArena;
+
+  const char* name_;
+  const char* residues_;
+  int id_;
+  int length_;
+  int target_pos_; // -1 if none
+  bool has_name_;
+};
+
+typedef vector<const ProteinView*> ProteinViewVec;
+
+class ProteinArena {
+ public:
+  ProteinArena() {}
+
+  // Read the proteins in filename, in order, replacing any already held.
+  // Returns false, holding nothing, if the file cannot be read.
+  bool Read(const string& filename, pb::Header* header = NULL);
+
+  // The proteins, indexed as the records of the file.
+  const ProteinViewVec& Proteins() const { return proteins_; }
+
+ private:
+  vector<char> text_;
+  vector<ProteinView> views_;
+  ProteinViewVec proteins_;
+
+  ProteinArena(const ProteinArena&);
+  ProteinArena& operator=(const ProteinArena&);
+};
+
+#endif // PROTEIN_ARENA_H
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include "psm_writer.h"
+
+void PsmBuffer::BeginRow(int scan, int charge, int rank) {
+  if (writer_->sorted_) {
+    Row row = { scan, charge, rank, text_.size(), text_.size() };
+    rows_.push_back(row);
+  }
+}
+
+void PsmBuffer::EndRow() {
+  text_.push_back('\n');
+  if (!rows_.empty()) {
+    rows_.back().end = text_.size();
+  }
+  if (text_.size() >= PsmWriter::kBlockSize) {
+    writer_->Submit(this);
+  }
+}
+
+PsmBuffer& PsmBuffer::operator<<(int value) {
+  char buf[16];
+  char* end = buf + sizeof(buf);
+  char* p = end;
+  unsigned int u = (value < 0) ? 0u - (unsigned int)value : (unsigned int)value;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (value < 0) {
+    *--p = '-';
+  }
+  text_.append(p, end - p);
+  return *this;
+}
+
+PsmBuffer& PsmBuffer::operator<<(double value) {
+  // ostream's default: general notation, precision 6
+  char buf[32];
+  int n = snprintf(buf, sizeof(buf), "%g", value);
+  text_.append(buf, n);
+  return *this;
+}
+
+PsmBuffer& PsmBuffer::operator<<(const FixedValue& fixed) {
+  char buf[64];
+  int n = snprintf(buf, sizeof(buf), "%.*f", fixed.decimals, fixed.value);
+  if (n < (int)sizeof(buf)) {
+    text_.append(buf, n);
+  } else {
+    size_t old_size = text_.size();
+    text_.resize(old_size + n + 1);
+    snprintf(&text_[old_size], n + 1, "%.*f", fixed.decimals, fixed.value);
+    text_.resize(old_size + n);
+  }
+  return *this;
+}
+
+PsmWriter::PsmWriter(ostream* out, bool sorted)
+  : out_(out), sorted_(sorted), writing_(false), stop_(false), thread_(NULL),
+    buffer_(Retire) {
+  if (!sorted_) {
+    thread_ = new boost::thread(boost::bind(&PsmWriter::Run, this));
+  }
+}
+
+PsmWriter::~PsmWriter() {
+  buffer_.reset();
+  Flush();
+  if (thread_ != NULL) {
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    queued_.notify_one();
+    thread_->join();
+    delete thread_;
+  }
+  for (vector<Block*>::iterator i = free_.begin(); i != free_.end(); ++i) {
+    delete *i;
+  }
+  for (vector<PsmBuffer*>::iterator i = buffers_.begin(); i != buffers_.end(); ++i) {
+    delete *i;
+  }
+}
+
+PsmBuffer* PsmWriter::Buffer() {
+  PsmBuffer* buffer = buffer_.get();
+  if (buffer == NULL) {
+    buffer = new PsmBuffer(this);
+    buffer->text_.reserve(kBlockSize);
+    buffer_.reset(buffer);
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    buffers_.push_back(buffer);
+  }
+  return buffer;
+}
+
+void PsmWriter::Submit(PsmBuffer* buffer) {
+  if (buffer->text_.empty()) {
+    return;
+  }
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  Block* block;
+  if (free_.empty()) {
+    block = new Block;
+  } else {
+    block = free_.back();
+    free_.pop_back();
+  }
+  // The buffer takes over the empty block's storage in exchange
+  block->text.swap(buffer->text_);
+  block->rows.swap(buffer->rows_);
+  if (sorted_) {
+    held_.push_back(block);
+  } else {
+    queue_.push_back(block);
+    queued_.notify_one();
+  }
+}
+
+void PsmWriter::Retire(PsmBuffer* buffer) {
+  PsmWriter* writer = buffer->writer_;
+  writer->Submit(buffer);
+  boost::lock_guard<boost::mutex> lock(writer->mutex_);
+  writer->buffers_.erase(
+    find(writer->buffers_.begin(), writer->buffers_.end(), buffer));
+  delete buffer;
+}
+
+void PsmWriter::Flush() {
+  vector<PsmBuffer*> buffers;
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    buffers = buffers_;
+  }
+  for (vector<PsmBuffer*>::iterator i = buffers.begin(); i != buffers.end(); ++i) {
+    Submit(*i);
+  }
+  if (sorted_) {
+    WriteSorted();
+  } else {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (!queue_.empty() || writing_) {
+      written_.wait(lock);
+    }
+  }
+  out_->flush();
+}
+
+void PsmWriter::Run() {
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  for (;;) {
+    while (queue_.empty() && !stop_) {
+      queued_.wait(lock);
+    }
+    if (queue_.empty()) {
+      return;
+    }
+    Block* block = queue_.front();
+    queue_.pop_front();
+    writing_ = true;
+    lock.unlock();
+    out_->write(block->text.data(), block->text.size());
+    block->text.clear();
+    block->rows.clear();
+    lock.lock();
+    free_.push_back(block);
+    writing_ = false;
+    written_.notify_all();
+  }
+}
+
+namespace {
+
+struct RowRef {
+  const PsmBuffer::Row* row;
+  const string* text;
+};
+
+// Rows with the same key come from different report calls (e.g. in
+// peptide-centric search); their text breaks the tie.
+struct RowLess {
+  bool operator()(const RowRef& x, const RowRef& y) const {
+    if (x.row->scan != y.row->scan) {
+      return x.row->scan < y.row->scan;
+    }
+    if (x.row->charge != y.row->charge) {
+      return x.row->charge < y.row->charge;
+    }
+    if (x.row->rank != y.row->rank) {
+      return x.row->rank < y.row->rank;
+    }
+    return x.text->compare(x.row->begin, x.row->end - x.row->begin,
+                           *y.text, y.row->begin, y.row->end - y.row->begin) < 0;
+  }
+};
+
+}
+
+void PsmWriter::WriteSorted() {
+  vector<RowRef> rows;
+  for (vector<Block*>::const_iterator i = held_.begin(); i != held_.end(); ++i) {
+    for (vector<PsmBuffer::Row>::const_iterator j = (*i)->rows.begin();
+         j != (*i)->rows.end();
+         ++j) {
+      RowRef ref = { &*j, &(*i)->text };
+      rows.push_back(ref);
+    }
+  }
+  sort(rows.begin(), rows.end(), RowLess());
+  for (vector<RowRef>::const_iterator i = rows.begin(); i != rows.end(); ++i) {
+    out_->write(i->text->data() + i->row->begin, i->row->end - i->row->begin);
+  }
+  for (vector<Block*>::iterator i = held_.begin(); i != held_.end(); ++i) {
+    (*i)->text.clear();
+    (*i)->rows.clear();
+    free_.push_back(*i);
+  }
+  held_.clear();
+}
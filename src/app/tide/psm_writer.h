@@ -0,0 +1,133 @@
+// PsmWriter collects the tab-delimited PSM rows that search threads produce
+// and writes them to one output stream in large blocks.
+//
+// Each thread formats its rows into its own PsmBuffer (see Buffer()), so no
+// lock is taken per row. When a buffer fills up, its contents are handed to
+// a single writer thread as one block; a search thread only takes the
+// writer's mutex for as long as it takes to queue that block. Numbers are
+// formatted with the same conversions that ostream uses, so the text matches
+// what ofstream::operator<< would have written.
+//
+// In sorted mode the writer keeps every row until Flush(), and then writes
+// them in order of scan number and charge, so that the output does not
+// depend on how the spectra were divided among threads.
+//
+//    PsmBuffer* out = writer->Buffer();
+//    out->BeginRow(scan, charge, rank);
+//    *out << scan << '\t' << PsmBuffer::Fixed(mz, 4) << '\t' << name;
+//    out->EndRow();
+
+#ifndef PSM_WRITER_H
+#define PSM_WRITER_H
+
+#include <deque>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+class PsmWriter;
+
+class PsmBuffer {
+ public:
+  // A value to be written in fixed notation with the given number of
+  // decimals, as StringUtils::ToString(value, decimals) would.
+  struct FixedValue {
+    double value;
+    int decimals;
+  };
+  static FixedValue Fixed(double value, int decimals) {
+    FixedValue fixed = { value, decimals };
+    return fixed;
+  }
+
+  // Start a row. The key is only used in sorted mode: rows are ordered by
+  // scan, then charge, then rank.
+  void BeginRow(int scan, int charge, int rank);
+
+  // Finish the current row with a newline.
+  void EndRow();
+
+  PsmBuffer& operator<<(const string& s) { text_.append(s); return *this; }
+  PsmBuffer& operator<<(const char* s) { text_.append(s); return *this; }
+  PsmBuffer& operator<<(char c) { text_.push_back(c); return *this; }
+  PsmBuffer& operator<<(int value);
+  PsmBuffer& operator<<(double value);  // as ostream's default format
+  PsmBuffer& operator<<(const FixedValue& fixed);
+
+  // The key of a row, and where its text lies in the buffer.
+  struct Row {
+    int scan;
+    int charge;
+    int rank;
+    size_t begin;
+    size_t end;
+  };
+
+ private:
+  friend class PsmWriter;
+
+  explicit PsmBuffer(PsmWriter* writer) : writer_(writer) {}
+
+  PsmWriter* writer_;
+  string text_;
+  vector<Row> rows_;  // sorted mode only
+};
+
+class PsmWriter {
+ public:
+  // Rows go to out, which must outlive the writer. In sorted mode they are
+  // held until Flush().
+  PsmWriter(ostream* out, bool sorted);
+  ~PsmWriter();
+
+  // The calling thread's buffer. It belongs to the writer, and is handed over
+  // when the thread exits.
+  PsmBuffer* Buffer();
+
+  // Write out every row added so far and flush the stream. Must not be
+  // called while other threads are adding rows.
+  void Flush();
+
+ private:
+  friend class PsmBuffer;
+
+  // A buffer's contents once it has been handed over.
+  struct Block {
+    string text;
+    vector<PsmBuffer::Row> rows;
+  };
+
+  static const size_t kBlockSize = 1 << 18;
+
+  // Hand the buffer's contents to the writer.
+  void Submit(PsmBuffer* buffer);
+  // Called as a thread exits, with that thread's buffer.
+  static void Retire(PsmBuffer* buffer);
+
+  void Run();
+  void WriteSorted();
+
+  ostream* out_;
+  bool sorted_;
+
+  boost::mutex mutex_;
+  boost::condition_variable queued_;
+  boost::condition_variable written_;
+  deque<Block*> queue_;        // blocks waiting for the writer thread
+  vector<Block*> free_;        // written blocks, kept for reuse
+  vector<Block*> held_;        // sorted mode: blocks waiting for Flush()
+  vector<PsmBuffer*> buffers_; // buffers of threads that are still running
+  bool writing_;
+  bool stop_;
+  boost::thread* thread_;
+
+  boost::thread_specific_ptr<PsmBuffer> buffer_;
+
+  PsmWriter(const PsmWriter&);
+  PsmWriter& operator=(const PsmWriter&);
+};
+
+#endif // PSM_WRITER_H
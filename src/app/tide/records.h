@@ -55,6 +55,9 @@
 #endif
 #include <iostream>
 #include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/io/coded_stream.h>
@@ -68,10 +71,14 @@ using namespace std;
 #endif
 #define MAGIC_NUMBER  0xfead1234ul
 
+// A table of (mass, byte offset) pairs, sorted by mass, for seeking within a
+// file of records sorted by mass. See mass_index.h.
+typedef vector<pair<double, google::protobuf::int64> > MassIndex;
+
 class RecordWriter {
  public:
   explicit RecordWriter(const string& filename, int buf_size = -1)
-    : raw_output_(NULL), coded_output_(NULL) {
+    : raw_output_(NULL), coded_output_(NULL), offset_(0) {
     if ((fd_ = open(filename.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
       carp(CARP_FATAL, "Couldn't open file %s for write (errno %d: %s).",
 	   filename.c_str(), errno, strerror(errno));
@@ -82,7 +89,7 @@ class RecordWriter {
   }
   
   explicit RecordWriter(google::protobuf::io::ZeroCopyOutputStream* raw_output)
-    : fd_(-1), raw_output_(raw_output) {
+    : fd_(-1), raw_output_(raw_output), offset_(0) {
     Init();
     raw_output_ = NULL; // we do not own (and will not delete) raw_output
   }
@@ -99,20 +106,26 @@ class RecordWriter {
   bool OK() const { return NULL != coded_output_; }
 
   bool Write(const google::protobuf::Message* message) {
-    coded_output_->WriteVarint32(message->ByteSize());
+    int size = message->ByteSize();
+    coded_output_->WriteVarint32(size);
     if (coded_output_->HadError()) {
       delete coded_output_;
       coded_output_ = NULL;
       return false;
     }
     message->SerializeWithCachedSizes(coded_output_);
+    offset_ += google::protobuf::io::CodedOutputStream::VarintSize32(size) + size;
     return !coded_output_->HadError();
   }
 
+  // Byte offset within the file at which the next record will be written.
+  google::protobuf::int64 Offset() const { return offset_; }
+
  private:
   void Init() {
     coded_output_ = new google::protobuf::io::CodedOutputStream(raw_output_);
     coded_output_->WriteLittleEndian32(MAGIC_NUMBER);
+    offset_ = sizeof(google::protobuf::uint32);
     if (coded_output_->HadError()) {
       delete coded_output_;
       coded_output_ = NULL;
@@ -122,13 +135,15 @@ class RecordWriter {
   int fd_;
   google::protobuf::io::ZeroCopyOutputStream* raw_output_;
   google::protobuf::io::CodedOutputStream* coded_output_;
+  google::protobuf::int64 offset_;
 };
 
 
 class RecordReader {
  public:
   explicit RecordReader(const string& filename, int buf_size = -1)
-    : raw_input_(NULL), coded_input_(NULL), size_(UINT32_MAX), valid_(false) {
+    : raw_input_(NULL), coded_input_(NULL), size_(UINT32_MAX), valid_(false),
+    buf_size_(buf_size), base_offset_(0), mass_index_(NULL) {
     fd_ = open(filename.c_str(), O_RDONLY);
     if (fd_ < 0)
       return;
@@ -180,12 +195,77 @@ class RecordReader {
     return true;
   }
 
+  // Read the next record without parsing it, so that it can be parsed
+  // elsewhere, e.g. on another thread.
+  bool ReadBytes(string* bytes) {
+    if (!valid_)
+      return false;
+    assert(size_ != UINT32_MAX);
+    if (!coded_input_->ReadString(bytes, size_))
+      return valid_ = false;
+    delete coded_input_;
+    coded_input_ = NULL;
+    size_ = UINT32_MAX;
+    return true;
+  }
+
+  // Byte offset within the file of the next record to be read. Not valid
+  // between a call to Done() and the following call to Read().
+  google::protobuf::int64 Offset() const {
+    return base_offset_ + raw_input_->ByteCount();
+  }
+
+  // Continue reading at the record that begins at the given byte offset.
+  bool Seek(google::protobuf::int64 offset) {
+    if (fd_ < 0)
+      return false;
+    delete coded_input_;
+    coded_input_ = NULL;
+    size_ = UINT32_MAX;
+    delete raw_input_;
+    raw_input_ = NULL;
+    if (lseek(fd_, (off_t)offset, SEEK_SET) == (off_t)-1)
+      return valid_ = false;
+    raw_input_ = new google::protobuf::io::FileInputStream(fd_, buf_size_);
+    base_offset_ = offset;
+    return valid_ = true;
+  }
+
+  // Provide a mass index for the records in this file; see mass_index.h.
+  // The reader does not take ownership.
+  void SetMassIndex(const MassIndex* mass_index) { mass_index_ = mass_index; }
+
+  // Move ahead to a record no heavier than any record of the given mass or
+  // more. Does nothing if there is no mass index, or if the record found
+  // lies at or before the current position: SeekToMass() never goes back.
+  // The caller is still expected to skip over records lighter than mass.
+  bool SeekToMass(double mass) {
+    if (mass_index_ == NULL || mass_index_->empty() || !valid_ ||
+        coded_input_ != NULL)
+      return false;
+    MassIndex::const_iterator i = lower_bound(
+      mass_index_->begin(), mass_index_->end(),
+      make_pair(mass, (google::protobuf::int64)0));
+    // i is the first entry with mass >= the given mass; the entry before it
+    // is the last one that is lighter.
+    if (i == mass_index_->begin())
+      return false;
+    --i;
+    if (i->second <= Offset())
+      return false;
+    return Seek(i->second);
+  }
+
  private:
   int fd_;
   google::protobuf::io::ZeroCopyInputStream* raw_input_;
   google::protobuf::io::CodedInputStream* coded_input_;
   google::protobuf::uint32 size_;
   bool valid_;
+  int buf_size_;
+  // Offset at which raw_input_ began reading.
+  google::protobuf::int64 base_offset_;
+  const MassIndex* mass_index_;
 };
 
 class HeadedRecordWriter {
@@ -237,6 +317,7 @@ class HeadedRecordReader {
   bool Read(google::protobuf::Message* message) { 
     return reader_.Read(message);
   }
+  bool ReadBytes(string* bytes) { return reader_.ReadBytes(bytes); }
   const pb::Header* GetHeader() const { return header_; }
 
  private:
@@ -0,0 +1,32 @@
+// SearchConfig gathers the settings that spectrum preprocessing and scoring
+// consult for every spectrum. tide-search fills one in from Params once,
+// before searching, and each ObservedPeakSet keeps a copy, so that no
+// parameter is looked up by name per spectrum. The defaults leave every
+// optional peak and filter off.
+
+#ifndef SEARCH_CONFIG_H
+#define SEARCH_CONFIG_H
+
+#include "mass_constants.h"
+
+struct SearchConfig {
+  SearchConfig()
+    : bin_width(MassConstants::bin_width_),
+    bin_offset(MassConstants::bin_offset_),
+    use_neutral_loss_peaks(false),
+    use_flanking_peaks(false),
+    skip_preprocessing(false),
+    remove_precursor_peak(false),
+    remove_precursor_tolerance(1.5) {
+  }
+
+  double bin_width;                   // mz-bin-width
+  double bin_offset;                  // mz-bin-offset
+  bool use_neutral_loss_peaks;        // use-neutral-loss-peaks
+  bool use_flanking_peaks;            // use-flanking-peaks
+  bool skip_preprocessing;            // skip-preprocessing
+  bool remove_precursor_peak;         // remove-precursor-peak
+  double remove_precursor_tolerance;  // remove-precursor-tolerance
+};
+
+#endif // SEARCH_CONFIG_H
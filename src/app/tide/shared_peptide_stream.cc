@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <gflags/gflags.h>
+#include "shared_peptide_stream.h"
+#include "peak_index.h"
+#include "compiler.h"
+#include "peak_scorer.h"
+#define CHECK(x) GOOGLE_CHECK((x))
+
+DECLARE_int32(fifo_page_size);
+
+SharedPeptideStream::SharedPeptideStream(RecordReader* reader,
+                                         const ProteinViewVec&
+                                         proteins,
+                                         int num_consumers)
+  : reader_(reader),
+    proteins_(proteins),
+    theoretical_peak_set_(2000),   // probably overkill, but no harm
+    peak_index_(NULL),
+    first_index_(0),
+    low_index_(num_consumers, 0),
+    fifo_alloc_peptides_(FLAGS_fifo_page_size << 20, false),
+    fifo_alloc_prog1_(FLAGS_fifo_page_size << 20,
+                      PeakScorer::UseCompiledPrograms()),
+    fifo_alloc_prog2_(FLAGS_fifo_page_size << 20,
+                      PeakScorer::UseCompiledPrograms()) {
+  CHECK(reader_->OK());
+  if (PeakScorer::UseCompiledPrograms()) {
+    compiler_prog1_ = new TheoreticalPeakCompiler(&fifo_alloc_prog1_);
+    compiler_prog2_ = new TheoreticalPeakCompiler(&fifo_alloc_prog2_);
+  } else {
+    compiler_prog1_ = compiler_prog2_ = NULL;
+  }
+}
+
+SharedPeptideStream::~SharedPeptideStream() {
+  fifo_alloc_peptides_.ReleaseAll();
+  fifo_alloc_prog1_.ReleaseAll();
+  fifo_alloc_prog2_.ReleaseAll();
+
+  delete compiler_prog1_;
+  delete compiler_prog2_;
+}
+
+bool SharedPeptideStream::ReadNext() {
+  if (reader_->Done()) {
+    return false;
+  }
+  reader_->Read(&current_pb_peptide_);
+  Peptide* peptide = new(&fifo_alloc_peptides_)
+    Peptide(current_pb_peptide_, proteins_, &fifo_alloc_peptides_);
+  // Programs are compiled in index order, so the programs of any contiguous
+  // run of peptides form a single chain.
+  FifoAllocator* fifo_alloc_peaks = PeakScorer::UsePeakLists() ?
+    &fifo_alloc_peptides_ : NULL;
+  const int32_t* peaks;
+  int num_peaks1, num_peaks2;
+  if (peak_index_ != NULL &&
+      peak_index_->Find(peptide->Id(), &peaks, &num_peaks1, &num_peaks2)) {
+    theoretical_peak_set_.LoadPeaks(peaks, num_peaks1, num_peaks2);
+    peptide->CompileTheoreticalPeaks(&theoretical_peak_set_,
+                                     compiler_prog1_, compiler_prog2_,
+                                     fifo_alloc_peaks);
+  } else {
+    theoretical_peak_set_.Clear();
+    peptide->ComputeTheoreticalPeaks(&theoretical_peak_set_,
+                                     compiler_prog1_, compiler_prog2_,
+                                     fifo_alloc_peaks);
+  }
+  peptides_.push_back(peptide);
+  return true;
+}
+
+void SharedPeptideStream::ReleaseConsumed() {
+  size_t low = *min_element(low_index_.begin(), low_index_.end());
+  if (low <= first_index_) {
+    return;
+  }
+  while (!peptides_.empty() && first_index_ < low) {
+    peptides_.pop_front();
+    ++first_index_;
+  }
+  if (peptides_.empty()) {
+    fifo_alloc_peptides_.ReleaseAll();
+    fifo_alloc_prog1_.ReleaseAll();
+    fifo_alloc_prog2_.ReleaseAll();
+  } else {
+    Peptide* peptide = peptides_.front();
+    // Free all peptides up to, but not including peptide.
+    fifo_alloc_peptides_.Release(peptide);
+    peptide->ReleaseFifo(&fifo_alloc_prog1_, &fifo_alloc_prog2_);
+  }
+}
+
+size_t SharedPeptideStream::Fetch(int consumer, size_t low_index,
+                                  size_t next_index, double min_range,
+                                  double max_range, deque<Peptide*>* out) {
+  boost::mutex::scoped_lock lock(lock_);
+  low_index_[consumer] = low_index;
+  ReleaseConsumed();
+  CHECK(next_index >= first_index_);
+
+  while (true) {
+    while (next_index >= first_index_ + peptides_.size()) {
+      if (!ReadNext()) {
+        return next_index;
+      }
+    }
+    Peptide* peptide = peptides_[next_index++ - first_index_];
+    if (peptide->Mass() < min_range) {
+      continue; // skip peptides that fall below min_range
+    }
+    out->push_back(peptide);
+    if (peptide->Mass() > max_range) {
+      return next_index;
+    }
+  }
+}
+
+void SharedPeptideStream::Detach(int consumer) {
+  boost::mutex::scoped_lock lock(lock_);
+  low_index_[consumer] = (size_t)-1;
+}
@@ -0,0 +1,91 @@
+// A SharedPeptideStream lets several ActivePeptideQueues, one per search
+// thread, draw their candidate peptides from a single reader. Without it each
+// thread opens its own copy of the peptide index, decodes every pb::Peptide
+// and compiles the same dot-product programs (see compiler.h) again.
+//
+// The stream reads peptides in the order they appear in the index (i.e. by
+// non-decreasing mass), constructs each Peptide once and compiles its
+// programs once, into memory owned by the stream. Peptides are addressed by
+// their ordinal position in the index. Each consumer (an ActivePeptideQueue)
+// calls Fetch() to append to its own queue all peptides up to a given mass,
+// and reports the ordinal of the lightest peptide it still needs. The stream
+// frees a peptide, and its programs, only once every consumer has moved past
+// it. Because the programs of consecutive peptides are laid out consecutively
+// by the compiler, any contiguous range of the stream is a valid chain of
+// programs for collectScoresCompiled().
+//
+// Only the spectrum-centric XCorr search uses the shared stream; exact
+// p-value and peptide-centric searches keep a private reader per queue.
+
+#ifndef SHARED_PEPTIDE_STREAM_H
+#define SHARED_PEPTIDE_STREAM_H
+
+#include <deque>
+#include <vector>
+#include <boost/thread.hpp>
+#include "records.h"
+#include "peptides.pb.h"
+#include "peptide.h"
+#include "theoretical_peak_set.h"
+#include "fifo_alloc.h"
+
+class TheoreticalPeakCompiler;
+class PeakIndexReader;
+
+class SharedPeptideStream {
+ public:
+  SharedPeptideStream(RecordReader* reader,
+                      const ProteinViewVec& proteins,
+                      int num_consumers);
+
+  ~SharedPeptideStream();
+
+  // Called by consumer with its current low-water mark, low_index (the
+  // ordinal of the lightest peptide it still holds, or next_index if it holds
+  // none). Appends to out the peptides with ordinals from next_index onward
+  // that are no lighter than min_range, stopping after the first peptide
+  // heavier than max_range. Returns the ordinal following the last peptide
+  // examined, which the consumer passes back as next_index on its next call.
+  size_t Fetch(int consumer, size_t low_index, size_t next_index,
+               double min_range, double max_range, deque<Peptide*>* out);
+
+  // Called when a consumer will make no more requests, so that it no longer
+  // holds back the release of lighter peptides.
+  void Detach(int consumer);
+
+  // Take theoretical peaks from a peak index (see peak_index.h) for the
+  // peptides it covers, rather than computing them.
+  void SetPeakIndex(PeakIndexReader* peak_index) { peak_index_ = peak_index; }
+
+ private:
+  // Read, construct and compile the next peptide in the index. Returns false
+  // at end of file. Caller must hold lock_.
+  bool ReadNext();
+
+  // Free peptides that every consumer has moved past. Caller must hold lock_.
+  void ReleaseConsumed();
+
+  RecordReader* reader_;
+  pb::Peptide current_pb_peptide_;
+  const ProteinViewVec& proteins_;
+
+  ST_TheoreticalPeakSet theoretical_peak_set_;
+  PeakIndexReader* peak_index_;
+
+  // peptides_[i] has ordinal first_index_ + i.
+  deque<Peptide*> peptides_;
+  size_t first_index_;
+
+  // Low-water mark for each consumer.
+  vector<size_t> low_index_;
+
+  FifoAllocator fifo_alloc_peptides_;
+  FifoAllocator fifo_alloc_prog1_;
+  FifoAllocator fifo_alloc_prog2_;
+  TheoreticalPeakCompiler* compiler_prog1_;
+  TheoreticalPeakCompiler* compiler_prog2_;
+
+  boost::mutex lock_;
+};
+
+#endif // SHARED_PEPTIDE_STREAM_H
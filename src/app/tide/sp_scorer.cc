@@ -7,7 +7,7 @@
 #include "sp_scorer.h"
 #include "peptide.h"
 
-SpScorer::SpScorer(const ProteinVec& proteins, const Spectrum& spectrum, 
+SpScorer::SpScorer(const ProteinViewVec& proteins, const Spectrum& spectrum, 
                    int charge, double max_mz)
   : proteins_(proteins), spectrum_(spectrum), charge_(charge), max_mz_(max_mz),
   sp_spectrum_(spectrum, charge, max_mz) {
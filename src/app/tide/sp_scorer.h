@@ -37,8 +37,8 @@
 #include "crux_sp_spectrum.h"
 #include "raw_proteins.pb.h"
 #include "peptides.pb.h"
+#include "protein_arena.h"
 
-typedef vector<const pb::Protein*> ProteinVec;
 typedef vector<const pb::AuxLocation*> AuxLocVec;
 
 
@@ -70,7 +70,7 @@ class SpScorer {
     }
   };
   
-  SpScorer(const ProteinVec& proteins, const Spectrum& spectrum, 
+  SpScorer(const ProteinViewVec& proteins, const Spectrum& spectrum, 
            int charge, double max_mz);
 
   void Score(const pb::Peptide& pb_peptide, SpScoreData& sp_score_data);
@@ -97,7 +97,7 @@ class SpScorer {
                  SpScoreData& sp_score_data);
 
   
-  const ProteinVec& proteins_;
+  const ProteinViewVec& proteins_;
   const Spectrum& spectrum_;
   SpSpectrum sp_spectrum_;
   int charge_;
@@ -0,0 +1,73 @@
+#include "spec_charge_scheduler.h"
+
+SpecChargeScheduler::SpecChargeScheduler(const vector<double>& weights,
+                                         int num_threads, int num_partitions,
+                                         int blocks_per_partition)
+  : next_block_(num_partitions), last_block_(num_partitions),
+    position_(num_threads, 0) {
+  int num_items = weights.size();
+  int num_blocks = num_partitions * blocks_per_partition;
+  if (num_blocks > num_items) {
+    num_blocks = num_items;
+  }
+  if (num_blocks < 1) {
+    num_blocks = 1;
+  }
+  double total = 0;
+  for (int i = 0; i < num_items; ++i) {
+    total += weights[i];
+  }
+  // Block b starts at the item nearest to where b / num_blocks of the weight
+  // has gone before, taking each item to sit at its midpoint. An item heavier
+  // than a block gets a block of its own, and the empty blocks that would
+  // follow it are dropped.
+  block_start_.push_back(0);
+  double before = 0;
+  int item = 0;
+  for (int b = 1; b < num_blocks; ++b) {
+    double target = total * b / num_blocks;
+    while (item < num_items && before + weights[item] / 2 <= target) {
+      before += weights[item++];
+    }
+    if (item > block_start_.back() && item < num_items) {
+      block_start_.push_back(item);
+    }
+  }
+  block_start_.push_back(num_items);
+  num_blocks = block_start_.size() - 1;
+  for (int p = 0; p < num_partitions; ++p) {
+    next_block_[p] = num_blocks * p / num_partitions;
+    last_block_[p] = num_blocks * (p + 1) / num_partitions;
+  }
+}
+
+bool SpecChargeScheduler::Next(int thread, int* begin, int* end) {
+  boost::mutex::scoped_lock lock(lock_);
+  int num_partitions = next_block_.size();
+  int own = thread % num_partitions;
+  int block;
+  if (next_block_[own] < last_block_[own]) {
+    block = next_block_[own]++;
+  } else {
+    // Steal from the back of the partition with the most blocks left,
+    // provided that block is not lighter than where this thread has been.
+    int victim = -1;
+    int most = 0;
+    for (int p = 0; p < num_partitions; ++p) {
+      int remaining = last_block_[p] - next_block_[p];
+      if (remaining > most &&
+          block_start_[last_block_[p] - 1] >= position_[thread]) {
+        most = remaining;
+        victim = p;
+      }
+    }
+    if (victim < 0) {
+      return false;
+    }
+    block = --last_block_[victim];
+  }
+  *begin = block_start_[block];
+  *end = block_start_[block + 1];
+  position_[thread] = *end;
+  return true;
+}
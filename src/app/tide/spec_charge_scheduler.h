@@ -0,0 +1,50 @@
+// A SpecChargeScheduler hands out the mass-sorted spectrum-charge pairs of a
+// search to the search threads in contiguous blocks.
+//
+// The range [0, num_items) is cut into blocks, and the blocks into
+// num_partitions contiguous runs, so that each partition covers its own part
+// of the precursor mass range. Thread t takes blocks in order from the front
+// of partition t % num_partitions. A thread whose partition is exhausted
+// steals the last block of the partition with the most remaining work.
+//
+// Each block holds about the same total weight of items, such as the
+// expected number of candidate peptides of each spectrum-charge pair; with
+// equal weights, blocks hold equal numbers of items.
+//
+// Each thread's ActivePeptideQueue can only move toward heavier peptides, so
+// the blocks handed to any one thread are always increasing: a thread never
+// steals a block that lies below the last block it was given.
+
+#ifndef SPEC_CHARGE_SCHEDULER_H
+#define SPEC_CHARGE_SCHEDULER_H
+
+#include <vector>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+class SpecChargeScheduler {
+ public:
+  // weights[i] is the weight of item i; num_items is weights.size().
+  SpecChargeScheduler(const vector<double>& weights, int num_threads,
+                      int num_partitions, int blocks_per_partition);
+
+  // Get the next block of items for thread, as [*begin, *end). Returns false
+  // when no work remains for that thread.
+  bool Next(int thread, int* begin, int* end);
+
+ private:
+  // block_start_[b] is the first item of block b; the last entry is num_items.
+  vector<int> block_start_;
+
+  // Partition p still holds blocks [next_block_[p], last_block_[p]).
+  vector<int> next_block_;
+  vector<int> last_block_;
+
+  // Item following the last block handed to each thread.
+  vector<int> position_;
+
+  boost::mutex lock_;
+};
+
+#endif // SPEC_CHARGE_SCHEDULER_H
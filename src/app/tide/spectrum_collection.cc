@@ -4,9 +4,19 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <limits>
+#include <deque>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 #include "spectrum.pb.h"
 #include "spectrum_collection.h"
 #include "mass_constants.h"
@@ -18,23 +28,24 @@ using google::protobuf::uint64;
 
 #define CHECK(x) GOOGLE_CHECK((x))
 
-Spectrum::Spectrum(const pb::Spectrum& spec) {
+Spectrum::Spectrum(const pb::Spectrum& spec, PeakStore* peaks)
+  : peaks_(peaks), first_peak_(peaks ? peaks->Size() : 0) {
   spectrum_number_ = spec.spectrum_number();
   precursor_m_z_ = spec.precursor_m_z();
   rtime_ = spec.rtime();
   for (int i = 0; i < spec.charge_state_size(); ++i)
     charge_states_.push_back(spec.charge_state(i));
-  int size = spec.peak_m_z_size();
-  CHECK(size == spec.peak_intensity_size());
-  ReservePeaks(size);
+  size_ = spec.peak_m_z_size();
+  CHECK(size_ == spec.peak_intensity_size());
   uint64 total = 0;
-  double m_z_denom = spec.peak_m_z_denominator();
+  m_z_denom_ = spec.peak_m_z_denominator();
   double intensity_denom = spec.peak_intensity_denominator();
-  for (int i = 0; i < size; ++i) {
+  for (int i = 0; i < size_; ++i) {
     CHECK(spec.peak_m_z(i) > 0);
     total += spec.peak_m_z(i); // deltas of m/z are stored
-    peak_m_z_.push_back(total / m_z_denom);
-    peak_intensity_.push_back(spec.peak_intensity(i) / intensity_denom);
+    CHECK(total <= numeric_limits<uint32_t>::max());
+    if (peaks)
+      peaks->Add(total, spec.peak_intensity(i) / intensity_denom);
   }
 }
 
@@ -64,58 +75,57 @@ static inline int GetDenom(const vector<double>& vals) {
   return kMaxPrecision;
 }
 
-void Spectrum::FillPB(pb::Spectrum* spec) {
-  spec->Clear();
-  spec->set_spectrum_number(spectrum_number_);
-  if (precursor_m_z_ > 0)
-    spec->set_precursor_m_z(precursor_m_z_);
-  spec->set_rtime(rtime_);
-  for (int i = 0; i < NumChargeStates(); ++i)
-    spec->add_charge_state(ChargeState(i));
-  int size = peak_m_z_.size();
-  CHECK(size == peak_intensity_.size());
-  int m_z_denom = GetDenom(peak_m_z_);
-  int intensity_denom = GetDenom(peak_intensity_);
+static void FillPBPeaks(const vector<double>& peak_m_z,
+                        const vector<double>& peak_intensity,
+                        pb::Spectrum* spec) {
+  int size = peak_m_z.size();
+  CHECK(size == peak_intensity.size());
+  int m_z_denom = GetDenom(peak_m_z);
+  int intensity_denom = GetDenom(peak_intensity);
   spec->set_peak_m_z_denominator(m_z_denom);
   spec->set_peak_intensity_denominator(intensity_denom);
   uint64 last = 0;
   for (int i = 0; i < size; ++i) {
-    uint64 val = uint64(peak_m_z_[i]*m_z_denom + 0.5);
+    uint64 val = uint64(peak_m_z[i]*m_z_denom + 0.5);
     CHECK(val > last);
     spec->add_peak_m_z(val - last);
     last = val;
-    spec->add_peak_intensity(uint64(peak_intensity_[i]*intensity_denom + 0.5));
+    spec->add_peak_intensity(uint64(peak_intensity[i]*intensity_denom + 0.5));
   }
 }
 
-void Spectrum::SortIfNecessary() {
-  if (adjacent_find(peak_m_z_.begin(), peak_m_z_.end(), greater<double>())
-      == peak_m_z_.end())
-    return;
-
-  // TODO: eliminate copy operations
-  int size = Size();
-  vector< pair<double, double> > pairs;
-  for (int i = 0; i < size; ++i)
-    pairs[i] = make_pair(peak_m_z_[i], peak_intensity_[i]);
-  sort(pairs.begin(), pairs.begin() + size);
-  for (int i = 0; i < size; ++i) {
-    peak_m_z_[i] = pairs[i].first;
-    peak_intensity_[i] = pairs[i].second;
+void Spectrum::FillPB(pb::Spectrum* spec) {
+  spec->Clear();
+  spec->set_spectrum_number(spectrum_number_);
+  if (precursor_m_z_ > 0)
+    spec->set_precursor_m_z(precursor_m_z_);
+  spec->set_rtime(rtime_);
+  for (int i = 0; i < NumChargeStates(); ++i)
+    spec->add_charge_state(ChargeState(i));
+  vector<double> peak_m_z, peak_intensity;
+  for (int i = 0; i < Size(); ++i) {
+    peak_m_z.push_back(M_Z(i));
+    peak_intensity.push_back(Intensity(i));
   }
+  FillPBPeaks(peak_m_z, peak_intensity, spec);
 }
 
 void SpectrumCollection::ReadMS(istream& in, bool ms1) {
-  // Parse MS2 file format. 
+  // Parse MS2 file format. Each spectrum is gathered into a pb::Spectrum
+  // and added as a spectrumrecords record would be.
   // Not very fast: uses scanf. CONSIDER speed-up.
   static const int kMaxLine = 1000;
   char line[kMaxLine];
-  Spectrum* spectrum = NULL;
+  pb::Spectrum spectrum;
+  bool have_spectrum = false;
+  vector<double> peak_m_z, peak_intensity;
   while (in.getline(line, kMaxLine)) {
     switch(line[0]) {
     case 'S': {
-        if (spectrum)
-	  spectra_.push_back(spectrum);
+        if (have_spectrum) {
+	  FillPBPeaks(peak_m_z, peak_intensity, &spectrum);
+	  Add(spectrum);
+	}
 	int specnum1, specnum2;
 	double precursor_m_z = 0;
 	int ok1 = 0;
@@ -124,7 +134,13 @@ void SpectrumCollection::ReadMS(istream& in, bool ms1) {
 	       &precursor_m_z, &ok2);
 	CHECK((ok1 > 0) && (ms1 != (ok2 > 0)));
 	CHECK(specnum1 == specnum2);
-	spectrum = new Spectrum(specnum1, precursor_m_z);
+	spectrum.Clear();
+	spectrum.set_spectrum_number(specnum1);
+	if (precursor_m_z > 0)
+	  spectrum.set_precursor_m_z(precursor_m_z);
+	peak_m_z.clear();
+	peak_intensity.clear();
+	have_spectrum = true;
       }
       break;
     case 'I': {
@@ -133,55 +149,241 @@ void SpectrumCollection::ReadMS(istream& in, bool ms1) {
 	sscanf(line, "I RTime %n%lf", &pos, &rtime);
 	if (pos > 0) {
 	  CHECK(rtime >= 0);
-	  spectrum->SetRTime(rtime);
+	  spectrum.set_rtime(rtime);
 	}
       }
       break;
     case 'Z':
       int charge;
       CHECK(1 == sscanf(line, "Z %d", &charge));
-      spectrum->AddChargeState(charge);
+      spectrum.add_charge_state(charge);
       break;
     case '0': case '1': case '2': case '3': case '4':
     case '5': case '6': case '7': case '8': case '9':
       double location, intensity;
       CHECK(2 == sscanf(line, "%lf %lf", &location, &intensity));
-      if (spectrum->Size() > 0) // check that m_z values are increasing.
-	CHECK(location > spectrum->M_Z(spectrum->Size() - 1));
-      if (intensity > 0)
-	spectrum->AddPeak(location, intensity);
+      if (!peak_m_z.empty()) // check that m_z values are increasing.
+	CHECK(location > peak_m_z.back());
+      if (intensity > 0) {
+	peak_m_z.push_back(location);
+	peak_intensity.push_back(intensity);
+      }
       break;
     default:
       break;
     }
   }
-  if (spectrum)
-    spectra_.push_back(spectrum);
+  if (have_spectrum) {
+    FillPBPeaks(peak_m_z, peak_intensity, &spectrum);
+    Add(spectrum);
+  }
 }
 
 bool SpectrumCollection::ReadSpectrumRecords(const string& filename,
-					     pb::Header* header) {
+					     pb::Header* header,
+					     int num_threads) {
+  records_file_.clear();
+  return ReadRecords(filename, header, num_threads);
+}
+
+bool SpectrumCollection::IndexSpectrumRecords(const string& filename,
+					      pb::Header* header,
+					      int num_threads) {
+  records_file_ = filename;
+  return ReadRecords(filename, header, num_threads);
+}
+
+bool SpectrumCollection::ReadRecords(const string& filename,
+				     pb::Header* header,
+				     int num_threads) {
   pb::Header tmp_header;
   if (header == NULL)
     header = &tmp_header;
   HeadedRecordReader reader(filename, header);
-  if (header->file_type() != pb::Header::SPECTRA)
+  if (header->file_type() != pb::Header::SPECTRA ||
+      header->spectra_header().version() > SPECTRUM_RECORDS_VERSION)
     return false;
-  pb::Spectrum pb_spectrum;
-  while (!reader.Done()) {
-    reader.Read(&pb_spectrum);
-    spectra_.push_back(new Spectrum(pb_spectrum));
+  bool ok;
+  if (num_threads > 1) {
+    ok = ReadRecordsParallel(&reader, num_threads);
+  } else {
+    pb::Spectrum pb_spectrum;
+    RecordSpan span;
+    for (;;) {
+      span.offset = reader.Reader()->Offset();
+      if (reader.Done())
+        break;
+      reader.Read(&pb_spectrum);
+      span.size = reader.Reader()->Offset() - span.offset;
+      AddRecord(pb_spectrum, span);
+    }
+    ok = reader.OK();
   }
-  if (!reader.OK()) {
+  if (!ok) {
     for (int i = 0; i < spectra_.size(); ++i)
       delete spectra_[i];
     spectra_.clear();
+    peaks_.Clear();
+    records_file_.clear();
+    spans_.clear();
     return false;
   }
   return true;
 }
 
+// A run of consecutive records of a spectrumrecords file, read by one thread
+// and parsed by another.
+struct RecordChunk {
+  vector<string> records;
+  vector<SpectrumCollection::RecordSpan> spans;
+  vector<pb::Spectrum> spectra;
+  int size;
+  bool parsed;
+  bool ok;
+};
+
+struct RecordChunkQueue {
+  boost::mutex lock;
+  boost::condition_variable queued;  // a chunk was queued, or done was set
+  boost::condition_variable parsed;  // a chunk was parsed
+  deque<RecordChunk*> pending;
+  bool done;
+};
+
+static void ParseRecordChunks(RecordChunkQueue* queue) {
+  for (;;) {
+    RecordChunk* chunk;
+    {
+      boost::mutex::scoped_lock lock(queue->lock);
+      while (queue->pending.empty() && !queue->done)
+        queue->queued.wait(lock);
+      if (queue->pending.empty())
+        return;
+      chunk = queue->pending.front();
+      queue->pending.pop_front();
+    }
+    bool ok = true;
+    for (int i = 0; i < chunk->size && ok; ++i)
+      ok = chunk->spectra[i].ParseFromString(chunk->records[i]);
+    {
+      boost::mutex::scoped_lock lock(queue->lock);
+      chunk->ok = ok;
+      chunk->parsed = true;
+    }
+    queue->parsed.notify_all();
+  }
+}
+
+bool SpectrumCollection::ReadRecordsParallel(HeadedRecordReader* reader,
+                                             int num_threads) {
+  // This thread reads chunks of raw records into a ring of 2 * num_threads
+  // chunks, and adds the spectra of each chunk, in order, once a worker has
+  // parsed it. Reading stalls when the ring is full of chunks not yet added,
+  // which bounds the memory held in flight.
+  const int kChunkRecords = 256;
+  vector<RecordChunk> ring(2 * num_threads);
+  for (size_t i = 0; i < ring.size(); ++i) {
+    ring[i].records.resize(kChunkRecords);
+    ring[i].spans.resize(kChunkRecords);
+    ring[i].spectra.resize(kChunkRecords);
+  }
+  RecordChunkQueue queue;
+  queue.done = false;
+  boost::thread_group workers;
+  for (int i = 0; i < num_threads; ++i)
+    workers.create_thread(boost::bind(ParseRecordChunks, &queue));
+
+  bool ok = true;
+  bool eof = false;
+  size_t next_read = 0; // chunks read
+  size_t next_add = 0;  // chunks added
+  while (ok && (!eof || next_add < next_read)) {
+    if (!eof && next_read - next_add < ring.size()) {
+      RecordChunk* chunk = &ring[next_read % ring.size()];
+      chunk->size = 0;
+      while (chunk->size < kChunkRecords) {
+        RecordSpan& span = chunk->spans[chunk->size];
+        span.offset = reader->Reader()->Offset();
+        if (reader->Done()) {
+          eof = true;
+          ok = reader->OK();
+          break;
+        }
+        if (!reader->ReadBytes(&chunk->records[chunk->size])) {
+          ok = false;
+          break;
+        }
+        span.size = reader->Reader()->Offset() - span.offset;
+        ++chunk->size;
+      }
+      if (!ok || chunk->size == 0)
+        continue;
+      {
+        boost::mutex::scoped_lock lock(queue.lock);
+        chunk->parsed = false;
+        queue.pending.push_back(chunk);
+      }
+      queue.queued.notify_one();
+      ++next_read;
+    } else {
+      RecordChunk* chunk = &ring[next_add % ring.size()];
+      {
+        boost::mutex::scoped_lock lock(queue.lock);
+        while (!chunk->parsed)
+          queue.parsed.wait(lock);
+      }
+      ok = chunk->ok;
+      for (int i = 0; i < chunk->size && ok; ++i)
+        AddRecord(chunk->spectra[i], chunk->spans[i]);
+      ++next_add;
+    }
+  }
+
+  {
+    boost::mutex::scoped_lock lock(queue.lock);
+    queue.done = true;
+  }
+  queue.queued.notify_all();
+  workers.join_all();
+  return ok;
+}
+
+void SpectrumCollection::Add(const pb::Spectrum& pb_spectrum) {
+  RecordSpan span = { 0, 0 };
+  AddRecord(pb_spectrum, span);
+}
+
+void SpectrumCollection::AddRecord(const pb::Spectrum& pb_spectrum,
+                                   const RecordSpan& span) {
+  Spectrum* spectrum = new Spectrum(pb_spectrum, OutOfCore() ? NULL : &peaks_);
+  int num_precursors = pb_spectrum.charge_precursor_m_z_size();
+  if (num_precursors == 0) {
+    spectra_.push_back(spectrum);
+  } else {
+    // Split the record into a spectrum per charge state, all sharing the
+    // peaks decoded once above.
+    CHECK(num_precursors == spectrum->NumChargeStates());
+    for (int i = 0; i < num_precursors; ++i)
+      spectra_.push_back(new Spectrum(*spectrum, spectrum->ChargeState(i),
+                                      pb_spectrum.charge_precursor_m_z(i)));
+    delete spectrum;
+  }
+  if (OutOfCore()) {
+    spans_.resize(spectra_.size(), span);
+    // The last peak is the sum of the m/z deltas, as the Spectrum
+    // constructor computes it.
+    uint64 total = 0;
+    for (int i = 0; i < pb_spectrum.peak_m_z_size(); ++i)
+      total += pb_spectrum.peak_m_z(i);
+    double last_peak = total / (double)pb_spectrum.peak_m_z_denominator();
+    if (last_peak > highest_m_z_)
+      highest_m_z_ = last_peak;
+  }
+}
+
 void SpectrumCollection::MakeSpecCharges() {
+  // No spectra are added once they are sorted, so the peak store is final.
+  peaks_.Trim();
   // Create one entry in the spec_charges_ array for each 
   // (spectrum, charge) pair.
   int spectrum_index = 0;
@@ -205,14 +407,132 @@ double SpectrumCollection::FindHighestMZ() const {
   for (; i != spectra_.end(); ++i) {
     CHECK((*i)->Size() > 0) << "ERROR: spectrum " << (*i)->SpectrumNumber()
 			    << " has no peaks.\n";
+    if (OutOfCore())
+      continue; // highest_m_z_ was found while indexing
     double last_peak = (*i)->M_Z((*i)->Size() - 1);
     if (last_peak > highest)
       highest = last_peak;
   }
-  return highest;
+  return OutOfCore() ? highest_m_z_ : highest;
 }
 
 void SpectrumCollection::Sort() {
   MakeSpecCharges();
   sort(spec_charges_.begin(), spec_charges_.end());
 }
+
+SpectrumReader::SpectrumReader(const SpectrumCollection& spectra,
+                               size_t cache_bytes)
+  : spectra_(spectra), cache_bytes_(cache_bytes), bytes_(0) {
+#ifdef _MSC_VER
+  fd_ = open(spectra_.records_file_.c_str(), O_RDONLY | O_BINARY);
+#else
+  fd_ = open(spectra_.records_file_.c_str(), O_RDONLY);
+#endif
+  if (fd_ < 0)
+    carp(CARP_FATAL, "Could not open spectra file %s",
+         spectra_.records_file_.c_str());
+}
+
+SpectrumReader::~SpectrumReader() {
+  while (!records_.empty())
+    Drop(records_.begin());
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+// Reads and parses the record of sc into pb_spectrum_.
+void SpectrumReader::ReadRecord(const SpectrumCollection::SpecCharge& sc) {
+  const SpectrumCollection::RecordSpan& span =
+    spectra_.spans_[sc.spectrum_index];
+  buf_.resize(span.size);
+  bool ok = lseek(fd_, (off_t)span.offset, SEEK_SET) != (off_t)-1;
+  // read() may return less than asked for; keep going to the end of the span
+  for (size_t done = 0; ok && done < span.size; ) {
+    int n = read(fd_, &buf_[done], span.size - done);
+    if (n <= 0)
+      ok = false;
+    else
+      done += n;
+  }
+  // The record is its length, as a varint, then the message.
+  google::protobuf::io::CodedInputStream coded_input(
+    (const google::protobuf::uint8*)buf_.data(), buf_.size());
+  google::protobuf::uint32 size;
+  ok = ok && coded_input.ReadVarint32(&size);
+  if (ok) {
+    coded_input.PushLimit(size);
+    ok = pb_spectrum_.ParseFromCodedStream(&coded_input) &&
+         coded_input.ConsumedEntireMessage();
+  }
+  if (!ok)
+    carp(CARP_FATAL, "Could not read spectrum %d from %s",
+         sc.spectrum->SpectrumNumber(), spectra_.records_file_.c_str());
+}
+
+Spectrum* SpectrumReader::Load(const SpectrumCollection::SpecCharge& sc) {
+  uint64_t offset = spectra_.spans_[sc.spectrum_index].offset;
+  RecordMap::iterator r = records_.find(offset);
+  if (r == records_.end()) {
+    ReadRecord(sc);
+    Record* record = new Record;
+    record->peaks.Reserve(pb_spectrum_.peak_m_z_size());
+    record->spectrum = new Spectrum(pb_spectrum_, &record->peaks);
+    record->bytes = sizeof(Record) + sizeof(Spectrum) +
+      record->peaks.Size() * (sizeof(uint32_t) + sizeof(double));
+    record->in_use = false;
+    r = records_.insert(make_pair(offset, record)).first;
+    order_.push_back(offset);
+    bytes_ += record->bytes;
+  }
+  Record* record = r->second;
+  if (!record->in_use) {
+    record->in_use = true;
+    in_use_.push_back(record);
+  }
+
+  Spectrum*& spectrum = loaded_[sc.spectrum_index];
+  if (spectrum == NULL) {
+    spectrum = new Spectrum(*sc.spectrum, *record->spectrum);
+    record->loaded.push_back(sc.spectrum_index);
+    bytes_ += sizeof(Spectrum);
+  }
+  Trim();
+  return spectrum;
+}
+
+void SpectrumReader::Release() {
+  for (size_t i = 0; i < in_use_.size(); ++i)
+    in_use_[i]->in_use = false;
+  in_use_.clear();
+  Trim();
+}
+
+// Drops the oldest records not in use until no more than cache_bytes_ is
+// held, or all that is left is in use.
+void SpectrumReader::Trim() {
+  list<uint64_t>::iterator i = order_.begin();
+  while (bytes_ > cache_bytes_ && i != order_.end()) {
+    RecordMap::iterator r = records_.find(*i);
+    if (r->second->in_use) {
+      ++i;
+    } else {
+      Drop(r);
+      i = order_.erase(i);
+    }
+  }
+}
+
+// Frees a record and the spectra loaded from it. The caller keeps order_.
+void SpectrumReader::Drop(RecordMap::iterator r) {
+  Record* record = r->second;
+  for (size_t i = 0; i < record->loaded.size(); ++i) {
+    map<int, Spectrum*>::iterator j = loaded_.find(record->loaded[i]);
+    delete j->second;
+    loaded_.erase(j);
+  }
+  bytes_ -= record->bytes + record->loaded.size() * sizeof(Spectrum);
+  delete record->spectrum;
+  delete record;
+  records_.erase(r);
+}
@@ -5,7 +5,7 @@
 // relatively compact.
 //
 // The SpectrumCollection class represents all the spectra in the input.
-// Initialize with ReadMS2() or ReadSpectrumRecords(). ReadMS2() takes an MS2
+// Initialize with ReadMS() or ReadSpectrumRecords(). ReadMS() takes an MS2
 // format, ReadSpectrumRecords() takes a file of records of spectrum.proto.
 //
 // SpectrumCollection::Sort() creates one entry in the spec_charges_ array for
@@ -14,6 +14,16 @@
 // mass in order to perform the rolling-window join. (See
 // active_peptide_queue.{h,cc}.)
 //
+// The peaks of all the spectra of a collection are held in one PeakStore,
+// and each Spectrum refers to its range of it. A spectrumrecords record may
+// stand for several spectra, one per charge state, that differ only in
+// precursor m/z (see spectrum.proto). Those Spectrum instances share a
+// single range.
+//
+// For runs too large to hold, IndexSpectrumRecords() keeps the spectra but
+// not their peaks, and each search thread reads the peaks back from the file
+// through a SpectrumReader when it comes to search the spectrum.
+//
 // SpectrumCollection::FindHighestMZ() returns the maximum MZ seen across all
 // input spectra. This is cached by the MaxMZ class.
 
@@ -21,32 +31,84 @@
 #define SPECTRUM_COLLECTION_H
 
 #include <iostream>
+#include <list>
+#include <map>
 #include <vector>
+#include <stdint.h>
 #include "header.pb.h"
 #include "spectrum.pb.h"
 
 using namespace std;
 
-class Spectrum {
+class HeadedRecordReader;
+
+// The layout of the spectrumrecords files that SpectrumRecordWriter writes,
+// as marked in their SpectraHeader. Files of an earlier layout are read as
+// they always were; files of a later one are refused.
+#define SPECTRUM_RECORDS_VERSION 1
+
+// PeakStore holds the peaks of many spectra in two columns, so that a run of
+// spectra costs two allocations rather than two per spectrum. m/z values are
+// kept as the fixed-point numerators of spectrum.proto, which fit in 32 bits
+// and divide back to exactly the double that was stored; intensities stay
+// double, since preprocessing rounds them to fixed point itself and single
+// precision would change the rounding.
+class PeakStore {
  public:
-  // Manual instantiation and specification
-  Spectrum(int spectrum_number, double precursor_m_z)
-    : spectrum_number_(spectrum_number), precursor_m_z_(precursor_m_z) {
+  PeakStore() {}
+
+  size_t Size() const { return m_z_.size(); }
+  void Add(uint32_t m_z, double intensity) {
+    m_z_.push_back(m_z);
+    intensity_.push_back(intensity);
+  }
+  uint32_t M_Z(size_t index) const { return m_z_[index]; }
+  double Intensity(size_t index) const { return intensity_[index]; }
+
+  void Reserve(size_t size) {
+    m_z_.reserve(size);
+    intensity_.reserve(size);
+  }
+  void Clear() {
+    m_z_.clear();
+    intensity_.clear();
   }
-  void ReservePeaks(int num) {
-    peak_m_z_.reserve(num);
-    peak_intensity_.reserve(num);
+  // Give back the capacity left over from growing.
+  void Trim() {
+    vector<uint32_t>(m_z_).swap(m_z_);
+    vector<double>(intensity_).swap(intensity_);
   }
-  void SetRTime(double rtime) { rtime_ = rtime; }
-  void AddChargeState(int charge_state) {
-    charge_states_.push_back(charge_state);
+
+ private:
+  vector<uint32_t> m_z_;
+  vector<double> intensity_;
+
+  PeakStore(const PeakStore&);
+  PeakStore& operator=(const PeakStore&);
+};
+
+// A Spectrum is a view of a range of a PeakStore, which must outlive it.
+class Spectrum {
+ public:
+  // Instantiation from PB, appending the peaks to peaks. If peaks is NULL,
+  // the spectrum has no peaks to view, but Size() still counts them.
+  Spectrum(const pb::Spectrum& spec, PeakStore* peaks);
+  // A spectrum with a single charge state that shares the peaks of other.
+  Spectrum(const Spectrum& other, int charge_state, double precursor_m_z)
+    : spectrum_number_(other.spectrum_number_), rtime_(other.rtime_),
+      precursor_m_z_(precursor_m_z), charge_states_(1, charge_state),
+      peaks_(other.peaks_), first_peak_(other.first_peak_),
+      size_(other.size_), m_z_denom_(other.m_z_denom_) {
   }
-  void AddPeak(double m_z, double intensity) {
-    peak_m_z_.push_back(m_z);
-    peak_intensity_.push_back(intensity);
+  // A copy of other that views the peaks of peaks instead.
+  Spectrum(const Spectrum& other, const Spectrum& peaks)
+    : spectrum_number_(other.spectrum_number_), rtime_(other.rtime_),
+      precursor_m_z_(other.precursor_m_z_),
+      charge_states_(other.charge_states_), peaks_(peaks.peaks_),
+      first_peak_(peaks.first_peak_), size_(peaks.size_),
+      m_z_denom_(peaks.m_z_denom_) {
   }
-  
-  explicit Spectrum(const pb::Spectrum& spec); // Instantiation from PB
+
   void FillPB(pb::Spectrum* spec);
 
   int SpectrumNumber() const { return spectrum_number_; }
@@ -56,12 +118,13 @@ class Spectrum {
   int NumChargeStates() const { return charge_states_.size(); }
   int ChargeState(int index) const { return charge_states_[index]; }
 
-  int Size() const { return peak_m_z_.size(); } // number of peaks
-  double M_Z(int index) const { return peak_m_z_[index]; }
-  double Intensity(int index) const { return peak_intensity_[index]; }
-
-  void SortIfNecessary();
-  void InferChargeStatesIfNecessary();
+  int Size() const { return size_; } // number of peaks
+  double M_Z(int index) const {
+    return peaks_->M_Z(first_peak_ + index) / m_z_denom_;
+  }
+  double Intensity(int index) const {
+    return peaks_->Intensity(first_peak_ + index);
+  }
 
  private:
   int spectrum_number_;
@@ -69,19 +132,33 @@ class Spectrum {
   double precursor_m_z_;
   vector<int> charge_states_;
 
-  vector<double> peak_m_z_;
-  vector<double> peak_intensity_;
+  const PeakStore* peaks_;
+  size_t first_peak_;
+  int size_;
+  double m_z_denom_;
 };
 
 class SpectrumCollection {
  public:
+  SpectrumCollection() : highest_m_z_(0) {}
   ~SpectrumCollection() {
     for (int i = 0; i < spectra_.size(); ++i)
       delete spectra_[i];
   }
 
   void ReadMS(istream& in, bool ms1);
-  bool ReadSpectrumRecords(const string& filename, pb::Header* header = NULL);
+  // Add the spectra of one spectrumrecords record.
+  void Add(const pb::Spectrum& pb_spectrum);
+  // With num_threads > 1, records are parsed on that many threads while this
+  // one reads ahead; the spectra are added in file order all the same.
+  bool ReadSpectrumRecords(const string& filename, pb::Header* header = NULL,
+                           int num_threads = 1);
+  // Like ReadSpectrumRecords(), but leave the peaks in filename, keeping only
+  // what is needed to sort and select the spectra and where each record lies.
+  // The spectra have no peaks to view; a SpectrumReader reads them back.
+  bool IndexSpectrumRecords(const string& filename, pb::Header* header = NULL,
+                            int num_threads = 1);
+  bool OutOfCore() const { return !records_file_.empty(); }
   void Sort();
 
   template<typename BinaryPredicate>
@@ -112,11 +189,77 @@ class SpectrumCollection {
   const vector<SpecCharge>* SpecCharges() const { return &spec_charges_; }
   vector<Spectrum*>* Spectra() { return &spectra_; }
 
+  // Where a record lies in the spectrumrecords file, length prefix included.
+  struct RecordSpan {
+    uint64_t offset;
+    uint64_t size;
+  };
+
  private:
+  friend class SpectrumReader;
+
   void MakeSpecCharges();
+  bool ReadRecords(const string& filename, pb::Header* header,
+                   int num_threads);
+  bool ReadRecordsParallel(HeadedRecordReader* reader, int num_threads);
+  void AddRecord(const pb::Spectrum& pb_spectrum, const RecordSpan& span);
 
   vector<Spectrum*> spectra_;
   vector<SpecCharge> spec_charges_;
+  PeakStore peaks_;
+
+  // Out of core only
+  string records_file_;
+  vector<RecordSpan> spans_;  // by spectrum index
+  double highest_m_z_;
+};
+
+// A SpectrumReader reads back the peaks of spectra from a collection made
+// with IndexSpectrumRecords(), for one search thread. Each record is read and
+// decoded when one of its spectra is first loaded. Loaded spectra are kept,
+// so that another charge or a later batch may use them again, but the oldest
+// records not in use are dropped whenever more than cache_bytes is held. Only
+// the spectra in use at once (one batch) may take the reader over.
+class SpectrumReader {
+ public:
+  SpectrumReader(const SpectrumCollection& spectra, size_t cache_bytes);
+  ~SpectrumReader();
+
+  // The spectrum of sc, with its peaks. It is in use, and kept, until the
+  // next call to Release().
+  Spectrum* Load(const SpectrumCollection::SpecCharge& sc);
+
+  // Called when no spectrum returned by Load() is in use.
+  void Release();
+
+ private:
+  // The peaks of one record, decoded once for all of its spectra.
+  struct Record {
+    PeakStore peaks;
+    Spectrum* spectrum;   // views peaks
+    vector<int> loaded;   // indexes of the spectra loaded from it
+    size_t bytes;
+    bool in_use;
+  };
+  typedef map<uint64_t, Record*> RecordMap;
+
+  void ReadRecord(const SpectrumCollection::SpecCharge& sc);
+  void Drop(RecordMap::iterator record);
+  void Trim();
+
+  const SpectrumCollection& spectra_;
+  size_t cache_bytes_;
+  size_t bytes_;  // held by records_ and loaded_
+  int fd_;
+  string buf_;
+  pb::Spectrum pb_spectrum_;
+  RecordMap records_;             // by record offset
+  list<uint64_t> order_;          // offsets of records_, oldest first
+  vector<Record*> in_use_;        // loaded since the last Release()
+  map<int, Spectrum*> loaded_;    // by spectrum index
+
+  SpectrumReader(const SpectrumReader&);
+  SpectrumReader& operator=(const SpectrumReader&);
 };
 
 #endif // SPECTRUM_COLLECTION_H
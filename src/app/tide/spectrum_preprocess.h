@@ -109,6 +109,7 @@
 #include "theoretical_peak_pair.h"
 #include "max_mz.h"
 #include "mass_constants.h"
+#include "search_config.h"
 
 using namespace std;
 
@@ -123,10 +124,17 @@ class ObservedPeakSet {
     : peaks_(new double[MaxBin::Global().BackgroundBinEnd()]),
     cache_(new int[MaxBin::Global().CacheBinEnd()*NUM_PEAK_TYPES]) {
     
-    bin_width_  = bin_width;
-    bin_offset_ = bin_offset;
-    NL_ = NL; //NL means neutral loss
-    FP_ = FP; //FP means flanking peaks
+    config_.bin_width  = bin_width;
+    config_.bin_offset = bin_offset;
+    config_.use_neutral_loss_peaks = NL;
+    config_.use_flanking_peaks = FP;
+  }
+
+  // All preprocessing and evidence settings come from config.
+  explicit ObservedPeakSet(const SearchConfig& config)
+    : peaks_(new double[MaxBin::Global().BackgroundBinEnd()]),
+    cache_(new int[MaxBin::Global().CacheBinEnd()*NUM_PEAK_TYPES]),
+    config_(config) {
   }
 
   ~ObservedPeakSet() { delete[] peaks_; delete[] cache_; }
@@ -188,10 +196,7 @@ class ObservedPeakSet {
   double* peaks_;
   int* cache_;
 
-  bool NL_;
-  bool FP_;
-  double bin_width_;
-  double bin_offset_;
+  SearchConfig config_;
 
   MaxBin max_mz_;
   int cache_end_;
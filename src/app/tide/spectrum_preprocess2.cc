@@ -22,7 +22,6 @@
 #include "spectrum_preprocess.h"
 #include "mass_constants.h"
 #include "max_mz.h"
-#include "util/Params.h"
 
 using namespace std;
 
@@ -81,7 +80,7 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum,
 
   memset(peaks_, 0, sizeof(double) * MaxBin::Global().BackgroundBinEnd());
 
-  if (Params::GetBool("skip-preprocessing")) {
+  if (config_.skip_preprocessing) {
     for (int i = 0; i < spectrum.Size(); ++i) {
       double peak_location = spectrum.M_Z(i);
       if (peak_location >= experimental_mass_cut_off) {
@@ -94,8 +93,8 @@ void ObservedPeakSet::PreprocessSpectrum(const Spectrum& spectrum,
       }
     }
   } else {
-    bool remove_precursor = Params::GetBool("remove-precursor-peak");
-    double precursor_tolerance = Params::GetDouble("remove-precursor-tolerance");
+    bool remove_precursor = config_.remove_precursor_peak;
+    double precursor_tolerance = config_.remove_precursor_tolerance;
 
     // Fill peaks
     int largest_mz = 0;
@@ -221,8 +220,8 @@ void ObservedPeakSet::CreateEvidenceVector(
   const double H2OLossHeight = 10.0;
   const double FlankingHeight = BYHeight / 2;;
   // TODO end need to review
-  bool flanking_peak = Params::GetBool("use-flanking-peaks");
-  bool neutral_loss_peak = Params::GetBool("use-neutral-loss-peaks");
+  bool flanking_peak = config_.use_flanking_peaks;
+  bool neutral_loss_peak = config_.use_neutral_loss_peaks;
 
   int ma;
   int pc;
@@ -507,7 +506,7 @@ void ObservedPeakSet::ComputeCache() {
 
   for (int i = 0; i < max_mz_.CacheBinEnd(); ++i) {
     int flanks = Peak(PrimaryPeak, i);
-    if ( FP_ == true) {
+    if (config_.use_flanking_peaks) {
         if (i > 0) {
           flanks += Peak(FlankingPeak, i-1);
         }
@@ -516,7 +515,7 @@ void ObservedPeakSet::ComputeCache() {
         }
     }
     int Y1 = flanks;
-    if ( NL_ == true) {
+    if (config_.use_neutral_loss_peaks) {
         if (i > MassConstants::BIN_NH3) {
           Y1 += Peak(LossPeak, i-MassConstants::BIN_NH3);
         }
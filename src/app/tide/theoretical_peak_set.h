@@ -503,6 +503,17 @@ class TheoreticalPeakSetBYSparse : public TheoreticalPeakSet {
   // Faster interface needing no copying at all.
   const TheoreticalPeakArr* GetPeaks() const { return peaks_; }
 
+  // Set the peaks to those stored by a peak index (see peak_index.h), in
+  // place of adding ions.
+  void LoadPeaks(const int32_t* codes, int num_peaks1, int num_peaks2) {
+    Clear();
+    for (int i = 0; i < num_peaks1; ++i)
+      peaks_[0].push_back(TheoreticalPeakPair(codes[i]));
+    codes += num_peaks1;
+    for (int i = 0; i < num_peaks2; ++i)
+      peaks_[1].push_back(TheoreticalPeakPair(codes[i]));
+  }
+
   void GetPeaks(TheoreticalPeakArr* peaks_charge_1,
     TheoreticalPeakArr* negs_charge_1,
     TheoreticalPeakArr* peaks_charge_2,
@@ -2,6 +2,7 @@
 #include <memory>
 #include "app/tide/records.h"
 #include "app/tide/mass_constants.h"
+#include "app/tide/spectrum_collection.h"
 
 #include "model/Peak.h"
 #include "SpectrumCollectionFactory.h"
@@ -25,17 +26,8 @@ bool SpectrumRecordWriter::convert(
   const string& infile, ///< spectra file to convert
   string outfile  ///< spectrumrecords file to output
 ) {
-  auto_ptr<Crux::SpectrumCollection> spectra(SpectrumCollectionFactory::create(infile.c_str()));
-
-  // Open infile
-  try {
-    if (!spectra->parse()) {
-      return false;
-    }
-  } catch (const std::exception& e) {
-    carp(CARP_ERROR, "%s", e.what());
-    return false;
-  } catch (...) {
+  Crux::SpectrumCollection* spectra = parse(infile);
+  if (spectra == NULL) {
     return false;
   }
 
@@ -50,9 +42,11 @@ bool SpectrumRecordWriter::convert(
   source->set_filetype(extension);
 
   header.mutable_spectra_header()->set_sorted(false);
+  header.mutable_spectra_header()->set_version(SPECTRUM_RECORDS_VERSION);
 
   HeadedRecordWriter writer(outfile, header);
   if (!writer.OK()) {
+    delete spectra;
     return false;
   }
 
@@ -69,12 +63,67 @@ bool SpectrumRecordWriter::convert(
     }
   }
 
+  delete spectra;
   return true;
 }
 
 /**
- * Return a pb::Spectrum from a pwiz SpectrumPtr
- * If spectrum is ms1, or has no precursors/peaks then return empty pb::Spectrum
+ * Reads a spectra file straight into a tide SpectrumCollection, encoded as
+ * convert() would write it. Returns true on success.
+ */
+bool SpectrumRecordWriter::read(
+  const string& infile, ///< spectra file to read
+  ::SpectrumCollection* out ///< collection to add the spectra to
+) {
+  Crux::SpectrumCollection* spectra = parse(infile);
+  if (spectra == NULL) {
+    return false;
+  }
+
+  scanCounter_ = 0;
+
+  for (SpectrumIterator i = spectra->begin(); i != spectra->end(); ++i) {
+    (*i)->sortPeaks(_PEAK_LOCATION); // Sort by m/z
+    vector<pb::Spectrum> pb_spectra = getPbSpectra(*i);
+    for (vector<pb::Spectrum>::const_iterator j = pb_spectra.begin();
+         j != pb_spectra.end();
+         ++j) {
+      out->Add(*j);
+    }
+  }
+
+  delete spectra;
+  return true;
+}
+
+/**
+ * Parse a spectra file with the reader for its type. Returns NULL if it
+ * cannot be parsed.
+ */
+Crux::SpectrumCollection* SpectrumRecordWriter::parse(
+  const string& infile ///< spectra file to parse
+) {
+  Crux::SpectrumCollection* spectra = SpectrumCollectionFactory::create(infile.c_str());
+
+  // Open infile
+  bool ok = false;
+  try {
+    ok = spectra->parse();
+  } catch (const std::exception& e) {
+    carp(CARP_ERROR, "%s", e.what());
+  } catch (...) {
+  }
+  if (!ok) {
+    delete spectra;
+    return NULL;
+  }
+  return spectra;
+}
+
+/**
+ * Return the pb::Spectrum records for a spectrum: a single record carrying
+ * the peaks once, with a charge state and precursor m/z for each z-state.
+ * If spectrum is ms1, or has no precursors/peaks then return no records
  */
 vector<pb::Spectrum> SpectrumRecordWriter::getPbSpectra(
   const Crux::Spectrum* s
@@ -93,17 +142,18 @@ vector<pb::Spectrum> SpectrumRecordWriter::getPbSpectra(
     scan_num = ++scanCounter_;
   }
 
+  spectra.push_back(pb::Spectrum());
+  pb::Spectrum& newSpectrum = spectra.back();
+  newSpectrum.set_spectrum_number(scan_num);
   const vector<SpectrumZState>& zStates = s->getZStates();
+  newSpectrum.set_precursor_m_z(zStates.front().getMZ());
   for (vector<SpectrumZState>::const_iterator i = zStates.begin(); i != zStates.end(); ++i) {
-    spectra.push_back(pb::Spectrum());
-    pb::Spectrum& newSpectrum = spectra.back();
-    newSpectrum.set_spectrum_number(scan_num);
-    newSpectrum.set_precursor_m_z(i->getMZ());
-    newSpectrum.mutable_charge_state()->Add(i->getCharge());
-    addPeaks(&newSpectrum, s);
-    if (newSpectrum.peak_m_z_size() == 0) {
-      spectra.pop_back();
-    }
+    newSpectrum.add_charge_state(i->getCharge());
+    newSpectrum.add_charge_precursor_m_z(i->getMZ());
+  }
+  addPeaks(&newSpectrum, s);
+  if (newSpectrum.peak_m_z_size() == 0) {
+    spectra.pop_back();
   }
 
   return spectra;
@@ -6,6 +6,11 @@
 
 using namespace std;
 
+class SpectrumCollection;
+namespace Crux {
+class SpectrumCollection;
+}
+
 /**
  * A class for converting spectra file to the spectrumrecords format for use
  * with tide-search.
@@ -23,10 +28,28 @@ class SpectrumRecordWriter {
     string outfile  ///< spectrumrecords file to output
   );
 
+  /**
+   * Reads a spectra file straight into a tide SpectrumCollection. The spectra
+   * are encoded exactly as convert() would write them, so they search the
+   * same, but nothing is written or read back. Returns true on success.
+   */
+  static bool read(
+    const string& infile, ///< spectra file to read
+    ::SpectrumCollection* out ///< collection to add the spectra to
+  );
+
  protected:
 
   static int scanCounter_;
 
+  /**
+   * Parse a spectra file with the reader for its type. Returns NULL if it
+   * cannot be parsed.
+   */
+  static Crux::SpectrumCollection* parse(
+    const string& infile ///< spectra file to parse
+  );
+
   /**
    * Return a pb::Spectrum from a Crux::Spectrum
    * Returns a default instance if there is a problem
@@ -274,6 +274,34 @@ Params::Params() : finalized_(false) {
     "then a second file will be created containing the decoy peptides. Decoys that also "
     "appear in the target database are marked with an asterisk in a third column.",
     "Available for tide-index.", true);
+  InitBoolParam("flat-index", false,
+    "Also write the peptides of the index in a fixed-width binary layout that tide-search "
+    "maps directly into memory instead of decoding record by record. Concurrent searches "
+    "against the same index share the mapped pages.",
+    "Available for tide-index.", true);
+  InitBoolParam("packed-index", false,
+    "Also write the peptides of the index in a compact block encoding, with masses, "
+    "protein ids and modifications stored as small differences and ids left implicit. "
+    "tide-search reads it, decoding a block at a time, in place of pepix; it is less than "
+    "half the size of pepix, so less has to be read from disk before the search starts.",
+    "Available for tide-index.", true);
+  InitBoolParam("peak-index", false,
+    "Also store in the index the binned theoretical b and y ion peaks of every peptide, "
+    "for the given mz-bin-width and mz-bin-offset. tide-search then reads the peaks "
+    "instead of computing them, as long as it is run with the same mz-bin-width and "
+    "mz-bin-offset. The stored peaks are dropped if the index is later modified with "
+    "subtract-index, and recomputed if it is modified with append.",
+    "Available for tide-index.", true);
+  InitBoolParam("append", false,
+    "Add the proteins in the FASTA file to an existing index instead of creating a new "
+    "one. Only the new proteins are digested, and their peptides are merged into the "
+    "index. The digestion, mass, length, modification and decoy settings must be the "
+    "same as those the index was created with. New decoys that are the same as an "
+    "existing target, and existing decoys that are the same as a new target, are "
+    "dropped. So are the new decoys of targets that the index already has, so that "
+    "each target keeps a single decoy. With peptide-list, the lists are of the whole "
+    "index.",
+    "Available for tide-index.", true);
   // print-processed-spectra option
   InitStringParam("stop-after", "xcorr", "remove-precursor|square-root|"
     "remove-grass|ten-bin|xcorr",
@@ -340,13 +368,13 @@ Params::Params() : finalized_(false) {
     "formula for computing the discretized m/z value is floor((x/mz-bin-width) + 1.0 - mz-bin-offset), where x is the observed m/z "
     "value. For low resolution ion trap ms/ms data 1.0005079 and for high resolution ms/ms "
     "0.02 is recommended.",
-    "Available for tide-search and xlink-assign-ions.", true);
+    "Available for tide-search, xlink-assign-ions, and tide-index with peak-index=T.", true);
   InitDoubleParam("mz-bin-offset", 0.40, 0.0, 1.0,
     "In the discretization of the m/z axes of the observed and theoretical spectra, this "
     "parameter specifies the location of the left edge of the first bin, relative to "
     "mass = 0 (i.e., mz-bin-offset = 0.xx means the left edge of the first bin will be "
     "located at +0.xx Da).",
-    "Available for tide-search.", true);
+    "Available for tide-search, and tide-index with peak-index=T.", true);
   InitBoolParam("use-flanking-peaks", false,
     "Include flanking peaks around singly charged b and y theoretical ions. Each flanking "
     "peak occurs in the adjacent m/z bin and has half the intensity of the primary peak.",
@@ -372,6 +400,22 @@ Params::Params() : finalized_(false) {
     "The name of the directory where temporary files will be created. If this "
     "parameter is blank, then the system temporary directory will be used",
     "Available for tide-index.", true);
+  InitIntParam("max-index-memory", 0, 0, BILLION,
+    "The amount of memory, in MB, that tide-index may use to hold peptides "
+    "before sorting them. When the peptides outgrow this limit, they are "
+    "sorted and written to temp-dir, and the sorted runs are merged once all "
+    "peptides have been generated. The distinct target sequences, which are "
+    "needed to make peptide decoys, are still held in memory. Zero means no "
+    "limit for unmodified peptides, and 1024 MB for modified peptides.",
+    "Available for tide-index.", true);
+  InitIntParam("max-spectrum-memory", 0, 0, BILLION,
+    "The amount of memory, in MB, that tide-search may use to hold the peaks of "
+    "spectra. Zero means that all spectra are read into memory before the search. "
+    "Otherwise only the precursors of the spectra are held, and each search thread "
+    "reads the peaks of a spectrum back from spectrumrecords when it comes to search "
+    "it. Spectra in other formats are first converted to a temporary spectrumrecords "
+    "file in the output directory. Not used with peptide-centric-search.",
+    "Available for tide-search.", true);
   // coder options regarding decoys
   InitIntParam("num-decoy-files", 1, 0, 10,
     "Replaces number-decoy-set.  Determined by decoy-location"
@@ -756,6 +800,12 @@ Params::Params() : finalized_(false) {
   InitBoolParam("file-column", true,
     "Include the file column in tab-delimited output.",
     "Available for tide-search", true);
+  InitBoolParam("sorted-output", false,
+    "When set to T, the tab-delimited output of each spectrum file is written in order of "
+    "scan number and charge, so that it does not depend on the number of threads. This "
+    "requires holding all of the matches for a spectrum file in memory until its search "
+    "is complete.",
+    "Available for tide-search", true);
   // Same as remove_precursor_peak and remove_precursor tolerance in Comet
   InitBoolParam("remove-precursor-peak", false,
     "If true, all peaks around the precursor m/z will be removed, within a range "
@@ -778,6 +828,13 @@ Params::Params() : finalized_(false) {
     "the database without checking for duplication. This option reduces the memory requirements "
     "significantly.",
     "Available for tide-index.", true);
+  InitBoolParam("parallel-decoys", false,
+    "Generate peptide-shuffle and peptide-reverse decoys using num-threads threads. "
+    "Each shuffle is seeded from seed and the target sequence, so the decoys do not "
+    "depend on the number of threads, but shuffled decoys differ from those generated "
+    "when this option is F. Reversed decoys are the same. Has no effect when "
+    "allow-dups=T.",
+    "Available for tide-index.", true);
   InitBoolParam("use-neutral-loss-peaks", true,
     "Controls whether neutral loss ions are considered in the search. "
     "Two types of neutral losses are included and are applied only to "
@@ -814,7 +871,29 @@ Params::Params() : finalized_(false) {
                   "Available for tide-search", true);
   InitIntParam("num-threads", 0, 0, 64,
                "0=poll CPU to set num threads; else specify num threads directly.",
-               "Available for tide-search tab-delimited files only.", true);
+               "Available for tide-index, subtract-index, and for tide-search "
+               "tab-delimited files only.", true);
+  InitBoolParam("shared-peptide-stream", false,
+    "When searching with multiple threads, read the peptide index and compute "
+    "theoretical peaks once, in a window shared by all threads, rather than once "
+    "per thread. This reduces CPU usage at high thread counts. Not used with "
+    "exact-p-value.",
+    "Available for tide-search.", true);
+  InitStringParam("scoring-backend", "jit", "jit|simd|check",
+    "How tide-search computes XCorr scores. \"jit\" generates machine code for each "
+    "candidate peptide. \"simd\" sums the theoretical peaks with vector instructions "
+    "chosen for the CPU, and needs no executable memory. \"check\" runs both and "
+    "stops with an error if any score differs. Not used with exact-p-value.",
+    "Available for tide-search.", true);
+  InitIntParam("spectrum-batch-size", 1, 1, 64,
+    "Score up to this many neighboring spectra with overlapping candidate windows "
+    "together, so that each candidate peptide is scored against all of them in turn. "
+    "With scoring-backend=simd this improves cache reuse when many spectra share "
+    "candidates. With the default scoring-backend=jit each spectrum is still scored "
+    "by its own compiled programs, so batching only shares the peptide window and "
+    "does not speed up scoring. 1 scores each spectrum separately. Not used with "
+    "exact-p-value or peptide-centric-search.",
+    "Available for tide-search.", true);
   /*
    * Comet parameters
    */
@@ -1175,9 +1254,21 @@ Params::Params() : finalized_(false) {
     "Cascade-search will search the given spectra against these databases in the given order.");
   /*Subtract-index parameters*/
   InitArgParam("tide index 1", "A peptide index produced using tide-index");
-  InitArgParam("tide index 2", "A second peptide index, to be subtracted from the first index.");
+  InitArgParam("tide index 2", "A second peptide index, to be subtracted from the first index. "
+    "A comma-separated list of indexes is combined with the first index in one pass.");
   InitArgParam("output index", "A new peptide index containing all peptides that occur in the"
     "first index but not the second.");
+  InitStringParam("index-operation", "subtract", "subtract|union|intersect",
+    "How subtract-index combines the indexes. \"subtract\" keeps the peptides of the first "
+    "index that are in none of the others, \"intersect\" keeps the peptides of the first "
+    "index that are in all of the others, and \"union\" keeps the peptides of any index. "
+    "A target of one index only matches a target of another, and a decoy a decoy; unlike "
+    "in earlier versions of subtract-index, a peptide of the first index is therefore not "
+    "subtracted if the other indexes have it only as a decoy, or, for a decoy, only as a "
+    "target. For a union, all indexes must have been created with the same settings, and "
+    "a decoy of any index that is a target of another is dropped, as is a decoy of a "
+    "later index made from a target that an earlier index also has.",
+    "Available for subtract-index.", true);
 //  InitArgParam("index name", "output tide index");
   // **** predict-peptide-ions options. ****
   InitStringParam("primary-ions", "by", "a|b|y|by|bya",
@@ -1726,6 +1817,7 @@ void Params::Categorize() {
   items.insert("keep-terminal-aminos");
   items.insert("seed");
   items.insert("allow-dups");
+  items.insert("parallel-decoys");
   AddCategory("Decoy database generation", items);
 
   items.clear();
@@ -1812,6 +1904,9 @@ void Params::Categorize() {
   items.clear();
   items.insert("num-threads");
   items.insert("num_threads");
+  items.insert("shared-peptide-stream");
+  items.insert("scoring-backend");
+  items.insert("spectrum-batch-size");
   AddCategory("CPU threads", items);
 
   items.clear();
@@ -1931,6 +2026,8 @@ void Params::Categorize() {
   items.insert("xlink-print-db");
   items.insert("fileroot");
   items.insert("temp-dir");
+  items.insert("max-index-memory");
+  items.insert("max-spectrum-memory");
   items.insert("output-dir");
   items.insert("output-file");
   items.insert("overwrite");
@@ -1957,12 +2054,18 @@ void Params::Categorize() {
   items.insert("decoy-prefix");
   items.insert("precision");
   items.insert("peptide-list");
+  items.insert("flat-index");
+  items.insert("packed-index");
+  items.insert("peak-index");
+  items.insert("append");
+  items.insert("index-operation");
   items.insert("comparison");
   items.insert("header");
   items.insert("column-type");
   items.insert("ascending");
   items.insert("delimiter");
   items.insert("file-column");
+  items.insert("sorted-output");
   AddCategory("Input and output", items);
 }
 
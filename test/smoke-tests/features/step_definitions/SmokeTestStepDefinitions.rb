@@ -42,3 +42,7 @@ Then /^(.*) should contain the same lines as (.*)$/ do | actual, expected |
   expect(@tester.cmpUnordered(expected, actual)).to be true
 end
 
+Then /^(.*) should have the same number of lines as (.*)$/ do | actual, expected |
+  expect(File.readlines(actual).size).to eq(File.readlines(expected).size)
+end
+
@@ -17,5 +17,24 @@ Examples:
   |tide-dups      |--allow-dups T                                               |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-dups.target.txt   |tide-index.peptides.decoy.txt|tide-dups.decoy.txt   |
   |tide-proteinReverse|--decoy-format PROTEIN-REVERSE                           |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-reverse.target.txt|tide-index.peptides.decoy.txt|tide-reverse.decoy.txt|
   |tide-temp-dir  |--temp-dir .                                                 |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-default.target.txt|tide-index.peptides.decoy.txt|tide-default.decoy.txt|
+  |tide-max-memory|--max-index-memory 1 --temp-dir .                            |small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-default.target.txt|tide-index.peptides.decoy.txt|tide-default.decoy.txt|
   |tide-no-enzyme |--enzyme no-enzyme                                           |test.fasta       |tide_test_index|tide-index.peptides.target.txt|tide-no-enzyme.target.txt|tide-index.peptides.decoy.txt|tide-no-enzyme.decoy.txt|
 
+Scenario Outline: User runs tide-index with parallel decoy generation
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T --peptide-list T --seed 7 --output-dir crux-output-serial <index_args> <serial_args> <fasta> <index>_serial
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --peptide-list T --seed 7 --parallel-decoys T <index_args> <parallel_args> <fasta> <index>
+  When I run tide-index
+  Then the return value should be 0
+  And crux-output/<actual_targets> should contain the same lines as good_results/<expected_targets>
+  And crux-output/<actual_decoys> should contain the same lines as crux-output-serial/<actual_decoys>
+
+Examples:
+  # Parallel shuffles are seeded per peptide, so they are compared with those
+  # made on one thread; reversed decoys are the same as with parallel-decoys=F
+  |test_name                   |index_args                    |serial_args                        |parallel_args  |fasta            |index          |actual_targets                |expected_targets       |actual_decoys                |
+  |tide-parallel-decoys        |                              |--parallel-decoys T --num-threads 1|--num-threads 7|small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-default.target.txt|tide-index.peptides.decoy.txt|
+  |tide-parallel-decoys-reverse|--decoy-format peptide-reverse|--parallel-decoys F                |--num-threads 7|small-yeast.fasta|tide_test_index|tide-index.peptides.target.txt|tide-default.target.txt|tide-index.peptides.decoy.txt|
@@ -49,8 +49,69 @@ Examples:
   |tide-exact-pval|                                                             |--exact-p-value T                                       |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval.txt|
   |tide-1thread   |                                                             |--num-threads 1                                         |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
   |tide-7thread   |                                                             |--num-threads 7                                         |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-7thread-shared|                                                         |--num-threads 7 --shared-peptide-stream T               |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-simd      |                                                             |--scoring-backend simd                                  |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-simd-check|                                                             |--scoring-backend check --num-threads 7                 |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-batch     |                                                             |--spectrum-batch-size 8                                 |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-batch-simd|                                                             |--spectrum-batch-size 8 --scoring-backend check         |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-sorted    |                                                             |--num-threads 7 --sorted-output T                       |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-out-of-core|                                                            |--max-spectrum-memory 1                                 |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-out-of-core-7thread|                                                    |--max-spectrum-memory 1 --num-threads 7                 |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-flat-index|--flat-index T                                               |                                                        |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-flat-index-pval|--flat-index T                                          |--exact-p-value T                                       |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval.txt|
+  |tide-peak-index|--peak-index T                                               |                                                        |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
+  |tide-packed-index|--packed-index T                                           |                                                        |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt   |
   |tide-exact-pval-1thread|                                                     |--exact-p-value T --num-threads 1                       |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval.txt|
   |tide-exact-pval-7thread|                                                     |--exact-p-value T --num-threads 7                       |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-exact-pval.txt|
   |tide-concat    |                                                             |--concat T                                              |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.txt       |tide-concat.txt    |
   |tide-isoerr    |                                                             |--isotope-error -1,1,2,3                                |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-isoerr.txt    |
   |tide-isoerrpval|                                                             |--isotope-error -1,1,2,3 --exact-p-value T              |small-yeast.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-isoerrpval.txt|
+
+Scenario Outline: User appends proteins to a tide index and runs tide-search
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T --seed 7 <index_args> <fasta1> <index>
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --seed 7 --append T --peptide-list T <index_args> <fasta2> <index>
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And crux-output/tide-index.peptides.target.txt should contain the same lines as good_results/tide-default.target.txt
+  And crux-output/tide-index.peptides.decoy.txt should have the same number of lines as good_results/tide-default.decoy.txt
+  And I pass the arguments --overwrite T --file-column F <search_args> <spectra> <index>
+  When I run tide-search
+  Then the return value should be 0
+  And crux-output/<actual_output> should contain the same lines as good_results/<expected_output>
+
+Examples:
+  # The decoys of the new proteins are shuffled apart from those of the rest,
+  # so only the target matches are the same as those of a single tide-index,
+  # but there are as many decoys
+  |test_name             |index_args    |search_args|fasta1             |fasta2             |index          |spectra |actual_output         |expected_output |
+  |tide-append           |              |           |small-yeast-1.fasta|small-yeast-2.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt|
+  |tide-append-peak-index|--peak-index T|           |small-yeast-1.fasta|small-yeast-2.fasta|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt|
+
+Scenario Outline: User combines two tide indexes and runs tide-search
+  Given the path to Crux is ../../src/crux
+  And I want to run a test named <test_name>
+  And I pass the arguments --overwrite T --seed 7 <index1_args> <fasta1> <index>_1
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --seed 7 --output-dir crux-output-2 <index2_args> <fasta2> <index>_2
+  When I run tide-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --index-operation <operation> <index>_1 <index>_2 <index>
+  When I run subtract-index as an intermediate step
+  Then the return value should be 0
+  And I pass the arguments --overwrite T --file-column F <spectra> <index>
+  When I run tide-search
+  Then the return value should be 0
+  And crux-output/<actual_output> should contain the same lines as good_results/<expected_output>
+
+Examples:
+  # The decoys of the second index in tide-subtract-decoys are the targets of
+  # the first, so its targets are only kept if target and decoy never match
+  |test_name           |index1_args                   |index2_args                   |fasta1             |fasta2                             |operation|index          |spectra |actual_output         |expected_output |
+  |tide-union          |                              |                              |small-yeast-1.fasta|small-yeast-2.fasta                |union    |tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt|
+  |tide-intersect      |                              |--decoy-format peptide-reverse|small-yeast.fasta  |small-yeast.fasta                  |intersect|tide_test_index|demo.ms2|tide-search.target.txt|tide-default.txt|
+  |tide-subtract-decoys|--decoy-format peptide-reverse|--decoy-format peptide-reverse|small-yeast.fasta  |crux-output/tide-index.decoy.fasta |subtract |tide_test_index|demo.ms2|tide-search.target.txt|tide-reverse.txt|